@@ -0,0 +1,236 @@
+// Loopback scaffolding shared by the tunnel benchmarks: a UDP echo backend for
+// the tunnel server to forward to, tunnel processes started with their output
+// discarded or captured, framed TCP clients that keep a window of datagrams in
+// flight on the server, and a closed-loop UDP load over several flows into the
+// client. Datagrams dropped on a full socket buffer never come back, so both
+// loads re-prime a client or flow that has made no progress for STALL_NS.
+//
+// Linux only. Include after platform.h and frame.h.
+
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define BENCH_MAX_PAYLOAD 65507
+#define BENCH_MAX_FLOWS 256
+#define BENCH_READ_BUFFER_SIZE (2 * (BENCH_MAX_PAYLOAD + FRAME_HEADER_SIZE))
+#define STALL_NS 200000000LL // Re-prime a client or flow whose datagrams were dropped
+
+struct bench_client { // A framed TCP connection to the tunnel server
+    int fd;
+    int in_flight;
+    long long last_progress_ns;
+    size_t fill;
+    char buffer[BENCH_READ_BUFFER_SIZE];
+};
+
+struct bench_flow { // A UDP socket sending into the tunnel client
+    int fd;
+    int in_flight;
+    long long last_progress_ns;
+};
+
+static inline long long bench_now_ns(void) {
+    return (long long)platform_now_ns();
+}
+
+static inline void *bench_echo_main(void *arg) { // Plain UDP echo, the tunnel's destination
+    int fd = (int)(intptr_t)arg;
+    static __thread char buffer[65536];
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+
+    while (1) {
+        peer_len = sizeof(peer);
+        ssize_t n = recvfrom(fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&peer, &peer_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        sendto(fd, buffer, (size_t)n, 0, (struct sockaddr *)&peer, peer_len);
+    }
+    return NULL;
+}
+
+// Binds the echo backend to an ephemeral loopback port, written back to addr,
+// and starts threads readers on it; returns -1 when the bind fails
+static inline int bench_echo_start(struct sockaddr_in *addr, int threads) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(*addr);
+    if (fd < 0 || bind(fd, (struct sockaddr *)addr, sizeof(*addr)) != 0 ||
+        getsockname(fd, (struct sockaddr *)addr, &len) != 0) {
+        perror("echo backend bind");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    int rcvbuf = 8 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    for (int i = 0; i < threads; i++) { // Several readers on one socket keep the echo up with many workers
+        pthread_t thread;
+        pthread_create(&thread, NULL, bench_echo_main, (void *)(intptr_t)fd);
+    }
+    return fd;
+}
+
+// Starts argv[0] with stderr discarded. Its stdout is discarded too, or
+// becomes a pipe whose read end is stored in output.
+static inline pid_t bench_spawn(char *const argv[], int *output) {
+    int fds[2];
+    if (output != NULL && pipe(fds) != 0)
+        return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(output != NULL ? fds[1] : devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        if (output != NULL)
+            close(fds[0]);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (output != NULL) {
+        close(fds[1]);
+        *output = fds[0];
+    }
+    return pid;
+}
+
+static inline int bench_connect_client(uint16_t tcp_port) { // Non-blocking, with Nagle off
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(tcp_port);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+static inline int bench_send_frames(struct bench_client *c, const char *frame, size_t frame_len, int count) {
+    for (int i = 0; i < count; i++) {
+        size_t off = 0;
+        while (off < frame_len) { // Frames are tiny; a short write just spins until the rest fits
+            ssize_t n = send(c->fd, frame + off, frame_len - off, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EINTR)
+                    continue;
+                return -1;
+            }
+            off += (size_t)n;
+        }
+        c->in_flight++;
+    }
+    return 0;
+}
+
+// Reads what the server has echoed and returns how many whole frames that
+// completed; a partial frame stays buffered for the next call
+static inline int bench_receive_frames(struct bench_client *c) {
+    ssize_t r = recv(c->fd, c->buffer + c->fill, sizeof(c->buffer) - c->fill, 0);
+    if (r <= 0)
+        return 0;
+    c->fill += (size_t)r;
+
+    size_t pos = 0;
+    int frames = 0;
+    struct frame_view view;
+    while (frame_parse(c->buffer + pos, (int)(c->fill - pos), &view) == 1) {
+        pos += (size_t)view.length;
+        frames++;
+    }
+    memmove(c->buffer, c->buffer + pos, c->fill - pos);
+    c->fill -= pos;
+    return frames;
+}
+
+// Opens count UDP sockets, registered with epfd, for bench_run_load
+static inline struct bench_flow *bench_open_flows(int epfd, int count) {
+    struct bench_flow *flows = calloc((size_t)count, sizeof(*flows));
+    int rcvbuf = 8 << 20;
+    for (int i = 0; i < count; i++) {
+        flows[i].fd = socket(AF_INET, SOCK_DGRAM, 0);
+        setsockopt(flows[i].fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &flows[i] };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, flows[i].fd, &ev);
+    }
+    return flows;
+}
+
+static inline void bench_close_flows(struct bench_flow *flows, int count) {
+    for (int i = 0; i < count; i++)
+        close(flows[i].fd);
+    free(flows);
+}
+
+static inline void bench_send_datagrams(struct bench_flow *f, const struct sockaddr_in *to, const char *payload,
+                                        size_t length, int count) {
+    for (int i = 0; i < count; i++) {
+        if (sendto(f->fd, payload, length, 0, (const struct sockaddr *)to, sizeof(*to)) >= 0)
+            f->in_flight++;
+    }
+}
+
+// Keeps window datagrams in flight on every flow until the deadline and
+// returns how many came back
+static inline long long bench_run_load(int epfd, struct bench_flow *flows, int flow_count, const struct sockaddr_in *to,
+                                       const char *payload, size_t length, int window, long long deadline) {
+    static char buffer[65536];
+    struct epoll_event events[BENCH_MAX_FLOWS];
+    long long echoed = 0;
+    long long now = bench_now_ns();
+    for (int i = 0; i < flow_count; i++) {
+        flows[i].last_progress_ns = now;
+        if (flows[i].in_flight < window)
+            bench_send_datagrams(&flows[i], to, payload, length, window - flows[i].in_flight);
+    }
+
+    while (now < deadline) {
+        int n = epoll_wait(epfd, events, BENCH_MAX_FLOWS, 10);
+        now = bench_now_ns();
+        for (int e = 0; e < n; e++) {
+            struct bench_flow *f = events[e].data.ptr;
+            int got = 0;
+            while (recv(f->fd, buffer, sizeof(buffer), MSG_DONTWAIT) >= 0)
+                got++;
+            echoed += got;
+            f->in_flight -= got;
+            f->last_progress_ns = now;
+            bench_send_datagrams(f, to, payload, length, got);
+        }
+        for (int i = 0; i < flow_count; i++) { // Datagrams lost to full UDP buffers never come back
+            if (now - flows[i].last_progress_ns > STALL_NS) {
+                flows[i].in_flight = 0;
+                flows[i].last_progress_ns = now;
+                bench_send_datagrams(&flows[i], to, payload, length, window);
+            }
+        }
+    }
+    return echoed;
+}
+
+#endif
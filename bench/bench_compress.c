@@ -0,0 +1,191 @@
+// Frame compression micro-benchmark: ratio and CPU cost of the compress.h
+// codec on the kinds of payload the tunnels carry, one frame at a time and as
+// the coalesced runs of -z batch.
+//
+// Three payloads are generated once, 4 MB each: JSON telemetry lines, binary
+// telemetry records with slowly changing fields, and random bytes that cannot
+// shrink. Every block size walks through its payload in consecutive slices,
+// so each block is different, compresses each one into a buffer no larger
+// than the slice, as the tunnels do, and decompresses it again; every result
+// is compared with the slice, so a wrong round trip cannot look fast. A slice
+// that does not shrink counts at its own size. The timed passes then repeat
+// compression, and decompression of the blocks kept from the check, without
+// the comparisons. CPU time is reported per MB of input for compression and
+// per MB opened for decompression, with the link rate below which the gate
+// keeps compressing: the rate at which the bytes saved take longer to send
+// than the compression takes.
+//
+// Build: gcc -O2 -o bench_compress bench/bench_compress.c
+
+#include "../platform.h"
+#include "../metrics.h"
+#include "../frame.h"
+#include "../pool.h"
+#include "../compress.h"
+
+#define MAX_LIST 16
+#define DATA_BYTES (4 << 20)
+#define DEFAULT_BYTES (64 << 20)
+
+static volatile long long sink;
+
+static double cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int parse_list(const char *text, long *values, int max, long limit) { // "64,1400,32768"; returns the count or -1
+    int count = 0;
+    const char *p = text;
+    while (*p != '\0' && count < max) {
+        char *end;
+        values[count] = strtol(p, &end, 10);
+        if (end == p || values[count] <= 0 || values[count] > limit || (*end != ',' && *end != '\0'))
+            return -1;
+        count++;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return *p == '\0' ? count : -1;
+}
+
+static uint64_t next_random(uint64_t *state) { // xorshift64
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void fill_text(char *data, size_t size, uint64_t *state) {
+    static const char *const status[] = { "ok", "ok", "ok", "warn" };
+    size_t used = 0;
+    for (long i = 0; used < size; i++) {
+        char line[160];
+        uint64_t r = next_random(state);
+        int n = snprintf(line, sizeof(line), "{\"ts\":%ld,\"host\":\"edge-%02d\",\"cpu\":%.2f,\"mem\":%d,\"status\":\"%s\"}\n",
+                         1700000000000L + i * 7, (int)(r % 32), (double)(r >> 40) / (1 << 24) * 100,
+                         100000 + (int)((r >> 8) % 800000), status[(r >> 20) % 4]);
+        size_t take = size - used < (size_t)n ? size - used : (size_t)n;
+        memcpy(data + used, line, take);
+        used += take;
+    }
+}
+
+static void fill_binary(char *data, size_t size, uint64_t *state) {
+    struct { uint64_t ts; uint32_t sensor; uint16_t kind; uint16_t flags; float value; float limit; } record;
+    float values[64] = { 0 };
+    size_t used = 0;
+    for (uint64_t i = 0; used < size; i++) {
+        uint64_t r = next_random(state);
+        memset(&record, 0, sizeof(record));
+        record.ts = 1700000000000000ull + i * 1000;
+        record.sensor = (uint32_t)(r % 64);
+        record.kind = (uint16_t)(record.sensor / 16);
+        record.flags = (r >> 32) % 16 == 0;
+        values[record.sensor] += (float)((int)((r >> 12) % 5) - 2) / 8;
+        record.value = values[record.sensor];
+        record.limit = 100;
+        size_t take = size - used < sizeof(record) ? size - used : sizeof(record);
+        memcpy(data + used, &record, take);
+        used += take;
+    }
+}
+
+static void fill_random(char *data, size_t size, uint64_t *state) {
+    for (size_t i = 0; i < size; i++)
+        data[i] = (char)(next_random(state) >> 32);
+}
+
+int main(int argc, char *argv[]) {
+    static const char *const kinds[] = { "text", "binary", "random" };
+    long sizes[MAX_LIST];
+    int size_count = parse_list("64,256,1400,8192,32768,65527", sizes, MAX_LIST, COMPRESS_RUN_BYTES);
+    long bytes = DEFAULT_BYTES;
+    int ok = argc % 2 == 1;
+    for (int i = 1; ok && i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-s") == 0)
+            ok = (size_count = parse_list(argv[i + 1], sizes, MAX_LIST, COMPRESS_RUN_BYTES)) > 0;
+        else if (strcmp(argv[i], "-b") == 0)
+            ok = (bytes = atol(argv[i + 1])) >= COMPRESS_RUN_BYTES;
+        else
+            ok = 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Usage: %s [-s block_sizes] [-b bytes_per_run]\n", argv[0]);
+        return 1;
+    }
+
+    char *data = malloc(DATA_BYTES);
+    char *store = malloc(DATA_BYTES); // Each slice's block, at the slice's offset
+    int *lengths = malloc(DATA_BYTES / sizeof(int));
+    char *packed = malloc(COMPRESS_RUN_BYTES);
+    char *opened = malloc(COMPRESS_RUN_BYTES);
+    if (data == NULL || store == NULL || lengths == NULL || packed == NULL || opened == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("# %.1f MB of input per run; CPU time per MB in, and per MB opened\n", (double)bytes / 1e6);
+    printf("%8s %8s %8s %12s %12s %12s\n", "payload", "block", "saved", "comp us/MB", "decomp us/MB", "pays below");
+    for (int k = 0; k < 3; k++) {
+        uint64_t state = 0x9E3779B97F4A7C15ull;
+        if (k == 0)
+            fill_text(data, DATA_BYTES, &state);
+        else if (k == 1)
+            fill_binary(data, DATA_BYTES, &state);
+        else
+            fill_random(data, DATA_BYTES, &state);
+
+        for (int si = 0; si < size_count; si++) {
+            int size = (int)sizes[si];
+            int slices = DATA_BYTES / size;
+            long blocks = bytes / size;
+            long long out_bytes = 0, opened_bytes = 0;
+            long offset = 0;
+            for (int i = 0; i < slices; i++, offset += size) { // Checks every round trip and keeps the blocks, untimed
+                int n = compress_block(data + offset, size, store + offset, size);
+                lengths[i] = n;
+                out_bytes += n > 0 ? n : size; // A block that does not shrink is sent as it is
+                opened_bytes += n > 0 ? size : 0;
+                if (n > 0 && (decompress_block(store + offset, n, opened, COMPRESS_RUN_BYTES) != size ||
+                              memcmp(opened, data + offset, (size_t)size) != 0)) {
+                    fprintf(stderr, "Round trip of a %d-byte %s block failed\n", size, kinds[k]);
+                    return 1;
+                }
+            }
+
+            long long sum = 0; // Uses every result, so no pass can be optimized away
+            double start = cpu_seconds();
+            for (long b = 0; b < blocks; b++)
+                sum += compress_block(data + (b % slices) * size, size, packed, size) + packed[0];
+            double comp_seconds = cpu_seconds() - start;
+            start = cpu_seconds();
+            for (long b = 0; b < blocks; b++)
+                if (lengths[b % slices] > 0)
+                    sum += decompress_block(store + (b % slices) * size, lengths[b % slices], opened, COMPRESS_RUN_BYTES) +
+                           opened[size - 1];
+            double decomp_seconds = cpu_seconds() - start;
+            sink += sum;
+
+            double saving = 1 - (double)out_bytes / ((double)slices * size);
+            double ns_per_byte = comp_seconds * 1e9 / ((double)blocks * size);
+            char decomp[32], pays[32];
+            if (opened_bytes > 0) // Per MB that came out of a block
+                snprintf(decomp, sizeof(decomp), "%.0f", decomp_seconds * 1e12 / ((double)blocks / slices * opened_bytes));
+            else
+                snprintf(decomp, sizeof(decomp), "-");
+            if (saving < COMPRESS_MIN_SAVING)
+                snprintf(pays, sizeof(pays), "never");
+            else
+                snprintf(pays, sizeof(pays), "%.0f Mbit/s", saving * 8000 / ns_per_byte);
+            printf("%8s %8d %7.1f%% %12.0f %12s %12s\n", kinds[k], size, saving * 100, ns_per_byte * 1e3, decomp, pays);
+            fflush(stdout);
+        }
+    }
+    free(data);
+    free(store);
+    free(lengths);
+    free(packed);
+    free(opened);
+    return 0;
+}
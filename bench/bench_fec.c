@@ -0,0 +1,195 @@
+// FEC micro-benchmark: CPU cost of encoding and decoding per MB of data, and
+// how much random loss the repairs win back, at several (K, M) settings and
+// for each region kernel the CPU runs (scalar, SSE2, AVX2).
+//
+// A stream of random datagrams is encoded once per setting, timing the
+// encoder alone. The packets, data and repairs alike, are then dropped
+// independently at each loss rate and fed to a fresh decoder, timing the
+// decoder alone. Every recovered payload is compared with the original. CPU
+// time comes from the process clock, so it is cost rather than elapsed
+// time. "Recovered" is the share of lost data datagrams rebuilt; "residual"
+// is the data loss left after FEC.
+//
+// Build: gcc -O2 -o bench_fec bench/bench_fec.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../fec.h"
+
+#define MAX_LIST 16
+#define DEFAULT_BYTES (32 << 20)
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t rng(void) { // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+static double cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Whether a recovered payload is one of the data datagrams of the packet's block
+static int is_original(const struct fec_output *o, const uint8_t *packet, int k, const uint8_t *data, long size,
+                       long count) {
+    uint32_t block = ((uint32_t)packet[4] << 24) | ((uint32_t)packet[5] << 16) | ((uint32_t)packet[6] << 8) | packet[7];
+    long base = (long)block * k;
+    for (int j = 0; j < k && base + j < count; j++) {
+        if (o->length == (uint32_t)size && memcmp(o->data, data + (base + j) * size, (size_t)size) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int parse_pairs(const char *text, int *k, int *m, int max) { // "8:1,8:2,..."; returns the count or -1
+    int count = 0;
+    const char *p = text;
+    while (*p != '\0' && count < max) {
+        int used = 0;
+        if (sscanf(p, "%d:%d%n", &k[count], &m[count], &used) != 2 || k[count] < 1 || k[count] > FEC_MAX_K ||
+            m[count] < 1 || m[count] > FEC_MAX_M)
+            return -1;
+        count++;
+        p += used;
+        if (*p == ',')
+            p++;
+        else if (*p != '\0')
+            return -1;
+    }
+    return *p == '\0' ? count : -1;
+}
+
+static int parse_doubles(const char *text, double *values, int max) {
+    int count = 0;
+    const char *p = text;
+    while (*p != '\0' && count < max) {
+        char *end;
+        values[count++] = strtod(p, &end);
+        if (end == p || (*end != ',' && *end != '\0'))
+            return -1;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return *p == '\0' ? count : -1;
+}
+
+int main(int argc, char *argv[]) {
+    int ks[MAX_LIST], ms[MAX_LIST];
+    double losses[MAX_LIST];
+    int setting_count = parse_pairs("4:1,8:1,8:2,16:2,16:4,32:4", ks, ms, MAX_LIST);
+    int loss_count = parse_doubles("1,5,10", losses, MAX_LIST);
+    long size = 1400;
+    long bytes = DEFAULT_BYTES;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        int ok = 1;
+        if (strcmp(argv[i], "-f") == 0)
+            ok = (setting_count = parse_pairs(argv[i + 1], ks, ms, MAX_LIST)) > 0;
+        else if (strcmp(argv[i], "-l") == 0)
+            ok = (loss_count = parse_doubles(argv[i + 1], losses, MAX_LIST)) > 0;
+        else if (strcmp(argv[i], "-z") == 0)
+            ok = (size = atol(argv[i + 1])) > 0 && size <= FEC_MAX_PAYLOAD;
+        else if (strcmp(argv[i], "-b") == 0)
+            ok = (bytes = atol(argv[i + 1])) > 0;
+        else
+            ok = 0;
+        if (!ok) {
+            fprintf(stderr, "Usage: %s [-f K:M,...] [-l loss_percents] [-z datagram_size] [-b bytes]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (argc % 2 == 0) {
+        fprintf(stderr, "Usage: %s [-f K:M,...] [-l loss_percents] [-z datagram_size] [-b bytes]\n", argv[0]);
+        return 1;
+    }
+
+    fec_init();
+    int best = fec_kernel;
+    long count = bytes / size;
+    uint8_t *data = malloc((size_t)count * (size_t)size);
+    size_t packet_room = (size_t)FEC_HEADER_SIZE + FEC_LENGTH_SIZE + (size_t)size;
+    size_t max_packets = (size_t)count + ((size_t)count + 1) * FEC_MAX_M + FEC_MAX_M;
+    uint8_t *packets = malloc(max_packets * packet_room);
+    int *lengths = malloc(max_packets * sizeof(*lengths));
+    if (data == NULL || packets == NULL || lengths == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (long i = 0; i < count * size; i++)
+        data[i] = (uint8_t)(rng() >> 56);
+    double mb = (double)count * (double)size / 1e6;
+
+    printf("# %ld datagrams of %ld bytes (%.1f MB) per run; CPU time per MB of data\n", count, size, mb);
+    printf("%-7s %4s %4s %8s %12s %12s %7s %12s %10s %10s %10s\n", "kernel", "K", "M", "overhead", "enc us/MB",
+           "enc Gbit/s", "loss%", "dec us/MB", "lost", "recovered", "residual%");
+    for (int kernel = FEC_SCALAR; kernel <= best; kernel++) {
+        fec_kernel = kernel;
+        for (int si = 0; si < setting_count; si++) {
+            struct fec_encoder e;
+            if (fec_encoder_init(&e, ks[si], ms[si]) != 0) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+            size_t n = 0;
+            double start = cpu_seconds();
+            for (long i = 0; i < count; i++) {
+                lengths[n] = fec_encode(&e, data + i * size, (uint32_t)size, packets + n * packet_room);
+                n++;
+                if (e.count == e.k || i == count - 1) {
+                    for (int r = 0; r < e.m; r++, n++)
+                        lengths[n] = fec_encode_repair(&e, r, packets + n * packet_room);
+                    fec_encoder_next_block(&e);
+                }
+            }
+            double encode = cpu_seconds() - start;
+            fec_encoder_destroy(&e);
+
+            for (int li = 0; li < loss_count; li++) {
+                struct fec_decoder d;
+                static struct fec_output out[FEC_MAX_M + 1];
+                if (fec_decoder_init(&d) != 0) {
+                    fprintf(stderr, "Out of memory\n");
+                    return 1;
+                }
+                uint64_t threshold = (uint64_t)(losses[li] / 100.0 * 18446744073709551615.0);
+                long dropped = 0, mismatched = 0;
+                double decode = cpu_seconds(); // Dropping costs next to nothing; comparing is subtracted
+                for (size_t p = 0; p < n; p++) {
+                    const uint8_t *packet = packets + p * packet_room;
+                    if (rng() < threshold) {
+                        dropped += packet[1] < packet[2]; // Data, not a repair
+                        continue;
+                    }
+                    int yielded = fec_decode(&d, packet, lengths[p], out);
+                    int own = packet[1] < packet[2]; // A data datagram yields its own payload first
+                    if (yielded > own) {
+                        decode -= cpu_seconds();
+                        for (int y = own; y < yielded; y++)
+                            mismatched += !is_original(&out[y], packet, ks[si], data, size, count);
+                        decode += cpu_seconds();
+                    }
+                }
+                fec_decoder_flush(&d);
+                decode = cpu_seconds() - decode;
+                printf("%-7s %4d %4d %7.1f%% %12.0f %12.2f %6.1f%% %12.0f %10ld %9.2f%% %9.3f%%%s\n",
+                       fec_kernel_names[kernel], ks[si], ms[si], 100.0 * ms[si] / ks[si], encode * 1e6 / mb,
+                       mb * 8 / 1e3 / encode, losses[li], decode * 1e6 / mb, dropped,
+                       dropped > 0 ? 100.0 * (double)d.stats.recovered / (double)dropped : 100.0,
+                       100.0 * (double)d.stats.lost / (double)count, mismatched > 0 ? "  MISMATCH" : "");
+                fflush(stdout);
+                fec_decoder_destroy(&d);
+            }
+        }
+    }
+    free(data);
+    free(packets);
+    free(lengths);
+    return 0;
+}
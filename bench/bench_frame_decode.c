@@ -0,0 +1,144 @@
+// Frame decoder micro-benchmark: throughput of the tunnels' incremental frame
+// decoder for payloads from 0 bytes to 64 KB, as the TCP stream arrives in
+// reads of different sizes.
+//
+// A stream of frames is encoded once per payload size with
+// frame_prepend_header, cycling through flow IDs. It is then fed to a fresh
+// decoder in chunks of each read size, the way recv would deliver it, and
+// every complete frame is taken with frame_decoder_next and consumed. Each
+// view is checked against the flow ID and length it was encoded with, so a
+// wrong parse cannot look fast. CPU time covers the copies into the ring and
+// the parsing, and is reported per frame and as payload throughput. Small
+// reads show the cost of waiting for partial frames; 1-byte reads are the
+// worst case, where every header byte comes in a read of its own.
+//
+// Build: gcc -O2 -o bench_frame_decode bench/bench_frame_decode.c
+
+#include "../platform.h"
+#include "../frame.h"
+
+#define MAX_LIST 16
+#define DEFAULT_BYTES (32 << 20)
+#define FLOWS 64
+
+static double cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int parse_list(const char *text, long *values, int max, long limit) { // "0,64,1400"; returns the count or -1
+    int count = 0;
+    const char *p = text;
+    while (*p != '\0' && count < max) {
+        char *end;
+        values[count] = strtol(p, &end, 10);
+        if (end == p || values[count] < 0 || values[count] > limit || (*end != ',' && *end != '\0'))
+            return -1;
+        count++;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return *p == '\0' ? count : -1;
+}
+
+// Encodes back-to-back frames of payload bytes into the stream until it is
+// full; returns the stream length
+static size_t encode_stream(char *stream, size_t room, long payload, int stamped, long *frames) {
+    uint64_t timestamp_ns = stamped ? platform_realtime_ns() : 0;
+    int header = timestamp_ns != 0 && payload <= FRAME_MAX_PAYLOAD - FRAME_TIMESTAMP_SIZE ? FRAME_MAX_HEADER_SIZE
+                                                                                           : FRAME_HEADER_SIZE;
+    size_t used = 0;
+    long count = 0;
+    while (used + (size_t)header + (size_t)payload <= room) {
+        char *data = stream + used + header;
+        memset(data, (int)(count & 0xFF), (size_t)payload);
+        frame_prepend_header(data, (int)payload, (uint32_t)(count % FLOWS) + 1, timestamp_ns);
+        used += (size_t)header + (size_t)payload;
+        count++;
+    }
+    *frames = count;
+    return used;
+}
+
+// Feeds the stream in reads of read_size bytes; returns the frames decoded
+// correctly, or -1 on a mismatch
+static long decode_stream(struct frame_decoder *d, char *ring, const char *stream, size_t length, long read_size,
+                         long payload) {
+    struct frame_view view;
+    size_t offset = 0;
+    long frames = 0;
+    frame_decoder_init(d, ring);
+    while (offset < length) {
+        size_t chunk = length - offset < (size_t)read_size ? length - offset : (size_t)read_size;
+        offset += frame_decoder_feed(d, stream + offset, chunk);
+        int status;
+        while ((status = frame_decoder_next(d, &view)) == 1) {
+            if (view.flow_id != (uint32_t)(frames % FLOWS) + 1 || view.payload_length != payload)
+                return -1;
+            frame_decoder_consume(d, view.length);
+            frames++;
+        }
+        if (status < 0)
+            return -1;
+    }
+    return frames;
+}
+
+int main(int argc, char *argv[]) {
+    long payloads[MAX_LIST], reads[MAX_LIST];
+    int payload_count = parse_list("0,64,512,1400,8192,65527", payloads, MAX_LIST, FRAME_MAX_PAYLOAD);
+    int read_count = parse_list("1,64,1448,16384,65536", reads, MAX_LIST, FRAME_RING_SIZE);
+    long bytes = DEFAULT_BYTES;
+    int stamped = 0;
+    int ok = argc % 2 == 1;
+    for (int i = 1; ok && i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-p") == 0)
+            ok = (payload_count = parse_list(argv[i + 1], payloads, MAX_LIST, FRAME_MAX_PAYLOAD)) > 0;
+        else if (strcmp(argv[i], "-r") == 0)
+            ok = (read_count = parse_list(argv[i + 1], reads, MAX_LIST, FRAME_RING_SIZE)) > 0;
+        else if (strcmp(argv[i], "-b") == 0)
+            ok = (bytes = atol(argv[i + 1])) >= (long)FRAME_MAX_HEADER_SIZE + FRAME_MAX_PAYLOAD;
+        else if (strcmp(argv[i], "-t") == 0)
+            stamped = atoi(argv[i + 1]) != 0;
+        else
+            ok = 0;
+    }
+    for (int r = 0; ok && r < read_count; r++)
+        ok = reads[r] > 0;
+    if (!ok) {
+        fprintf(stderr, "Usage: %s [-p payload_sizes] [-r read_sizes] [-b stream_bytes] [-t 0|1]\n", argv[0]);
+        return 1;
+    }
+
+    char *stream = malloc((size_t)bytes);
+    char *ring = malloc(FRAME_RING_SIZE);
+    struct frame_decoder d;
+    if (stream == NULL || ring == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("# %.1f MB of stream per run, %s frames; CPU time\n", (double)bytes / 1e6, stamped ? "stamped" : "unstamped");
+    printf("%8s %8s %10s %12s %12s %12s\n", "payload", "read", "frames", "ns/frame", "MB/s", "Gbit/s");
+    for (int pi = 0; pi < payload_count; pi++) {
+        long frames;
+        size_t length = encode_stream(stream, (size_t)bytes, payloads[pi], stamped, &frames);
+        for (int ri = 0; ri < read_count; ri++) {
+            double start = cpu_seconds();
+            long decoded = decode_stream(&d, ring, stream, length, reads[ri], payloads[pi]);
+            double seconds = cpu_seconds() - start;
+            if (decoded != frames) {
+                fprintf(stderr, "Decoded %ld of %ld frames of %ld bytes in %ld-byte reads\n", decoded, frames,
+                        payloads[pi], reads[ri]);
+                return 1;
+            }
+            double payload_mb = (double)frames * (double)payloads[pi] / 1e6;
+            printf("%8ld %8ld %10ld %12.1f %12.0f %12.2f\n", payloads[pi], reads[ri], frames, seconds * 1e9 / frames,
+                   payload_mb / seconds, payload_mb * 8 / 1e3 / seconds);
+            fflush(stdout);
+        }
+    }
+    free(stream);
+    free(ring);
+    return 0;
+}
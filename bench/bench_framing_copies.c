@@ -0,0 +1,175 @@
+// Framing copy benchmark: bytes copied in user space per forwarded byte, and
+// throughput, for the tunnel's old copy-based framing path and for the
+// headroom send + receive-ring path the tunnel programs use now.
+//
+// Each run streams v2 frames over a local TCP-like socketpair and forwards
+// every decoded payload as a datagram, exactly like the tunnel's TCP->UDP leg.
+//
+// Linux only. Build: gcc -O2 -pthread -o bench_framing_copies bench/bench_framing_copies.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "../platform.h"
+#include "../frame.h"
+
+#define UDP_BUFFER_SIZE 65536
+#define TCP_BUFFER_SIZE (UDP_BUFFER_SIZE + FRAME_HEADER_SIZE)
+#define RECONSTRUCTION_BUFFER_SIZE 131076
+#define STREAM_BYTES (64LL << 20) // Payload bytes per run
+
+struct run {
+    int zero_copy;
+    int payload;
+    int stream[2];   // Frames travel stream[0] -> stream[1]
+    int datagram[2]; // Forwarded payloads travel datagram[0] -> datagram[1]
+    long long frames;
+    long long copied; // Bytes moved by memcpy/memmove in user space
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long long sender_copies = 0;
+
+static void *sender(void *arg) { // The UDP->TCP leg: frame each datagram onto the stream
+    struct run *r = arg;
+    static char udp_buffer[FRAME_HEADER_SIZE + UDP_BUFFER_SIZE]; // Datagrams land after the header's headroom
+    static char tcp_buffer[TCP_BUFFER_SIZE];
+    memset(udp_buffer, 'x', sizeof(udp_buffer));
+
+    for (long long i = 0; i < r->frames; i++) {
+        char *frame;
+        if (r->zero_copy) {
+            frame = frame_prepend_header(udp_buffer + FRAME_HEADER_SIZE, r->payload, 1, 0);
+        } else {
+            frame = frame_prepend_header(tcp_buffer + FRAME_HEADER_SIZE, r->payload, 1, 0);
+            memcpy(tcp_buffer + FRAME_HEADER_SIZE, udp_buffer + FRAME_HEADER_SIZE, (size_t)r->payload);
+            sender_copies += r->payload;
+        }
+        size_t off = 0, len = FRAME_HEADER_SIZE + (size_t)r->payload;
+        while (off < len) {
+            ssize_t n = send(r->stream[0], frame + off, len - off, 0);
+            if (n <= 0)
+                return NULL;
+            off += (size_t)n;
+        }
+    }
+    shutdown(r->stream[0], SHUT_WR);
+    return NULL;
+}
+
+static void *drain(void *arg) { // Stand-in for the UDP server
+    struct run *r = arg;
+    static char sink[UDP_BUFFER_SIZE];
+    while (recv(r->datagram[1], sink, sizeof(sink), 0) > 0) { // Returns 0 once shut down
+    }
+    return NULL;
+}
+
+static void receive_legacy(struct run *r) { // recv -> memcpy -> parse -> memmove
+    static char tcp_buffer[TCP_BUFFER_SIZE];
+    static char reconstruction_buffer[RECONSTRUCTION_BUFFER_SIZE];
+    int index = 0;
+
+    while (1) {
+        ssize_t n = recv(r->stream[1], tcp_buffer, TCP_BUFFER_SIZE, 0);
+        if (n <= 0)
+            return;
+        memcpy(reconstruction_buffer + index, tcp_buffer, (size_t)n);
+        r->copied += n;
+        index += (int)n;
+
+        int processed = 0;
+        struct frame_view view;
+        while (frame_parse(reconstruction_buffer + processed, index - processed, &view) == 1) {
+            send(r->datagram[0], IO_VEC_BASE(view.payload[0]), (size_t)view.payload_length, 0);
+            processed += view.length;
+        }
+        if (processed > 0) {
+            memmove(reconstruction_buffer, reconstruction_buffer + processed, (size_t)(index - processed));
+            r->copied += index - processed;
+            index -= processed;
+        }
+    }
+}
+
+static void receive_ring(struct run *r) { // recv into ring -> parse and send in place
+    static char ring[FRAME_RING_SIZE];
+    struct frame_decoder d;
+    struct frame_view view;
+    frame_decoder_init(&d, ring);
+
+    while (1) {
+        io_vec v[2];
+        struct msghdr msg = { .msg_iov = v, .msg_iovlen = (size_t)frame_decoder_space(&d, v) };
+        ssize_t n = recvmsg(r->stream[1], &msg, 0);
+        if (n <= 0)
+            return;
+        frame_decoder_commit(&d, (uint32_t)n);
+
+        while (frame_decoder_next(&d, &view) == 1) {
+            struct msghdr out = { .msg_iov = view.payload, .msg_iovlen = (size_t)view.payload_count };
+            sendmsg(r->datagram[0], &out, 0);
+            frame_decoder_consume(&d, view.length);
+        }
+    }
+}
+
+static void run_one(int zero_copy, int payload) {
+    struct run r;
+    memset(&r, 0, sizeof(r));
+    r.zero_copy = zero_copy;
+    r.payload = payload;
+    r.frames = STREAM_BYTES / (payload > 0 ? payload : 1);
+    if (r.frames > 4000000)
+        r.frames = 4000000;
+    sender_copies = 0;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, r.stream);
+    socketpair(AF_UNIX, SOCK_DGRAM, 0, r.datagram);
+    int sndbuf = 4 << 20;
+    setsockopt(r.datagram[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    pthread_t send_thread, drain_thread;
+    double start = now_seconds();
+    pthread_create(&drain_thread, NULL, drain, &r);
+    pthread_create(&send_thread, NULL, sender, &r);
+    if (zero_copy)
+        receive_ring(&r);
+    else
+        receive_legacy(&r);
+    pthread_join(send_thread, NULL);
+    double elapsed = now_seconds() - start;
+
+    shutdown(r.datagram[1], SHUT_RDWR);
+    pthread_join(drain_thread, NULL);
+    for (int i = 0; i < 2; i++) {
+        close(r.stream[i]);
+        close(r.datagram[i]);
+    }
+
+    double forwarded = (double)r.frames * payload;
+    printf("%-12s %8d %12.0f %14.3f\n", zero_copy ? "ring+gather" : "copy", payload,
+           forwarded / elapsed / 1e6, forwarded > 0 ? (r.copied + sender_copies) / forwarded : 0.0);
+}
+
+int main(void) {
+    static const int payloads[] = { 64, 512, 1400, 8192, 32768 };
+    printf("%-12s %8s %12s %14s\n", "path", "payload", "MB/s", "copies/byte");
+    for (size_t i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+        run_one(0, payloads[i]);
+        run_one(1, payloads[i]);
+    }
+    return 0;
+}
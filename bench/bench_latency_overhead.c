@@ -0,0 +1,149 @@
+// Latency instrumentation benchmark for the tunnel: datagrams/sec echoed through
+// tunnel_udp_over_tcp_client and tunnel_udp_over_tcp_server, and the CPU time
+// both spend per datagram, with -l 0 and with -l 1 on both ends.
+//
+// A UDP echo backend sits behind the server and a closed-loop load keeps a
+// window of datagrams in flight on each of several UDP flows. The two settings
+// alternate for several runs and the best run of each counts, which keeps a
+// noisy neighbour from deciding the result. CPU time comes from /proc. The
+// histograms of the last -l 1 run are printed as both ends report them on exit.
+//
+// Linux only. Build: gcc -O2 -pthread -o bench_latency_overhead bench/bench_latency_overhead.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "../platform.h"
+#include "../frame.h"
+#include "bench_common.h"
+
+struct tunnel {
+    pid_t pids[2]; // Client, server
+    int output[2]; // Their standard output
+};
+
+static double cpu_seconds(pid_t pid) { // User plus system time of a process
+    char path[64], line[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    size_t n = fread(line, 1, sizeof(line) - 1, f);
+    fclose(f);
+    line[n] = '\0';
+    char *p = strrchr(line, ')'); // The command name may contain spaces
+    unsigned long utime = 0, stime = 0;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return 0;
+    return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+// Stops both ends with SIGTERM and prints the latency lines they report
+static void stop_tunnel(struct tunnel *t, int print) {
+    static const char *names[] = { "client", "server" };
+    for (int i = 0; i < 2; i++)
+        kill(t->pids[i], SIGTERM);
+    for (int i = 0; i < 2; i++) {
+        char buffer[8192];
+        size_t fill = 0;
+        ssize_t n;
+        while (fill < sizeof(buffer) - 1 && (n = read(t->output[i], buffer + fill, sizeof(buffer) - 1 - fill)) > 0)
+            fill += (size_t)n;
+        buffer[fill] = '\0';
+        close(t->output[i]);
+        waitpid(t->pids[i], NULL, 0);
+        for (char *line = strtok(buffer, "\n"); print && line != NULL; line = strtok(NULL, "\n")) {
+            if (strncmp(line, "Latency ", 8) == 0)
+                printf("%s: %s\n", names[i], line);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <tunnel_server_binary> <tunnel_client_binary> [flows] [seconds] [payload] [window] [runs]\n",
+                argv[0]);
+        return 1;
+    }
+    char *server_binary = argv[1];
+    char *client_binary = argv[2];
+    int flow_count = argc > 3 ? atoi(argv[3]) : 16;
+    double seconds = argc > 4 ? atof(argv[4]) : 2.0;
+    size_t payload = argc > 5 ? (size_t)atoi(argv[5]) : 64;
+    int window = argc > 6 ? atoi(argv[6]) : 16;
+    int runs = argc > 7 ? atoi(argv[7]) : 3;
+    if (flow_count < 1 || flow_count > BENCH_MAX_FLOWS || payload < 1 || payload > BENCH_MAX_PAYLOAD ||
+        window < 1 || runs < 1) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_in udp_addr; // Echo backend on an ephemeral port
+    if (bench_echo_start(&udp_addr, 1) < 0)
+        return 1;
+
+    char *payload_bytes = malloc(payload);
+    memset(payload_bytes, 'x', payload);
+
+    double best_rate[2] = { 0, 0 }, best_cpu[2] = { 0, 0 };
+    for (int run = 0; run < 2 * runs; run++) {
+        int latency = run % 2;
+        char setting[4], udp_port[8], tcp_port[8], tunnel_port[8];
+        snprintf(setting, sizeof(setting), "%d", latency);
+        snprintf(udp_port, sizeof(udp_port), "%u", ntohs(udp_addr.sin_port));
+        uint16_t base = (uint16_t)(20000 + (getpid() * 2 + run * 2) % 20000); // Fresh ports per run
+        snprintf(tcp_port, sizeof(tcp_port), "%u", base);
+        snprintf(tunnel_port, sizeof(tunnel_port), "%u", base + 1);
+
+        struct tunnel t;
+        char *server_argv[] = { server_binary, tcp_port, "127.0.0.1", udp_port, "-l", setting, NULL };
+        t.pids[1] = bench_spawn(server_argv, &t.output[1]);
+        usleep(300000);
+        char *client_argv[] = { client_binary, tunnel_port, "127.0.0.1", tcp_port, "-l", setting, NULL };
+        t.pids[0] = bench_spawn(client_argv, &t.output[0]);
+        usleep(300000);
+
+        struct sockaddr_in to;
+        memset(&to, 0, sizeof(to));
+        to.sin_family = AF_INET;
+        to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        to.sin_port = htons(base + 1);
+        int epfd = epoll_create1(0);
+        struct bench_flow *flows = bench_open_flows(epfd, flow_count);
+
+        bench_run_load(epfd, flows, flow_count, &to, payload_bytes, payload, window,
+                       bench_now_ns() + 500000000LL); // Warm-up
+        double cpu_before = cpu_seconds(t.pids[0]) + cpu_seconds(t.pids[1]);
+        long long echoed = bench_run_load(epfd, flows, flow_count, &to, payload_bytes, payload, window,
+                                          bench_now_ns() + (long long)(seconds * 1e9));
+        double cpu = cpu_seconds(t.pids[0]) + cpu_seconds(t.pids[1]) - cpu_before;
+
+        double rate = echoed / seconds;
+        double cpu_us = echoed > 0 ? cpu * 1e6 / (double)echoed : 0;
+        if (rate > best_rate[latency])
+            best_rate[latency] = rate;
+        if (echoed > 0 && (best_cpu[latency] == 0 || cpu_us < best_cpu[latency]))
+            best_cpu[latency] = cpu_us;
+
+        bench_close_flows(flows, flow_count);
+        close(epfd);
+        if (run == 2 * runs - 1) { // The last run is a -l 1 run; its histograms close the report
+            printf("# %d flows, payload=%zu bytes, window=%d, %.1fs per run, best of %d runs\n", flow_count, payload,
+                   window, seconds, runs);
+            printf("%8s %16s %16s\n", "latency", "datagrams/sec", "CPU us/dgram");
+            for (int l = 0; l < 2; l++)
+                printf("%8s %16.0f %16.2f\n", l ? "-l 1" : "-l 0", best_rate[l], best_cpu[l]);
+            printf("overhead: %.1f%% fewer datagrams/sec, %.1f%% more CPU per datagram\n",
+                   best_rate[0] > 0 ? 100.0 * (best_rate[0] - best_rate[1]) / best_rate[0] : 0.0,
+                   best_cpu[0] > 0 ? 100.0 * (best_cpu[1] - best_cpu[0]) / best_cpu[0] : 0.0);
+            fflush(stdout);
+        }
+        stop_tunnel(&t, run == 2 * runs - 1);
+    }
+    free(payload_bytes);
+    return 0;
+}
@@ -0,0 +1,475 @@
+// End-to-end loopback benchmark for the whole pipeline: a built-in load
+// generator sends UDP datagrams through tunnel_udp_over_tcp_client and
+// tunnel_udp_over_tcp_server to reply_udp and measures what comes back, or
+// straight to reply_udp as a baseline without the tunnel.
+//
+// Every combination of mode, payload size, flow count and offered rate is one
+// run against freshly started tunnel processes. Each flow is its own connected
+// UDP socket. An offered rate paces datagrams open loop, round robin over the
+// flows; rate 0 instead keeps a window of datagrams in flight on every flow,
+// which finds the saturation throughput. Datagrams of 16 bytes or more carry a
+// sequence number and their send time, so every echo yields a round trip;
+// shorter ones are matched to their flow's oldest unanswered send. Late echoes
+// are collected for a while after the last send, and whatever has not come
+// back by then counts as lost.
+//
+// Each run prints a table row and, with -o, appends a CSV row (header on a new
+// file) tagged with the -t label, so runs of different commits can be compared.
+//
+// Linux only. Build: gcc -O2 -o bench_pipeline bench/bench_pipeline.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define MAX_FLOWS 1024
+#define MAX_LIST 16 // Values per sweep list
+#define MAX_PAYLOAD 65507 // Largest UDP payload over IPv4
+#define TAG_SIZE 16 // Sequence number and send time
+#define FIFO_DEPTH 1024 // Unanswered untagged sends remembered per flow
+#define DRAIN_NS 500000000LL // Wait this long for late echoes after the last send
+#define STALL_NS 200000000LL // Closed loop: re-prime a flow whose datagrams were lost
+#define MAX_BURST 64 // Open loop: most datagrams sent per flow per catch-up
+
+// Round trips in a log-bucketed histogram: exact below 32 ns, then 32 linear
+// sub-buckets per power of two, about 3% resolution
+#define RTT_SUB_BITS 5
+#define RTT_SUB_BUCKETS (1 << RTT_SUB_BITS)
+#define RTT_MAX_BITS 40
+#define RTT_BUCKETS ((RTT_MAX_BITS - RTT_SUB_BITS + 1) * RTT_SUB_BUCKETS)
+
+struct load_flow {
+    int fd;
+    long long last_progress_ns;
+    long long *fifo; // Send times of untagged datagrams not yet answered
+    unsigned fifo_head, fifo_tail;
+};
+
+struct run_result {
+    long long sent;
+    long long received;
+    double seconds;
+    uint64_t rtt[RTT_BUCKETS];
+    long long rtt_max_ns;
+};
+
+struct options {
+    const char *reply_binary;
+    const char *server_binary;
+    const char *client_binary;
+    const char *server_args;
+    const char *client_args;
+    int modes; // Bit 0: direct, bit 1: tunnel
+    long payloads[MAX_LIST];
+    int payload_count;
+    long rates[MAX_LIST];
+    int rate_count;
+    long flows[MAX_LIST];
+    int flow_count;
+    int window;
+    double seconds;
+    const char *output;
+    const char *label;
+};
+
+static char send_buffer[MAX_PAYLOAD];
+static char recv_buffer[65536];
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned rtt_bucket(uint64_t ns) {
+    if (ns < RTT_SUB_BUCKETS)
+        return (unsigned)ns;
+    unsigned top = 63 - (unsigned)__builtin_clzll(ns);
+    if (top >= RTT_MAX_BITS)
+        return RTT_BUCKETS - 1;
+    unsigned shift = top - RTT_SUB_BITS;
+    return (shift + 1) * RTT_SUB_BUCKETS + (unsigned)((ns >> shift) - RTT_SUB_BUCKETS);
+}
+
+static uint64_t rtt_bucket_top(unsigned bucket) { // Largest value a bucket counts
+    if (bucket < RTT_SUB_BUCKETS)
+        return bucket;
+    unsigned shift = bucket / RTT_SUB_BUCKETS - 1;
+    uint64_t sub = RTT_SUB_BUCKETS + bucket % RTT_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void rtt_record(struct run_result *r, long long ns) {
+    if (ns < 0)
+        ns = 0;
+    r->rtt[rtt_bucket((uint64_t)ns)]++;
+    if (ns > r->rtt_max_ns)
+        r->rtt_max_ns = ns;
+}
+
+static double rtt_percentile_us(const struct run_result *r, unsigned permille) { // -1 without samples
+    uint64_t total = 0, seen = 0;
+    for (unsigned i = 0; i < RTT_BUCKETS; i++)
+        total += r->rtt[i];
+    if (total == 0)
+        return -1;
+    uint64_t rank = (total * permille + 999) / 1000;
+    for (unsigned i = 0; i < RTT_BUCKETS; i++) {
+        seen += r->rtt[i];
+        if (seen >= rank && seen > 0) {
+            uint64_t top = rtt_bucket_top(i);
+            return (double)(top < (uint64_t)r->rtt_max_ns ? top : (uint64_t)r->rtt_max_ns) / 1000.0;
+        }
+    }
+    return (double)r->rtt_max_ns / 1000.0;
+}
+
+static pid_t spawn(const char *binary, char *const fixed[], const char *extra) {
+    char *args[64];
+    char copy[1024];
+    int n = 0;
+    args[n++] = (char *)binary;
+    for (int i = 0; fixed[i] != NULL; i++)
+        args[n++] = fixed[i];
+    snprintf(copy, sizeof(copy), "%s", extra != NULL ? extra : "");
+    for (char *arg = strtok(copy, " "); arg != NULL && n < 63; arg = strtok(NULL, " "))
+        args[n++] = arg;
+    args[n] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        execv(binary, args);
+        _exit(127);
+    }
+    return pid;
+}
+
+static void stop(pid_t pid) {
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+}
+
+static int parse_list(const char *text, long *values, int max) { // Comma-separated; returns the count or -1
+    int count = 0;
+    const char *p = text;
+    while (*p != '\0' && count < max) {
+        char *end;
+        values[count++] = strtol(p, &end, 10);
+        if (end == p || (*end != ',' && *end != '\0'))
+            return -1;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return *p == '\0' ? count : -1;
+}
+
+static void send_datagram(struct load_flow *f, size_t payload, long long *seq, struct run_result *r) {
+    long long now = now_ns();
+    if (payload >= TAG_SIZE) {
+        memcpy(send_buffer, seq, sizeof(*seq));
+        memcpy(send_buffer + 8, &now, sizeof(now));
+    }
+    if (send(f->fd, send_buffer, payload, MSG_DONTWAIT) < 0)
+        return; // Counts neither as sent nor as lost: the load generator could not keep up
+    (*seq)++;
+    r->sent++;
+    if (payload < TAG_SIZE) {
+        if (f->fifo_tail - f->fifo_head == FIFO_DEPTH) // Presumed lost
+            f->fifo_head++;
+        f->fifo[f->fifo_tail++ % FIFO_DEPTH] = now;
+    }
+}
+
+static int receive_echoes(struct load_flow *f, size_t payload, struct run_result *r) { // Returns echoes received
+    int got = 0;
+    ssize_t n;
+    while ((n = recv(f->fd, recv_buffer, sizeof(recv_buffer), MSG_DONTWAIT)) >= 0) {
+        long long now = now_ns();
+        if ((size_t)n != payload)
+            continue;
+        if (payload >= TAG_SIZE) {
+            long long sent_ns;
+            memcpy(&sent_ns, recv_buffer + 8, sizeof(sent_ns));
+            rtt_record(r, now - sent_ns);
+        } else if (f->fifo_tail != f->fifo_head) {
+            rtt_record(r, now - f->fifo[f->fifo_head++ % FIFO_DEPTH]);
+        }
+        got++;
+    }
+    r->received += got;
+    return got;
+}
+
+// One run against the UDP endpoint at port: rate datagrams/sec spread over the
+// flows, or a closed loop of window datagrams per flow when rate is 0
+static void run_load(uint16_t port, size_t payload, int flow_count, long rate, int window, double seconds,
+                     struct run_result *r) {
+    static struct load_flow flows[MAX_FLOWS];
+    static long long fifo_space[MAX_FLOWS][FIFO_DEPTH];
+    int epfd = epoll_create1(0);
+    struct sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    to.sin_port = htons(port);
+    int rcvbuf = 8 << 20;
+    memset(r, 0, sizeof(*r));
+    r->seconds = seconds;
+
+    for (int i = 0; i < flow_count; i++) { // One flow per connected socket
+        struct load_flow *f = &flows[i];
+        memset(f, 0, sizeof(*f));
+        f->fifo = fifo_space[i];
+        f->fd = socket(AF_INET, SOCK_DGRAM, 0);
+        setsockopt(f->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        connect(f->fd, (struct sockaddr *)&to, sizeof(to));
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = f };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, f->fd, &ev);
+    }
+
+    long long seq = 0;
+    long long start = now_ns();
+    long long end = start + (long long)(seconds * 1e9);
+    long long interval = rate > 0 ? 1000000000LL / rate : 0;
+    long long due = 0; // Open loop: datagrams that should have been sent by now
+    if (rate == 0) {
+        for (int i = 0; i < flow_count; i++) {
+            flows[i].last_progress_ns = start;
+            for (int k = 0; k < window; k++)
+                send_datagram(&flows[i], payload, &seq, r);
+        }
+    }
+
+    struct epoll_event events[MAX_FLOWS];
+    long long now = start;
+    while (now < end + DRAIN_NS) {
+        int sending = now < end;
+        if (sending && rate > 0) { // Catch up with the schedule, a bounded burst at a time
+            long long target = (now - start) / interval + 1;
+            if (target - due > (long long)MAX_BURST * flow_count)
+                due = target - (long long)MAX_BURST * flow_count; // Behind: skip rather than burst
+            while (due < target)
+                send_datagram(&flows[due++ % flow_count], payload, &seq, r);
+        }
+
+        int timeout_ms = 10;
+        if (sending && rate > 0) {
+            long long wait = start + due * interval - now_ns();
+            timeout_ms = wait > 0 ? (int)(wait / 1000000) : 0;
+        }
+        int n = epoll_wait(epfd, events, MAX_FLOWS, timeout_ms);
+        now = now_ns();
+        sending = now < end;
+        for (int e = 0; e < n; e++) {
+            struct load_flow *f = events[e].data.ptr;
+            int got = receive_echoes(f, payload, r);
+            if (rate == 0 && got > 0) {
+                f->last_progress_ns = now;
+                for (int k = 0; sending && k < got; k++)
+                    send_datagram(f, payload, &seq, r);
+            }
+        }
+        for (int i = 0; rate == 0 && sending && i < flow_count; i++) { // Lost datagrams never come back
+            if (now - flows[i].last_progress_ns > STALL_NS) {
+                flows[i].last_progress_ns = now;
+                for (int k = 0; k < window; k++)
+                    send_datagram(&flows[i], payload, &seq, r);
+            }
+        }
+    }
+
+    for (int i = 0; i < flow_count; i++)
+        close(flows[i].fd);
+    close(epfd);
+}
+
+static void report(FILE *csv, const struct options *o, const char *mode, size_t payload, int flow_count, long rate,
+                   const struct run_result *r) {
+    double loss = r->sent > 0 ? 100.0 * (double)(r->sent - r->received) / (double)r->sent : 0.0;
+    if (loss < 0)
+        loss = 0; // Duplicates, never expected
+    double pps = (double)r->received / r->seconds;
+    double mbps = pps * (double)payload * 8 / 1e6;
+    double p[5] = { rtt_percentile_us(r, 500), rtt_percentile_us(r, 900), rtt_percentile_us(r, 990),
+                    rtt_percentile_us(r, 999), r->received > 0 ? (double)r->rtt_max_ns / 1000.0 : -1 };
+    char offered[24];
+    if (rate > 0)
+        snprintf(offered, sizeof(offered), "%ld", rate);
+    else
+        snprintf(offered, sizeof(offered), "w%d", o->window);
+
+    printf("%-6s %7zu %6d %10s %10lld %10lld %7.2f %10.0f %9.1f", mode, payload, flow_count, offered, r->sent,
+           r->received, loss, pps, mbps);
+    for (int i = 0; i < 5; i++) {
+        if (p[i] >= 0)
+            printf(" %9.1f", p[i]);
+        else
+            printf(" %9s", "-");
+    }
+    printf("\n");
+    fflush(stdout);
+
+    if (csv != NULL) {
+        fprintf(csv, "%s,%s,%zu,%d,%ld,%d,%.3f,%lld,%lld,%.4f,%.1f,%.3f", o->label, mode, payload, flow_count, rate,
+                rate > 0 ? 0 : o->window, r->seconds, r->sent, r->received, loss, pps, mbps);
+        for (int i = 0; i < 5; i++) {
+            if (p[i] >= 0)
+                fprintf(csv, ",%.1f", p[i]);
+            else
+                fprintf(csv, ",");
+        }
+        fprintf(csv, "\n");
+        fflush(csv);
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s -r <reply_udp_binary> [-s <tunnel_server_binary> -c <tunnel_client_binary>]\n"
+                    "       [-m direct|tunnel|both] [-p payloads] [-R rates] [-f flows] [-w window] [-d seconds]\n"
+                    "       [-o results.csv] [-t label] [-S \"server args\"] [-C \"client args\"]\n"
+                    "Lists are comma-separated; rate 0 runs a closed loop of window datagrams per flow.\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    struct options o;
+    memset(&o, 0, sizeof(o));
+    o.modes = 3;
+    o.payload_count = parse_list("0,64,480,1400,8192,65507", o.payloads, MAX_LIST);
+    o.rate_count = parse_list("0", o.rates, MAX_LIST);
+    o.flow_count = parse_list("1,16", o.flows, MAX_LIST);
+    o.window = 8;
+    o.seconds = 2.0;
+    o.label = "";
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        const char *value = argv[++i];
+        const char *flag = argv[i - 1];
+        int ok = 1;
+        if (strcmp(flag, "-r") == 0)
+            o.reply_binary = value;
+        else if (strcmp(flag, "-s") == 0)
+            o.server_binary = value;
+        else if (strcmp(flag, "-c") == 0)
+            o.client_binary = value;
+        else if (strcmp(flag, "-S") == 0)
+            o.server_args = value;
+        else if (strcmp(flag, "-C") == 0)
+            o.client_args = value;
+        else if (strcmp(flag, "-m") == 0)
+            ok = (o.modes = strcmp(value, "direct") == 0 ? 1 : strcmp(value, "tunnel") == 0 ? 2
+                          : strcmp(value, "both") == 0 ? 3 : 0) != 0;
+        else if (strcmp(flag, "-p") == 0)
+            ok = (o.payload_count = parse_list(value, o.payloads, MAX_LIST)) > 0;
+        else if (strcmp(flag, "-R") == 0)
+            ok = (o.rate_count = parse_list(value, o.rates, MAX_LIST)) > 0;
+        else if (strcmp(flag, "-f") == 0)
+            ok = (o.flow_count = parse_list(value, o.flows, MAX_LIST)) > 0;
+        else if (strcmp(flag, "-w") == 0)
+            ok = (o.window = atoi(value)) > 0;
+        else if (strcmp(flag, "-d") == 0)
+            ok = (o.seconds = atof(value)) > 0;
+        else if (strcmp(flag, "-o") == 0)
+            o.output = value;
+        else if (strcmp(flag, "-t") == 0)
+            o.label = value;
+        else
+            ok = 0;
+        if (!ok) {
+            fprintf(stderr, "Invalid option: %s %s\n", flag, value);
+            return 1;
+        }
+    }
+    for (int i = 0; i < o.payload_count; i++)
+        if (o.payloads[i] < 0 || o.payloads[i] > MAX_PAYLOAD)
+            o.reply_binary = NULL;
+    for (int i = 0; i < o.flow_count; i++)
+        if (o.flows[i] < 1 || o.flows[i] > MAX_FLOWS)
+            o.reply_binary = NULL;
+    for (int i = 0; i < o.rate_count; i++)
+        if (o.rates[i] < 0 || o.rates[i] > 1000000000L)
+            o.reply_binary = NULL;
+    if (o.reply_binary == NULL || ((o.modes & 2) && (o.server_binary == NULL || o.client_binary == NULL))) {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    FILE *csv = NULL;
+    if (o.output != NULL) {
+        csv = fopen(o.output, "a");
+        if (csv == NULL) {
+            perror(o.output);
+            return 1;
+        }
+        if (ftell(csv) == 0)
+            fprintf(csv, "label,mode,payload,flows,offered_rate,window,seconds,sent,received,loss_pct,pps,mbps,"
+                         "rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_p999_us,rtt_max_us\n");
+    }
+
+    uint16_t base = (uint16_t)(20000 + (getpid() * 4) % 20000);
+    char reply_port[8];
+    snprintf(reply_port, sizeof(reply_port), "%u", base);
+    char *reply_fixed[] = { reply_port, NULL };
+    pid_t reply = spawn(o.reply_binary, reply_fixed, NULL);
+    usleep(200000);
+
+    static struct run_result r;
+    printf("# %.1fs per run, closed-loop window %d per flow; RTT in microseconds\n", o.seconds, o.window);
+    printf("%-6s %7s %6s %10s %10s %10s %7s %10s %9s %9s %9s %9s %9s %9s\n", "mode", "payload", "flows", "offered",
+           "sent", "received", "loss%", "pps", "Mbit/s", "p50", "p90", "p99", "p99.9", "max");
+    int run = 0;
+    for (int mode = 1; mode <= 2; mode++) {
+        if (!(o.modes & mode))
+            continue;
+        for (int pi = 0; pi < o.payload_count; pi++) {
+            for (int fi = 0; fi < o.flow_count; fi++) {
+                for (int ri = 0; ri < o.rate_count; ri++, run++) {
+                    pid_t server = -1, client = -1;
+                    uint16_t target = base;
+                    if (mode == 2) { // Fresh tunnel processes per run
+                        char tcp_port[8], udp_port[8];
+                        uint16_t tcp = (uint16_t)(base + 1 + 2 * (run % 1000)), udp = (uint16_t)(tcp + 1);
+                        snprintf(tcp_port, sizeof(tcp_port), "%u", tcp);
+                        snprintf(udp_port, sizeof(udp_port), "%u", udp);
+                        char *server_fixed[] = { tcp_port, "127.0.0.1", reply_port, NULL };
+                        server = spawn(o.server_binary, server_fixed, o.server_args);
+                        usleep(200000);
+                        char *client_fixed[] = { udp_port, "127.0.0.1", tcp_port, NULL };
+                        client = spawn(o.client_binary, client_fixed, o.client_args);
+                        usleep(200000);
+                        target = udp;
+                    }
+                    run_load(target, (size_t)o.payloads[pi], (int)o.flows[fi], o.rates[ri], o.window, o.seconds, &r);
+                    report(csv, &o, mode == 2 ? "tunnel" : "direct", (size_t)o.payloads[pi], (int)o.flows[fi],
+                           o.rates[ri], &r);
+                    stop(client);
+                    stop(server);
+                }
+            }
+        }
+    }
+
+    stop(reply);
+    if (csv != NULL)
+        fclose(csv);
+    return 0;
+}
@@ -0,0 +1,164 @@
+// Readiness wait micro-benchmark: CPU time per wakeup of the select loop the
+// tunnel client and the load generator used to run, against the
+// platform_poller that replaces it (epoll on Linux), as the number of watched
+// sockets grows.
+//
+// N UDP sockets are bound on loopback. Each round sends one datagram to a
+// socket picked at random, waits for readiness and reads the datagram. The
+// select loop rebuilds its fd_set over all N sockets, selects and scans them
+// with FD_ISSET on every pass, as before; the poller registers the sockets
+// once. Both do the same send and receive, so the difference between the
+// columns is the cost of the wait. The last line checks timeouts: the mean
+// overshoot of a 250 us wait with no socket ready, where epoll alone would
+// round up to a whole millisecond.
+//
+// Build: gcc -O2 -o bench_poller bench/bench_poller.c
+
+#include "../platform.h"
+
+#define ROUNDS 200000
+#define TIMEOUT_WAITS 2000
+#define TIMEOUT_NS 250000
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t rng(void) { // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+static double cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int open_sockets(SOCKET *sockets, struct sockaddr_in *addrs, int count) {
+    for (int i = 0; i < count; i++) {
+        sockets[i] = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        memset(&addrs[i], 0, sizeof(addrs[i]));
+        addrs[i].sin_family = AF_INET;
+        addrs[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(addrs[i]);
+        if (sockets[i] == INVALID_SOCKET || bind(sockets[i], (struct sockaddr *)&addrs[i], sizeof(addrs[i])) != 0 ||
+            getsockname(sockets[i], (struct sockaddr *)&addrs[i], &length) != 0 ||
+            platform_set_nonblocking(sockets[i], 1) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static double select_round_ns(SOCKET sender, const SOCKET *sockets, const struct sockaddr_in *addrs, int count) {
+    char byte = 0, buffer[64];
+    double start = cpu_seconds();
+    for (int r = 0; r < ROUNDS; r++) {
+        int target = (int)(rng() % (uint64_t)count);
+        sendto(sender, &byte, 1, 0, (const struct sockaddr *)&addrs[target], sizeof(addrs[target]));
+        int received = 0;
+        while (!received) {
+            fd_set readfds;
+            FD_ZERO(&readfds);
+            SOCKET highest = 0;
+            for (int i = 0; i < count; i++) {
+                FD_SET(sockets[i], &readfds);
+                if (sockets[i] > highest)
+                    highest = sockets[i];
+            }
+            if (select((int)highest + 1, &readfds, NULL, NULL, NULL) <= 0)
+                continue;
+            for (int i = 0; i < count; i++)
+                if (FD_ISSET(sockets[i], &readfds) && recv(sockets[i], buffer, sizeof(buffer), 0) > 0)
+                    received = 1;
+        }
+    }
+    return (cpu_seconds() - start) * 1e9 / ROUNDS;
+}
+
+static double poller_round_ns(struct platform_poller *p, SOCKET sender, const SOCKET *sockets,
+                              const struct sockaddr_in *addrs, int count) {
+    struct platform_event events[16];
+    char byte = 0, buffer[64];
+    double start = cpu_seconds();
+    for (int r = 0; r < ROUNDS; r++) {
+        int target = (int)(rng() % (uint64_t)count);
+        sendto(sender, &byte, 1, 0, (const struct sockaddr *)&addrs[target], sizeof(addrs[target]));
+        int received = 0;
+        while (!received) {
+            int n = platform_poller_wait(p, events, 16, -1);
+            for (int i = 0; i < n; i++)
+                if (recv(sockets[events[i].token], buffer, sizeof(buffer), 0) > 0)
+                    received = 1;
+        }
+    }
+    return (cpu_seconds() - start) * 1e9 / ROUNDS;
+}
+
+static double select_overshoot_us(SOCKET s) {
+    uint64_t total = 0;
+    for (int i = 0; i < TIMEOUT_WAITS; i++) {
+        uint64_t start = platform_now_ns();
+        platform_wait(s, PLATFORM_READABLE, TIMEOUT_NS);
+        total += platform_now_ns() - start - TIMEOUT_NS;
+    }
+    return (double)total / TIMEOUT_WAITS / 1e3;
+}
+
+static double poller_overshoot_us(struct platform_poller *p) {
+    struct platform_event events[16];
+    uint64_t total = 0;
+    for (int i = 0; i < TIMEOUT_WAITS; i++) {
+        uint64_t start = platform_now_ns();
+        platform_poller_wait(p, events, 16, TIMEOUT_NS);
+        total += platform_now_ns() - start - TIMEOUT_NS;
+    }
+    return (double)total / TIMEOUT_WAITS / 1e3;
+}
+
+int main(int argc, char *argv[]) {
+    static const int counts[] = { 1, 16, 64, 256, 1000 };
+    int max = argc > 1 ? atoi(argv[1]) : 1000;
+    if (max < 1 || max > 1000) { // select cannot watch descriptors past FD_SETSIZE
+        fprintf(stderr, "Usage: %s [max_sockets, at most 1000]\n", argv[0]);
+        return 1;
+    }
+    SOCKET *sockets = calloc((size_t)max, sizeof(*sockets));
+    struct sockaddr_in *addrs = calloc((size_t)max, sizeof(*addrs));
+    SOCKET sender = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sockets == NULL || addrs == NULL || sender == INVALID_SOCKET || open_sockets(sockets, addrs, max) != 0) {
+        fprintf(stderr, "Could not open %d sockets: %d\n", max, WSAGetLastError());
+        return 1;
+    }
+
+    printf("# %d rounds of send, wait, receive per row; CPU time per round\n", ROUNDS);
+    printf("%8s %14s %14s %9s\n", "sockets", "select ns", "poller ns", "speedup");
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]) && counts[c] <= max; c++) {
+        int count = counts[c];
+        struct platform_poller poller;
+        if (platform_poller_init(&poller) != 0) {
+            fprintf(stderr, "Could not create the poller\n");
+            return 1;
+        }
+        for (int i = 0; i < count; i++)
+            platform_poller_add(&poller, sockets[i], PLATFORM_READABLE, (uint64_t)i);
+        double before = select_round_ns(sender, sockets, addrs, count);
+        double after = poller_round_ns(&poller, sender, sockets, addrs, count);
+        printf("%8d %14.0f %14.0f %8.2fx\n", count, before, after, before / after);
+        fflush(stdout);
+        platform_poller_destroy(&poller);
+    }
+
+    struct platform_poller poller;
+    platform_poller_init(&poller);
+    platform_poller_add(&poller, sockets[0], PLATFORM_READABLE, 0);
+    printf("250 us timeout overshoot: select %.1f us, poller %.1f us\n", select_overshoot_us(sockets[0]),
+           poller_overshoot_us(&poller));
+    platform_poller_destroy(&poller);
+    for (int i = 0; i < max; i++)
+        closesocket(sockets[i]);
+    closesocket(sender);
+    free(sockets);
+    free(addrs);
+    return 0;
+}
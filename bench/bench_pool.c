@@ -0,0 +1,107 @@
+// Buffer pool micro-benchmark: cost of taking and returning one buffer from
+// pool.h against malloc and free, for the size classes the programs use.
+//
+// Each round takes a buffer, writes its first and last byte so neither side
+// can skip the memory, and returns it; a second pass keeps a window of 64
+// buffers live, so the allocator cannot hand back the same block every time.
+// The last part runs the window from several threads at once to show what
+// the shared counters cost; on one core the threads only take turns. The
+// per-class statistics close the run.
+//
+// Build: gcc -O2 -pthread -o bench_pool bench/bench_pool.c
+
+#include "../platform.h"
+#include "../pool.h"
+
+#include <pthread.h>
+
+#define ROUNDS 1000000
+#define WINDOW 64
+#define MAX_THREADS 8
+
+static double cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void touch(char *p, size_t size) {
+    ((volatile char *)p)[0] = 1;
+    ((volatile char *)p)[size - 1] = 1;
+}
+
+static double pool_ns(size_t size, int window, long rounds) {
+    char *live[WINDOW] = { 0 };
+    double start = cpu_seconds();
+    for (long r = 0; r < rounds; r++) {
+        int slot = (int)(r % window);
+        if (live[slot] != NULL)
+            pool_release(live[slot]);
+        live[slot] = pool_alloc(size);
+        touch(live[slot], size);
+    }
+    double seconds = cpu_seconds() - start;
+    for (int i = 0; i < window; i++)
+        if (live[i] != NULL)
+            pool_release(live[i]);
+    return seconds * 1e9 / (double)rounds;
+}
+
+static double malloc_ns(size_t size, int window, long rounds) {
+    char *live[WINDOW] = { 0 };
+    double start = cpu_seconds();
+    for (long r = 0; r < rounds; r++) {
+        int slot = (int)(r % window);
+        free(live[slot]);
+        live[slot] = malloc(size);
+        touch(live[slot], size);
+    }
+    double seconds = cpu_seconds() - start;
+    for (int i = 0; i < window; i++)
+        free(live[i]);
+    return seconds * 1e9 / (double)rounds;
+}
+
+static void *pool_worker(void *arg) {
+    (void)arg;
+    pool_ns(65536, WINDOW, ROUNDS);
+    pool_thread_flush();
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t sizes[] = { 2048, 16384, 65536, 131072, 1 << 20 };
+    int max_threads = argc > 1 ? atoi(argv[1]) : 4;
+    if (max_threads < 1 || max_threads > MAX_THREADS) {
+        fprintf(stderr, "Usage: %s [max_threads, at most %d]\n", argv[0], MAX_THREADS);
+        return 1;
+    }
+
+    printf("# %d rounds of take, touch, return per cell; CPU time per round\n", ROUNDS);
+    printf("%10s %12s %12s %14s %14s\n", "size", "pool ns", "malloc ns", "pool x64 ns", "malloc x64 ns");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        double pool_one = pool_ns(sizes[i], 1, ROUNDS);
+        double malloc_one = malloc_ns(sizes[i], 1, ROUNDS);
+        double pool_window = pool_ns(sizes[i], WINDOW, ROUNDS);
+        double malloc_window = malloc_ns(sizes[i], WINDOW, ROUNDS);
+        printf("%10zu %12.1f %12.1f %14.1f %14.1f\n", sizes[i], pool_one, malloc_one, pool_window, malloc_window);
+        fflush(stdout);
+    }
+
+    printf("# 64 KiB buffers, window of %d per thread; CPU time per round, all threads\n", WINDOW);
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        pthread_t ids[MAX_THREADS];
+        double start = cpu_seconds();
+        for (int t = 0; t < threads; t++)
+            pthread_create(&ids[t], NULL, pool_worker, NULL);
+        for (int t = 0; t < threads; t++)
+            pthread_join(ids[t], NULL);
+        double total = cpu_seconds() - start;
+        printf("%d thread%s: %.1f ns per round\n", threads, threads > 1 ? "s" : "", total * 1e9 / ((double)ROUNDS * threads));
+    }
+
+    char text[4096];
+    pool_format(text, sizeof(text));
+    printf("%s", text);
+    return 0;
+}
@@ -0,0 +1,168 @@
+// Worker scaling benchmark for tunnel_udp_over_tcp_server: aggregate datagrams/sec
+// forwarded through the tunnel and echoed back with -w 1, 2, 4 and 8 workers.
+//
+// The benchmark runs a multi-threaded UDP echo backend, restarts the tunnel
+// server with each worker count and drives it from several load threads, each
+// owning a share of the framed TCP connections with a small window of
+// datagrams in flight. The load and echo threads compete with the workers for
+// CPUs, so the server scales at most up to the cores left over.
+//
+// Linux only. Build: gcc -O2 -pthread -o bench_server_workers bench/bench_server_workers.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "../platform.h"
+#include "../frame.h"
+#include "bench_common.h"
+
+#define ECHO_THREADS 4
+
+struct load_thread {
+    pthread_t thread;
+    uint16_t tcp_port;
+    int clients;
+    int window;
+    size_t payload;
+    double seconds;
+    long long echoed;
+};
+
+// Keeps window datagrams in flight on each of its connections and counts echoes
+static void *load_main(void *arg) {
+    struct load_thread *t = arg;
+    struct bench_client *c = calloc((size_t)t->clients, sizeof(*c));
+    char *data = calloc(1, t->payload + FRAME_HEADER_SIZE);
+    size_t frame_len = t->payload + FRAME_HEADER_SIZE;
+    int epfd = epoll_create1(0);
+
+    memset(data + FRAME_HEADER_SIZE, 'x', t->payload);
+    // Every client uses flow 1 on its own connection
+    const char *frame = frame_prepend_header(data + FRAME_HEADER_SIZE, (int)t->payload, 1, 0);
+
+    for (int i = 0; i < t->clients; i++) {
+        c[i].fd = bench_connect_client(t->tcp_port);
+        if (c[i].fd < 0) {
+            fprintf(stderr, "connect failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &c[i] };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c[i].fd, &ev);
+    }
+    usleep(200000); // Let the workers register every connection
+
+    long long start = bench_now_ns();
+    for (int i = 0; i < t->clients; i++) {
+        c[i].last_progress_ns = start;
+        bench_send_frames(&c[i], frame, frame_len, t->window);
+    }
+
+    long long deadline = start + (long long)(t->seconds * 1e9);
+    struct epoll_event events[256];
+    long long now = start;
+    while (now < deadline) {
+        int n = epoll_wait(epfd, events, 256, 10);
+        now = bench_now_ns();
+        for (int e = 0; e < n; e++) {
+            struct bench_client *cl = events[e].data.ptr;
+            int frames = bench_receive_frames(cl);
+            if (frames == 0)
+                continue;
+
+            t->echoed += frames;
+            cl->in_flight -= frames;
+            cl->last_progress_ns = now;
+            bench_send_frames(cl, frame, frame_len, frames);
+        }
+
+        for (int i = 0; i < t->clients; i++) { // Datagrams lost to full UDP buffers never come back
+            if (now - c[i].last_progress_ns > STALL_NS) {
+                c[i].in_flight = 0;
+                c[i].last_progress_ns = now;
+                bench_send_frames(&c[i], frame, frame_len, t->window);
+            }
+        }
+    }
+
+    for (int i = 0; i < t->clients; i++)
+        close(c[i].fd);
+    close(epfd);
+    free(data);
+    free(c);
+    return NULL;
+}
+
+static pid_t start_server(char *binary, char *tcp_port, char *udp_port, int workers) {
+    char workers_str[8];
+    snprintf(workers_str, sizeof(workers_str), "%d", workers);
+    char *argv[] = { binary, tcp_port, "127.0.0.1", udp_port, "-w", workers_str, NULL };
+    pid_t pid = bench_spawn(argv, NULL); // Resets from closed benchmark clients are expected
+    usleep(300000); // Give every worker time to bind
+    return pid;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <tunnel_server_binary> [clients] [load_threads] [seconds] [payload] [window]\n",
+                argv[0]);
+        return 1;
+    }
+    char *server_binary = argv[1];
+    int clients = argc > 2 ? atoi(argv[2]) : 64;
+    int load_threads = argc > 3 ? atoi(argv[3]) : 4;
+    double seconds = argc > 4 ? atof(argv[4]) : 3.0;
+    size_t payload = argc > 5 ? (size_t)atoi(argv[5]) : 64;
+    int window = argc > 6 ? atoi(argv[6]) : 8;
+
+    if (payload > BENCH_MAX_PAYLOAD || clients < 1 || load_threads < 1 || load_threads > clients || window < 1) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_in udp_addr; // Echo backend on an ephemeral port
+    if (bench_echo_start(&udp_addr, ECHO_THREADS) < 0)
+        return 1;
+
+    char tcp_port_str[8], udp_port_str[8];
+    snprintf(udp_port_str, sizeof(udp_port_str), "%u", ntohs(udp_addr.sin_port));
+
+    printf("# %d clients on %d load threads, payload=%zu bytes, window=%d, %.1fs per step, %ld CPUs\n",
+           clients, load_threads, payload, window, seconds, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %16s %12s\n", "workers", "datagrams/sec", "vs 1 worker");
+    double base = 0;
+    for (int workers = 1; workers <= 8; workers *= 2) {
+        uint16_t tcp_port = (uint16_t)(20000 + (getpid() + workers) % 20000); // Fresh port per step
+        snprintf(tcp_port_str, sizeof(tcp_port_str), "%u", tcp_port);
+        pid_t server = start_server(server_binary, tcp_port_str, udp_port_str, workers);
+
+        struct load_thread *t = calloc((size_t)load_threads, sizeof(*t));
+        for (int i = 0; i < load_threads; i++) {
+            t[i].tcp_port = tcp_port;
+            t[i].clients = clients / load_threads + (i < clients % load_threads);
+            t[i].window = window;
+            t[i].payload = payload;
+            t[i].seconds = seconds;
+            pthread_create(&t[i].thread, NULL, load_main, &t[i]);
+        }
+        long long echoed = 0;
+        for (int i = 0; i < load_threads; i++) {
+            pthread_join(t[i].thread, NULL);
+            echoed += t[i].echoed;
+        }
+        free(t);
+
+        double rate = echoed / seconds;
+        if (workers == 1)
+            base = rate;
+        printf("%8d %16.0f %11.2fx\n", workers, rate, base > 0 ? rate / base : 0.0);
+        fflush(stdout);
+
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+    return 0;
+}
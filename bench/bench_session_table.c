@@ -0,0 +1,131 @@
+// Session table micro-benchmark: nanoseconds per session_touch as the table
+// fills, for packets from sources already in the table and for new sources,
+// and once the table is full and every new source evicts one.
+//
+// The table is filled to each level with distinct IPv4 source addresses, then
+// touched in a random order from a precomputed list, so the key generator and
+// the random number generator stay out of the timing. With the slot array at
+// least twice the capacity, the average probe length (also printed) stays
+// near one at any fill level. Time per touch still rises while the sessions
+// touched grow out of the CPU caches, then stays flat.
+//
+// Build: gcc -O2 -o bench_session_table bench/bench_session_table.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../hash_slots.h"
+#include "../session_table.h"
+
+#define DEFAULT_CAPACITY 262144
+#define TOUCHES (1 << 22) // Per measurement
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t rng(void) { // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+static void make_key(struct session_key *key, uint32_t n) { // Distinct source n: address and port both vary
+    struct sockaddr_storage addr;
+    struct sockaddr_in in;
+    memset(&addr, 0, sizeof(addr));
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_addr.s_addr = htonl(0x0a000000u + n / 16); // 10.x.y.z
+    in.sin_port = htons((uint16_t)(10000 + n % 16));
+    memcpy(&addr, &in, sizeof(in)); // As recvfrom would fill it
+    session_key_from_addr(key, &addr);
+}
+
+static double mean_probes(const struct session_table *t) { // Slots a lookup of a present key visits, on average
+    uint64_t total = 0;
+    for (uint32_t i = 0; i <= t->slot_mask; i++) {
+        if (t->slots[i].index != 0)
+            total += ((i - (t->slots[i].hash & t->slot_mask)) & t->slot_mask) + 1;
+    }
+    return t->count > 0 ? (double)total / t->count : 0.0;
+}
+
+static double touch_ns(struct session_table *t, const struct session_key *keys, const uint32_t *order, uint32_t count) {
+    struct timespec a, b;
+    uint64_t sink = 0;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    for (uint32_t i = 0; i < count; i++)
+        sink += session_touch(t, &keys[order[i]], 64, i)->packets;
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    if (sink == 0)
+        printf("!");
+    return ((double)(b.tv_sec - a.tv_sec) * 1e9 + (double)(b.tv_nsec - a.tv_nsec)) / count;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t capacity = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 10) : DEFAULT_CAPACITY;
+    if (capacity == 0 || capacity > SESSION_MAX_CAPACITY / 2) {
+        fprintf(stderr, "Usage: %s [capacity up to %u]\n", argv[0], SESSION_MAX_CAPACITY / 2);
+        return 1;
+    }
+
+    uint32_t key_count = capacity * 2; // Room for the eviction runs
+    struct session_key *keys = malloc(key_count * sizeof(*keys));
+    uint32_t *order = malloc(TOUCHES * sizeof(*order));
+    struct session_table t;
+    if (keys == NULL || order == NULL || session_table_init(&t, capacity) != 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (uint32_t n = 0; n < key_count; n++)
+        make_key(&keys[n], n);
+
+    struct session_table warmup; // Page faults, the clock and the branch predictors, on a throwaway table
+    if (session_table_init(&warmup, 65536) == 0) {
+        for (uint32_t i = 0; i < 65536; i++)
+            order[i] = i % key_count;
+        touch_ns(&warmup, keys, order, 65536);
+        session_table_destroy(&warmup);
+    }
+
+    printf("capacity %u sessions, %zu-byte entries, %u slots\n", capacity, sizeof(struct session), t.slot_mask + 1);
+    printf("%8s %10s %8s %14s %14s\n", "fill", "sessions", "probes", "hit ns/touch", "new ns/touch");
+
+    static const int percent[] = { 10, 25, 50, 75, 90, 100 };
+    uint32_t filled = 0;
+    for (size_t p = 0; p < sizeof(percent) / sizeof(percent[0]); p++) {
+        uint32_t target = (uint32_t)((uint64_t)capacity * percent[p] / 100);
+        double new_ns = 0;
+        if (target > filled) { // New sources, timed, bringing the table up to this level
+            uint32_t added = target - filled;
+            for (uint32_t i = 0; i < added; i++)
+                order[i] = filled + i;
+            new_ns = touch_ns(&t, keys, order, added);
+            filled = target;
+        }
+        for (uint32_t i = 0; i < TOUCHES; i++) // Known sources in random order
+            order[i] = (uint32_t)(rng() % filled);
+        double hit_ns = touch_ns(&t, keys, order, TOUCHES);
+        printf("%7d%% %10u %8.2f %14.1f %14.1f\n", percent[p], t.count, mean_probes(&t), hit_ns, new_ns);
+    }
+
+    // Full table, sources drawn from twice as many addresses as it holds:
+    // about half the touches miss and evict
+    for (uint32_t i = 0; i < TOUCHES; i++)
+        order[i] = (uint32_t)(rng() % key_count);
+    uint64_t evictions = t.evictions;
+    double mixed_ns = touch_ns(&t, keys, order, TOUCHES);
+    printf("%8s %10u %8.2f %14.1f   (%.0f%% of touches evicted a session)\n", "evicting", t.count, mean_probes(&t), mixed_ns,
+           100.0 * (double)(t.evictions - evictions) / TOUCHES);
+
+    session_table_destroy(&t);
+    free(keys);
+    free(order);
+    return 0;
+}
@@ -0,0 +1,289 @@
+// Striping benchmark: round-trip latency of many UDP flows through the tunnel
+// while its TCP connections suffer losses, for 1, 2, 4 and 8 stripes.
+//
+// A lost TCP segment holds back every byte behind it until it is
+// retransmitted, so every flow sharing that connection waits too. With K
+// stripes a loss only stalls the flows hashed onto one connection, which shows
+// up in the tail of the latency distribution.
+//
+// The benchmark runs a UDP echo backend, the tunnel server and, per step, the
+// tunnel client with -k K. Loss comes from `tc qdisc ... netem loss` on the
+// loopback device when tc is usable (root, sch_netem present). Otherwise TCP
+// runs through a built-in proxy that holds each forwarded chunk back for
+// stall_ms with probability loss_percent, the way a connection waits out a
+// retransmission timeout.
+//
+// Linux only. Build: gcc -O2 -pthread -o bench_striped_loss bench/bench_striped_loss.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "../platform.h"
+#include "../frame.h"
+#include "bench_common.h"
+
+#define FLOWS 64
+#define PING_SIZE 64
+#define DRAIN_NS 1000000000LL // Wait this long for late echoes after the last ping
+
+struct proxy_pump {
+    int from;
+    int to;
+    uint64_t seed;
+};
+
+static double loss_probability = 0.001;
+static int stall_ms = 200;
+static uint16_t server_port;
+
+static int bind_loopback(int type, uint16_t port) {
+    int fd = socket(AF_INET, type, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static uint16_t local_port(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+static uint64_t xorshift(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static void *proxy_pump(void *arg) { // One direction of one proxied connection
+    struct proxy_pump *pump = arg;
+    static __thread char buffer[65536];
+
+    while (1) {
+        ssize_t n = recv(pump->from, buffer, sizeof(buffer), 0);
+        if (n <= 0)
+            break;
+        if ((xorshift(&pump->seed) >> 11) * (1.0 / 9007199254740992.0) < loss_probability)
+            usleep((useconds_t)stall_ms * 1000); // Everything behind the lost segment waits
+        for (ssize_t off = 0; off < n;) {
+            ssize_t w = send(pump->to, buffer + off, (size_t)(n - off), MSG_NOSIGNAL);
+            if (w <= 0)
+                goto done;
+            off += w;
+        }
+    }
+done:
+    shutdown(pump->to, SHUT_WR);
+    shutdown(pump->from, SHUT_RD);
+    free(pump);
+    return NULL;
+}
+
+static void *proxy_listener(void *arg) { // Accepts tunnel client stripes and relays them to the server
+    int listen_fd = *(int *)arg;
+    uint64_t seed = 0x9e3779b97f4a7c15ull ^ (uint64_t)bench_now_ns();
+
+    while (1) {
+        int client = accept(listen_fd, NULL, NULL);
+        if (client < 0)
+            continue;
+        int server = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(server_port);
+        if (connect(server, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(client);
+            close(server);
+            continue;
+        }
+        int one = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        for (int dir = 0; dir < 2; dir++) {
+            struct proxy_pump *pump = malloc(sizeof(*pump));
+            pump->from = dir == 0 ? client : server;
+            pump->to = dir == 0 ? server : client;
+            pump->seed = xorshift(&seed) | 1;
+            pthread_t thread;
+            pthread_create(&thread, NULL, proxy_pump, pump);
+            pthread_detach(thread);
+        }
+    }
+    return NULL;
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Sends rate pings per second round-robin over FLOWS sockets and records the
+// round trip of each; returns the number of pings sent
+static long long run_pings(uint16_t tunnel_port, int rate, double seconds, long long *rtt) {
+    int fds[FLOWS];
+    int epfd = epoll_create1(0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(tunnel_port);
+
+    for (int i = 0; i < FLOWS; i++) { // One tunnel flow per socket
+        fds[i] = bind_loopback(SOCK_DGRAM, 0);
+        connect(fds[i], (struct sockaddr *)&addr, sizeof(addr));
+        fcntl(fds[i], F_SETFL, O_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = fds[i] };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev);
+    }
+
+    long long total = (long long)(rate * seconds);
+    long long interval = 1000000000LL / rate;
+    long long start = bench_now_ns(), sent = 0;
+    char ping[PING_SIZE];
+    memset(ping, 0, sizeof(ping));
+
+    while (1) {
+        long long now = bench_now_ns();
+        while (sent < total && now >= start + sent * interval) { // Open loop: never wait for echoes
+            long long seq = sent++;
+            memcpy(ping, &seq, sizeof(seq));
+            memcpy(ping + 8, &now, sizeof(now));
+            rtt[seq] = -1;
+            send(fds[seq % FLOWS], ping, sizeof(ping), 0);
+        }
+        long long end = start + total * interval;
+        if (sent == total && now > end + DRAIN_NS)
+            break;
+
+        long long wake = sent < total ? start + sent * interval : end + DRAIN_NS;
+        int timeout_ms = wake > now ? (int)((wake - now + 999999) / 1000000) : 0;
+        struct epoll_event events[FLOWS];
+        int n = epoll_wait(epfd, events, FLOWS, timeout_ms);
+        now = bench_now_ns();
+        for (int e = 0; e < n; e++) {
+            char echo[PING_SIZE];
+            while (recv(events[e].data.fd, echo, sizeof(echo), 0) == (ssize_t)sizeof(echo)) {
+                long long seq, sent_ns;
+                memcpy(&seq, echo, sizeof(seq));
+                memcpy(&sent_ns, echo + 8, sizeof(sent_ns));
+                if (seq >= 0 && seq < total)
+                    rtt[seq] = now - sent_ns;
+            }
+        }
+    }
+
+    for (int i = 0; i < FLOWS; i++)
+        close(fds[i]);
+    close(epfd);
+    return total;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <tunnel_server_binary> <tunnel_client_binary> [seconds] [pings_per_sec]"
+                        " [loss_percent] [stall_ms]\n", argv[0]);
+        return 1;
+    }
+    char *server_binary = argv[1];
+    char *client_binary = argv[2];
+    double seconds = argc > 3 ? atof(argv[3]) : 10.0;
+    int rate = argc > 4 ? atoi(argv[4]) : 1000;
+    double loss_percent = argc > 5 ? atof(argv[5]) : 0.1;
+    stall_ms = argc > 6 ? atoi(argv[6]) : 200;
+    if (seconds <= 0 || rate < 1 || rate > 1000000 || loss_percent < 0 || loss_percent > 100 || stall_ms < 0) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+    loss_probability = loss_percent / 100.0;
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_in udp_addr; // Echo backend on an ephemeral port
+    if (bench_echo_start(&udp_addr, 1) < 0)
+        return 1;
+
+    server_port = (uint16_t)(20000 + getpid() % 20000);
+    char server_port_str[8], udp_port_str[8];
+    snprintf(server_port_str, sizeof(server_port_str), "%u", server_port);
+    snprintf(udp_port_str, sizeof(udp_port_str), "%u", ntohs(udp_addr.sin_port));
+    char *server_args[] = { server_binary, server_port_str, "127.0.0.1", udp_port_str, NULL };
+    pid_t server = bench_spawn(server_args, NULL);
+    usleep(300000); // Give the server time to bind
+
+    // Real packet loss on lo when netem is available, the stalling proxy otherwise
+    char command[128];
+    snprintf(command, sizeof(command), "tc qdisc add dev lo root netem loss %.4f%% 2>/dev/null", loss_percent);
+    int netem = loss_percent > 0 && system(command) == 0;
+    uint16_t tunnel_tcp_port = server_port;
+    if (!netem) {
+        int listen_fd = bind_loopback(SOCK_STREAM, 0);
+        listen(listen_fd, 64);
+        tunnel_tcp_port = local_port(listen_fd);
+        static int proxy_fd;
+        proxy_fd = listen_fd;
+        pthread_t proxy_thread;
+        pthread_create(&proxy_thread, NULL, proxy_listener, &proxy_fd);
+    }
+
+    long long *rtt = malloc(sizeof(long long) * (size_t)(rate * seconds + 1));
+    long long *sorted = malloc(sizeof(long long) * (size_t)(rate * seconds + 1));
+    printf("# %d flows, %d pings/s, %.1fs per step, loss %.3f%% via %s", FLOWS, rate, seconds, loss_percent,
+           netem ? "netem on lo" : "stalling proxy");
+    if (!netem)
+        printf(" (%d ms per stall)", stall_ms);
+    printf("\n%8s %10s %10s %10s %10s %10s\n", "stripes", "p50 ms", "p90 ms", "p99 ms", "max ms", "lost %");
+
+    for (int stripes = 1; stripes <= 8; stripes *= 2) {
+        char stripes_str[4], client_udp_str[8], tcp_port_str[8];
+        uint16_t client_udp = (uint16_t)(server_port + 1 + stripes);
+        snprintf(stripes_str, sizeof(stripes_str), "%d", stripes);
+        snprintf(client_udp_str, sizeof(client_udp_str), "%u", client_udp);
+        snprintf(tcp_port_str, sizeof(tcp_port_str), "%u", tunnel_tcp_port);
+        char *client_args[] = { client_binary, client_udp_str, "127.0.0.1", tcp_port_str, "-k", stripes_str, NULL };
+        pid_t client = bench_spawn(client_args, NULL);
+        usleep(300000); // Let every stripe connect
+
+        long long total = run_pings(client_udp, rate, seconds, rtt);
+        long long received = 0;
+        for (long long i = 0; i < total; i++) {
+            if (rtt[i] >= 0)
+                sorted[received++] = rtt[i];
+        }
+        qsort(sorted, (size_t)received, sizeof(*sorted), compare_ll);
+        if (received > 0)
+            printf("%8d %10.3f %10.3f %10.3f %10.3f %10.3f\n", stripes, sorted[received / 2] / 1e6,
+                   sorted[received * 9 / 10] / 1e6, sorted[received * 99 / 100] / 1e6, sorted[received - 1] / 1e6,
+                   100.0 * (total - received) / total);
+        else
+            printf("%8d %10s %10s %10s %10s %10.3f\n", stripes, "-", "-", "-", "-", 100.0);
+        fflush(stdout);
+
+        kill(client, SIGTERM);
+        waitpid(client, NULL, 0);
+        usleep(200000); // Let the server tear the session down
+    }
+
+    if (netem)
+        system("tc qdisc del dev lo root 2>/dev/null");
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    free(rtt);
+    free(sorted);
+    return 0;
+}
@@ -0,0 +1,428 @@
+// Goodput of the reliable transfer (send_udp -t 1 into receive_udp -o) against
+// packet loss on loopback.
+//
+// The benchmark relays every datagram between the two programs through its
+// own UDP socket and drops each one, in either direction, with the given
+// probability, so data, retransmissions and ACKs are all lost alike. Every
+// combination of congestion control, loss rate and datagram size is one run
+// with a fresh receiver. The run sends a file of random bytes; goodput is the
+// file size over the time from starting the sender until it exits, which is
+// once its FIN is acknowledged. The received file is then compared with the
+// original.
+//
+// Each run prints a table row and, with -o, appends a CSV row (header on a new
+// file) tagged with the -t label.
+//
+// Linux only. Build: gcc -O2 -o bench_transfer bench/bench_transfer.c
+
+#define _GNU_SOURCE // recvmmsg, sendmmsg
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MAX_LIST 16 // Values per sweep list
+#define RELAY_BATCH 64
+#define RUN_TIMEOUT_NS 120000000000LL // A run that has not finished by then counts as failed
+
+struct options {
+    const char *send_binary;
+    const char *receive_binary;
+    const char *algorithms[MAX_LIST];
+    int algorithm_count;
+    double losses[MAX_LIST]; // Percent, each direction
+    int loss_count;
+    long sizes[MAX_LIST];
+    int size_count;
+    long bytes;
+    long window;
+    const char *output;
+    const char *label;
+};
+
+struct run_result {
+    double seconds;
+    long long retransmits;
+    long long timeouts;
+    long long relayed;
+    long long dropped;
+    const char *status; // ok, corrupt, failed, timeout
+};
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t rng(void) { // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Starts binary with args; stdin from in_fd unless -1, stderr into err_fd
+// unless -1, everything else to /dev/null
+static pid_t spawn(const char *binary, char *const args[], int in_fd, int err_fd) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_RDWR);
+        dup2(in_fd >= 0 ? in_fd : devnull, STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(err_fd >= 0 ? err_fd : devnull, STDERR_FILENO);
+        execv(binary, args);
+        _exit(127);
+    }
+    return pid;
+}
+
+static void stop(pid_t pid) {
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+}
+
+static int parse_list(const char *text, long *values, int max) { // Comma-separated; returns the count or -1
+    int count = 0;
+    const char *p = text;
+    while (*p != '\0' && count < max) {
+        char *end;
+        values[count++] = strtol(p, &end, 10);
+        if (end == p || (*end != ',' && *end != '\0'))
+            return -1;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return *p == '\0' ? count : -1;
+}
+
+static int parse_double_list(const char *text, double *values, int max) {
+    int count = 0;
+    const char *p = text;
+    while (*p != '\0' && count < max) {
+        char *end;
+        values[count++] = strtod(p, &end);
+        if (end == p || (*end != ',' && *end != '\0'))
+            return -1;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return *p == '\0' ? count : -1;
+}
+
+static int parse_words(char *text, const char **words, int max) { // Splits text in place at commas
+    int count = 0;
+    for (char *word = strtok(text, ","); word != NULL && count < max; word = strtok(NULL, ","))
+        words[count++] = word;
+    return count;
+}
+
+static int open_relay(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    int size = 4 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("relay socket");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+// Forwards what is waiting on the relay socket: datagrams from the receiver's
+// port to the sender, everything else to the receiver, each dropped with
+// probability loss
+static void relay(int fd, uint16_t receiver_port, struct sockaddr_in *sender, double loss, struct run_result *r) {
+    static char buffers[RELAY_BATCH][65536];
+    static struct mmsghdr in[RELAY_BATCH], out[RELAY_BATCH];
+    static struct iovec in_iov[RELAY_BATCH], out_iov[RELAY_BATCH];
+    static struct sockaddr_in from[RELAY_BATCH], to[RELAY_BATCH];
+    uint64_t threshold = (uint64_t)(loss / 100.0 * 18446744073709551615.0);
+
+    while (1) {
+        for (int i = 0; i < RELAY_BATCH; i++) {
+            in_iov[i].iov_base = buffers[i];
+            in_iov[i].iov_len = sizeof(buffers[i]);
+            memset(&in[i].msg_hdr, 0, sizeof(in[i].msg_hdr));
+            in[i].msg_hdr.msg_iov = &in_iov[i];
+            in[i].msg_hdr.msg_iovlen = 1;
+            in[i].msg_hdr.msg_name = &from[i];
+            in[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        }
+        int n = recvmmsg(fd, in, RELAY_BATCH, 0, NULL);
+        if (n <= 0)
+            return;
+        int count = 0;
+        for (int i = 0; i < n; i++) {
+            r->relayed++;
+            if (loss > 0 && rng() < threshold) {
+                r->dropped++;
+                continue;
+            }
+            if (ntohs(from[i].sin_port) == receiver_port) {
+                if (sender->sin_port == 0)
+                    continue;
+                to[count] = *sender;
+            } else {
+                *sender = from[i];
+                memset(&to[count], 0, sizeof(to[count]));
+                to[count].sin_family = AF_INET;
+                to[count].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                to[count].sin_port = htons(receiver_port);
+            }
+            out_iov[count].iov_base = buffers[i];
+            out_iov[count].iov_len = in[i].msg_len;
+            memset(&out[count].msg_hdr, 0, sizeof(out[count].msg_hdr));
+            out[count].msg_hdr.msg_iov = &out_iov[count];
+            out[count].msg_hdr.msg_iovlen = 1;
+            out[count].msg_hdr.msg_name = &to[count];
+            out[count].msg_hdr.msg_namelen = sizeof(to[count]);
+            count++;
+        }
+        for (int sent = 0; sent < count;) { // A full socket buffer loses the rest, like a congested link
+            int m = sendmmsg(fd, out + sent, (unsigned)(count - sent), 0);
+            if (m <= 0)
+                break;
+            sent += m;
+        }
+    }
+}
+
+static int same_file(const char *path, const char *data, long bytes) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return 0;
+    static char chunk[1 << 16];
+    long offset = 0;
+    size_t got;
+    int same = 1;
+    while (same && (got = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        same = offset + (long)got <= bytes && memcmp(chunk, data + offset, got) == 0;
+        offset += (long)got;
+    }
+    fclose(f);
+    return same && offset == bytes;
+}
+
+static void run_transfer(const struct options *o, const char *algorithm, double loss, long size, uint16_t base,
+                         const char *input_path, const char *output_path, const char *data, struct run_result *r) {
+    memset(r, 0, sizeof(*r));
+    r->status = "failed";
+    uint16_t relay_port = base, receiver_port = (uint16_t)(base + 1);
+    char relay_arg[8], receiver_arg[8], size_arg[16], window_arg[16];
+    snprintf(relay_arg, sizeof(relay_arg), "%u", relay_port);
+    snprintf(receiver_arg, sizeof(receiver_arg), "%u", receiver_port);
+    snprintf(size_arg, sizeof(size_arg), "%ld", size);
+    snprintf(window_arg, sizeof(window_arg), "%ld", o->window);
+
+    int fd = open_relay(relay_port);
+    if (fd < 0)
+        return;
+    unlink(output_path);
+    char *receive_args[] = { (char *)o->receive_binary, receiver_arg, "-o", (char *)output_path, "-w", window_arg, NULL };
+    pid_t receiver = spawn(o->receive_binary, receive_args, -1, -1);
+    usleep(200000);
+
+    int in_fd = open(input_path, O_RDONLY);
+    int err_pipe[2];
+    if (in_fd < 0 || pipe(err_pipe) != 0) {
+        perror("sender setup");
+        stop(receiver);
+        close(fd);
+        return;
+    }
+    char *send_args[] = { (char *)o->send_binary, "127.0.0.1", relay_arg, "-t", "1", "-c", (char *)algorithm,
+                          "-s", size_arg, "-w", window_arg, NULL };
+    long long start = now_ns();
+    pid_t sender = spawn(o->send_binary, send_args, in_fd, err_pipe[1]);
+    close(in_fd);
+    close(err_pipe[1]);
+
+    struct sockaddr_in sender_addr;
+    memset(&sender_addr, 0, sizeof(sender_addr));
+    int status = -1;
+    while (1) {
+        struct pollfd p = { fd, POLLIN, 0 };
+        if (poll(&p, 1, 1) > 0)
+            relay(fd, receiver_port, &sender_addr, loss, r);
+        if (waitpid(sender, &status, WNOHANG) == sender)
+            break;
+        if (now_ns() - start > RUN_TIMEOUT_NS) {
+            stop(sender);
+            r->status = "timeout";
+            break;
+        }
+    }
+    r->seconds = (double)(now_ns() - start) / 1e9;
+
+    char report[4096];
+    ssize_t got = read(err_pipe[0], report, sizeof(report) - 1);
+    close(err_pipe[0]);
+    report[got > 0 ? got : 0] = '\0';
+    const char *line = strstr(report, "retransmissions");
+    if (line != NULL) { // "N retransmissions (x%), M timeouts, ..."
+        while (line > report && line[-1] != '\n')
+            line--;
+        sscanf(line, "%lld retransmissions (%*[^)]), %lld timeouts", &r->retransmits, &r->timeouts);
+    }
+
+    stop(receiver);
+    close(fd);
+    if (strcmp(r->status, "timeout") != 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        r->status = same_file(output_path, data, o->bytes) ? "ok" : "corrupt";
+}
+
+static void report(FILE *csv, const struct options *o, const char *algorithm, double loss, long size,
+                   const struct run_result *r) {
+    double goodput = r->seconds > 0 ? (double)o->bytes * 8 / r->seconds / 1e6 : 0;
+    long long datagrams = (o->bytes + size - 1) / size;
+    double retransmit_pct = datagrams > 0 ? 100.0 * (double)r->retransmits / (double)datagrams : 0;
+    double dropped_pct = r->relayed > 0 ? 100.0 * (double)r->dropped / (double)r->relayed : 0;
+    printf("%-6s %6.2f %6ld %8.3f %10.1f %9.2f %8lld %9.2f %8s\n", algorithm, loss, size, r->seconds, goodput,
+           retransmit_pct, r->timeouts, dropped_pct, r->status);
+    fflush(stdout);
+    if (csv != NULL) {
+        fprintf(csv, "%s,%s,%.2f,%ld,%ld,%ld,%.3f,%.1f,%lld,%lld,%lld,%lld,%s\n", o->label, algorithm, loss, size,
+                o->bytes, o->window, r->seconds, goodput, r->retransmits, r->timeouts, r->relayed, r->dropped,
+                r->status);
+        fflush(csv);
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s -s <send_udp_binary> -r <receive_udp_binary> [-c algorithms] [-l loss_percents]\n"
+                    "       [-z datagram_sizes] [-b bytes] [-w window] [-o results.csv] [-t label]\n"
+                    "Lists are comma-separated; loss applies to each direction.\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    struct options o;
+    memset(&o, 0, sizeof(o));
+    static char default_algorithms[] = "aimd,delay";
+    o.algorithm_count = parse_words(default_algorithms, o.algorithms, MAX_LIST);
+    o.loss_count = parse_double_list("0,0.1,1,2,5,10", o.losses, MAX_LIST);
+    o.size_count = parse_list("1400", o.sizes, MAX_LIST);
+    o.bytes = 20000000;
+    o.window = 1024;
+    o.label = "";
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        char *value = argv[++i];
+        const char *flag = argv[i - 1];
+        int ok = 1;
+        if (strcmp(flag, "-s") == 0)
+            o.send_binary = value;
+        else if (strcmp(flag, "-r") == 0)
+            o.receive_binary = value;
+        else if (strcmp(flag, "-c") == 0)
+            ok = (o.algorithm_count = parse_words(value, o.algorithms, MAX_LIST)) > 0;
+        else if (strcmp(flag, "-l") == 0)
+            ok = (o.loss_count = parse_double_list(value, o.losses, MAX_LIST)) > 0;
+        else if (strcmp(flag, "-z") == 0)
+            ok = (o.size_count = parse_list(value, o.sizes, MAX_LIST)) > 0;
+        else if (strcmp(flag, "-b") == 0)
+            ok = (o.bytes = atol(value)) > 0;
+        else if (strcmp(flag, "-w") == 0)
+            ok = (o.window = atol(value)) > 0;
+        else if (strcmp(flag, "-o") == 0)
+            o.output = value;
+        else if (strcmp(flag, "-t") == 0)
+            o.label = value;
+        else
+            ok = 0;
+        if (!ok) {
+            fprintf(stderr, "Invalid option: %s %s\n", flag, value);
+            return 1;
+        }
+    }
+    for (int i = 0; i < o.loss_count; i++)
+        if (o.losses[i] < 0 || o.losses[i] >= 100)
+            o.send_binary = NULL;
+    for (int i = 0; i < o.size_count; i++)
+        if (o.sizes[i] < 1 || o.sizes[i] > 65483)
+            o.send_binary = NULL;
+    if (o.send_binary == NULL || o.receive_binary == NULL) {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    FILE *csv = NULL;
+    if (o.output != NULL) {
+        csv = fopen(o.output, "a");
+        if (csv == NULL) {
+            perror(o.output);
+            return 1;
+        }
+        if (ftell(csv) == 0)
+            fprintf(csv, "label,algorithm,loss_pct,datagram,bytes,window,seconds,goodput_mbps,retransmits,timeouts,"
+                         "relayed,dropped,status\n");
+    }
+
+    char *data = malloc((size_t)o.bytes);
+    char input_path[] = "/tmp/bench_transfer_in_XXXXXX";
+    char output_path[64];
+    int in_fd = mkstemp(input_path);
+    if (data == NULL || in_fd < 0) {
+        fprintf(stderr, "Could not set up the input file\n");
+        return 1;
+    }
+    for (long i = 0; i < o.bytes; i++)
+        data[i] = (char)(rng() >> 56);
+    if (write(in_fd, data, (size_t)o.bytes) != o.bytes) {
+        fprintf(stderr, "Could not write the input file\n");
+        unlink(input_path);
+        return 1;
+    }
+    close(in_fd);
+    snprintf(output_path, sizeof(output_path), "%s.out", input_path);
+
+    uint16_t base = (uint16_t)(20000 + (getpid() * 4) % 20000);
+    static struct run_result r;
+    printf("# %ld bytes per run, window %ld; loss applies to each direction\n", o.bytes, o.window);
+    printf("%-6s %6s %6s %8s %10s %9s %8s %9s %8s\n", "cc", "loss%", "size", "seconds", "Mbit/s", "retx%",
+           "timeouts", "dropped%", "result");
+    int run = 0;
+    for (int ai = 0; ai < o.algorithm_count; ai++) {
+        for (int si = 0; si < o.size_count; si++) {
+            for (int li = 0; li < o.loss_count; li++, run++) {
+                run_transfer(&o, o.algorithms[ai], o.losses[li], o.sizes[si], (uint16_t)(base + 2 * (run % 1000)),
+                             input_path, output_path, data, &r);
+                report(csv, &o, o.algorithms[ai], o.losses[li], o.sizes[si], &r);
+            }
+        }
+    }
+
+    unlink(input_path);
+    unlink(output_path);
+    free(data);
+    if (csv != NULL)
+        fclose(csv);
+    return 0;
+}
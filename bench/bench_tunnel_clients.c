@@ -0,0 +1,127 @@
+// Loopback benchmark for tunnel_udp_over_tcp_server: aggregate datagrams/sec
+// echoed through the tunnel as the number of concurrent TCP clients grows.
+//
+// The benchmark runs its own UDP echo backend, starts the tunnel server pointed
+// at it, then opens 1, 2, 4 ... max_clients framed TCP connections that each
+// keep a small window of datagrams in flight.
+//
+// Linux only. Build: gcc -O2 -pthread -o bench_tunnel_clients bench/bench_tunnel_clients.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "../platform.h"
+#include "../frame.h"
+#include "bench_common.h"
+
+// Runs one step of the sweep and returns echoed datagrams per second
+static double run_step(uint16_t tcp_port, int clients, int window, size_t payload, double seconds) {
+    struct bench_client *c = calloc((size_t)clients, sizeof(*c));
+    char *data = calloc(1, payload + FRAME_HEADER_SIZE);
+    int epfd = epoll_create1(0);
+    long long echoed = 0;
+
+    memset(data + FRAME_HEADER_SIZE, 'x', payload);
+    // Every client uses flow 1 on its own connection
+    const char *frame = frame_prepend_header(data + FRAME_HEADER_SIZE, (int)payload, 1, 0);
+
+    for (int i = 0; i < clients; i++) {
+        c[i].fd = bench_connect_client(tcp_port);
+        if (c[i].fd < 0) {
+            fprintf(stderr, "connect failed for client %d: %s\n", i, strerror(errno));
+            exit(1);
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &c[i] };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c[i].fd, &ev);
+    }
+    usleep(100000); // Let the server register every connection
+
+    long long start = bench_now_ns();
+    for (int i = 0; i < clients; i++) {
+        c[i].last_progress_ns = start;
+        bench_send_frames(&c[i], frame, payload + FRAME_HEADER_SIZE, window);
+    }
+
+    long long deadline = start + (long long)(seconds * 1e9);
+    struct epoll_event events[256];
+    long long now = start;
+    while (now < deadline) {
+        int n = epoll_wait(epfd, events, 256, 10);
+        now = bench_now_ns();
+        for (int e = 0; e < n; e++) {
+            struct bench_client *cl = events[e].data.ptr;
+            int frames = bench_receive_frames(cl);
+            if (frames == 0)
+                continue;
+
+            echoed += frames;
+            cl->in_flight -= frames;
+            cl->last_progress_ns = now;
+            bench_send_frames(cl, frame, payload + FRAME_HEADER_SIZE, frames);
+        }
+
+        for (int i = 0; i < clients; i++) { // Datagrams lost to full UDP buffers never come back
+            if (now - c[i].last_progress_ns > STALL_NS) {
+                c[i].in_flight = 0;
+                c[i].last_progress_ns = now;
+                bench_send_frames(&c[i], frame, payload + FRAME_HEADER_SIZE, window);
+            }
+        }
+    }
+    double elapsed = (bench_now_ns() - start) / 1e9;
+
+    for (int i = 0; i < clients; i++)
+        close(c[i].fd);
+    close(epfd);
+    free(data);
+    free(c);
+    usleep(200000); // Let the server tear the connections down
+    return echoed / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <tunnel_server_binary> [max_clients] [seconds] [payload] [window]\n", argv[0]);
+        return 1;
+    }
+    char *server_binary = argv[1];
+    int max_clients = argc > 2 ? atoi(argv[2]) : 512;
+    double seconds = argc > 3 ? atof(argv[3]) : 2.0;
+    size_t payload = argc > 4 ? (size_t)atoi(argv[4]) : 64;
+    int window = argc > 5 ? atoi(argv[5]) : 4;
+
+    if (payload > BENCH_MAX_PAYLOAD || max_clients < 1 || window < 1) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_in udp_addr; // Echo backend on an ephemeral port
+    if (bench_echo_start(&udp_addr, 1) < 0)
+        return 1;
+
+    uint16_t tcp_port = (uint16_t)(20000 + getpid() % 20000);
+    char tcp_port_str[8], udp_port_str[8];
+    snprintf(tcp_port_str, sizeof(tcp_port_str), "%u", tcp_port);
+    snprintf(udp_port_str, sizeof(udp_port_str), "%u", ntohs(udp_addr.sin_port));
+
+    char *server_argv[] = { server_binary, tcp_port_str, "127.0.0.1", udp_port_str, NULL };
+    pid_t server = bench_spawn(server_argv, NULL); // Resets from closed benchmark clients are expected
+    usleep(300000); // Give the server time to bind
+
+    printf("# payload=%zu bytes, window=%d per client, %.1fs per step\n", payload, window, seconds);
+    printf("%8s %16s %16s\n", "clients", "datagrams/sec", "per client");
+    for (int clients = 1; clients <= max_clients; clients *= 2) {
+        double rate = run_step(tcp_port, clients, window, payload, seconds);
+        printf("%8d %16.0f %16.0f\n", clients, rate, rate / clients);
+        fflush(stdout);
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    return 0;
+}
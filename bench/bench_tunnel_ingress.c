@@ -0,0 +1,302 @@
+// UDP->TCP ingress benchmark for both tunnel programs: small datagrams per
+// second framed onto the TCP connection, one recv and one send per datagram
+// (-b 1 -t 0) against the batched recvmmsg + coalescing path.
+//
+// The benchmark plays the far end of the tunnel. For the client it is the TCP
+// server; for the server it is the TCP client that opens the flows and then the
+// UDP backend that floods them. A sender thread keeps the tunnel's UDP sockets
+// saturated while the main thread counts the frames arriving over TCP, so only
+// the ingress leg is measured.
+//
+// Linux only. Build: gcc -O2 -pthread -o bench_tunnel_ingress bench/bench_tunnel_ingress.c
+
+#define _GNU_SOURCE // sendmmsg
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../platform.h"
+#include "../frame.h"
+
+#define FLOWS 4 // Distinct UDP peers, one tunnel flow each
+#define SEND_BATCH 64
+#define READ_BUFFER_SIZE (1 << 20)
+
+struct flood {
+    int fd[FLOWS]; // Sockets the datagrams leave from
+    struct sockaddr_in to[FLOWS];
+    size_t payload;
+    volatile int stop;
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *flood_sender(void *arg) { // Open loop: the kernel drops what the tunnel cannot take
+    struct flood *f = arg;
+    static char data[65536];
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iov[SEND_BATCH];
+
+    memset(data, 'x', sizeof(data));
+    while (!f->stop) {
+        for (int flow = 0; flow < FLOWS && !f->stop; flow++) {
+            memset(msgs, 0, sizeof(msgs));
+            for (int i = 0; i < SEND_BATCH; i++) {
+                iov[i].iov_base = data;
+                iov[i].iov_len = f->payload;
+                msgs[i].msg_hdr.msg_iov = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                msgs[i].msg_hdr.msg_name = &f->to[flow];
+                msgs[i].msg_hdr.msg_namelen = sizeof(f->to[flow]);
+            }
+            sendmmsg(f->fd[flow], msgs, SEND_BATCH, MSG_DONTWAIT);
+        }
+        sched_yield(); // Do not starve the tunnel when they share a core
+    }
+    return NULL;
+}
+
+static int bind_loopback(int type, struct sockaddr_in *addr) { // Ephemeral port, written back to addr
+    int fd = socket(AF_INET, type, 0);
+    socklen_t len = sizeof(*addr);
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *)addr, sizeof(*addr)) != 0 ||
+        getsockname(fd, (struct sockaddr *)addr, &len) != 0) {
+        perror("bind");
+        exit(1);
+    }
+    return fd;
+}
+
+static pid_t spawn(const char *binary, char *const args[]) { // Tunnel process with its output discarded
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        execv(binary, args);
+        _exit(127);
+    }
+    return pid;
+}
+
+struct result {
+    double rate; // Frames delivered per wall-clock second
+    double per_cpu; // Frames delivered per CPU second spent in the tunnel process
+};
+
+// Counts the frames that arrive on the TCP connection within the given time.
+// A partial frame stays buffered for the next call, which keeps the parse aligned.
+static char stream_buffer[READ_BUFFER_SIZE];
+static size_t stream_fill = 0;
+
+static long long count_frames(int tcp_fd, double seconds) {
+    char *buffer = stream_buffer;
+    size_t fill = stream_fill;
+    long long frames = 0;
+    double deadline = now_seconds() + seconds;
+    struct timeval tv = { 0, 100000 };
+    setsockopt(tcp_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    while (now_seconds() < deadline) {
+        ssize_t n = recv(tcp_fd, buffer + fill, READ_BUFFER_SIZE - fill, 0);
+        if (n == 0)
+            break;
+        if (n < 0)
+            continue;
+        fill += (size_t)n;
+        size_t pos = 0;
+        struct frame_view view;
+        while (frame_parse(buffer + pos, (int)(fill - pos), &view) == 1) {
+            pos += (size_t)view.length;
+            frames++;
+        }
+        memmove(buffer, buffer + pos, fill - pos);
+        fill -= pos;
+    }
+    stream_fill = fill;
+    return frames;
+}
+
+static double process_cpu_seconds(pid_t pid) { // utime + stime of a running process
+    char path[64];
+    unsigned long utime = 0, stime = 0;
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0.0;
+    if (fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        utime = stime = 0;
+    fclose(f);
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double stop_tunnel(pid_t pid) { // Returns the CPU seconds the tunnel process used
+    struct rusage usage;
+    kill(pid, SIGTERM);
+    wait4(pid, NULL, 0, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// Client ingress: local UDP peers -> tunnel client -> this process as TCP server
+static struct result run_client(const char *binary, char *const options[], size_t payload, double seconds, uint16_t udp_port) {
+    struct sockaddr_in tcp_addr;
+    int listen_fd = bind_loopback(SOCK_STREAM, &tcp_addr);
+    listen(listen_fd, 1);
+
+    char udp_port_str[8], tcp_port_str[8];
+    snprintf(udp_port_str, sizeof(udp_port_str), "%u", udp_port);
+    snprintf(tcp_port_str, sizeof(tcp_port_str), "%u", ntohs(tcp_addr.sin_port));
+    char *args[16] = { (char *)binary, udp_port_str, "127.0.0.1", tcp_port_str };
+    int argc = 4;
+    for (int i = 0; options[i] != NULL && argc < 15; i++)
+        args[argc++] = options[i];
+    args[argc] = NULL;
+
+    pid_t pid = spawn(binary, args);
+    int tcp_fd = accept(listen_fd, NULL, NULL);
+    usleep(100000); // The client binds its UDP port before connecting, but let it settle
+
+    struct flood f;
+    memset(&f, 0, sizeof(f));
+    f.payload = payload;
+    for (int i = 0; i < FLOWS; i++) {
+        struct sockaddr_in from;
+        f.fd[i] = bind_loopback(SOCK_DGRAM, &from);
+        f.to[i].sin_family = AF_INET;
+        f.to[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        f.to[i].sin_port = htons(udp_port);
+    }
+
+    pthread_t sender;
+    pthread_create(&sender, NULL, flood_sender, &f);
+    stream_fill = 0;
+    count_frames(tcp_fd, 0.3); // Warm up
+    double warm_cpu = process_cpu_seconds(pid);
+    long long frames = count_frames(tcp_fd, seconds);
+    f.stop = 1;
+    pthread_join(sender, NULL);
+
+    double cpu = stop_tunnel(pid) - warm_cpu;
+    for (int i = 0; i < FLOWS; i++)
+        close(f.fd[i]);
+    close(tcp_fd);
+    close(listen_fd);
+    struct result r = { frames / seconds, cpu > 0 ? frames / cpu : 0.0 };
+    return r;
+}
+
+// Server ingress: this process as UDP backend -> tunnel server -> this process as TCP client
+static struct result run_server(const char *binary, char *const options[], size_t payload, double seconds, uint16_t tcp_port) {
+    struct sockaddr_in backend_addr;
+    int backend_fd = bind_loopback(SOCK_DGRAM, &backend_addr);
+
+    char tcp_port_str[8], udp_port_str[8];
+    snprintf(tcp_port_str, sizeof(tcp_port_str), "%u", tcp_port);
+    snprintf(udp_port_str, sizeof(udp_port_str), "%u", ntohs(backend_addr.sin_port));
+    char *args[16] = { (char *)binary, tcp_port_str, "127.0.0.1", udp_port_str };
+    int argc = 4;
+    for (int i = 0; options[i] != NULL && argc < 15; i++)
+        args[argc++] = options[i];
+    args[argc] = NULL;
+
+    pid_t pid = spawn(binary, args);
+    usleep(300000); // Give the server time to bind
+
+    int tcp_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server_addr.sin_port = htons(tcp_port);
+    if (connect(tcp_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) != 0) {
+        perror("connect to tunnel server");
+        exit(1);
+    }
+
+    // One frame per flow makes the server open a UDP socket towards the backend
+    struct flood f;
+    memset(&f, 0, sizeof(f));
+    f.payload = payload;
+    for (int i = 0; i < FLOWS; i++) {
+        char data[FRAME_HEADER_SIZE + 1];
+        data[FRAME_HEADER_SIZE] = 'o';
+        char *frame = frame_prepend_header(data + FRAME_HEADER_SIZE, 1, (uint32_t)i + 1, 0);
+        send(tcp_fd, frame, sizeof(data), 0);
+        socklen_t len = sizeof(f.to[i]);
+        recvfrom(backend_fd, data, sizeof(data), 0, (struct sockaddr *)&f.to[i], &len);
+        f.fd[i] = backend_fd;
+    }
+
+    pthread_t sender;
+    pthread_create(&sender, NULL, flood_sender, &f);
+    stream_fill = 0;
+    count_frames(tcp_fd, 0.3); // Warm up
+    double warm_cpu = process_cpu_seconds(pid);
+    long long frames = count_frames(tcp_fd, seconds);
+    f.stop = 1;
+    pthread_join(sender, NULL);
+
+    close(tcp_fd);
+    double cpu = stop_tunnel(pid) - warm_cpu;
+    close(backend_fd);
+    struct result r = { frames / seconds, cpu > 0 ? frames / cpu : 0.0 };
+    return r;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <tunnel_server_binary> <tunnel_client_binary> [seconds] [payload]\n", argv[0]);
+        return 1;
+    }
+    double seconds = argc > 3 ? atof(argv[3]) : 2.0;
+    size_t payload = argc > 4 ? (size_t)atoi(argv[4]) : 64;
+    if (seconds <= 0 || payload < 1 || payload > 1400) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    uint16_t port = (uint16_t)(20000 + getpid() % 20000);
+
+    static char *legacy[] = { "-b", "1", "-t", "0", NULL };
+    static char *batched[] = { NULL }; // Defaults: -b 32 -t 32768 -d 0
+
+    printf("# payload=%zu bytes, %d flows, %.1fs per run\n", payload, FLOWS, seconds);
+    printf("# dgram/s is wall clock; dgram/cpu-s divides by the tunnel process's own CPU time\n");
+    printf("%-8s %-8s %14s %14s\n", "program", "mode", "dgram/s", "dgram/cpu-s");
+
+    struct result legacy_server = run_server(argv[1], legacy, payload, seconds, port);
+    struct result batched_server = run_server(argv[1], batched, payload, seconds, (uint16_t)(port + 1));
+    struct result legacy_client = run_client(argv[2], legacy, payload, seconds, (uint16_t)(port + 2));
+    struct result batched_client = run_client(argv[2], batched, payload, seconds, (uint16_t)(port + 3));
+
+    printf("%-8s %-8s %14.0f %14.0f\n", "server", "legacy", legacy_server.rate, legacy_server.per_cpu);
+    printf("%-8s %-8s %14.0f %14.0f\n", "server", "batched", batched_server.rate, batched_server.per_cpu);
+    printf("%-8s %-8s %14.0f %14.0f\n", "client", "legacy", legacy_client.rate, legacy_client.per_cpu);
+    printf("%-8s %-8s %14.0f %14.0f\n", "client", "batched", batched_client.rate, batched_client.per_cpu);
+    printf("speedup  server %.2fx (%.2fx per cpu-s), client %.2fx (%.2fx per cpu-s)\n",
+           batched_server.rate / legacy_server.rate, batched_server.per_cpu / legacy_server.per_cpu,
+           batched_client.rate / legacy_client.rate, batched_client.per_cpu / legacy_client.per_cpu);
+    return 0;
+}
@@ -0,0 +1,163 @@
+// Event backend benchmark for the tunnel: datagrams/sec echoed through
+// tunnel_udp_over_tcp_client and tunnel_udp_over_tcp_server, and the system
+// calls both spend per datagram, with -e poll and with -e uring.
+//
+// A UDP echo backend sits behind the server and a closed-loop load keeps a
+// window of datagrams in flight on each of several UDP flows. Throughput is
+// measured first, untraced; system calls are then counted in a second window
+// by attaching to both processes with ptrace and counting syscall stops, which
+// slows the tunnel down, so that window only yields calls per datagram. A
+// machine without io_uring runs the readiness loop for both rows.
+//
+// Linux only. Build: gcc -O2 -pthread -o bench_uring_backend bench/bench_uring_backend.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+#include "../platform.h"
+#include "../frame.h"
+#include "bench_common.h"
+
+struct tracer {
+    pthread_t thread;
+    pid_t pids[2]; // Client, server
+    double seconds;
+    long long syscalls[2];
+    int ready;
+};
+
+// Counts the syscall stops of both processes for a while. Every call stops
+// twice, on entry and on exit. All ptrace requests come from this thread.
+static void *trace_main(void *arg) {
+    struct tracer *t = arg;
+    for (int i = 0; i < 2; i++) {
+        int status;
+        if (ptrace(PTRACE_SEIZE, t->pids[i], 0, PTRACE_O_TRACESYSGOOD) != 0) {
+            perror("ptrace");
+            exit(1);
+        }
+        ptrace(PTRACE_INTERRUPT, t->pids[i], 0, 0);
+        waitpid(t->pids[i], &status, __WALL);
+        ptrace(PTRACE_SYSCALL, t->pids[i], 0, 0);
+    }
+    __atomic_store_n(&t->ready, 1, __ATOMIC_RELEASE);
+
+    long long stops[2] = { 0, 0 };
+    long long deadline = bench_now_ns() + (long long)(t->seconds * 1e9);
+    while (bench_now_ns() < deadline) {
+        int status;
+        pid_t pid = waitpid(-1, &status, __WALL);
+        if (pid < 0)
+            break;
+        int i = pid == t->pids[0] ? 0 : 1;
+        if (!WIFSTOPPED(status))
+            continue;
+        int sig = WSTOPSIG(status);
+        if (sig == (SIGTRAP | 0x80)) {
+            stops[i]++;
+            sig = 0;
+        } else if (status >> 16 == PTRACE_EVENT_STOP || sig == SIGTRAP) {
+            sig = 0; // Not a signal to deliver
+        }
+        ptrace(PTRACE_SYSCALL, pid, 0, sig);
+    }
+
+    for (int i = 0; i < 2; i++) { // Stop, then let go
+        int status;
+        ptrace(PTRACE_INTERRUPT, t->pids[i], 0, 0);
+        while (waitpid(t->pids[i], &status, __WALL) == t->pids[i] && !WIFSTOPPED(status))
+            ;
+        ptrace(PTRACE_DETACH, t->pids[i], 0, 0);
+        t->syscalls[i] = stops[i] / 2;
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <tunnel_server_binary> <tunnel_client_binary> [flows] [seconds] [payload] [window]\n",
+                argv[0]);
+        return 1;
+    }
+    char *server_binary = argv[1];
+    char *client_binary = argv[2];
+    int flow_count = argc > 3 ? atoi(argv[3]) : 16;
+    double seconds = argc > 4 ? atof(argv[4]) : 3.0;
+    size_t payload = argc > 5 ? (size_t)atoi(argv[5]) : 64;
+    int window = argc > 6 ? atoi(argv[6]) : 16;
+    if (flow_count < 1 || flow_count > BENCH_MAX_FLOWS || payload < 1 || payload > BENCH_MAX_PAYLOAD || window < 1) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_in udp_addr; // Echo backend on an ephemeral port
+    if (bench_echo_start(&udp_addr, 1) < 0)
+        return 1;
+
+    char *payload_bytes = malloc(payload);
+    memset(payload_bytes, 'x', payload);
+
+    printf("# %d flows, payload=%zu bytes, window=%d, %.1fs per window\n", flow_count, payload, window, seconds);
+    printf("%8s %16s %18s %18s %18s\n", "backend", "datagrams/sec", "client calls/dgram", "server calls/dgram",
+           "total calls/dgram");
+    const char *backends[] = { "poll", "uring" };
+    for (int b = 0; b < 2; b++) {
+        char backend[8], udp_port[8], tcp_port[8], tunnel_port[8];
+        snprintf(backend, sizeof(backend), "%s", backends[b]);
+        snprintf(udp_port, sizeof(udp_port), "%u", ntohs(udp_addr.sin_port));
+        uint16_t base = (uint16_t)(20000 + (getpid() * 2 + b * 2) % 20000); // Fresh ports per backend
+        snprintf(tcp_port, sizeof(tcp_port), "%u", base);
+        snprintf(tunnel_port, sizeof(tunnel_port), "%u", base + 1);
+
+        char *server_argv[] = { server_binary, tcp_port, "127.0.0.1", udp_port, "-e", backend, NULL };
+        pid_t server = bench_spawn(server_argv, NULL);
+        usleep(300000);
+        char *client_argv[] = { client_binary, tunnel_port, "127.0.0.1", tcp_port, "-e", backend, NULL };
+        pid_t client = bench_spawn(client_argv, NULL);
+        usleep(300000);
+
+        struct sockaddr_in to;
+        memset(&to, 0, sizeof(to));
+        to.sin_family = AF_INET;
+        to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        to.sin_port = htons(base + 1);
+        int epfd = epoll_create1(0);
+        struct bench_flow *flows = bench_open_flows(epfd, flow_count);
+
+        bench_run_load(epfd, flows, flow_count, &to, payload_bytes, payload, window,
+                       bench_now_ns() + 500000000LL); // Warm-up
+        long long echoed = bench_run_load(epfd, flows, flow_count, &to, payload_bytes, payload, window,
+                                          bench_now_ns() + (long long)(seconds * 1e9));
+
+        struct tracer t;
+        memset(&t, 0, sizeof(t));
+        t.pids[0] = client;
+        t.pids[1] = server;
+        t.seconds = seconds;
+        pthread_create(&t.thread, NULL, trace_main, &t);
+        while (!__atomic_load_n(&t.ready, __ATOMIC_ACQUIRE))
+            usleep(1000);
+        long long traced = bench_run_load(epfd, flows, flow_count, &to, payload_bytes, payload, window,
+                                          bench_now_ns() + (long long)(seconds * 1e9));
+        pthread_join(t.thread, NULL);
+
+        double per = traced > 0 ? 1.0 / (double)traced : 0.0;
+        printf("%8s %16.0f %18.2f %18.2f %18.2f\n", backend, echoed / seconds, t.syscalls[0] * per,
+               t.syscalls[1] * per, (t.syscalls[0] + t.syscalls[1]) * per);
+        fflush(stdout);
+
+        bench_close_flows(flows, flow_count);
+        close(epfd);
+        kill(client, SIGTERM);
+        kill(server, SIGTERM);
+        waitpid(client, NULL, 0);
+        waitpid(server, NULL, 0);
+    }
+    free(payload_bytes);
+    return 0;
+}
@@ -0,0 +1,435 @@
+// Frame compression shared by tunnel_udp_over_tcp_client and
+// tunnel_udp_over_tcp_server: an LZ4-format block codec, a gate that decides
+// from recent results whether compressing still pays, and the helpers that
+// build compressed frames and open them again.
+//
+// Codec: the LZ4 block format, compressed greedily. A block is a series of
+// sequences, each a token, literals, a 16-bit offset and a match of at least
+// 4 bytes from the last 64 KiB; the last sequence is literals only. Matches
+// are found through a 4096-entry hash table per thread. It is never cleared
+// between blocks: positions are stored above a base that moves past every
+// block, so entries left by earlier blocks fall out of range. The compressor
+// stops as soon as its output would reach the capacity it is given. Callers
+// ask for output smaller than the input, so incompressible data is abandoned
+// early; the search also steps faster the longer it goes without a match.
+// The decompressor checks every length and offset against both buffers, so
+// a corrupt block is rejected rather than overrunning either.
+//
+// Frames: a frame with FRAME_FLAG_COMPRESSED carries its payload as one block
+// and keeps its flow ID and timestamp. A batch frame, FRAME_FLAG_BATCH as
+// well, carries a run of whole frames, at most COMPRESS_RUN_BYTES and
+// COMPRESS_RUN_FRAMES of them, as one block; its flow ID is 0 and it takes
+// the timestamp of the run's first frame. Frames in a run are never
+// compressed themselves.
+//
+// Gate: every attempt updates running averages of the share of bytes saved
+// and the time spent per input byte. Compression pays while it saves at least
+// COMPRESS_MIN_SAVING and costs less time than the saved bytes would take on
+// the link. After an attempt that does not pay, the next COMPRESS_PROBE_MIN
+// frames or runs go out as they are, doubling up to COMPRESS_PROBE_MAX while
+// compression keeps not paying. The first attempt, and the first after such a
+// pause, find the hash table out of the cache: their time is left out and the
+// attempt after them decides. The time is wall-clock, so no attempt counts for
+// more than twice the average: a thread preempted while compressing must not
+// close the gate by itself.
+//
+// Include after platform.h, metrics.h, frame.h and pool.h.
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define COMPRESS_HASH_BITS 12
+#define COMPRESS_MIN_MATCH 4
+#define COMPRESS_MAX_OFFSET 65535
+#define COMPRESS_LAST_LITERALS 5  // A block ends with at least this many literals (LZ4 format)
+#define COMPRESS_MATCH_LIMIT 12  // No match starts closer than this to the end (LZ4 format)
+#define COMPRESS_MIN_FRAME 64  // Shorter frames seldom shrink
+#define COMPRESS_RUN_BYTES FRAME_MAX_PAYLOAD  // A run opens into no more than a payload
+#define COMPRESS_RUN_FRAMES 256  // Fewer than the io_uring send slots of one loop
+#define COMPRESS_MIN_SAVING 0.0625
+#define COMPRESS_PROBE_MIN 8
+#define COMPRESS_PROBE_MAX 1024
+#define COMPRESS_DEFAULT_LINK_MBIT 1000
+
+#ifdef _MSC_VER
+#define COMPRESS_THREAD_LOCAL __declspec(thread)
+#else
+#define COMPRESS_THREAD_LOCAL _Thread_local
+#endif
+
+enum compress_mode {
+    COMPRESS_OFF,
+    COMPRESS_FRAMES, // Every frame on its own
+    COMPRESS_RUNS // Coalesced runs of frames together, and frames too large to coalesce on their own
+};
+
+struct compress_table { // One per thread
+    uint32_t base; // Positions of the current block are stored as base + offset
+    uint32_t slots[1 << COMPRESS_HASH_BITS];
+};
+
+struct compress_gate { // One per connection and kind of attempt
+    double saving; // Share of bytes saved, averaged over recent attempts
+    double ns_per_byte; // Time per input byte, likewise
+    double link_ns_per_byte; // What a byte costs on the link; 0 ignores the time spent
+    uint32_t attempts;
+    uint32_t skip; // Frames or runs to send as they are before the next attempt
+    uint32_t backoff; // skip after the next attempt that does not pay
+    int cold; // The next attempt follows a pause, or is the first
+};
+
+static COMPRESS_THREAD_LOCAL struct compress_table compress_table;
+
+static inline int parse_compress_mode(const char *name, enum compress_mode *mode) {
+    if (strcmp(name, "off") == 0)
+        *mode = COMPRESS_OFF;
+    else if (strcmp(name, "frame") == 0)
+        *mode = COMPRESS_FRAMES;
+    else if (strcmp(name, "batch") == 0)
+        *mode = COMPRESS_RUNS;
+    else
+        return -1;
+    return 0;
+}
+
+static inline uint32_t compress_load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t compress_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+}
+
+static inline uint8_t *compress_put_length(uint8_t *op, size_t n) { // Bytes beyond a 4-bit field of 15
+    while (n >= 255) {
+        *op++ = 255;
+        n -= 255;
+    }
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+// Appends a sequence: literals, then a match unless match_length is 0, as in
+// the last sequence. Returns the new end, or NULL when it would reach end.
+static inline uint8_t *compress_put_sequence(uint8_t *op, const uint8_t *end, const uint8_t *literals,
+                                             size_t literal_length, size_t offset, size_t match_length) {
+    size_t worst = 1 + literal_length / 255 + 1 + literal_length + (match_length > 0 ? 2 + match_length / 255 + 1 : 0);
+    if (worst >= (size_t)(end - op))
+        return NULL;
+    uint8_t *token = op++;
+    *token = (uint8_t)((literal_length < 15 ? literal_length : 15) << 4);
+    if (literal_length >= 15)
+        op = compress_put_length(op, literal_length - 15);
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+    if (match_length == 0)
+        return op;
+    *op++ = (uint8_t)(offset & 0xFF);
+    *op++ = (uint8_t)(offset >> 8);
+    size_t extra = match_length - COMPRESS_MIN_MATCH;
+    *token |= (uint8_t)(extra < 15 ? extra : 15);
+    if (extra >= 15)
+        op = compress_put_length(op, extra - 15);
+    return op;
+}
+
+// Compresses length bytes into fewer than capacity bytes. Returns the
+// compressed length, or 0 when the block would not be that small.
+static inline int compress_block(const void *source, int length, void *dest, int capacity) {
+    const uint8_t *src = (const uint8_t *)source;
+    uint8_t *op = (uint8_t *)dest;
+    const uint8_t *end = op + capacity;
+    struct compress_table *t = &compress_table;
+    if (t->base == 0 || t->base > 0x80000000u) { // First use, or about to wrap
+        memset(t->slots, 0, sizeof(t->slots));
+        t->base = 1;
+    }
+    uint32_t base = t->base;
+    t->base += (uint32_t)length + 1; // Every position stored for this block is now below the base
+
+    int anchor = 0; // First byte not yet covered by a sequence
+    if (length > COMPRESS_MATCH_LIMIT) {
+        int limit = length - COMPRESS_MATCH_LIMIT;
+        int match_end = length - COMPRESS_LAST_LITERALS;
+        int i = 0;
+        while (i < limit) {
+            uint32_t v = compress_load32(src + i);
+            uint32_t *slot = &t->slots[compress_hash(v)];
+            uint32_t candidate = *slot;
+            *slot = base + (uint32_t)i;
+            if (candidate < base || base + (uint32_t)i - candidate > COMPRESS_MAX_OFFSET ||
+                compress_load32(src + (candidate - base)) != v) {
+                i += 1 + ((i - anchor) >> 6); // Step faster through bytes that keep failing to match
+                continue;
+            }
+            int m = (int)(candidate - base);
+            while (i > anchor && m > 0 && src[i - 1] == src[m - 1]) { // The match may start earlier
+                i--;
+                m--;
+            }
+            int n = COMPRESS_MIN_MATCH;
+            while (i + n + 8 <= match_end && memcmp(src + i + n, src + m + n, 8) == 0)
+                n += 8;
+            while (i + n < match_end && src[i + n] == src[m + n])
+                n++;
+            op = compress_put_sequence(op, end, src + anchor, (size_t)(i - anchor), (size_t)(i - m), (size_t)n);
+            if (op == NULL)
+                return 0;
+            i += n;
+            anchor = i;
+            if (i - 2 < limit) // Lets the next match reach back into this one
+                t->slots[compress_hash(compress_load32(src + i - 2))] = base + (uint32_t)(i - 2);
+        }
+    }
+    op = compress_put_sequence(op, end, src + anchor, (size_t)(length - anchor), 0, 0);
+    return op == NULL ? 0 : (int)(op - (uint8_t *)dest);
+}
+
+static inline int decompress_length(const uint8_t **ip, const uint8_t *end, size_t *n) { // Adds a field's extra bytes
+    uint8_t b;
+    do {
+        if (*ip == end)
+            return -1;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+// Decompresses a block into at most capacity bytes. Returns the decompressed
+// length, or -1 when the block is corrupt or does not fit.
+static inline int decompress_block(const void *source, int length, void *dest, int capacity) {
+    const uint8_t *ip = (const uint8_t *)source;
+    const uint8_t *ip_end = ip + length;
+    uint8_t *start = (uint8_t *)dest;
+    uint8_t *op = start;
+    uint8_t *op_end = start + capacity;
+    while (ip < ip_end) {
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && decompress_length(&ip, ip_end, &literals) != 0)
+            return -1;
+        if (literals > (size_t)(ip_end - ip) || literals > (size_t)(op_end - op))
+            return -1;
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == ip_end) // The last sequence has no match
+            return (int)(op - start);
+
+        if (ip_end - ip < 2)
+            return -1;
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15 && decompress_length(&ip, ip_end, &match) != 0)
+            return -1;
+        match += COMPRESS_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - start) || match > (size_t)(op_end - op))
+            return -1;
+        const uint8_t *from = op - offset;
+        if (offset >= match) {
+            memcpy(op, from, match);
+        } else { // The match repeats bytes it is still writing
+            for (size_t k = 0; k < match; k++)
+                op[k] = from[k];
+        }
+        op += match;
+    }
+    return -1; // Ended on a match instead of literals
+}
+
+static inline void compress_gate_init(struct compress_gate *g, int link_mbit) { // link_mbit 0: time is free
+    memset(g, 0, sizeof(*g));
+    g->link_ns_per_byte = link_mbit > 0 ? 8000.0 / link_mbit : 0;
+    g->backoff = COMPRESS_PROBE_MIN;
+    g->cold = 1;
+}
+
+static inline int compress_gate_open(struct compress_gate *g) { // Nonzero when the next frame or run should be tried
+    if (g->skip == 0)
+        return 1;
+    g->skip--;
+    return 0;
+}
+
+// Records an attempt on length bytes that came out as packed bytes (length
+// when they did not shrink) and took ns, and decides whether to go on trying
+static inline void compress_gate_record(struct compress_gate *g, int length, int packed, uint64_t ns) {
+    double saving = (double)(length - packed) / length;
+    g->saving = g->attempts++ == 0 ? saving : g->saving + (saving - g->saving) / 4;
+    metrics_add(METRIC_COMPRESS_IN_BYTES, (uint64_t)length);
+    metrics_add(METRIC_COMPRESS_OUT_BYTES, (uint64_t)packed);
+    metrics_add(METRIC_COMPRESS_NS, ns);
+
+    if (g->cold) { // Its time includes warming the hash table and caches
+        g->cold = 0;
+        if (g->saving >= COMPRESS_MIN_SAVING)
+            return; // The next attempt decides
+    } else {
+        double ns_per_byte = (double)ns / length;
+        if (g->ns_per_byte > 0 && ns_per_byte > 2 * g->ns_per_byte) // Preempted, likely
+            ns_per_byte = 2 * g->ns_per_byte;
+        g->ns_per_byte = g->ns_per_byte == 0 ? ns_per_byte : g->ns_per_byte + (ns_per_byte - g->ns_per_byte) / 4;
+    }
+
+    int pays = g->saving >= COMPRESS_MIN_SAVING &&
+               (g->link_ns_per_byte == 0 || g->ns_per_byte < g->saving * g->link_ns_per_byte);
+    if (pays) {
+        g->backoff = COMPRESS_PROBE_MIN;
+    } else {
+        g->skip = g->backoff;
+        g->cold = 1;
+        if (g->backoff < COMPRESS_PROBE_MAX)
+            g->backoff *= 2;
+    }
+}
+
+// Compresses the payload of a complete frame on its own. Returns a pool
+// buffer holding the compressed frame, with *length updated, or NULL when the
+// payload does not shrink or the pool has no memory.
+static inline char *compress_frame(struct compress_gate *g, const char *frame, int *length) {
+    int header_size = (frame[3] & FRAME_FLAG_TIMESTAMP) ? FRAME_MAX_HEADER_SIZE : FRAME_HEADER_SIZE;
+    int payload_length = *length - header_size;
+    char *out = pool_alloc((size_t)*length);
+    if (out == NULL)
+        return NULL;
+    uint64_t start_ns = platform_now_ns();
+    int packed = compress_block(frame + header_size, payload_length, out + header_size, payload_length);
+    compress_gate_record(g, *length, packed > 0 ? header_size + packed : *length, platform_now_ns() - start_ns);
+    if (packed == 0) {
+        pool_release(out);
+        return NULL;
+    }
+    memcpy(out, frame, (size_t)header_size);
+    uint16_t prefix = (uint16_t)(header_size - FRAME_PREFIX_SIZE + packed);
+    out[0] = (char)(prefix >> 8);
+    out[1] = (char)(prefix & 0xFF);
+    out[3] |= FRAME_FLAG_COMPRESSED;
+    *length = header_size + packed;
+    return out;
+}
+
+// Compresses a run of whole frames, length bytes at most COMPRESS_RUN_BYTES,
+// into a batch frame written to out. Returns the batch frame's length, which
+// is less than length, or 0 when the run does not shrink that far.
+static inline int compress_run(struct compress_gate *g, const char *run, int length, char *out) {
+    uint64_t timestamp_ns = frame_timestamp(run);
+    int header_size = timestamp_ns != 0 ? FRAME_MAX_HEADER_SIZE : FRAME_HEADER_SIZE;
+    uint64_t start_ns = platform_now_ns();
+    int packed = length > header_size + 1 ? compress_block(run, length, out + header_size, length - header_size) : 0;
+    compress_gate_record(g, length, packed > 0 ? header_size + packed : length, platform_now_ns() - start_ns);
+    if (packed == 0)
+        return 0;
+    frame_prepend_header(out + header_size, packed, 0, timestamp_ns);
+    out[3] |= FRAME_FLAG_COMPRESSED | FRAME_FLAG_BATCH;
+    return header_size + packed;
+}
+
+// Walks the frames a received frame carries: the frame itself when it is not
+// compressed, the frame with its payload opened when it is, or every frame of
+// a batch. Opened bytes sit in buffer, from the pool, until frame_unpack_close.
+struct frame_unpack {
+    const struct frame_view *frame;
+    char *buffer; // Opened payload or run, or NULL
+    int length;
+    int offset; // Next frame of a run
+    int count; // Views the frame yields
+};
+
+static inline void frame_unpack_close(struct frame_unpack *u) {
+    if (u->buffer != NULL)
+        pool_release(u->buffer);
+    u->buffer = NULL;
+}
+
+// Opens frame. Returns 0, or -1 when its block is corrupt, a run holds a frame
+// that is malformed or compressed, or the pool has no memory; nothing is left
+// to close then.
+static inline int frame_unpack_open(struct frame_unpack *u, const struct frame_view *frame) {
+    u->frame = frame;
+    u->buffer = NULL;
+    u->offset = 0;
+    u->length = frame->payload_length;
+    u->count = 1;
+    if (!(frame->flags & FRAME_FLAG_COMPRESSED))
+        return 0;
+
+    const char *block = IO_VEC_BASE(frame->payload[0]);
+    char *joined = NULL;
+    if (frame->payload_count == 2) { // Wraps the end of the ring: the block must be contiguous
+        joined = pool_alloc((size_t)frame->payload_length + 1);
+        if (joined == NULL)
+            return -1;
+        memcpy(joined, IO_VEC_BASE(frame->payload[0]), IO_VEC_LEN(frame->payload[0]));
+        memcpy(joined + IO_VEC_LEN(frame->payload[0]), IO_VEC_BASE(frame->payload[1]), IO_VEC_LEN(frame->payload[1]));
+        block = joined;
+    }
+    u->buffer = pool_alloc(FRAME_MAX_PAYLOAD);
+    uint64_t start_ns = platform_now_ns();
+    u->length = u->buffer != NULL ? decompress_block(block, frame->payload_length, u->buffer, FRAME_MAX_PAYLOAD) : -1;
+    metrics_add(METRIC_DECOMPRESS_NS, platform_now_ns() - start_ns);
+    if (joined != NULL)
+        pool_release(joined);
+    if (u->length < 0) {
+        frame_unpack_close(u);
+        return -1;
+    }
+    metrics_add(METRIC_DECOMPRESS_BYTES, (uint64_t)u->length);
+    if (!(frame->flags & FRAME_FLAG_BATCH))
+        return 0;
+
+    struct frame_view inner;
+    u->count = 0;
+    for (int at = 0; at < u->length; at += inner.length, u->count++) {
+        if (frame_parse(u->buffer + at, u->length - at, &inner) != 1 || (inner.flags & FRAME_FLAG_COMPRESSED) ||
+            u->count == COMPRESS_RUN_FRAMES) {
+            frame_unpack_close(u);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Fills view with the next frame. Returns 1, or 0 once every frame is taken.
+static inline int frame_unpack_next(struct frame_unpack *u, struct frame_view *view) {
+    const struct frame_view *frame = u->frame;
+    if (!(frame->flags & FRAME_FLAG_BATCH) || u->buffer == NULL) {
+        if (u->offset > 0)
+            return 0;
+        *view = *frame;
+        u->offset = 1;
+        if (u->buffer != NULL) {
+            view->flags &= (uint8_t)~FRAME_FLAG_COMPRESSED;
+            io_vec_set(&view->payload[0], u->buffer, (size_t)u->length);
+            view->payload_count = 1;
+            view->payload_length = u->length;
+        }
+        return 1;
+    }
+    if (u->offset == u->length || frame_parse(u->buffer + u->offset, u->length - u->offset, view) != 1)
+        return 0; // Parses, as frame_unpack_open checked; the test keeps the compiler sure view is set
+    u->offset += view->length;
+    return 1;
+}
+
+// Prints what compression saved and cost, summed over every thread's metrics
+static inline void compress_report(void) {
+    uint64_t in = metrics_sum(METRIC_COMPRESS_IN_BYTES), out = metrics_sum(METRIC_COMPRESS_OUT_BYTES);
+    uint64_t opened = metrics_sum(METRIC_DECOMPRESS_BYTES);
+    if (in > 0)
+        printf("Compression: %.1f MB tried, %.1f MB on the wire (%.1f%% saved), %.0f us CPU per MB\n", in / 1e6,
+               out / 1e6, 100.0 * (double)(in - out) / (double)in,
+               metrics_sum(METRIC_COMPRESS_NS) / 1e3 / (in / 1e6));
+    if (opened > 0)
+        printf("Decompression: %.1f MB opened, %.0f us CPU per MB\n", opened / 1e6,
+               metrics_sum(METRIC_DECOMPRESS_NS) / 1e3 / (opened / 1e6));
+}
+
+#endif
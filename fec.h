@@ -0,0 +1,585 @@
+// Forward error correction for datagram streams, shared by send_udp -f and
+// receive_udp -f: every block of K data datagrams is followed by M repair
+// datagrams, and any K of the K + M that arrive rebuild the whole block
+// without a round trip.
+//
+// The code is systematic Reed-Solomon over GF(2^8) with a Cauchy matrix:
+// repair i is the sum of coef[i][j] * data j. The columns are scaled so the
+// first repair row is all ones, so M = 1 is plain XOR parity and the first
+// repair of any block costs only XORs. Scaling keeps every square submatrix
+// invertible, which is what lets any M losses be repaired. The coefficients
+// do not depend on K or M, so a short final block needs nothing special.
+//
+// On the wire every datagram starts with an 8-byte header: magic 0xFE, index
+// in the block (repairs follow the K data), K, M and the 32-bit block
+// number, big-endian. A data datagram continues with a symbol: the 2-byte
+// payload length, then the payload. A repair carries a symbol as long as
+// the block's longest, with shorter ones taken as zero-padded.
+//
+// Region kernels: AVX2 multiplies 32 bytes at a time by table lookups on the
+// two nibbles (vpshufb); SSE2, which has no byte shuffle, multiplies 16 at a
+// time by shifting and XOR-ing the eight powers of two; scalar looks every
+// byte up in a 64 KB product table. fec_init picks the best the CPU runs.
+//
+// Include after platform.h. Encoders and decoders belong to one
+// thread each.
+
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__))
+#define FEC_HAVE_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__)
+#define FEC_HAVE_AVX2 1 // Built with a target attribute, used only when the CPU has it
+#include <immintrin.h>
+#endif
+#endif
+
+#define FEC_MAGIC 0xFE
+#define FEC_HEADER_SIZE 8
+#define FEC_LENGTH_SIZE 2
+#define FEC_OVERHEAD (FEC_HEADER_SIZE + FEC_LENGTH_SIZE) // Added to every data datagram
+#define FEC_MAX_PAYLOAD (65507 - FEC_OVERHEAD)
+#define FEC_MAX_SYMBOL (FEC_LENGTH_SIZE + FEC_MAX_PAYLOAD)
+#define FEC_MAX_K 64
+#define FEC_MAX_M 16
+#define FEC_WINDOW 16 // Blocks a decoder keeps open at once; a power of two
+
+enum fec_kernel { FEC_SCALAR, FEC_SSE2, FEC_AVX2 };
+
+static const char *const fec_kernel_names[] = { "scalar", "sse2", "avx2" };
+static uint8_t fec_exp[512];
+static uint8_t fec_log[256];
+static uint8_t fec_mul_table[256][256];
+static uint8_t fec_coef[FEC_MAX_M][FEC_MAX_K];
+static int fec_kernel = -1; // -1 until fec_init
+
+static inline uint8_t fec_gf_mul(uint8_t a, uint8_t b) {
+    return fec_mul_table[a][b];
+}
+
+static inline uint8_t fec_gf_inv(uint8_t a) { // a != 0
+    return fec_exp[255 - fec_log[a]];
+}
+
+// Builds the field tables and coefficients and picks the fastest kernel.
+// Call once before any other fec_ function, before starting threads.
+static inline void fec_init(void) {
+    if (fec_kernel >= 0)
+        return;
+    unsigned x = 1;
+    for (int i = 0; i < 255; i++) { // Powers of the generator 2 modulo x^8 + x^4 + x^3 + x^2 + 1
+        fec_exp[i] = (uint8_t)x;
+        fec_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= 0x11d;
+    }
+    for (int i = 255; i < 512; i++)
+        fec_exp[i] = fec_exp[i - 255];
+    for (int a = 1; a < 256; a++)
+        for (int b = 1; b < 256; b++)
+            fec_mul_table[a][b] = fec_exp[fec_log[a] + fec_log[b]];
+    for (int i = 0; i < FEC_MAX_M; i++) { // Cauchy 1 / (x_i + y_j) with x_i = i, y_j = FEC_MAX_M + j, times y_j
+        for (int j = 0; j < FEC_MAX_K; j++) {
+            uint8_t y = (uint8_t)(FEC_MAX_M + j);
+            fec_coef[i][j] = fec_gf_mul(fec_gf_inv((uint8_t)(i ^ y)), y);
+        }
+    }
+    fec_kernel = FEC_SCALAR;
+#ifdef FEC_HAVE_SSE2
+    fec_kernel = FEC_SSE2;
+#endif
+#ifdef FEC_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        fec_kernel = FEC_AVX2;
+#endif
+}
+
+static inline void fec_xor_scalar(uint8_t *dst, const uint8_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < n; i++)
+        dst[i] ^= src[i];
+}
+
+static inline void fec_mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+    const uint8_t *row = fec_mul_table[c];
+    for (size_t i = 0; i < n; i++)
+        dst[i] ^= row[src[i]];
+}
+
+#ifdef FEC_HAVE_SSE2
+static inline void fec_xor_sse2(uint8_t *dst, const uint8_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, b));
+    }
+    fec_xor_scalar(dst + i, src + i, n - i);
+}
+
+// c * x as the XOR of x * 2^b over the bits b of c; doubling is a byte-wise
+// shift, then the reduction polynomial wherever the top bit fell out
+static inline void fec_mul_add_sse2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i poly = _mm_set1_epi8(0x1d);
+    int top = 7;
+    while (!(c >> top))
+        top--;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i sum = zero;
+        for (int b = 0;; b++) {
+            if (c & (1 << b))
+                sum = _mm_xor_si128(sum, x);
+            if (b == top)
+                break;
+            __m128i carry = _mm_and_si128(_mm_cmplt_epi8(x, zero), poly);
+            x = _mm_xor_si128(_mm_add_epi8(x, x), carry);
+        }
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, sum));
+    }
+    fec_mul_add_scalar(dst + i, src + i, c, n - i);
+}
+#endif
+
+#ifdef FEC_HAVE_AVX2
+__attribute__((target("avx2"))) static inline void fec_xor_avx2(uint8_t *dst, const uint8_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(a, b));
+    }
+    fec_xor_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static inline void fec_mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c,
+                                                                    size_t n) {
+    uint8_t low[16], high[16]; // c times every low nibble, and every high nibble
+    for (int v = 0; v < 16; v++) {
+        low[v] = fec_gf_mul(c, (uint8_t)v);
+        high[v] = fec_gf_mul(c, (uint8_t)(v << 4));
+    }
+    const __m256i low_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)low));
+    const __m256i high_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)high));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i lo = _mm256_and_si256(x, mask);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), mask);
+        __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(low_table, lo), _mm256_shuffle_epi8(high_table, hi));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, product));
+    }
+    fec_mul_add_scalar(dst + i, src + i, c, n - i);
+}
+#endif
+
+static inline void fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) { // dst += c * src
+    if (c == 0)
+        return;
+    switch (fec_kernel) {
+#ifdef FEC_HAVE_AVX2
+    case FEC_AVX2:
+        if (c == 1)
+            fec_xor_avx2(dst, src, n);
+        else
+            fec_mul_add_avx2(dst, src, c, n);
+        return;
+#endif
+#ifdef FEC_HAVE_SSE2
+    case FEC_SSE2:
+        if (c == 1)
+            fec_xor_sse2(dst, src, n);
+        else
+            fec_mul_add_sse2(dst, src, c, n);
+        return;
+#endif
+    default:
+        if (c == 1)
+            fec_xor_scalar(dst, src, n);
+        else
+            fec_mul_add_scalar(dst, src, c, n);
+    }
+}
+
+struct fec_header {
+    uint32_t block;
+    uint8_t index; // Data below k, repairs from k
+    uint8_t k; // Data in the block; a repair of a short final block carries the real count
+    uint8_t m;
+};
+
+static inline void fec_header_pack(uint8_t *p, const struct fec_header *h) {
+    p[0] = FEC_MAGIC;
+    p[1] = h->index;
+    p[2] = h->k;
+    p[3] = h->m;
+    p[4] = (uint8_t)(h->block >> 24);
+    p[5] = (uint8_t)(h->block >> 16);
+    p[6] = (uint8_t)(h->block >> 8);
+    p[7] = (uint8_t)h->block;
+}
+
+static inline int fec_header_unpack(struct fec_header *h, const uint8_t *p, int length) { // -1 when not FEC
+    if (length < FEC_HEADER_SIZE + FEC_LENGTH_SIZE || p[0] != FEC_MAGIC)
+        return -1;
+    h->index = p[1];
+    h->k = p[2];
+    h->m = p[3];
+    h->block = ((uint32_t)p[4] << 24) | ((uint32_t)p[5] << 16) | ((uint32_t)p[6] << 8) | p[7];
+    if (h->k == 0 || h->k > FEC_MAX_K || h->m > FEC_MAX_M || h->index >= h->k + h->m)
+        return -1;
+    return 0;
+}
+
+// Encoder: wraps data datagrams as they are sent and folds each into the
+// block's repairs, so data is never held back or copied twice
+struct fec_encoder {
+    int k, m;
+    uint32_t block;
+    int count; // Data in the current block so far
+    uint32_t length; // Longest symbol in the block; the repairs are zero beyond it
+    uint8_t *repairs; // m symbols of FEC_MAX_SYMBOL bytes
+};
+
+static inline int fec_encoder_init(struct fec_encoder *e, int k, int m) {
+    if (k < 1 || k > FEC_MAX_K || m < 1 || m > FEC_MAX_M)
+        return -1;
+    fec_init();
+    e->repairs = calloc((size_t)m, FEC_MAX_SYMBOL);
+    if (e->repairs == NULL)
+        return -1;
+    e->k = k;
+    e->m = m;
+    e->block = 0;
+    e->count = 0;
+    e->length = 0;
+    return 0;
+}
+
+static inline void fec_encoder_destroy(struct fec_encoder *e) {
+    free(e->repairs);
+}
+
+// Writes payload into out as the next data datagram of the block, at most
+// FEC_OVERHEAD + FEC_MAX_PAYLOAD bytes, and returns its length. Once
+// e->count reaches e->k the block's repairs are due: fec_encode_repair each
+// of them, then fec_encoder_next_block.
+static inline int fec_encode(struct fec_encoder *e, const void *payload, uint32_t length, uint8_t *out) {
+    struct fec_header h = { e->block, (uint8_t)e->count, (uint8_t)e->k, (uint8_t)e->m };
+    fec_header_pack(out, &h);
+    uint8_t *symbol = out + FEC_HEADER_SIZE;
+    symbol[0] = (uint8_t)(length >> 8);
+    symbol[1] = (uint8_t)length;
+    memcpy(symbol + FEC_LENGTH_SIZE, payload, length);
+    uint32_t symbol_length = FEC_LENGTH_SIZE + length;
+    for (int i = 0; i < e->m; i++)
+        fec_mul_add(e->repairs + (size_t)i * FEC_MAX_SYMBOL, symbol, fec_coef[i][e->count], symbol_length);
+    if (symbol_length > e->length)
+        e->length = symbol_length;
+    e->count++;
+    return FEC_HEADER_SIZE + (int)symbol_length;
+}
+
+// Writes repair i of the current block into out and returns its length.
+// Also closes a short block: its repairs carry the real data count.
+static inline int fec_encode_repair(const struct fec_encoder *e, int i, uint8_t *out) {
+    struct fec_header h = { e->block, (uint8_t)(e->count + i), (uint8_t)e->count, (uint8_t)e->m };
+    fec_header_pack(out, &h);
+    memcpy(out + FEC_HEADER_SIZE, e->repairs + (size_t)i * FEC_MAX_SYMBOL, e->length);
+    return FEC_HEADER_SIZE + (int)e->length;
+}
+
+static inline void fec_encoder_next_block(struct fec_encoder *e) {
+    for (int i = 0; i < e->m; i++)
+        memset(e->repairs + (size_t)i * FEC_MAX_SYMBOL, 0, e->length);
+    e->block++;
+    e->count = 0;
+    e->length = 0;
+}
+
+// Decoder: passes data through as it arrives and keeps a copy until its block
+// is complete. Once any k of a block's datagrams are in, the missing data
+// are solved for and handed out too, late but without a round trip.
+struct fec_symbol {
+    uint8_t *data;
+    uint32_t length;
+    uint32_t capacity;
+};
+
+struct fec_block {
+    uint32_t block;
+    int open;
+    int k, m;
+    int data; // Data in hand, received or recovered
+    int repairs; // Repairs received
+    uint32_t repair_length;
+    uint8_t have[FEC_MAX_K + FEC_MAX_M]; // Data by index, then repairs by number
+    struct fec_symbol symbols[FEC_MAX_K + FEC_MAX_M];
+};
+
+struct fec_stats {
+    uint64_t data; // Data datagrams received
+    uint64_t repairs; // Repair datagrams received
+    uint64_t recovered; // Data rebuilt from repairs
+    uint64_t lost; // Data missing from blocks that could not be rebuilt
+    uint64_t late; // Data for blocks already given up on, handed out anyway
+    uint64_t invalid; // Datagrams that are not FEC or contradict their block
+};
+
+struct fec_decoder {
+    struct fec_block blocks[FEC_WINDOW];
+    struct fec_stats stats;
+    uint8_t *scratch; // Right-hand sides while solving, FEC_MAX_M symbols
+};
+
+struct fec_output { // A data payload handed out by fec_decode
+    const uint8_t *data;
+    uint32_t length;
+};
+
+static inline int fec_decoder_init(struct fec_decoder *d) {
+    fec_init();
+    memset(d, 0, sizeof(*d));
+    d->scratch = malloc((size_t)FEC_MAX_M * FEC_MAX_SYMBOL);
+    return d->scratch != NULL ? 0 : -1;
+}
+
+static inline void fec_decoder_destroy(struct fec_decoder *d) {
+    for (int b = 0; b < FEC_WINDOW; b++)
+        for (int i = 0; i < FEC_MAX_K + FEC_MAX_M; i++)
+            free(d->blocks[b].symbols[i].data);
+    free(d->scratch);
+}
+
+static inline int fec_keep(struct fec_symbol *s, const uint8_t *data, uint32_t length) {
+    if (s->capacity < length) {
+        uint8_t *grown = realloc(s->data, length);
+        if (grown == NULL)
+            return -1;
+        s->data = grown;
+        s->capacity = length;
+    }
+    memcpy(s->data, data, length);
+    s->length = length;
+    return 0;
+}
+
+static inline void fec_close(struct fec_decoder *d, struct fec_block *b) {
+    if (b->open && b->data < b->k)
+        d->stats.lost += (uint64_t)(b->k - b->data);
+    b->open = 0;
+}
+
+// Closes every open block, counting what they still miss, and forgets them
+// all, so the next stream may number its blocks from 0 again. For the end of
+// a stream.
+static inline void fec_decoder_flush(struct fec_decoder *d) {
+    for (int b = 0; b < FEC_WINDOW; b++) {
+        fec_close(d, &d->blocks[b]);
+        d->blocks[b].k = 0;
+    }
+}
+
+// Inverts the n x n matrix a in place by Gauss-Jordan elimination over
+// GF(2^8). Returns -1 if it is singular, which the Cauchy construction rules out.
+static inline int fec_invert(uint8_t a[FEC_MAX_M][FEC_MAX_M], int n) {
+    uint8_t inv[FEC_MAX_M][FEC_MAX_M];
+    memset(inv, 0, sizeof(inv));
+    for (int i = 0; i < n; i++)
+        inv[i][i] = 1;
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        while (pivot < n && a[pivot][col] == 0)
+            pivot++;
+        if (pivot == n)
+            return -1;
+        for (int j = 0; j < n; j++) {
+            uint8_t t = a[col][j];
+            a[col][j] = a[pivot][j];
+            a[pivot][j] = t;
+            t = inv[col][j];
+            inv[col][j] = inv[pivot][j];
+            inv[pivot][j] = t;
+        }
+        uint8_t scale = fec_gf_inv(a[col][col]);
+        for (int j = 0; j < n; j++) {
+            a[col][j] = fec_gf_mul(a[col][j], scale);
+            inv[col][j] = fec_gf_mul(inv[col][j], scale);
+        }
+        for (int row = 0; row < n; row++) {
+            uint8_t f = a[row][col];
+            if (row == col || f == 0)
+                continue;
+            for (int j = 0; j < n; j++) {
+                a[row][j] ^= fec_gf_mul(f, a[col][j]);
+                inv[row][j] ^= fec_gf_mul(f, inv[col][j]);
+            }
+        }
+    }
+    memcpy(a, inv, sizeof(inv));
+    return 0;
+}
+
+// Solves for the block's missing data from its first repairs and appends
+// each to out. Returns how many, or -1 when the block is inconsistent.
+static inline int fec_recover(struct fec_decoder *d, struct fec_block *b, struct fec_output *out) {
+    int missing[FEC_MAX_M], rows[FEC_MAX_M];
+    int lost = 0, used = 0;
+    for (int j = 0; j < b->k && lost <= FEC_MAX_M; j++)
+        if (!b->have[j])
+            missing[lost++] = j;
+    for (int r = 0; r < b->m && used < lost; r++)
+        if (b->have[FEC_MAX_K + r])
+            rows[used++] = r;
+    if (lost > FEC_MAX_M || used < lost)
+        return -1;
+
+    uint32_t length = b->repair_length;
+    uint8_t a[FEC_MAX_M][FEC_MAX_M];
+    for (int i = 0; i < lost; i++) { // Each repair less what the data in hand contributed to it
+        uint8_t *rhs = d->scratch + (size_t)i * FEC_MAX_SYMBOL;
+        memcpy(rhs, b->symbols[FEC_MAX_K + rows[i]].data, length);
+        for (int j = 0; j < b->k; j++) {
+            if (b->have[j])
+                fec_mul_add(rhs, b->symbols[j].data, fec_coef[rows[i]][j], b->symbols[j].length);
+        }
+        for (int c = 0; c < lost; c++)
+            a[i][c] = fec_coef[rows[i]][missing[c]];
+    }
+    if (fec_invert(a, lost) != 0)
+        return -1;
+
+    int count = 0;
+    for (int c = 0; c < lost; c++) {
+        struct fec_symbol *s = &b->symbols[missing[c]];
+        if (s->capacity < length) {
+            uint8_t *grown = realloc(s->data, length);
+            if (grown == NULL)
+                return -1;
+            s->data = grown;
+            s->capacity = length;
+        }
+        memset(s->data, 0, length);
+        for (int i = 0; i < lost; i++)
+            fec_mul_add(s->data, d->scratch + (size_t)i * FEC_MAX_SYMBOL, a[c][i], length);
+        uint32_t payload = ((uint32_t)s->data[0] << 8) | s->data[1];
+        if (payload > length - FEC_LENGTH_SIZE)
+            return -1;
+        s->length = FEC_LENGTH_SIZE + payload;
+        b->have[missing[c]] = 1;
+        b->data++;
+        out[count].data = s->data + FEC_LENGTH_SIZE;
+        out[count].length = payload;
+        count++;
+    }
+    d->stats.recovered += (uint64_t)count;
+    return count;
+}
+
+// Takes one datagram. Fills out (room for FEC_MAX_M + 1) with the data it
+// yields: its own payload if it is data, then anything it let the decoder
+// rebuild. The pointers stay valid until the next call. Returns the count,
+// or -1 when the datagram is not FEC at all.
+static inline int fec_decode(struct fec_decoder *d, const uint8_t *packet, int length, struct fec_output *out) {
+    struct fec_header h;
+    if (fec_header_unpack(&h, packet, length) != 0) {
+        d->stats.invalid++;
+        return -1;
+    }
+    const uint8_t *symbol = packet + FEC_HEADER_SIZE;
+    uint32_t symbol_length = (uint32_t)(length - FEC_HEADER_SIZE);
+    int is_data = h.index < h.k;
+    uint32_t payload = ((uint32_t)symbol[0] << 8) | symbol[1];
+    if (is_data && payload != symbol_length - FEC_LENGTH_SIZE) {
+        d->stats.invalid++;
+        return 0;
+    }
+    int count = 0;
+    if (is_data) {
+        d->stats.data++;
+        out[count].data = symbol + FEC_LENGTH_SIZE;
+        out[count].length = payload;
+        count++;
+    } else {
+        d->stats.repairs++;
+    }
+
+    struct fec_block *b = &d->blocks[h.block & (FEC_WINDOW - 1)];
+    if (b->k > 0 && b->block != h.block && (int32_t)(h.block - b->block) < 0) { // Its slot moved on to a newer block
+        d->stats.late += (uint64_t)is_data;
+        return count;
+    }
+    if (b->open && b->block != h.block)
+        fec_close(d, b);
+    if (!b->open) {
+        if (b->k > 0 && b->block == h.block) { // Closed already, complete or given up on
+            if (is_data && b->have[h.index])
+                return 0; // A duplicate; already handed out
+            d->stats.late += (uint64_t)is_data; // Repairs for a complete block are merely unneeded
+            return count;
+        }
+        b->block = h.block;
+        b->open = 1;
+        b->k = h.k;
+        b->m = h.m;
+        b->data = 0;
+        b->repairs = 0;
+        b->repair_length = 0;
+        memset(b->have, 0, sizeof(b->have));
+    }
+    if (!is_data && h.k < b->k) // A short final block: only now is its size known
+        b->k = h.k;
+
+    int slot = is_data ? h.index : FEC_MAX_K + (h.index - h.k);
+    if (b->have[slot]) {
+        if (is_data) // A duplicate; already handed out
+            count--;
+        return count;
+    }
+    if (!is_data && b->repairs > 0 && symbol_length != b->repair_length) {
+        d->stats.invalid++;
+        return count;
+    }
+    if (fec_keep(&b->symbols[slot], symbol, symbol_length) != 0)
+        return count;
+    b->have[slot] = 1;
+    if (is_data) {
+        b->data++;
+    } else {
+        b->repairs++;
+        b->repair_length = symbol_length;
+    }
+
+    if (b->data >= b->k) { // Complete: nothing to rebuild
+        b->open = 0;
+    } else if (b->data + b->repairs >= b->k) {
+        int recovered = fec_recover(d, b, out + count);
+        if (recovered < 0)
+            d->stats.invalid++;
+        else
+            count += recovered;
+        fec_close(d, b);
+    }
+    return count;
+}
+
+#endif
@@ -0,0 +1,222 @@
+// Tunnel frame codec shared by tunnel_udp_over_tcp_client and
+// tunnel_udp_over_tcp_server: the v2 frame format, an encoder that writes the
+// header in front of a payload, and an incremental decoder for the TCP stream.
+//
+// v2 frame: the 2-byte length prefix counts every byte after itself, followed
+// by a version byte, a flags byte and the 32-bit flow ID, all big-endian. With
+// FRAME_FLAG_TIMESTAMP set, the sender's wall-clock time in nanoseconds since
+// the Unix epoch follows the flow ID as a 64-bit field, ahead of the payload.
+// FRAME_FLAG_COMPRESSED marks a payload that is a compressed block, and
+// FRAME_FLAG_BATCH with it a block holding a run of whole frames; compress.h
+// writes and opens both.
+//
+// The decoder works in a ring of FRAME_RING_SIZE bytes that its owner supplies
+// and never allocates. Bytes go in either straight from the kernel, by
+// receiving into frame_decoder_space() and calling frame_decoder_commit(), or
+// by copy with frame_decoder_feed().
+// frame_decoder_next() hands out the frame at the head as a view into the
+// ring: header fields plus the payload as one or two vectors, two when it
+// wraps the end of the ring. The payload stays valid until it is consumed.
+// Head and tail run freely and are masked on access, so tail - head is always
+// the number of buffered bytes. A header that does not wrap is parsed with
+// direct loads; only one that straddles the end goes byte by byte.
+//
+// Include after platform.h, which defines io_vec.
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define FRAME_VERSION 2
+#define FRAME_PREFIX_SIZE 2
+#define FRAME_HEADER_SIZE 8  // Prefix + version + flags + flow ID
+#define FRAME_MAX_PAYLOAD (65535 - (FRAME_HEADER_SIZE - FRAME_PREFIX_SIZE))
+#define FRAME_FLAG_TIMESTAMP 0x01
+#define FRAME_FLAG_COMPRESSED 0x02
+#define FRAME_FLAG_BATCH 0x04
+#define FRAME_TIMESTAMP_SIZE 8
+#define FRAME_MAX_HEADER_SIZE (FRAME_HEADER_SIZE + FRAME_TIMESTAMP_SIZE)
+#define FRAME_RING_SIZE 131072  // 2^17, room for two maximum-size frames
+
+struct frame_decoder {
+    uint32_t head; // First byte not yet consumed
+    uint32_t tail; // Next byte to be written
+    char *data; // FRAME_RING_SIZE bytes; the owner may swap it while nothing is buffered
+};
+
+struct frame_view { // A complete frame still sitting in the decoder's ring
+    int length; // Whole frame, prefix included
+    uint8_t version;
+    uint8_t flags;
+    uint32_t flow_id;
+    uint64_t timestamp_ns; // 0 unless FRAME_FLAG_TIMESTAMP is set
+    io_vec payload[2];
+    int payload_count;
+    int payload_length;
+};
+
+// Writes a frame header into the headroom in front of payload and returns where
+// the frame starts. A nonzero timestamp_ns is stamped into the header unless
+// the payload leaves no room for it.
+static inline char *frame_prepend_header(char *payload, int payload_length, uint32_t flow_id, uint64_t timestamp_ns) {
+    int stamped = timestamp_ns != 0 && payload_length <= FRAME_MAX_PAYLOAD - FRAME_TIMESTAMP_SIZE;
+    char *frame = payload - (stamped ? FRAME_MAX_HEADER_SIZE : FRAME_HEADER_SIZE);
+    uint16_t length = (uint16_t)(payload + payload_length - frame - FRAME_PREFIX_SIZE);
+    frame[0] = (char)(length >> 8);
+    frame[1] = (char)(length & 0xFF);
+    frame[2] = FRAME_VERSION;
+    frame[3] = stamped ? FRAME_FLAG_TIMESTAMP : 0;
+    frame[4] = (char)(flow_id >> 24);
+    frame[5] = (char)(flow_id >> 16);
+    frame[6] = (char)(flow_id >> 8);
+    frame[7] = (char)(flow_id & 0xFF);
+    for (int i = 0; stamped && i < FRAME_TIMESTAMP_SIZE; i++)
+        frame[FRAME_HEADER_SIZE + i] = (char)(timestamp_ns >> (56 - 8 * i));
+    return frame;
+}
+
+static inline uint64_t frame_timestamp(const char *frame) { // 0 when the frame is not stamped
+    uint64_t timestamp_ns = 0;
+    if (frame[3] & FRAME_FLAG_TIMESTAMP) {
+        for (int i = FRAME_HEADER_SIZE; i < FRAME_MAX_HEADER_SIZE; i++)
+            timestamp_ns = (timestamp_ns << 8) | (uint8_t)frame[i];
+    }
+    return timestamp_ns;
+}
+
+static inline void frame_decoder_init(struct frame_decoder *d, char *data) { // data may come later
+    d->head = d->tail = 0;
+    d->data = data;
+}
+
+static inline uint32_t frame_decoder_buffered(const struct frame_decoder *d) {
+    return d->tail - d->head;
+}
+
+// Describes the free space as one or two vectors, in stream order, for the
+// caller to receive into; returns how many (0 when the ring is full). An
+// empty ring is rewound first, so the next read lands contiguously.
+static inline int frame_decoder_space(struct frame_decoder *d, io_vec *v) {
+    if (d->head == d->tail)
+        d->head = d->tail = 0;
+    uint32_t free_space = FRAME_RING_SIZE - (d->tail - d->head);
+    uint32_t start = d->tail & (FRAME_RING_SIZE - 1);
+    uint32_t first = FRAME_RING_SIZE - start;
+    if (free_space == 0)
+        return 0;
+    if (first >= free_space) {
+        io_vec_set(&v[0], d->data + start, free_space);
+        return 1;
+    }
+    io_vec_set(&v[0], d->data + start, first);
+    io_vec_set(&v[1], d->data, free_space - first);
+    return 2;
+}
+
+static inline void frame_decoder_commit(struct frame_decoder *d, uint32_t bytes) { // Received into the space
+    d->tail += bytes;
+}
+
+// Copies in as many of the bytes as fit and returns how many that was
+static inline size_t frame_decoder_feed(struct frame_decoder *d, const void *bytes, size_t length) {
+    io_vec v[2];
+    int count = frame_decoder_space(d, v);
+    size_t copied = 0;
+    for (int i = 0; i < count && copied < length; i++) {
+        size_t n = IO_VEC_LEN(v[i]) < length - copied ? IO_VEC_LEN(v[i]) : length - copied;
+        memcpy(IO_VEC_BASE(v[i]), (const char *)bytes + copied, n);
+        copied += n;
+    }
+    d->tail += (uint32_t)copied;
+    return copied;
+}
+
+static inline uint8_t frame_decoder_byte(const struct frame_decoder *d, uint32_t offset) {
+    return (uint8_t)d->data[(d->head + offset) & (FRAME_RING_SIZE - 1)];
+}
+
+// Returns 1 and fills view when a whole frame is buffered, 0 when more bytes
+// are needed, and -1 when the stream does not hold a v2 frame
+static inline int frame_decoder_next(const struct frame_decoder *d, struct frame_view *view) {
+    uint32_t used = d->tail - d->head;
+    if (used < FRAME_PREFIX_SIZE)
+        return 0;
+    uint32_t at = d->head & (FRAME_RING_SIZE - 1);
+    const uint8_t *p = (const uint8_t *)d->data + at;
+    int contiguous = at <= FRAME_RING_SIZE - FRAME_MAX_HEADER_SIZE; // The whole header can be read in place
+
+    int length = FRAME_PREFIX_SIZE + (contiguous ? (p[0] << 8) | p[1]
+                                                 : (frame_decoder_byte(d, 0) << 8) | frame_decoder_byte(d, 1));
+    if (used < (uint32_t)length)
+        return 0;
+    uint8_t version = contiguous ? p[2] : frame_decoder_byte(d, 2);
+    uint8_t flags = contiguous ? p[3] : frame_decoder_byte(d, 3);
+    int header_size = (flags & FRAME_FLAG_TIMESTAMP) ? FRAME_MAX_HEADER_SIZE : FRAME_HEADER_SIZE;
+    if (length < header_size || version != FRAME_VERSION)
+        return -1;
+
+    view->length = length;
+    view->version = version;
+    view->flags = flags;
+    view->timestamp_ns = 0;
+    if (contiguous) {
+        view->flow_id = ((uint32_t)p[4] << 24) | ((uint32_t)p[5] << 16) | ((uint32_t)p[6] << 8) | p[7];
+        for (int i = FRAME_HEADER_SIZE; i < header_size; i++)
+            view->timestamp_ns = (view->timestamp_ns << 8) | p[i];
+    } else {
+        view->flow_id = ((uint32_t)frame_decoder_byte(d, 4) << 24) | ((uint32_t)frame_decoder_byte(d, 5) << 16) |
+                        ((uint32_t)frame_decoder_byte(d, 6) << 8) | frame_decoder_byte(d, 7);
+        for (int i = FRAME_HEADER_SIZE; i < header_size; i++)
+            view->timestamp_ns = (view->timestamp_ns << 8) | frame_decoder_byte(d, (uint32_t)i);
+    }
+    view->payload_length = length - header_size;
+
+    uint32_t start = (d->head + (uint32_t)header_size) & (FRAME_RING_SIZE - 1);
+    uint32_t first = FRAME_RING_SIZE - start;
+    if ((uint32_t)view->payload_length <= first) {
+        io_vec_set(&view->payload[0], d->data + start, (size_t)view->payload_length);
+        view->payload_count = 1;
+    } else { // Payload wraps around the end of the ring
+        io_vec_set(&view->payload[0], d->data + start, first);
+        io_vec_set(&view->payload[1], d->data, (size_t)view->payload_length - first);
+        view->payload_count = 2;
+    }
+    return 1;
+}
+
+// Parses the frame at the start of length contiguous bytes, such as the run a
+// batch frame opens into. Returns 1 and fills view, 0 when the bytes end
+// inside the frame, and -1 when they do not hold a v2 frame.
+static inline int frame_parse(const char *bytes, int length, struct frame_view *view) {
+    const uint8_t *p = (const uint8_t *)bytes;
+    if (length < FRAME_PREFIX_SIZE)
+        return 0;
+    int frame_length = FRAME_PREFIX_SIZE + ((p[0] << 8) | p[1]);
+    if (length < frame_length)
+        return 0;
+    if (frame_length < FRAME_HEADER_SIZE)
+        return -1;
+    int header_size = (p[3] & FRAME_FLAG_TIMESTAMP) ? FRAME_MAX_HEADER_SIZE : FRAME_HEADER_SIZE;
+    if (frame_length < header_size || p[2] != FRAME_VERSION)
+        return -1;
+
+    view->length = frame_length;
+    view->version = p[2];
+    view->flags = p[3];
+    view->flow_id = ((uint32_t)p[4] << 24) | ((uint32_t)p[5] << 16) | ((uint32_t)p[6] << 8) | p[7];
+    view->timestamp_ns = 0;
+    for (int i = FRAME_HEADER_SIZE; i < header_size; i++)
+        view->timestamp_ns = (view->timestamp_ns << 8) | p[i];
+    view->payload_length = frame_length - header_size;
+    io_vec_set(&view->payload[0], bytes + header_size, (size_t)view->payload_length);
+    view->payload_count = 1;
+    return 1;
+}
+
+static inline void frame_decoder_consume(struct frame_decoder *d, int length) { // The frame at the head is done with
+    d->head += (uint32_t)length;
+}
+
+#endif
@@ -0,0 +1,64 @@
+// Open-addressing hash index shared by the session table of the echo servers
+// and the flow tables of both tunnels. The owner keeps its entries in an array
+// of its own; the index maps a 32-bit hash to an entry's position through a
+// power-of-two array of 8-byte slots, so a probe sequence stays within a cache
+// line or two. Probing is linear, and deletion shifts the rest of a probe run
+// back rather than leaving tombstones, so lookups stay short however entries
+// come and go. Owners keep at least twice as many slots as entries and walk
+// probe sequences themselves to compare keys:
+//
+//     for (uint32_t i = hash & mask; slots[i].index != 0; i = (i + 1) & mask)
+//
+// Include after platform.h.
+
+#ifndef HASH_SLOTS_H
+#define HASH_SLOTS_H
+
+#include <stdint.h>
+
+struct hash_slot {
+    uint32_t hash;
+    uint32_t index; // Entry index + 1; 0 marks an empty slot
+};
+
+static inline uint32_t hash_slots_free(const struct hash_slot *slots, uint32_t mask, uint32_t hash) { // First empty slot on the probe sequence
+    uint32_t i = hash & mask;
+    while (slots[i].index != 0)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static inline void hash_slots_insert(struct hash_slot *slots, uint32_t mask, uint32_t hash, uint32_t index) {
+    uint32_t i = hash_slots_free(slots, mask, hash);
+    slots[i].hash = hash;
+    slots[i].index = index + 1;
+}
+
+static inline uint32_t hash_slots_find(const struct hash_slot *slots, uint32_t mask, uint32_t hash, uint32_t index) { // Entry must be present
+    uint32_t i = hash & mask;
+    while (slots[i].index != index + 1)
+        i = (i + 1) & mask;
+    return i;
+}
+
+// Removes the entry at index, which was inserted with hash
+static inline void hash_slots_remove(struct hash_slot *slots, uint32_t mask, uint32_t hash, uint32_t index) {
+    uint32_t i = hash_slots_find(slots, mask, hash, index);
+
+    // Backward-shift deletion keeps probe sequences intact without tombstones
+    uint32_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (slots[j].index == 0)
+            break;
+        uint32_t home = slots[j].hash & mask;
+        int movable = (j > i) ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+    slots[i].index = 0;
+}
+
+#endif
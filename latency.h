@@ -0,0 +1,97 @@
+// Latency histograms shared by tunnel_udp_over_tcp_client,
+// tunnel_udp_over_tcp_server and send_receive_udp, log-bucketed like
+// HdrHistogram: exact below 32 ns, then 32 linear buckets per power of two, so
+// a reported value is at most about 3% above the true one. A histogram has a
+// single writer, which records without a locked add, and is read without locks
+// while that writer keeps recording.
+//
+// Include after platform.h.
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h> // _BitScanReverse64
+#endif
+
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 40  // 2^40 ns is about 18 minutes; longer values land in the last bucket
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+struct latency_histogram {
+    uint64_t counts[LATENCY_BUCKETS];
+};
+
+static inline unsigned latency_bucket(uint64_t ns) {
+    if (ns >> LATENCY_MAX_BITS)
+        ns = (1ULL << LATENCY_MAX_BITS) - 1;
+    if (ns < LATENCY_SUB_BUCKETS)
+        return (unsigned)ns;
+#ifdef _MSC_VER
+    unsigned long top;
+    _BitScanReverse64(&top, ns);
+#else
+    int top = 63 - __builtin_clzll(ns);
+#endif
+    int shift = (int)top - LATENCY_SUB_BITS;
+    return (unsigned)((shift + 1) * LATENCY_SUB_BUCKETS) + (unsigned)(ns >> shift) - LATENCY_SUB_BUCKETS;
+}
+
+static inline uint64_t latency_bucket_top(unsigned bucket) { // Largest value a bucket counts
+    unsigned group = bucket / LATENCY_SUB_BUCKETS;
+    unsigned sub = bucket % LATENCY_SUB_BUCKETS;
+    if (group == 0)
+        return sub;
+    return ((uint64_t)(LATENCY_SUB_BUCKETS + sub + 1) << (group - 1)) - 1;
+}
+
+static inline void latency_record(struct latency_histogram *h, uint64_t since_ns, uint64_t now_ns) {
+    uint64_t *count = &h->counts[latency_bucket(now_ns > since_ns ? now_ns - since_ns : 0)]; // A clock step back counts as 0
+#ifdef _WIN32
+    InterlockedExchangeAdd64((volatile LONG64 *)count, 1);
+#else
+    __atomic_store_n(count, __atomic_load_n(count, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED); // One writer: no locked add
+#endif
+}
+
+static inline uint64_t latency_count(const uint64_t *count) {
+#ifdef _WIN32
+    return (uint64_t)InterlockedCompareExchange64((volatile LONG64 *)count, 0, 0);
+#else
+    return __atomic_load_n(count, __ATOMIC_RELAXED);
+#endif
+}
+
+// Fills value_us with the values below which the given shares (in per
+// mille) of the total fall
+static inline void latency_quantiles(const uint64_t *counts, uint64_t total, const unsigned *permille, int n,
+                                     double *value_us) {
+    uint64_t seen = 0;
+    int q = 0;
+    for (unsigned i = 0; i < LATENCY_BUCKETS && q < n; i++) {
+        seen += counts[i];
+        while (q < n && seen >= (total * permille[q] + 999) / 1000)
+            value_us[q++] = (double)latency_bucket_top(i) / 1000;
+    }
+}
+
+static inline void latency_print(const char *name, const struct latency_histogram *h) {
+    static const unsigned permille[] = { 500, 990, 999, 1000 };
+    double value_us[4];
+    uint64_t total = 0;
+    for (unsigned i = 0; i < LATENCY_BUCKETS; i++)
+        total += h->counts[i];
+    if (total == 0) {
+        printf("Latency %s: no samples\n", name);
+        return;
+    }
+    latency_quantiles(h->counts, total, permille, 4, value_us);
+    printf("Latency %s: %llu samples, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n", name,
+           (unsigned long long)total, value_us[0], value_us[1], value_us[2], value_us[3]);
+}
+
+#endif
@@ -0,0 +1,317 @@
+// Live metrics shared by the programs in this repository: counters and gauges
+// kept per thread and served on a local stats socket.
+//
+// Every thread that updates metrics owns a shard padded to whole cache lines,
+// so an update is a single uncontended add to memory no other thread writes.
+// The stats socket sums the shards only when it is polled and answers with one
+// "name value" line per metric. Gauges are kept as sums of signed deltas, so
+// they aggregate the same way as counters. -m unix:<path> serves a UNIX stream
+// socket (POSIX only) that writes the lines to every connection and closes it;
+// -m udp:<port> answers every datagram sent to 127.0.0.1:<port> with one
+// datagram holding the lines.
+//
+// Include after platform.h.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // SIGPIPE is ignored or blocked instead
+#endif
+#endif
+
+#define METRICS_CACHE_LINE 64
+#define METRICS_MAX_SHARDS 272  // Every tunnel server worker plus the main thread, with room to spare
+#define METRICS_TEXT_SIZE 4096  // Fits every line, pool classes included, and one datagram
+
+#ifdef _MSC_VER
+#define METRICS_ALIGNED __declspec(align(METRICS_CACHE_LINE))
+#define METRICS_THREAD_LOCAL __declspec(thread)
+#else
+#define METRICS_ALIGNED __attribute__((aligned(METRICS_CACHE_LINE)))
+#define METRICS_THREAD_LOCAL _Thread_local
+#endif
+
+enum metric_id {
+    METRIC_UDP_RX_PACKETS, // Datagrams received on UDP sockets
+    METRIC_UDP_RX_BYTES,
+    METRIC_UDP_TX_PACKETS, // Datagrams the kernel accepted for sending
+    METRIC_UDP_TX_BYTES,
+    METRIC_TCP_RX_BYTES,
+    METRIC_TCP_RX_FRAMES, // Frames parsed out of the TCP stream
+    METRIC_TCP_TX_BYTES,
+    METRIC_TCP_TX_FRAMES, // Frames accepted for a TCP connection
+    METRIC_DROPS, // Datagrams or frames discarded on purpose: full queues or tables, rate limits
+    METRIC_SEND_ERRORS, // Sends the kernel refused
+    METRIC_WAKEUPS, // Returns from select, poll, epoll or io_uring waits
+    METRIC_LOG_DROPS, // Log records discarded because the logging thread fell behind
+    METRIC_RETRANSMITS, // Datagrams a reliable transfer sent again
+    METRIC_FEC_REPAIRS, // FEC repair datagrams sent
+    METRIC_FEC_RECOVERED, // Lost data datagrams rebuilt from FEC repairs
+    METRIC_FEC_LOST, // Data datagrams lost beyond what FEC could rebuild
+    METRIC_COMPRESS_IN_BYTES, // Bytes offered to the compressor
+    METRIC_COMPRESS_OUT_BYTES, // What those bytes took on the wire, compressed or not
+    METRIC_COMPRESS_NS, // Time spent compressing
+    METRIC_DECOMPRESS_BYTES, // Bytes decompressed
+    METRIC_DECOMPRESS_NS, // Time spent decompressing
+    METRIC_QUEUE_BYTES, // Gauge: bytes waiting in outbound TCP queues
+    METRIC_RING_BYTES, // Gauge: bytes waiting in frame reconstruction rings
+    METRIC_FLOWS, // Gauge: UDP flows being tracked
+    METRIC_COUNT
+};
+
+#define METRIC_FIRST_GAUGE METRIC_QUEUE_BYTES
+
+static const char *const metric_names[METRIC_COUNT] = {
+    "udp_rx_packets", "udp_rx_bytes", "udp_tx_packets", "udp_tx_bytes", "tcp_rx_bytes", "tcp_rx_frames",
+    "tcp_tx_bytes", "tcp_tx_frames", "drops", "send_errors", "wakeups", "log_drops", "retransmits",
+    "fec_repairs", "fec_recovered", "fec_lost", "compress_in_bytes", "compress_out_bytes", "compress_ns",
+    "decompress_bytes", "decompress_ns", "queue_bytes", "ring_bytes", "flows"
+};
+
+struct METRICS_ALIGNED metrics_shard { // Written by one thread only
+    uint64_t values[METRIC_COUNT];
+};
+
+static struct metrics_shard metrics_shards[METRICS_MAX_SHARDS];
+static volatile long metrics_shards_claimed = 1; // Shard 0 belongs to whichever thread never claims one
+static METRICS_THREAD_LOCAL struct metrics_shard *metrics_local = &metrics_shards[0];
+
+static const char *metrics_program = "";
+static int (*metrics_extra)(char *text, size_t size) = NULL; // Appends more lines, such as pool_format
+static time_t metrics_started;
+
+// Gives the calling thread its own shard. Threads that update metrics call this
+// first, except one (normally the main thread), which keeps shard 0. Past
+// METRICS_MAX_SHARDS threads share the last shard and may lose updates.
+static inline void metrics_thread_init(void) {
+#ifdef _WIN32
+    long index = InterlockedIncrement(&metrics_shards_claimed) - 1;
+#else
+    long index = __atomic_fetch_add(&metrics_shards_claimed, 1, __ATOMIC_RELAXED);
+#endif
+    metrics_local = &metrics_shards[index < METRICS_MAX_SHARDS ? index : METRICS_MAX_SHARDS - 1];
+}
+
+static inline void metrics_add(enum metric_id id, uint64_t n) {
+    uint64_t *value = &metrics_local->values[id];
+#ifdef _WIN32
+    InterlockedExchangeAdd64((volatile LONG64 *)value, (LONG64)n);
+#else
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED); // One writer: no locked add
+#endif
+}
+
+static inline void metrics_sub(enum metric_id id, uint64_t n) { // Gauges only
+    metrics_add(id, (uint64_t)0 - n);
+}
+
+static inline uint64_t metrics_load(const uint64_t *value) {
+#ifdef _WIN32
+    return (uint64_t)InterlockedCompareExchange64((volatile LONG64 *)value, 0, 0);
+#else
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline long metrics_shard_count(void) {
+#ifdef _WIN32
+    long shards = InterlockedCompareExchange(&metrics_shards_claimed, 0, 0);
+#else
+    long shards = __atomic_load_n(&metrics_shards_claimed, __ATOMIC_RELAXED);
+#endif
+    return shards < METRICS_MAX_SHARDS ? shards : METRICS_MAX_SHARDS;
+}
+
+// One metric summed over every shard, for programs that report it themselves
+static inline uint64_t metrics_sum(enum metric_id id) {
+    uint64_t sum = 0;
+    for (long s = metrics_shard_count(); s-- > 0;)
+        sum += metrics_load(&metrics_shards[s].values[id]);
+    return sum;
+}
+
+// Sums every shard into text, one "name value" line per metric. Returns the length.
+static inline int metrics_format(char *text, size_t size) {
+    uint64_t sum[METRIC_COUNT] = { 0 };
+    long shards = metrics_shard_count();
+    for (long s = 0; s < shards; s++) {
+        for (int i = 0; i < METRIC_COUNT; i++)
+            sum[i] += metrics_load(&metrics_shards[s].values[i]);
+    }
+
+    int length = snprintf(text, size, "# %s\nuptime_seconds %lld\nthreads %ld\n", metrics_program,
+                          (long long)(time(NULL) - metrics_started), shards);
+    for (int i = 0; i < METRIC_COUNT && length >= 0 && (size_t)length < size; i++) {
+        if (i < METRIC_FIRST_GAUGE)
+            length += snprintf(text + length, size - (size_t)length, "%s %llu\n", metric_names[i],
+                               (unsigned long long)sum[i]);
+        else
+            length += snprintf(text + length, size - (size_t)length, "%s %lld\n", metric_names[i],
+                               (long long)(int64_t)sum[i]);
+    }
+    if (metrics_extra != NULL && length >= 0 && (size_t)length < size)
+        length += metrics_extra(text + length, size - (size_t)length);
+    return length < 0 ? 0 : ((size_t)length < size ? length : (int)size - 1);
+}
+
+#ifdef _WIN32
+typedef SOCKET metrics_socket;
+#define METRICS_INVALID_SOCKET INVALID_SOCKET
+#define metrics_close(s) closesocket(s)
+#else
+typedef int metrics_socket;
+#define METRICS_INVALID_SOCKET (-1)
+#define metrics_close(s) close(s)
+#endif
+
+struct metrics_server {
+    metrics_socket socket;
+    int stream; // UNIX stream socket rather than UDP
+};
+
+static struct metrics_server metrics_listener;
+
+// Answers polls until the socket fails. Runs on its own thread.
+static inline void metrics_serve_loop(struct metrics_server *server) {
+    static char text[METRICS_TEXT_SIZE];
+    while (1) {
+        if (server->stream) {
+#ifndef _WIN32
+            int c = accept(server->socket, NULL, NULL);
+            if (c < 0) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                break;
+            }
+            int length = metrics_format(text, sizeof(text));
+            for (int sent = 0; sent < length;) {
+                ssize_t n = send(c, text + sent, (size_t)(length - sent), MSG_NOSIGNAL);
+                if (n <= 0)
+                    break;
+                sent += (int)n;
+            }
+            close(c);
+#endif
+        } else {
+            char request[64];
+            struct sockaddr_storage peer;
+            socklen_t peer_len = sizeof(peer);
+            int n = recvfrom(server->socket, request, sizeof(request), 0, (struct sockaddr *)&peer, &peer_len);
+            if (n < 0) {
+#ifdef _WIN32
+                if (WSAGetLastError() == WSAECONNRESET || WSAGetLastError() == WSAEMSGSIZE) // A poller went away
+                    continue;
+#else
+                if (errno == EINTR)
+                    continue;
+#endif
+                break;
+            }
+            int length = metrics_format(text, sizeof(text));
+            sendto(server->socket, text, length, 0, (struct sockaddr *)&peer, peer_len);
+        }
+    }
+    fprintf(stderr, "Stats socket failed; metrics are no longer served\n");
+}
+
+static inline void metrics_thread(void *arg) {
+    metrics_serve_loop(arg);
+}
+
+// Starts serving metrics as described by spec, unix:<path> or udp:<port>.
+// Returns 0, or -1 after printing why not.
+static inline int metrics_serve(const char *spec, const char *program) {
+    struct metrics_server *server = &metrics_listener;
+    metrics_program = program;
+    metrics_started = time(NULL);
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+#ifdef _WIN32
+        fprintf(stderr, "UNIX stats sockets are not supported on Windows; use udp:<port>\n");
+        return -1;
+#else
+        struct sockaddr_un addr;
+        const char *path = spec + 5;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (*path == '\0' || strlen(path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Invalid stats socket path: %s\n", path);
+            return -1;
+        }
+        strcpy(addr.sun_path, path);
+        server->stream = 1;
+        server->socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(path); // A socket left behind by an earlier run
+        if (server->socket < 0 || bind(server->socket, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(server->socket, 16) != 0) {
+            fprintf(stderr, "Could not serve stats on %s: %s\n", path, strerror(errno));
+            if (server->socket >= 0)
+                close(server->socket);
+            return -1;
+        }
+#endif
+    } else if (strncmp(spec, "udp:", 4) == 0) {
+        char *end;
+        long port = strtol(spec + 4, &end, 10);
+        if (spec[4] == '\0' || *end != '\0' || port < 1 || port > 65535) {
+            fprintf(stderr, "Invalid stats port: %s\n", spec + 4);
+            return -1;
+        }
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Local pollers only
+        addr.sin_port = htons((uint16_t)port);
+        server->stream = 0;
+        server->socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (server->socket == METRICS_INVALID_SOCKET ||
+            bind(server->socket, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            fprintf(stderr, "Could not serve stats on 127.0.0.1:%ld\n", port);
+            if (server->socket != METRICS_INVALID_SOCKET)
+                metrics_close(server->socket);
+            return -1;
+        }
+    } else {
+        fprintf(stderr, "Invalid stats socket: %s (use unix:<path> or udp:<port>)\n", spec);
+        return -1;
+    }
+
+    platform_thread thread;
+#ifndef _WIN32
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved); // Signals stay with the threads doing the work
+#endif
+    int failed = platform_thread_start(&thread, metrics_thread, server) != 0;
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+#endif
+    if (failed) {
+        fprintf(stderr, "Could not start the stats thread\n");
+        metrics_close(server->socket);
+        return -1;
+    }
+    platform_thread_detach(thread);
+    return 0;
+}
+
+#endif
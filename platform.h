@@ -0,0 +1,560 @@
+// Platform layer shared by the programs in this repository: the socket names,
+// scatter-gather I/O, readiness waits, binary stdio and clocks that differ
+// between Winsock and POSIX, threads and CPU pinning, and port number parsing.
+// Every program is written against the Winsock names; on POSIX they map onto
+// BSD sockets with no cost beyond the call itself.
+//
+// Readiness: platform_wait() waits on one socket. A platform_poller watches
+// many; it is an epoll instance on Linux, so a wait costs the same however
+// many sockets are registered, and a growable pollfd array elsewhere (WSAPoll
+// on Windows), with no FD_SETSIZE cap. Both are level-triggered. Timeouts are
+// in nanoseconds; on Linux a timeout that is not a whole number of
+// milliseconds is kept exactly with a timerfd, elsewhere it is rounded up.
+//
+// Include before metrics.h and the other shared headers. On Linux, define
+// _GNU_SOURCE first when the program needs recvmmsg, sendmmsg or affinity.
+
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef _WIN32
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600 // WSAPoll and GetTickCount64 need Vista or later
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <io.h>
+#include <fcntl.h>
+
+#pragma comment(lib, "ws2_32.lib")
+
+#define poll WSAPoll
+#define SOCKET_WOULD_BLOCK WSAEWOULDBLOCK
+#define SOCKET_REFUSED WSAECONNRESET // A datagram bounced off a closed port
+
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
+// Minimal Winsock names so the same code builds against BSD sockets
+typedef int SOCKET;
+typedef struct { int unused; } WSADATA;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define MAKEWORD(a, b) ((a) | ((b) << 8))
+#define WSAStartup(version, data) ((void)(version), (void)(data), 0)
+#define WSACleanup() ((void)0)
+#define WSAGetLastError() errno
+#define WSAEWOULDBLOCK EWOULDBLOCK
+#define closesocket(s) close(s)
+#define SOCKET_WOULD_BLOCK EAGAIN
+#define SOCKET_REFUSED ECONNREFUSED
+#endif
+
+#define PLATFORM_READABLE 1
+#define PLATFORM_WRITABLE 2
+#define PLATFORM_POLL_EVENTS 256 // Most events one wait takes from the kernel
+#define PLATFORM_TIMER_TOKEN UINT64_MAX // Reserved for the poller's own timer
+
+// Parses a port number: decimal, or hex or octal with a C prefix. Returns -1
+// unless the whole string is a number from 0 to 65535.
+static inline int convert_port_name(uint16_t *port, const char *port_name) {
+    char *end;
+    long long int nn;
+    uint16_t t;
+    long long int tt;
+
+    if (port_name == NULL || *port_name == '\0')
+        return -1;
+
+    nn = strtoll(port_name, &end, 0);
+    if (*end != '\0')
+        return -1;
+    if (nn < 0)
+        return -1;
+
+    t = (uint16_t) nn;
+    tt = (long long int) t;
+    if (tt != nn)
+        return -1;
+
+    *port = t;
+    return 0;
+}
+
+// Scatter-gather vectors, so a frame header and its payload, or a frame that
+// wraps around the ring, go to the kernel in one call without being joined.
+#ifdef _WIN32
+typedef WSABUF io_vec;
+#define IO_VEC_BASE(v) ((v).buf)
+#define IO_VEC_LEN(v) ((size_t)(v).len)
+#else
+typedef struct iovec io_vec;
+#define IO_VEC_BASE(v) ((v).iov_base)
+#define IO_VEC_LEN(v) ((v).iov_len)
+#endif
+
+static inline void io_vec_set(io_vec *v, const void *base, size_t length) {
+#ifdef _WIN32
+    v->buf = (CHAR *)base;
+    v->len = (ULONG)length;
+#else
+    v->iov_base = (void *)base;
+    v->iov_len = length;
+#endif
+}
+
+static inline int recv_vec(SOCKET s, io_vec *v, int count) { // Returns bytes received or SOCKET_ERROR
+#ifdef _WIN32
+    DWORD received = 0;
+    DWORD flags = 0;
+    if (WSARecv(s, v, (DWORD)count, &received, &flags, NULL, NULL) == SOCKET_ERROR)
+        return SOCKET_ERROR;
+    return (int)received;
+#else
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = v;
+    msg.msg_iovlen = (size_t)count;
+    return (int)recvmsg(s, &msg, 0);
+#endif
+}
+
+// Sends one datagram or stream chunk gathered from count vectors
+static inline int send_vec(SOCKET s, io_vec *v, int count, const struct sockaddr *to, socklen_t to_len) {
+#ifdef _WIN32
+    DWORD sent = 0;
+    int rc = to == NULL ? WSASend(s, v, (DWORD)count, &sent, 0, NULL, NULL)
+                        : WSASendTo(s, v, (DWORD)count, &sent, 0, to, to_len, NULL, NULL);
+    if (rc == SOCKET_ERROR)
+        return SOCKET_ERROR;
+    return (int)sent;
+#else
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *)to;
+    msg.msg_namelen = to_len;
+    msg.msg_iov = v;
+    msg.msg_iovlen = (size_t)count;
+    return (int)sendmsg(s, &msg, 0);
+#endif
+}
+
+static inline int platform_set_nonblocking(SOCKET s, int enable) {
+#ifdef _WIN32
+    u_long mode = enable ? 1 : 0;
+    return ioctlsocket(s, FIONBIO, &mode) == SOCKET_ERROR ? -1 : 0;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags == -1)
+        return -1;
+    flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(s, F_SETFL, flags);
+#endif
+}
+
+static inline int platform_would_block(void) { // After a failed call on a nonblocking socket
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+// Puts stdin or stdout in binary mode, so Windows neither translates line
+// endings nor stops at ^Z. POSIX streams are always binary.
+static inline int platform_binary_stdio(FILE *stream) {
+#ifdef _WIN32
+    return _setmode(_fileno(stream), _O_BINARY) == -1 ? -1 : 0;
+#else
+    (void)stream;
+    return 0;
+#endif
+}
+
+static inline uint64_t platform_now_ns(void) { // Monotonic, from an arbitrary fixed point
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / frequency.QuadPart) * 1000000000 +
+           (uint64_t)(now.QuadPart % frequency.QuadPart) * 1000000000 / (uint64_t)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static inline uint64_t platform_monotonic_us(void) {
+    return platform_now_ns() / 1000;
+}
+
+static inline uint64_t platform_monotonic_ms(void) {
+#ifdef _WIN32
+    return GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+static inline uint64_t platform_realtime_ns(void) { // Wall-clock nanoseconds since the Unix epoch, comparable across hosts
+#ifdef _WIN32
+    typedef VOID (WINAPI *system_time_fn)(LPFILETIME);
+    static system_time_fn precise; // Windows 8 and later; older systems tick every few milliseconds
+    static int looked_up;
+    FILETIME ft;
+    if (!looked_up) {
+        precise = (system_time_fn)(void (*)(void))GetProcAddress(GetModuleHandleA("kernel32.dll"),
+                                                                 "GetSystemTimePreciseAsFileTime");
+        looked_up = 1;
+    }
+    if (precise != NULL)
+        precise(&ft);
+    else
+        GetSystemTimeAsFileTime(&ft);
+    uint64_t ticks = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime; // 100 ns units since 1601
+    return (ticks - 116444736000000000ULL) * 100;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// Waits until s is readable, or writable when events asks for it, or
+// timeout_ns passes (negative: no limit). Returns the events that are ready,
+// 0 on timeout or -1 on error.
+static inline int platform_wait(SOCKET s, unsigned events, int64_t timeout_ns) {
+    fd_set readable, writable;
+    FD_ZERO(&readable);
+    FD_ZERO(&writable);
+    if (events & PLATFORM_READABLE)
+        FD_SET(s, &readable);
+    if (events & PLATFORM_WRITABLE)
+        FD_SET(s, &writable);
+    struct timeval tv;
+    tv.tv_sec = (long)(timeout_ns / 1000000000);
+    tv.tv_usec = (long)(timeout_ns % 1000000000 / 1000);
+    int ready = select((int)s + 1, &readable, &writable, NULL, timeout_ns < 0 ? NULL : &tv);
+    if (ready <= 0)
+        return ready == SOCKET_ERROR ? -1 : 0;
+    return (FD_ISSET(s, &readable) ? PLATFORM_READABLE : 0) | (FD_ISSET(s, &writable) ? PLATFORM_WRITABLE : 0);
+}
+
+struct platform_event {
+    uint64_t token; // As registered: any value but PLATFORM_TIMER_TOKEN
+    unsigned events;
+};
+
+#ifdef __linux__
+struct platform_poller {
+    int epoll_fd;
+    int timer_fd; // Wakes a wait whose timeout has a fraction of a millisecond
+    int timer_armed; // Set by such a wait and not yet expired
+    struct epoll_event ready[PLATFORM_POLL_EVENTS];
+};
+
+static inline int platform_poller_init(struct platform_poller *p) {
+    p->timer_armed = 0;
+    p->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    p->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = PLATFORM_TIMER_TOKEN;
+    if (p->epoll_fd < 0 || p->timer_fd < 0 || epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, p->timer_fd, &event) != 0) {
+        if (p->epoll_fd >= 0)
+            close(p->epoll_fd);
+        if (p->timer_fd >= 0)
+            close(p->timer_fd);
+        return -1;
+    }
+    return 0;
+}
+
+static inline void platform_poller_destroy(struct platform_poller *p) {
+    close(p->timer_fd);
+    close(p->epoll_fd);
+}
+
+static inline int platform_poller_control(struct platform_poller *p, int op, SOCKET s, unsigned events,
+                                          uint64_t token) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = ((events & PLATFORM_READABLE) ? EPOLLIN : 0) | ((events & PLATFORM_WRITABLE) ? EPOLLOUT : 0);
+    event.data.u64 = token;
+    return epoll_ctl(p->epoll_fd, op, s, &event) == 0 ? 0 : -1;
+}
+
+static inline int platform_poller_add(struct platform_poller *p, SOCKET s, unsigned events, uint64_t token) {
+    return platform_poller_control(p, EPOLL_CTL_ADD, s, events, token);
+}
+
+static inline int platform_poller_modify(struct platform_poller *p, SOCKET s, unsigned events, uint64_t token) {
+    return platform_poller_control(p, EPOLL_CTL_MOD, s, events, token);
+}
+
+static inline int platform_poller_remove(struct platform_poller *p, SOCKET s) {
+    return platform_poller_control(p, EPOLL_CTL_DEL, s, 0, 0);
+}
+
+// Fills out with up to max ready sockets and returns how many, 0 on timeout
+// or -1 on error (errno EINTR when a signal interrupted it).
+static inline int platform_poller_wait(struct platform_poller *p, struct platform_event *out, int max,
+                                       int64_t timeout_ns) {
+    int timeout_ms = -1;
+    int use_timer = timeout_ns > 0 && timeout_ns % 1000000 != 0;
+    if (use_timer || p->timer_armed) { // Arm it, or disarm it so a stale expiry cannot cut this wait short
+        struct itimerspec at;
+        memset(&at, 0, sizeof(at));
+        if (use_timer) {
+            at.it_value.tv_sec = (time_t)(timeout_ns / 1000000000);
+            at.it_value.tv_nsec = (long)(timeout_ns % 1000000000);
+        }
+        if (timerfd_settime(p->timer_fd, 0, &at, NULL) != 0)
+            return -1;
+        p->timer_armed = use_timer;
+    }
+    if (timeout_ns >= 0 && !use_timer)
+        timeout_ms = timeout_ns / 1000000 > 0x7fffffff ? 0x7fffffff : (int)(timeout_ns / 1000000);
+    if (max > PLATFORM_POLL_EVENTS)
+        max = PLATFORM_POLL_EVENTS;
+    int n = epoll_wait(p->epoll_fd, p->ready, max, timeout_ms);
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        if (p->ready[i].data.u64 == PLATFORM_TIMER_TOKEN) { // Our timeout ran out; sockets may be ready too
+            uint64_t expirations;
+            if (read(p->timer_fd, &expirations, sizeof(expirations)) < 0) { // Already drained: nothing to do
+            }
+            p->timer_armed = 0;
+            continue;
+        }
+        uint32_t e = p->ready[i].events;
+        out[count].token = p->ready[i].data.u64;
+        out[count].events = ((e & (EPOLLIN | EPOLLERR | EPOLLHUP)) ? PLATFORM_READABLE : 0) |
+                            ((e & (EPOLLOUT | EPOLLERR | EPOLLHUP)) ? PLATFORM_WRITABLE : 0);
+        count++;
+    }
+    return n < 0 ? -1 : count;
+}
+
+#else
+struct platform_poller { // Parallel arrays, grown as sockets are added
+    struct pollfd *fds;
+    uint64_t *tokens;
+    int count, capacity;
+};
+
+static inline int platform_poller_init(struct platform_poller *p) {
+    memset(p, 0, sizeof(*p));
+    return 0;
+}
+
+static inline void platform_poller_destroy(struct platform_poller *p) {
+    free(p->fds);
+    free(p->tokens);
+}
+
+static inline int platform_poller_find(const struct platform_poller *p, SOCKET s) {
+    for (int i = 0; i < p->count; i++)
+        if (p->fds[i].fd == s)
+            return i;
+    return -1;
+}
+
+static inline short platform_poll_events(unsigned events) {
+    return (short)(((events & PLATFORM_READABLE) ? POLLIN : 0) | ((events & PLATFORM_WRITABLE) ? POLLOUT : 0));
+}
+
+static inline int platform_poller_add(struct platform_poller *p, SOCKET s, unsigned events, uint64_t token) {
+    if (platform_poller_find(p, s) >= 0)
+        return -1;
+    if (p->count == p->capacity) {
+        int capacity = p->capacity > 0 ? p->capacity * 2 : 16;
+        struct pollfd *fds = realloc(p->fds, (size_t)capacity * sizeof(*fds));
+        if (fds == NULL)
+            return -1;
+        p->fds = fds;
+        uint64_t *tokens = realloc(p->tokens, (size_t)capacity * sizeof(*tokens));
+        if (tokens == NULL)
+            return -1;
+        p->tokens = tokens;
+        p->capacity = capacity;
+    }
+    p->fds[p->count].fd = s;
+    p->fds[p->count].events = platform_poll_events(events);
+    p->fds[p->count].revents = 0;
+    p->tokens[p->count] = token;
+    p->count++;
+    return 0;
+}
+
+static inline int platform_poller_modify(struct platform_poller *p, SOCKET s, unsigned events, uint64_t token) {
+    int i = platform_poller_find(p, s);
+    if (i < 0)
+        return -1;
+    p->fds[i].events = platform_poll_events(events);
+    p->tokens[i] = token;
+    return 0;
+}
+
+static inline int platform_poller_remove(struct platform_poller *p, SOCKET s) {
+    int i = platform_poller_find(p, s);
+    if (i < 0)
+        return -1;
+    p->count--;
+    p->fds[i] = p->fds[p->count];
+    p->tokens[i] = p->tokens[p->count];
+    return 0;
+}
+
+static inline int platform_poller_wait(struct platform_poller *p, struct platform_event *out, int max,
+                                       int64_t timeout_ns) {
+    int timeout_ms = -1;
+    if (timeout_ns >= 0) // poll counts whole milliseconds: round up rather than wake early
+        timeout_ms = timeout_ns / 1000000 >= 0x7fffffff ? 0x7fffffff : (int)((timeout_ns + 999999) / 1000000);
+#ifdef _WIN32
+    if (p->count == 0) { // WSAPoll refuses an empty set
+        Sleep(timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms);
+        return 0;
+    }
+#endif
+    int n = poll(p->fds, (unsigned long)p->count, timeout_ms);
+    if (n == SOCKET_ERROR)
+        return -1;
+    int count = 0;
+    for (int i = 0; i < p->count && count < n && count < max; i++) {
+        short e = p->fds[i].revents;
+        if (e != 0) {
+            out[count].token = p->tokens[i];
+            out[count].events = ((e & (POLLIN | POLLERR | POLLHUP)) ? PLATFORM_READABLE : 0) |
+                                ((e & (POLLOUT | POLLERR | POLLHUP)) ? PLATFORM_WRITABLE : 0);
+            count++;
+        }
+    }
+    return count;
+}
+#endif
+
+// Threads: platform_thread_start() runs run(arg) on a new thread,
+// platform_thread_join() waits for it to return and platform_thread_detach()
+// lets it run on unjoined.
+#ifdef _WIN32
+typedef HANDLE platform_thread;
+#else
+typedef pthread_t platform_thread;
+#endif
+
+struct platform_thread_entry {
+    void (*run)(void *);
+    void *arg;
+};
+
+#ifdef _WIN32
+static inline DWORD WINAPI platform_thread_main(LPVOID start) {
+#else
+static inline void *platform_thread_main(void *start) {
+#endif
+    struct platform_thread_entry entry = *(struct platform_thread_entry *)start;
+    free(start);
+    entry.run(entry.arg);
+    return 0;
+}
+
+static inline int platform_thread_start(platform_thread *t, void (*run)(void *), void *arg) { // 0, or -1 on failure
+    struct platform_thread_entry *entry = malloc(sizeof(*entry));
+    if (entry == NULL)
+        return -1;
+    entry->run = run;
+    entry->arg = arg;
+#ifdef _WIN32
+    *t = CreateThread(NULL, 0, platform_thread_main, entry, 0, NULL);
+    if (*t != NULL)
+        return 0;
+#else
+    if (pthread_create(t, NULL, platform_thread_main, entry) == 0)
+        return 0;
+#endif
+    free(entry);
+    return -1;
+}
+
+static inline void platform_thread_join(platform_thread t) {
+#ifdef _WIN32
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+#else
+    pthread_join(t, NULL);
+#endif
+}
+
+static inline void platform_thread_detach(platform_thread t) {
+#ifdef _WIN32
+    CloseHandle(t);
+#else
+    pthread_detach(t);
+#endif
+}
+
+// Pins the calling thread to the index-th CPU it may run on. Linux needs
+// _GNU_SOURCE for the affinity calls; without it, as on other systems with no
+// portable affinity call, the thread stays where the scheduler puts it.
+static inline void platform_pin_thread(int index) {
+#if defined(__linux__) && defined(CPU_SETSIZE)
+    cpu_set_t allowed, set;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0)
+        return;
+    int target = index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            return;
+        }
+    }
+#elif defined(_WIN32)
+    DWORD_PTR process_mask, system_mask;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask) || process_mask == 0)
+        return;
+    int count = 0;
+    for (DWORD_PTR m = process_mask; m != 0; m &= m - 1)
+        count++;
+    int target = index % count;
+    for (int cpu = 0; cpu < (int)(8 * sizeof(DWORD_PTR)); cpu++) {
+        if ((process_mask >> cpu) & 1 && target-- == 0) {
+            SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+            return;
+        }
+    }
+#else
+    (void)index;
+#endif
+}
+
+#endif
@@ -0,0 +1,252 @@
+// Buffer pool shared by the programs in this repository: reference-counted
+// buffers in power-of-two size classes from 2 KiB to 1 GiB, with a cache per
+// thread in front of one free list per class.
+//
+// pool_alloc() hands out a buffer holding one reference. Each further stage
+// that keeps the same bytes, such as an asynchronous send still reading them,
+// takes its own with pool_ref(), and the last pool_release() returns the
+// buffer to the pool. A buffer goes back to the cache of the thread that
+// releases it, so a thread that takes and returns its own buffers never
+// touches a lock. A full cache hands half of its buffers to the class's free
+// list. The free lists keep at most POOL_IDLE_BYTES per class and free the
+// rest, so the memory held follows the buffers in use rather than the most
+// ever needed.
+//
+// For each class the pool counts buffers in use, their high-water mark and the
+// bytes allocated, idle ones included. pool_format() writes these as
+// "name value" lines; the programs hand it to metrics_extra so they appear on
+// the stats socket.
+//
+// Include after platform.h.
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define POOL_MIN_SHIFT 11  // 2 KiB
+#define POOL_MAX_SHIFT 30  // 1 GiB
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_CACHE_SLOTS 16  // Per class and thread, at most
+#define POOL_CACHE_BYTES (1 << 20)  // Per class and thread, at most
+#define POOL_IDLE_BYTES (8 << 20)  // Per class in the shared free list, at most
+#define POOL_HEADER_SIZE 64  // In front of the data, which stays 16-byte aligned
+#define POOL_CACHE_LINE 64
+
+#ifdef _MSC_VER
+#define POOL_ALIGNED __declspec(align(POOL_CACHE_LINE))
+#define POOL_THREAD_LOCAL __declspec(thread)
+#else
+#define POOL_ALIGNED __attribute__((aligned(POOL_CACHE_LINE)))
+#define POOL_THREAD_LOCAL _Thread_local
+#endif
+
+#ifdef _WIN32
+#define pool_atomic_add(p, n) InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(n))  // Returns the old value
+#define pool_atomic_load(p) InterlockedCompareExchange((volatile LONG *)(p), 0, 0)
+#define pool_atomic_cas(p, old, new) (InterlockedCompareExchange((volatile LONG *)(p), (LONG)(new), (LONG)(old)) == (LONG)(old))
+#define pool_atomic_swap(p, v) InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+#define pool_atomic_clear(p) InterlockedExchange((volatile LONG *)(p), 0)
+#else
+#define pool_atomic_add(p, n) __atomic_fetch_add((p), (n), __ATOMIC_ACQ_REL)
+#define pool_atomic_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define pool_atomic_cas(p, old, new) __atomic_compare_exchange_n((p), &(long){ (old) }, (new), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#define pool_atomic_swap(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQUIRE)
+#define pool_atomic_clear(p) __atomic_store_n((p), 0, __ATOMIC_RELEASE)
+#endif
+
+struct pool_buffer { // Sits POOL_HEADER_SIZE bytes in front of the data
+    struct pool_buffer *next; // Free list link while idle
+    volatile long refs;
+    int size_class;
+};
+
+struct POOL_ALIGNED pool_class {
+    volatile long lock; // Spin lock over free and idle; held for a few list operations only
+    struct pool_buffer *free;
+    long idle; // Buffers on the free list
+    volatile long live; // Buffers handed out and not yet released
+    volatile long peak; // High-water mark of live
+    volatile long allocated; // Buffers that exist: live, idle, or in a thread's cache
+};
+
+struct pool_cache { // One per thread
+    int count[POOL_CLASSES];
+    struct pool_buffer *slots[POOL_CLASSES][POOL_CACHE_SLOTS];
+};
+
+static struct pool_class pool_classes[POOL_CLASSES];
+static POOL_THREAD_LOCAL struct pool_cache pool_cache;
+
+static inline size_t pool_class_size(int c) {
+    return (size_t)1 << (c + POOL_MIN_SHIFT);
+}
+
+static inline int pool_class_of(size_t size) { // Smallest class that holds size bytes, or -1
+    int c = 0;
+    while (c < POOL_CLASSES && pool_class_size(c) < size)
+        c++;
+    return c < POOL_CLASSES ? c : -1;
+}
+
+static inline int pool_cache_limit(int c) { // Buffers a thread may keep for itself
+    size_t n = POOL_CACHE_BYTES / pool_class_size(c);
+    return n < POOL_CACHE_SLOTS ? (int)n : POOL_CACHE_SLOTS;
+}
+
+static inline long pool_idle_limit(int c) {
+    return (long)(POOL_IDLE_BYTES / pool_class_size(c));
+}
+
+static inline struct pool_buffer *pool_header(const void *data) {
+    return (struct pool_buffer *)((char *)data - POOL_HEADER_SIZE);
+}
+
+static inline void pool_lock(struct pool_class *pc) {
+    while (pool_atomic_swap(&pc->lock, 1) != 0) {
+        while (pool_atomic_load(&pc->lock) != 0) {
+        }
+    }
+}
+
+static inline void pool_unlock(struct pool_class *pc) {
+    pool_atomic_clear(&pc->lock);
+}
+
+// Puts count buffers of class c on its free list, and frees what the list
+// would hold beyond its idle limit
+static inline void pool_spill(int c, struct pool_buffer *const *buffers, int count) {
+    struct pool_class *pc = &pool_classes[c];
+    struct pool_buffer *excess = NULL;
+    pool_lock(pc);
+    for (int i = 0; i < count; i++) {
+        struct pool_buffer *b = buffers[i];
+        if (pc->idle < pool_idle_limit(c)) {
+            b->next = pc->free;
+            pc->free = b;
+            pc->idle++;
+        } else {
+            b->next = excess;
+            excess = b;
+        }
+    }
+    pool_unlock(pc);
+    while (excess != NULL) {
+        struct pool_buffer *next = excess->next;
+        free(excess);
+        pool_atomic_add(&pc->allocated, -1);
+        excess = next;
+    }
+}
+
+// Returns a buffer of at least size bytes holding one reference, or NULL when
+// size is above 1 GiB or memory runs out
+static inline void *pool_alloc(size_t size) {
+    int c = pool_class_of(size);
+    if (c < 0)
+        return NULL;
+    struct pool_class *pc = &pool_classes[c];
+    struct pool_cache *cache = &pool_cache;
+    struct pool_buffer *b = NULL;
+    if (cache->count[c] > 0) {
+        b = cache->slots[c][--cache->count[c]];
+    } else {
+        int refill = pool_cache_limit(c) / 2; // Take a few more while holding the lock
+        pool_lock(pc);
+        if (pc->free != NULL) {
+            b = pc->free;
+            pc->free = b->next;
+            pc->idle--;
+        }
+        while (refill-- > 0 && pc->free != NULL) {
+            cache->slots[c][cache->count[c]++] = pc->free;
+            pc->free = pc->free->next;
+            pc->idle--;
+        }
+        pool_unlock(pc);
+    }
+    if (b == NULL) {
+        b = malloc(POOL_HEADER_SIZE + pool_class_size(c));
+        if (b == NULL)
+            return NULL;
+        b->size_class = c;
+        pool_atomic_add(&pc->allocated, 1);
+    }
+    b->refs = 1;
+    long live = pool_atomic_add(&pc->live, 1) + 1;
+    long peak = pool_atomic_load(&pc->peak);
+    while (live > peak && !pool_atomic_cas(&pc->peak, peak, live))
+        peak = pool_atomic_load(&pc->peak);
+    return (char *)b + POOL_HEADER_SIZE;
+}
+
+static inline size_t pool_capacity(const void *data) {
+    return pool_class_size(pool_header(data)->size_class);
+}
+
+static inline void pool_ref(void *data) {
+    pool_atomic_add(&pool_header(data)->refs, 1);
+}
+
+// Drops one reference; the last one returns the buffer to the pool
+static inline void pool_release(void *data) {
+    struct pool_buffer *b = pool_header(data);
+    if (pool_atomic_load(&b->refs) != 1 && pool_atomic_add(&b->refs, -1) != 1) // Sole holder: no locked decrement
+        return;
+    int c = b->size_class;
+    struct pool_cache *cache = &pool_cache;
+    pool_atomic_add(&pool_classes[c].live, -1);
+    int limit = pool_cache_limit(c);
+    if (cache->count[c] < limit) {
+        cache->slots[c][cache->count[c]++] = b;
+        return;
+    }
+    struct pool_buffer *spill[POOL_CACHE_SLOTS / 2 + 1]; // Full, or this size is not cached: b and half the cache
+    int count = limit / 2;
+    cache->count[c] -= count;
+    memcpy(spill, &cache->slots[c][cache->count[c]], (size_t)count * sizeof(*spill));
+    spill[count++] = b;
+    pool_spill(c, spill, count);
+}
+
+// Hands the calling thread's cached buffers back to the shared free lists.
+// Threads that end call this, or their cache leaks.
+static inline void pool_thread_flush(void) {
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        pool_spill(c, pool_cache.slots[c], pool_cache.count[c]);
+        pool_cache.count[c] = 0;
+    }
+}
+
+static inline const char *pool_class_name(int c, char *name, size_t size) { // "2k", "128k", "1m"
+    int shift = c + POOL_MIN_SHIFT;
+    snprintf(name, size, "%d%c", 1 << (shift % 10), shift >= 30 ? 'g' : shift >= 20 ? 'm' : 'k');
+    return name;
+}
+
+// Writes pool_<class>_live, _peak and _bytes for every class ever used, and
+// the total allocated as pool_bytes. Returns the length.
+static inline int pool_format(char *text, size_t size) {
+    int length = 0;
+    unsigned long long total = 0;
+    for (int c = 0; c < POOL_CLASSES && (size_t)length < size; c++) {
+        const struct pool_class *pc = &pool_classes[c];
+        long peak = pool_atomic_load(&pc->peak);
+        if (peak == 0)
+            continue;
+        char name[8];
+        unsigned long long bytes = (unsigned long long)pool_atomic_load(&pc->allocated) * pool_class_size(c);
+        total += bytes;
+        pool_class_name(c, name, sizeof(name));
+        length += snprintf(text + length, size - (size_t)length, "pool_%s_live %ld\npool_%s_peak %ld\npool_%s_bytes %llu\n",
+                           name, pool_atomic_load(&pc->live), name, peak, name, bytes);
+    }
+    if ((size_t)length < size)
+        length += snprintf(text + length, size - (size_t)length, "pool_bytes %llu\n", total);
+    return (size_t)length < size ? length : (int)size - 1;
+}
+
+#endif
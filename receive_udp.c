@@ -1,44 +1,508 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
 #include <stdint.h>
+#include <time.h>
 
-#pragma comment(lib, "ws2_32.lib")
+#include "platform.h"
+
+#include "metrics.h"
+#include "hash_slots.h"
+#include "session_table.h"
+#include "transfer.h"
+#include "fec.h"
+#include "pool.h"
 
 #define BUFFER_SIZE 65536 // 2^16 as per requirements
 #define IP_BUFFER_SIZE 64
+#define PREVIEW_SIZE 50 // Longer messages are shown truncated
+#define LOG_RING_SIZE 4096 // Log records in flight to the logging thread; a power of two
+#define LOG_IDLE_MS 10 // How long the logging thread sleeps when the ring is empty
+#define DEFAULT_SESSIONS 65536
+#define MAX_TOP 100
+#define DEFAULT_REORDER_WINDOW 1024
+#define TRANSFER_IDLE_NS 10000000000ull // A started transfer is abandoned after this long without a datagram
+#define TRANSFER_LINGER_NS 2000000000ull // After the FIN, answer retransmissions until this long passes quietly
+#define TRANSFER_ACK_EVERY 16 // In-order datagrams acknowledged together at most
 
-static int convert_port_name(uint16_t *port, const char *port_name) { // Function to convert port name to port number
-    char *end;
-    long long int nn;
-    uint16_t t;
-    long long int tt;
+#ifdef _WIN32
+#define ring_load(p) ((uint32_t)InterlockedCompareExchange((volatile LONG *)(p), 0, 0))
+#define ring_store(p, v) InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+#define log_sleep_ms(ms) Sleep(ms)
+#else
+#define ring_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ring_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define log_sleep_ms(ms) usleep((ms) * 1000)
+#endif
 
-    if (port_name == NULL) return -1; // Check if port_name is NULL
-    if (*port_name == '\0') return -1; // Check if port_name is empty
-    
-    nn = strtoll(port_name, &end, 0);
-    if (*end != '\0') return -1; // Check if port_name contains invalid characters
-    if (nn < ((long long int) 0)) return -1; // Check if port_name is negative
-    
-    t = (uint16_t) nn; // Convert port_name to port number
-    tt = (long long int) t; // Convert port number to long long int
-    if (tt != nn) return -1; // Check if port number is not an integer
-    
-    *port = t;
-    return 0;
-}
+// What the logging thread needs to print one message: everything is copied,
+// so the packet buffer is free again as soon as the record is pushed
+struct log_record {
+    unsigned long msg_count;
+    struct sockaddr_in peer;
+    int bytes;
+    int echoed; // 0 when the echo failed
+    int recovered; // Rebuilt by FEC rather than received
+    char preview[PREVIEW_SIZE + 1];
+};
+
+// Single-producer, single-consumer ring: the packet loop only ever writes head
+// and the logging thread only ever writes tail, each on its own cache line
+struct log_ring {
+    METRICS_ALIGNED uint32_t head;
+    METRICS_ALIGNED uint32_t tail;
+    METRICS_ALIGNED uint32_t cached_tail; // Producer's last look at tail
+    uint32_t stop; // Set once the packet loop has published its last record
+    struct log_record records[LOG_RING_SIZE];
+};
+
+// Top talkers, picked on the packet thread, which owns the session table,
+// and printed by the logging thread. ready hands the report back and forth.
+struct session_report {
+    uint32_t ready;
+    int count;
+    uint32_t sessions;
+    uint64_t evictions;
+    uint64_t taken_ns;
+    int fec; // 1: fec_stats is filled in
+    struct fec_stats fec_stats;
+    struct session top[MAX_TOP];
+};
+
+static struct log_ring log_ring;
+static struct session_report session_report;
+static unsigned long log_every = 1; // Log every Nth packet
+static unsigned long log_max_per_second = 0; // 0: no limit
+static uint32_t session_capacity = DEFAULT_SESSIONS;
+static int top_count = 10;
+static unsigned long report_seconds = 10; // 0: no top talkers report
+static long limit_rate = 0; // Packets per second per source; 0: no limit
+static long limit_burst = 32;
+static struct session_limit limit;
+static const char *output_path = NULL; // Set: receive one reliable transfer into this file instead of echoing
+static uint32_t reorder_window = DEFAULT_REORDER_WINDOW;
+static int fec_enabled = 0; // 1: datagrams come from send_udp -f and are decoded before the echo
 
 void print_client_info(struct sockaddr_in *client_addr) { // Function to print client information
     char ip_str[IP_BUFFER_SIZE]; 
-    DWORD ip_str_len = IP_BUFFER_SIZE;
     
-    inet_ntop(AF_INET, &(client_addr->sin_addr), ip_str, ip_str_len); // Convert IP address to string
+    inet_ntop(AF_INET, &(client_addr->sin_addr), ip_str, sizeof(ip_str)); // Convert IP address to string
     printf("[Client %s:%d] ", ip_str, ntohs(client_addr->sin_port)); // Print client information
 }
 
+// Claims the next free record, or returns NULL and counts a dropped record
+// when the logging thread has fallen a whole ring behind. Never blocks.
+static struct log_record *log_claim(struct log_ring *ring) {
+    if (ring->head - ring->cached_tail == LOG_RING_SIZE) {
+        ring->cached_tail = ring_load(&ring->tail); // Only re-read when the ring looks full
+        if (ring->head - ring->cached_tail == LOG_RING_SIZE) {
+            metrics_add(METRIC_LOG_DROPS, 1);
+            return NULL;
+        }
+    }
+    return &ring->records[ring->head % LOG_RING_SIZE];
+}
+
+static void log_publish(struct log_ring *ring) { // Hands the claimed record to the logging thread
+    ring_store(&ring->head, ring->head + 1);
+}
+
+// Samples the packet loop: every log_every-th message, and no more than
+// log_max_per_second records in any one second
+static int log_sampled(unsigned long msg_count) {
+    static time_t window;
+    static unsigned long logged;
+    if ((msg_count - 1) % log_every != 0)
+        return 0;
+    if (log_max_per_second == 0)
+        return 1;
+    time_t now = time(NULL);
+    if (now != window) {
+        window = now;
+        logged = 0;
+    }
+    return logged++ < log_max_per_second;
+}
+
+static void print_record(const struct log_record *r) {
+    print_client_info((struct sockaddr_in *)&r->peer);// Print message info
+    printf("Received message #%lu (%d bytes): ", r->msg_count, r->bytes);
+
+    if (r->bytes == 0) { // Check if message is empty
+        printf("<empty packet>\n");
+    } else if (r->bytes <= PREVIEW_SIZE) { // Check if message is less than 50 bytes
+        printf("%s\n", r->preview);
+    } else {
+        printf("%.50s... (message truncated)\n", r->preview);
+    }
+    if (r->recovered)
+        printf("Message recovered by FEC\n");
+    if (r->echoed)
+        printf("Message echoed back successfully\n");
+}
+
+static void print_report(const struct session_report *report) {
+    printf("--- Top %d of %u sources (%llu evicted) ---\n", report->count, report->sessions,
+           (unsigned long long)report->evictions);
+    for (int i = 0; i < report->count; i++) {
+        const struct session *s = &report->top[i];
+        char ip_str[IP_BUFFER_SIZE];
+        inet_ntop(s->key.family, s->key.addr, ip_str, sizeof(ip_str));
+        printf("%3d. %s:%d  %llu packets, %llu bytes, %.1f packets/s, first seen %.1fs ago, last %.1fs ago", i + 1,
+               ip_str, ntohs(s->key.port), (unsigned long long)s->packets, (unsigned long long)s->bytes,
+               session_rate(s), (double)(report->taken_ns - s->first_seen_ns) / 1e9,
+               (double)(report->taken_ns - s->last_seen_ns) / 1e9);
+        if (s->limited > 0)
+            printf(", %llu rate-limited", (unsigned long long)s->limited);
+        printf("\n");
+    }
+    if (report->fec) {
+        const struct fec_stats *f = &report->fec_stats;
+        uint64_t lost = f->recovered + f->lost;
+        printf("FEC: %llu data, %llu repairs received; %llu lost, %llu recovered (%.1f%%), %llu beyond repair;"
+               " %llu late, %llu invalid\n", (unsigned long long)f->data, (unsigned long long)f->repairs,
+               (unsigned long long)lost, (unsigned long long)f->recovered,
+               lost > 0 ? 100.0 * (double)f->recovered / (double)lost : 100.0, (unsigned long long)f->lost,
+               (unsigned long long)f->late, (unsigned long long)f->invalid);
+    }
+}
+
+// Formats and writes records until told to stop and the ring is empty.
+// stdout is fully buffered here and flushed whenever the ring runs dry.
+static void log_drain(void *arg) {
+    struct log_ring *ring = arg;
+    static char out[1 << 16];
+    setvbuf(stdout, out, _IOFBF, sizeof(out));
+    uint64_t reported_drops = 0;
+    while (1) {
+        uint32_t head = ring_load(&ring->head);
+        uint32_t tail = ring->tail;
+        if (tail == head) {
+            if (ring_load(&session_report.ready)) {
+                print_report(&session_report);
+                ring_store(&session_report.ready, 0);
+            }
+            uint64_t drops = metrics_sum(METRIC_LOG_DROPS);
+            if (drops != reported_drops) {
+                printf("(%llu log records dropped: the log could not keep up)\n",
+                       (unsigned long long)(drops - reported_drops));
+                reported_drops = drops;
+            }
+            fflush(stdout);
+            if (ring_load(&ring->stop) && ring_load(&ring->head) == tail)
+                break;
+            log_sleep_ms(LOG_IDLE_MS);
+            continue;
+        }
+        for (; tail != head; tail++)
+            print_record(&ring->records[tail % LOG_RING_SIZE]);
+        ring_store(&ring->tail, tail);
+    }
+}
+
+static int parse_options(int argc, char *argv[], const char **stats_socket) {
+    for (int i = 2; i < argc; i++) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[i]);
+            return -1;
+        }
+        long value = strtol(argv[i + 1], NULL, 10);
+        if (strcmp(argv[i], "-n") == 0 && value > 0) {
+            log_every = (unsigned long)value;
+        } else if (strcmp(argv[i], "-r") == 0 && value >= 0) {
+            log_max_per_second = (unsigned long)value;
+        } else if (strcmp(argv[i], "-s") == 0 && value > 0 && value <= SESSION_MAX_CAPACITY) {
+            session_capacity = (uint32_t)value;
+        } else if (strcmp(argv[i], "-t") == 0 && value > 0 && value <= MAX_TOP) {
+            top_count = (int)value;
+        } else if (strcmp(argv[i], "-i") == 0 && value >= 0) {
+            report_seconds = (unsigned long)value;
+        } else if (strcmp(argv[i], "-l") == 0 && value >= 0) {
+            limit_rate = value;
+        } else if (strcmp(argv[i], "-k") == 0 && value > 0 && value <= 1000000) {
+            limit_burst = value;
+        } else if (strcmp(argv[i], "-o") == 0) {
+            output_path = argv[i + 1];
+        } else if (strcmp(argv[i], "-w") == 0 && value > 0 && value <= TRANSFER_MAX_WINDOW) {
+            reorder_window = (uint32_t)value;
+        } else if (strcmp(argv[i], "-f") == 0 && (value == 0 || value == 1)) {
+            fec_enabled = (int)value;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            *stats_socket = argv[i + 1];
+        } else {
+            fprintf(stderr, "Invalid option: %s %s\n", argv[i], argv[i + 1]);
+            return -1;
+        }
+        i++;
+    }
+    if (limit_rate > 0 && session_limit_init(&limit, (double)limit_rate, (uint32_t)limit_burst) != 0) {
+        fprintf(stderr, "Invalid rate limit: %ld packets/s, burst %ld\n", limit_rate, limit_burst);
+        return -1;
+    }
+    return 0;
+}
+
+// Receiving end of a reliable transfer (see transfer.h). Datagrams in order
+// go straight to the output; ones that arrive ahead of a gap wait in a ring
+// of window slots until the gap fills. ACKs go out once the socket is
+// drained, after every TRANSFER_ACK_EVERY datagrams in order, and at once
+// for anything out of order or repeated, so the sender learns of losses
+// within one datagram.
+struct transfer_receiver {
+    SOCKET s;
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    uint32_t id;
+    int started;
+    uint32_t mask; // Reorder slots - 1
+    uint32_t slot_size; // The sender's datagram size
+    char *slots;
+    uint32_t *lengths;
+    uint8_t *present;
+    uint32_t next; // Next sequence to write out
+    uint32_t highest; // One past the highest sequence received
+    uint32_t latest; // Sequence of the latest arrival
+    uint32_t fin_seq; // UINT32_MAX until the FIN arrives
+    uint64_t echo_ns; // Its stamp, echoed for the sender's RTT
+    uint32_t unacked;
+    FILE *out;
+    uint64_t bytes, datagrams, duplicates, reordered, acks;
+};
+
+static int transfer_send_ack(struct transfer_receiver *r) {
+    uint8_t ack[TRANSFER_MAX_ACK];
+    int blocks = 0;
+    uint32_t first = UINT32_MAX;
+    if (r->latest >= r->next && r->latest < r->highest && r->present[r->latest & r->mask]) {
+        uint32_t start = r->latest, end = r->latest + 1; // The block holding the latest arrival goes first
+        while (start > r->next && r->present[(start - 1) & r->mask])
+            start--;
+        while (end < r->highest && r->present[end & r->mask])
+            end++;
+        transfer_sack_pack(ack, blocks++, start, end);
+        first = start;
+    }
+    for (uint32_t seq = r->next; seq < r->highest && blocks < TRANSFER_MAX_SACK;) {
+        if (!r->present[seq & r->mask]) {
+            seq++;
+            continue;
+        }
+        uint32_t start = seq;
+        while (seq < r->highest && r->present[seq & r->mask])
+            seq++;
+        if (start != first)
+            transfer_sack_pack(ack, blocks++, start, seq);
+    }
+    struct transfer_header h = { TRANSFER_ACK, (uint8_t)blocks, r->id, r->next, r->mask + 1, r->echo_ns };
+    transfer_header_pack(ack, &h);
+    int length = TRANSFER_HEADER_SIZE + blocks * TRANSFER_SACK_SIZE;
+    r->unacked = 0;
+    if (sendto(r->s, (const char *)ack, length, 0, (struct sockaddr *)&r->peer, r->peer_len) == SOCKET_ERROR) {
+        if (platform_would_block())
+            return 0; // The sender times out and asks again
+        fprintf(stderr, "Error sending ACK: %d\n", WSAGetLastError());
+        metrics_add(METRIC_SEND_ERRORS, 1);
+        return -1;
+    }
+    r->acks++;
+    metrics_add(METRIC_UDP_TX_PACKETS, 1);
+    metrics_add(METRIC_UDP_TX_BYTES, (uint64_t)length);
+    return 0;
+}
+
+static int transfer_write(struct transfer_receiver *r, const char *data, uint32_t length) {
+    if (length > 0 && fwrite(data, 1, length, r->out) != length) {
+        fprintf(stderr, "Error writing the output\n");
+        return -1;
+    }
+    r->bytes += length;
+    return 0;
+}
+
+// Takes one datagram of the transfer. Returns -1 when the output cannot be
+// written or the reorder buffer not allocated, else 0.
+static int transfer_on_datagram(struct transfer_receiver *r, const char *packet, int length,
+                                const struct sockaddr_storage *from, socklen_t from_len) {
+    struct transfer_header h;
+    if (transfer_header_unpack(&h, (const uint8_t *)packet, length) != 0 || h.type == TRANSFER_ACK)
+        return 0;
+    if (!r->started) { // The first datagram picks the transfer and sizes the slots
+        uint32_t slot_size = h.window > 0 && h.window <= TRANSFER_MAX_PAYLOAD ? h.window : TRANSFER_MAX_PAYLOAD;
+        r->slots = malloc((size_t)(r->mask + 1) * slot_size);
+        r->lengths = malloc((size_t)(r->mask + 1) * sizeof(*r->lengths));
+        r->present = calloc(r->mask + 1, 1);
+        if (r->slots == NULL || r->lengths == NULL || r->present == NULL) {
+            fprintf(stderr, "Out of memory for %u reorder slots of %u bytes\n", r->mask + 1, slot_size);
+            return -1;
+        }
+        r->slot_size = slot_size;
+        r->id = h.id;
+        memcpy(&r->peer, from, sizeof(r->peer));
+        r->peer_len = from_len;
+        r->started = 1;
+    } else if (h.id != r->id) {
+        return 0; // Another transfer, or a stale one
+    }
+    uint32_t payload = (uint32_t)(length - TRANSFER_HEADER_SIZE);
+    if (payload > r->slot_size || (h.type == TRANSFER_FIN && payload != 0) ||
+        (r->fin_seq != UINT32_MAX && h.seq > r->fin_seq))
+        return 0;
+
+    r->latest = h.seq;
+    r->echo_ns = h.stamp_ns;
+    r->unacked++;
+    if (h.type == TRANSFER_FIN)
+        r->fin_seq = h.seq;
+    if (h.seq >= r->next && h.seq - r->next > r->mask)
+        return 0; // Beyond the window the sender was given
+    if (h.seq < r->next || (h.seq > r->next && r->present[h.seq & r->mask])) {
+        r->duplicates++;
+        r->unacked = TRANSFER_ACK_EVERY; // Its ACK was probably lost: answer at once
+        return 0;
+    }
+    if (h.seq + 1 > r->highest)
+        r->highest = h.seq + 1;
+    if (h.seq > r->next) { // Ahead of a gap: hold it
+        memcpy(r->slots + (size_t)(h.seq & r->mask) * r->slot_size, packet + TRANSFER_HEADER_SIZE, payload);
+        r->lengths[h.seq & r->mask] = payload;
+        r->present[h.seq & r->mask] = 1;
+        r->reordered++;
+        r->unacked = TRANSFER_ACK_EVERY;
+        return 0;
+    }
+    if (transfer_write(r, packet + TRANSFER_HEADER_SIZE, payload) != 0)
+        return -1;
+    r->datagrams += h.type == TRANSFER_DATA;
+    r->next++;
+    while (r->present[r->next & r->mask]) { // The gap is filled: write out what waited behind it
+        uint32_t slot = r->next & r->mask;
+        if (transfer_write(r, r->slots + (size_t)slot * r->slot_size, r->lengths[slot]) != 0)
+            return -1;
+        r->present[slot] = 0;
+        r->datagrams += r->next != r->fin_seq;
+        r->next++;
+    }
+    return 0;
+}
+
+static int transfer_finish(struct transfer_receiver *r, uint64_t start_ns, uint64_t done_ns) {
+    FILE *out = r->out;
+    r->out = NULL;
+    if (fflush(out) != 0 || (out != stdout && fclose(out) != 0)) {
+        fprintf(stderr, "Error writing the output\n");
+        return -1;
+    }
+    double seconds = (double)(done_ns - start_ns) / 1e9;
+    if (seconds <= 0)
+        seconds = 1e-9;
+    fprintf(stderr, "Received %llu bytes in %llu datagrams in %.3f s: %.1f Mbit/s; %llu out of order, "
+                    "%llu duplicates, %llu ACKs\n",
+            (unsigned long long)r->bytes, (unsigned long long)r->datagrams, seconds,
+            (double)r->bytes * 8 / seconds / 1e6, (unsigned long long)r->reordered,
+            (unsigned long long)r->duplicates, (unsigned long long)r->acks);
+    return 0;
+}
+
+static int receive_transfer(SOCKET sfd, const char *path) {
+    struct transfer_receiver r;
+    memset(&r, 0, sizeof(r));
+    uint32_t window = 16;
+    while (window < reorder_window)
+        window <<= 1;
+    r.s = sfd;
+    r.mask = window - 1;
+    r.fin_seq = UINT32_MAX;
+    if (strcmp(path, "-") == 0) {
+        r.out = stdout;
+        platform_binary_stdio(stdout);
+    } else if ((r.out = fopen(path, "wb")) == NULL) {
+        fprintf(stderr, "Could not open %s for writing\n", path);
+        return 1;
+    }
+    static char out_buffer[1 << 20];
+    setvbuf(r.out, out_buffer, _IOFBF, sizeof(out_buffer));
+    int size = 4 << 20; // Best effort: room for a window arriving in one burst
+    setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, (const char *)&size, sizeof(size));
+    if (platform_set_nonblocking(sfd, 1) != 0) {
+        fprintf(stderr, "Could not make the socket nonblocking\n");
+        return 1;
+    }
+    fprintf(stderr, "Waiting for a transfer on the socket, writing to %s\n", path);
+
+    static char buffer[BUFFER_SIZE];
+    uint64_t start_ns = 0, last_ns = 0, done_ns = 0;
+    int status = 0;
+    while (1) {
+        uint64_t now = platform_now_ns();
+        uint64_t wait_ns = done_ns ? last_ns + TRANSFER_LINGER_NS : r.started ? last_ns + TRANSFER_IDLE_NS : now + 1000000000;
+        int ready = platform_wait(sfd, PLATFORM_READABLE, (int64_t)(wait_ns > now ? wait_ns - now : 0));
+        if (ready < 0) {
+            fprintf(stderr, "Error waiting for data: %d\n", WSAGetLastError());
+            status = 1;
+            break;
+        }
+        metrics_add(METRIC_WAKEUPS, 1);
+        now = platform_now_ns();
+        if (ready == 0) {
+            if (done_ns)
+                break; // Quiet since the FIN: the sender has its ACK
+            if (r.started && now >= last_ns + TRANSFER_IDLE_NS) {
+                fprintf(stderr, "Transfer stalled: nothing received for %llu s\n",
+                        (unsigned long long)(TRANSFER_IDLE_NS / 1000000000));
+                status = 1;
+                break;
+            }
+            continue;
+        }
+
+        struct sockaddr_storage from;
+        socklen_t from_len;
+        int length;
+        while (from_len = sizeof(from),
+               (length = recvfrom(sfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&from, &from_len)) >= 0) {
+            metrics_add(METRIC_UDP_RX_PACKETS, 1);
+            metrics_add(METRIC_UDP_RX_BYTES, (uint64_t)length);
+            if (!r.started)
+                start_ns = now;
+            if (transfer_on_datagram(&r, buffer, length, &from, from_len) != 0) {
+                status = 1;
+                break;
+            }
+            last_ns = now;
+            if (!done_ns && r.fin_seq != UINT32_MAX && r.next > r.fin_seq) { // Written out before the FIN's ACK leaves
+                done_ns = now;
+                if (transfer_finish(&r, start_ns, done_ns) != 0) {
+                    status = 1;
+                    break;
+                }
+            }
+            if (r.unacked >= TRANSFER_ACK_EVERY && transfer_send_ack(&r) != 0) {
+                status = 1;
+                break;
+            }
+        }
+#ifdef _WIN32
+        if (length < 0 && WSAGetLastError() == WSAECONNRESET) // An earlier ACK bounced; not this socket's fault
+            continue;
+#endif
+        if (status == 0 && length < 0 && !platform_would_block()) {
+            fprintf(stderr, "Error receiving data: %d\n", WSAGetLastError());
+            status = 1;
+        }
+        if (status == 0 && r.unacked > 0 && transfer_send_ack(&r) != 0)
+            status = 1;
+        if (status != 0)
+            break;
+    }
+
+    if (r.out != NULL && r.out != stdout)
+        fclose(r.out);
+    free(r.slots);
+    free(r.lengths);
+    free(r.present);
+    return status;
+}
+
 int main(int argc, char *argv[]) { // Main function
     WSADATA wsaData;
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) { // Initialize Winsock
@@ -47,7 +511,9 @@ int main(int argc, char *argv[]) { // Main function
     }
 
     if (argc < 2) { // Check if port name is provided
-        fprintf(stderr, "Usage: %s <port_name>\n", argv[0]); // Print usage message
+        fprintf(stderr, "Usage: %s <port_name> [-n log_every] [-r max_lines_per_sec] [-s sessions] [-t top_n]"
+                        " [-i report_seconds] [-l packets_per_sec] [-k burst] [-o output_file] [-w reorder_window]"
+                        " [-f 0|1] [-m unix:path|udp:port]\n", argv[0]); // Print usage message
         WSACleanup();
         return 1;
     }
@@ -59,6 +525,14 @@ int main(int argc, char *argv[]) { // Main function
         return 1;
     }
 
+    const char *stats_socket = NULL;
+    metrics_extra = pool_format;
+    if (parse_options(argc, argv, &stats_socket) != 0 ||
+        (stats_socket != NULL && metrics_serve(stats_socket, "receive_udp") != 0)) { // Serve live metrics
+        WSACleanup();
+        return 1;
+    }
+
     struct addrinfo hints; // Set up UDP socket
     struct addrinfo *result, *rp; 
     SOCKET sfd = INVALID_SOCKET;
@@ -99,17 +573,70 @@ int main(int argc, char *argv[]) { // Main function
 
     freeaddrinfo(result); // Free address information
 
+    if (output_path != NULL) { // One reliable transfer from send_udp -t 1, then exit
+        int status = receive_transfer(sfd, output_path);
+        closesocket(sfd);
+        WSACleanup();
+        return status;
+    }
+
+    struct session_table sessions;
+    struct fec_decoder fec; // One stream: interleaved senders would mix their blocks
+    if (session_table_init(&sessions, session_capacity) != 0) {
+        fprintf(stderr, "Out of memory for %u sessions\n", session_capacity);
+        closesocket(sfd);
+        WSACleanup();
+        return 1;
+    }
+    if (fec_enabled && fec_decoder_init(&fec) != 0) {
+        fprintf(stderr, "Out of memory for the FEC decoder\n");
+        session_table_destroy(&sessions);
+        closesocket(sfd);
+        WSACleanup();
+        return 1;
+    }
+    char *buffer = pool_alloc(BUFFER_SIZE); // Every datagram lands here, echoes and all
+    if (buffer == NULL) {
+        fprintf(stderr, "Out of memory for the receive buffer\n");
+        if (fec_enabled)
+            fec_decoder_destroy(&fec);
+        session_table_destroy(&sessions);
+        closesocket(sfd);
+        WSACleanup();
+        return 1;
+    }
+
     printf("UDP Echo Server listening on port %u...\n", port);
     printf("Ready to receive and echo messages.\n");
     printf("---------------------------------------\n");
+    fflush(stdout);
+
+    // Printing happens on its own thread, so a slow terminal or pipe costs
+    // log records rather than echoes
+    platform_thread logger;
+    if (platform_thread_start(&logger, log_drain, &log_ring) != 0) {
+        fprintf(stderr, "Could not start the logging thread\n");
+        pool_release(buffer);
+        if (fec_enabled)
+            fec_decoder_destroy(&fec);
+        session_table_destroy(&sessions);
+        closesocket(sfd);
+        WSACleanup();
+        return 1;
+    }
 
-    char buffer[BUFFER_SIZE];
     int bytes_read;
-    struct sockaddr_in peer_addr;
-    int peer_addr_len = sizeof(peer_addr);
+    struct sockaddr_storage peer_addr; // IPv4 only, but sized for any session key
+    socklen_t peer_addr_len;
     unsigned long msg_count = 0;
+    uint64_t report_interval_ns = (uint64_t)report_seconds * 1000000000;
+    uint64_t next_report_ns = platform_now_ns() + report_interval_ns;
+    static struct fec_output outputs[FEC_MAX_M + 1];
+    struct fec_stats counted = { 0 }; // FEC stats already added to the metrics
+    int failed_send = 0;
 
     while (1) { // Loop to receive and echo messages
+        peer_addr_len = sizeof(peer_addr);
         bytes_read = recvfrom(sfd, buffer, BUFFER_SIZE, 0,(struct sockaddr *)&peer_addr, &peer_addr_len);
 
         if (bytes_read == SOCKET_ERROR) { // Check if receive fails
@@ -118,31 +645,100 @@ int main(int argc, char *argv[]) { // Main function
         }
 
         msg_count++;
-        
-        buffer[bytes_read] = '\0';// Ensure null termination for printing
-
-        print_client_info(&peer_addr);// Print message info
-        printf("Received message #%lu (%d bytes): ", msg_count, bytes_read);
-        
-        if (bytes_read == 0) { // Check if message is empty
-            printf("<empty packet>\n");
-        } else if (bytes_read <= 50) { // Check if message is less than 50 bytes
-            printf("%s\n", buffer);
-        } else {
-            printf("%.50s... (message truncated)\n", buffer);
+        metrics_add(METRIC_UDP_RX_PACKETS, 1);
+        metrics_add(METRIC_UDP_RX_BYTES, (uint64_t)bytes_read);
+
+        struct session_key key;
+        uint64_t now = platform_now_ns();
+        int admitted = 1;
+        if (session_key_from_addr(&key, &peer_addr) == 0)
+            admitted = session_admit(session_touch(&sessions, &key, (uint32_t)bytes_read, now), &limit, now);
+        if (fec_enabled && bytes_read == 0) { // The sender's end of stream: open blocks will not complete
+            fec_decoder_flush(&fec);
+            next_report_ns = now; // Report how the stream fared
+        }
+        if (report_interval_ns > 0 && now >= next_report_ns) { // One pass over the table; skipped while the last report is unprinted
+            if (!ring_load(&session_report.ready)) {
+                session_report.count = session_top(&sessions, session_report.top, top_count);
+                session_report.sessions = sessions.count;
+                session_report.evictions = sessions.evictions;
+                session_report.taken_ns = now;
+                session_report.fec = fec_enabled;
+                if (fec_enabled)
+                    session_report.fec_stats = fec.stats;
+                ring_store(&session_report.ready, 1);
+            }
+            next_report_ns = now + report_interval_ns;
+        }
+        if (!admitted) { // Over its source's rate: neither echoed nor logged
+            metrics_add(METRIC_DROPS, 1);
+            continue;
         }
 
-        // Echo data back
-        if (sendto(sfd, buffer, bytes_read, 0,
-                  (struct sockaddr *)&peer_addr, peer_addr_len) == SOCKET_ERROR) {
-            fprintf(stderr, "Error sending response: %d\n", WSAGetLastError()); // Check if send fails
-            break;
+        // The FEC stage hands on each payload: the datagram's own, if it is
+        // data, and whatever it let the decoder rebuild. Without FEC, or for
+        // the empty end-of-stream datagram, that is the datagram itself.
+        int output_count = 1;
+        outputs[0].data = (const uint8_t *)buffer;
+        outputs[0].length = (uint32_t)bytes_read;
+        if (fec_enabled && bytes_read > 0)
+            output_count = fec_decode(&fec, (const uint8_t *)buffer, bytes_read, outputs);
+        if (fec_enabled) {
+            metrics_add(METRIC_FEC_RECOVERED, fec.stats.recovered - counted.recovered);
+            metrics_add(METRIC_FEC_LOST, fec.stats.lost - counted.lost);
+            counted = fec.stats;
+        }
+        if (output_count < 0) { // Not from send_udp -f
+            metrics_add(METRIC_DROPS, 1);
+            continue;
         }
 
-        printf("Message echoed back successfully\n");
+        int received = output_count > 0 && (const char *)outputs[0].data >= buffer && // Its own payload comes first
+                       (const char *)outputs[0].data <= buffer + bytes_read;
+        for (int o = 0; o < output_count; o++) {
+            const char *data = (const char *)outputs[o].data;
+            int length = (int)outputs[o].length;
+
+            // Echo data back
+            int echoed = sendto(sfd, data, length, 0,
+                                (struct sockaddr *)&peer_addr, peer_addr_len) != SOCKET_ERROR;
+            int send_error = echoed ? 0 : WSAGetLastError();
+            if (echoed) {
+                metrics_add(METRIC_UDP_TX_PACKETS, 1);
+                metrics_add(METRIC_UDP_TX_BYTES, (uint64_t)length);
+            }
+
+            struct log_record *r;
+            if (log_sampled(msg_count) && (r = log_claim(&log_ring)) != NULL) { // Copy out what the log shows
+                int shown = length < PREVIEW_SIZE ? length : PREVIEW_SIZE;
+                r->msg_count = msg_count;
+                memcpy(&r->peer, &peer_addr, sizeof(r->peer));
+                r->bytes = length;
+                r->echoed = echoed;
+                r->recovered = o >= received;
+                memcpy(r->preview, data, (size_t)shown);
+                r->preview[shown] = '\0'; // Ensure null termination for printing
+                log_publish(&log_ring);
+            }
+
+            if (!echoed) {
+                fprintf(stderr, "Error sending response: %d\n", send_error); // Check if send fails
+                metrics_add(METRIC_SEND_ERRORS, 1);
+                failed_send = 1;
+                break;
+            }
+        }
+        if (failed_send)
+            break;
     }
 
+    ring_store(&log_ring.stop, 1); // Let the logging thread write out what is left
+    platform_thread_join(logger);
+    pool_release(buffer);
+    if (fec_enabled)
+        fec_decoder_destroy(&fec);
+    session_table_destroy(&sessions);
     closesocket(sfd); // Close socket
     WSACleanup(); // Cleanup Winsock
     return 0; // Return success
-}
\ No newline at end of file
+}
@@ -1,55 +1,100 @@
+#ifdef __linux__
+#define _GNU_SOURCE // recvmmsg, sendmmsg, pthread_setaffinity_np
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
 #include <stdint.h>
 
-#pragma comment(lib, "ws2_32.lib") // Link with ws2_32.lib
+#include "platform.h"
+
+#include "metrics.h"
+#include "hash_slots.h"
+#include "session_table.h"
+#include "pool.h"
 
 #define BUFFER_SIZE 65536 // 2^16 as per requirements
+#define DEFAULT_BATCH_SIZE 64
+#define MAX_BATCH_SIZE 256 // Every slot holds a whole datagram, so a worker keeps batch * 64 KiB
+#define MAX_WORKERS 256
+#define SOCKET_BUFFER_BYTES (4 << 20) // Absorbs bursts while a worker is busy echoing
+#define DEFAULT_SESSIONS 65536
+#define DEFAULT_BURST 32
 
-static int convert_port_name(uint16_t *port, const char *port_name) { // Function to convert port name to port number
-    char *end;
-    long long int nn;
-    uint16_t t;
-    long long int tt;
-
-    if (port_name == NULL) return -1;
-    if (*port_name == '\0') return -1;
-    
-    nn = strtoll(port_name, &end, 0);
-    if (*end != '\0') return -1;
-    if (nn < ((long long int) 0)) return -1;
-    
-    t = (uint16_t) nn;
-    tt = (long long int) t;
-    if (tt != nn) return -1;
-    
-    *port = t;
+static int worker_count = 0; // 0: the single-threaded loop
+static int batch_size = DEFAULT_BATCH_SIZE;
+static int show_rate = 1; // Workers only: print the echo rate every second
+static const char *stats_socket = NULL;
+static volatile long workers_running;
+static long limit_rate = 0; // Packets per second per source; 0: no limit
+static long limit_burst = DEFAULT_BURST;
+static uint32_t session_capacity = DEFAULT_SESSIONS; // Per worker
+static struct session_limit limit; // Read-only once the workers start
+
+static int parse_options(int argc, char *argv[]) {
+    for (int i = 2; i < argc; i++) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[i]);
+            return -1;
+        }
+        long value = strtol(argv[i + 1], NULL, 10);
+        if (strcmp(argv[i], "-w") == 0 && value > 0 && value <= MAX_WORKERS) {
+            worker_count = (int)value;
+        } else if (strcmp(argv[i], "-b") == 0 && value > 0 && value <= MAX_BATCH_SIZE) {
+            batch_size = (int)value;
+        } else if (strcmp(argv[i], "-r") == 0 && (value == 0 || value == 1)) {
+            show_rate = (int)value;
+        } else if (strcmp(argv[i], "-l") == 0 && value >= 0) {
+            limit_rate = value;
+        } else if (strcmp(argv[i], "-k") == 0 && value > 0 && value <= 1000000) {
+            limit_burst = value;
+        } else if (strcmp(argv[i], "-s") == 0 && value > 0 && value <= SESSION_MAX_CAPACITY) {
+            session_capacity = (uint32_t)value;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            stats_socket = argv[i + 1];
+        } else {
+            fprintf(stderr, "Invalid option: %s %s\n", argv[i], argv[i + 1]);
+            return -1;
+        }
+        i++;
+    }
+    if (limit_rate > 0 && session_limit_init(&limit, (double)limit_rate, (uint32_t)limit_burst) != 0) {
+        fprintf(stderr, "Invalid rate limit: %ld packets/s, burst %ld\n", limit_rate, limit_burst);
+        return -1;
+    }
     return 0;
 }
 
-int main(int argc, char *argv[]) {
-    WSADATA wsaData;// Initialize Winsock
-    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) { // Initialize Winsock
-        fprintf(stderr, "WSAStartup failed\n");
-        return 1;
+// Sets up the calling thread's sources for rate limiting. Every thread keeps
+// its own table, so buckets need no lock; SO_REUSEPORT sends a source to the
+// same worker every time. Returns 0, or -1 after printing why not.
+static int limiter_init(struct session_table *sessions) {
+    if (limit.interval_ns == 0)
+        return 0;
+    if (session_table_init(sessions, session_capacity) != 0) {
+        fprintf(stderr, "Out of memory for %u sessions\n", session_capacity);
+        return -1;
     }
+    return 0;
+}
 
-    if (argc < 2) { // Check if port name is provided
-        fprintf(stderr, "Usage: %s <port_name>\n", argv[0]);
-        WSACleanup();
-        return 1;
-    }
+static void limiter_destroy(struct session_table *sessions) {
+    if (limit.interval_ns != 0)
+        session_table_destroy(sessions);
+}
 
-    uint16_t port; // Set up UDP socket
-    if (convert_port_name(&port, argv[1]) != 0) { // Convert port name to port number
-        fprintf(stderr, "Invalid port name: %s\n", argv[1]);
-        WSACleanup();
+static int limiter_admit(struct session_table *sessions, const struct sockaddr_storage *peer, uint32_t length,
+                         uint64_t now_ns) { // 1 to echo, 0 to drop
+    struct session_key key;
+    if (session_key_from_addr(&key, peer) != 0)
         return 1;
-    }
+    return session_admit(session_touch(sessions, &key, length, now_ns), &limit, now_ns);
+}
 
+// Binds a UDP socket to port on every local address. Workers on Linux each
+// bind their own with SO_REUSEPORT, so the kernel spreads senders over them.
+static SOCKET open_socket(uint16_t port, int reuse_port) {
     struct addrinfo hints;
     struct addrinfo *result, *rp;
     SOCKET sfd = INVALID_SOCKET;
@@ -66,8 +111,7 @@ int main(int argc, char *argv[]) {
     int s = getaddrinfo(NULL, port_str, &hints, &result);
     if (s != 0) { // Check if getaddrinfo failed
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
-        WSACleanup();
-        return 1;
+        return INVALID_SOCKET;
     }
 
     for (rp = result; rp != NULL; rp = rp->ai_next) { // Loop through results
@@ -75,27 +119,51 @@ int main(int argc, char *argv[]) {
         if (sfd == INVALID_SOCKET) // Check if socket creation failed
             continue;
 
+#ifdef __linux__
+        int reuse = 1;
+        if (reuse_port && setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0) {
+            fprintf(stderr, "SO_REUSEPORT failed: %d\n", WSAGetLastError());
+            closesocket(sfd);
+            continue;
+        }
+#else
+        (void)reuse_port;
+#endif
         if (bind(sfd, rp->ai_addr, (int)rp->ai_addrlen) == 0) // Bind socket
             break;
 
         closesocket(sfd);
     }
 
+    freeaddrinfo(result);
     if (rp == NULL) { // Check if socket creation or binding failed
         fprintf(stderr, "Could not bind\n");
-        freeaddrinfo(result);
-        WSACleanup();
-        return 1;
+        return INVALID_SOCKET;
     }
 
-    freeaddrinfo(result);
+    if (worker_count > 0) { // Best effort: the kernel caps it at net.core.[rw]mem_max
+        int size = SOCKET_BUFFER_BYTES;
+        setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, (const char *)&size, sizeof(size));
+        setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (const char *)&size, sizeof(size));
+    }
+    return sfd;
+}
 
-    char buffer[BUFFER_SIZE];
+// Echoes one datagram at a time until a receive or send fails
+static void echo_single(SOCKET sfd) {
+    char *buffer = pool_alloc(BUFFER_SIZE);
     int bytes_read;
     struct sockaddr_storage peer_addr;
-    int peer_addr_len;
-
-    printf("UDP Echo Server listening on port %u...\n", port);
+    socklen_t peer_addr_len;
+    struct session_table sessions;
+    if (buffer == NULL) {
+        fprintf(stderr, "Out of memory for the receive buffer\n");
+        return;
+    }
+    if (limiter_init(&sessions) != 0) {
+        pool_release(buffer);
+        return;
+    }
 
     while (1) { // Loop forever
         peer_addr_len = sizeof(peer_addr); // Set peer address length
@@ -106,16 +174,257 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Error receiving data: %d\n", WSAGetLastError());
             break;
         }
+        metrics_add(METRIC_UDP_RX_PACKETS, 1);
+        metrics_add(METRIC_UDP_RX_BYTES, (uint64_t)bytes_read);
+
+        if (limit.interval_ns != 0 &&
+            !limiter_admit(&sessions, &peer_addr, (uint32_t)bytes_read, platform_now_ns())) { // Over its rate: no echo
+            metrics_add(METRIC_DROPS, 1);
+            continue;
+        }
 
         // Echo data back to sender
         if (sendto(sfd, buffer, bytes_read, 0,
                   (struct sockaddr *)&peer_addr, peer_addr_len) == SOCKET_ERROR) {
             fprintf(stderr, "Error sending response: %d\n", WSAGetLastError());
+            metrics_add(METRIC_SEND_ERRORS, 1);
             break;
         }
+        metrics_add(METRIC_UDP_TX_PACKETS, 1);
+        metrics_add(METRIC_UDP_TX_BYTES, (uint64_t)bytes_read);
     }
+    limiter_destroy(&sessions);
+    pool_release(buffer);
+}
 
-    closesocket(sfd);
+#ifdef __linux__
+// Receives up to batch_size datagrams with one recvmmsg and sends every one
+// back from the same buffer to the address it came from with sendmmsg. The
+// message headers, buffers and address array are set up once and reused.
+static void echo_batched(SOCKET sfd) {
+    struct mmsghdr *msgs = calloc((size_t)batch_size, sizeof(*msgs));
+    struct iovec *iov = calloc((size_t)batch_size, sizeof(*iov));
+    struct sockaddr_storage *addrs = calloc((size_t)batch_size, sizeof(*addrs));
+    int buffers = 0; // Slots with a pool buffer; each echo goes out of the buffer it arrived in
+    while (iov != NULL && buffers < batch_size && (iov[buffers].iov_base = pool_alloc(BUFFER_SIZE)) != NULL)
+        buffers++;
+    struct session_table sessions;
+    if (msgs == NULL || iov == NULL || addrs == NULL || buffers < batch_size || limiter_init(&sessions) != 0) {
+        if (msgs == NULL || iov == NULL || addrs == NULL || buffers < batch_size) // limiter_init says why itself
+            fprintf(stderr, "Out of memory for a batch of %d datagrams\n", batch_size);
+        for (int i = 0; i < buffers; i++)
+            pool_release(iov[i].iov_base);
+        free(msgs);
+        free(iov);
+        free(addrs);
+        return;
+    }
+    for (int i = 0; i < batch_size; i++) {
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+    }
+
+    int used = batch_size;
+    while (1) {
+        for (int i = 0; i < used; i++) { // Undo what the last batch's receive and echo shortened
+            iov[i].iov_len = BUFFER_SIZE;
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+        used = 0;
+        int n = recvmmsg(sfd, msgs, (unsigned)batch_size, MSG_WAITFORONE, NULL); // Blocks for the first only
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error receiving data: %d\n", errno);
+            break;
+        }
+        used = n;
+        metrics_add(METRIC_WAKEUPS, 1); // udp_rx_packets / wakeups is the average batch
+        uint64_t bytes = 0;
+        for (int i = 0; i < n; i++) { // Echo in place: the sender's address is already in msg_name
+            msgs[i].msg_hdr.msg_iov->iov_len = msgs[i].msg_len;
+            bytes += msgs[i].msg_len;
+        }
+        metrics_add(METRIC_UDP_RX_PACKETS, (uint64_t)n);
+        metrics_add(METRIC_UDP_RX_BYTES, bytes);
+
+        if (limit.interval_ns != 0) { // Move what the buckets refuse behind the echoes, before any send work
+            uint64_t now = platform_now_ns();
+            int kept = 0;
+            for (int i = 0; i < n; i++) {
+                if (!limiter_admit(&sessions, msgs[i].msg_hdr.msg_name, msgs[i].msg_len, now))
+                    continue;
+                if (i != kept) { // Swap, so every header keeps its own buffer and address
+                    struct mmsghdr m = msgs[kept];
+                    msgs[kept] = msgs[i];
+                    msgs[i] = m;
+                }
+                kept++;
+            }
+            metrics_add(METRIC_DROPS, (uint64_t)(n - kept));
+            n = kept;
+        }
+
+        for (int sent = 0; sent < n;) {
+            int m = sendmmsg(sfd, msgs + sent, (unsigned)(n - sent), 0);
+            if (m < 0) {
+                if (errno == EINTR)
+                    continue;
+                metrics_add(METRIC_SEND_ERRORS, 1); // The first unsent datagram is refused; skip it
+                sent++;
+                continue;
+            }
+            bytes = 0;
+            for (int i = sent; i < sent + m; i++)
+                bytes += msgs[i].msg_len;
+            metrics_add(METRIC_UDP_TX_PACKETS, (uint64_t)m);
+            metrics_add(METRIC_UDP_TX_BYTES, bytes);
+            sent += m;
+        }
+    }
+
+    limiter_destroy(&sessions);
+    for (int i = 0; i < batch_size; i++)
+        pool_release(iov[i].iov_base);
+    free(msgs);
+    free(iov);
+    free(addrs);
+}
+#endif
+
+struct worker {
+    int index;
+    SOCKET sfd; // Shared by all workers where SO_REUSEPORT cannot spread senders
+    platform_thread thread;
+};
+
+static void run_worker(void *arg) {
+    struct worker *w = arg;
+    metrics_thread_init();
+    platform_pin_thread(w->index);
+#ifdef __linux__
+    echo_batched(w->sfd);
+#else
+    echo_single(w->sfd); // No recvmmsg: one datagram per call
+#endif
+    pool_thread_flush();
+#ifdef _WIN32
+    InterlockedDecrement(&workers_running);
+#else
+    __atomic_fetch_sub(&workers_running, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+// Prints echoed datagrams and bits per second once a second until every worker has stopped
+static void report_rates(void) {
+    uint64_t last_packets = metrics_sum(METRIC_UDP_TX_PACKETS);
+    uint64_t last_bytes = metrics_sum(METRIC_UDP_TX_BYTES);
+    while (1) {
+#ifdef _WIN32
+        Sleep(1000);
+        long running = InterlockedCompareExchange(&workers_running, 0, 0);
+#else
+        sleep(1);
+        long running = __atomic_load_n(&workers_running, __ATOMIC_RELAXED);
+#endif
+        if (running == 0)
+            break;
+        uint64_t packets = metrics_sum(METRIC_UDP_TX_PACKETS);
+        uint64_t bytes = metrics_sum(METRIC_UDP_TX_BYTES);
+        if (show_rate) {
+            printf("%llu datagrams/s echoed, %.1f Mbit/s\n", (unsigned long long)(packets - last_packets),
+                   (double)(bytes - last_bytes) * 8 / 1e6);
+            fflush(stdout);
+        }
+        last_packets = packets;
+        last_bytes = bytes;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    WSADATA wsaData;// Initialize Winsock
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) { // Initialize Winsock
+        fprintf(stderr, "WSAStartup failed\n");
+        return 1;
+    }
+
+    if (argc < 2) { // Check if port name is provided
+        fprintf(stderr, "Usage: %s <port_name> [-w workers] [-b batch_size] [-r 0|1] [-l packets_per_sec]"
+                        " [-k burst] [-s sessions] [-m unix:path|udp:port]\n", argv[0]);
+        WSACleanup();
+        return 1;
+    }
+
+    uint16_t port; // Set up UDP socket
+    if (convert_port_name(&port, argv[1]) != 0) { // Convert port name to port number
+        fprintf(stderr, "Invalid port name: %s\n", argv[1]);
+        WSACleanup();
+        return 1;
+    }
+
+    metrics_extra = pool_format;
+    if (parse_options(argc, argv) != 0 ||
+        (stats_socket != NULL && metrics_serve(stats_socket, "reply_udp") != 0)) { // Serve live metrics
+        WSACleanup();
+        return 1;
+    }
+
+    if (worker_count == 0) {
+        SOCKET sfd = open_socket(port, 0);
+        if (sfd == INVALID_SOCKET) {
+            WSACleanup();
+            return 1;
+        }
+        printf("UDP Echo Server listening on port %u...\n", port);
+        echo_single(sfd);
+        closesocket(sfd);
+        WSACleanup();
+        return 0;
+    }
+
+#ifdef __linux__
+    int socket_count = worker_count; // One SO_REUSEPORT socket per worker
+#else
+    int socket_count = 1; // Workers take turns receiving from one socket
+#endif
+    struct worker *workers = calloc((size_t)worker_count, sizeof(*workers));
+    if (workers == NULL) {
+        fprintf(stderr, "Out of memory for %d workers\n", worker_count);
+        WSACleanup();
+        return 1;
+    }
+    for (int i = 0; i < socket_count; i++) {
+        workers[i].sfd = open_socket(port, 1);
+        if (workers[i].sfd == INVALID_SOCKET) {
+            while (i-- > 0)
+                closesocket(workers[i].sfd);
+            free(workers);
+            WSACleanup();
+            return 1;
+        }
+    }
+
+    printf("UDP Echo Server listening on port %u with %d worker%s, batches of %d...\n", port, worker_count,
+           worker_count > 1 ? "s" : "", batch_size);
+    fflush(stdout);
+
+    workers_running = worker_count;
+    for (int i = 0; i < worker_count; i++) { // Every worker runs on its own thread and CPU
+        workers[i].index = i;
+        workers[i].sfd = workers[i % socket_count].sfd;
+        if (platform_thread_start(&workers[i].thread, run_worker, &workers[i]) != 0) {
+            fprintf(stderr, "Could not start worker %d\n", i);
+            return 1; // Returning from main also stops the workers already running
+        }
+    }
+    report_rates();
+
+    for (int i = 0; i < worker_count; i++)
+        platform_thread_join(workers[i].thread);
+    for (int i = 0; i < socket_count; i++)
+        closesocket(workers[i].sfd);
+    free(workers);
     WSACleanup();
-    return 0;
-}
\ No newline at end of file
+    return 1; // Workers only stop when their socket fails
+}
@@ -1,21 +1,59 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
 #include <stdint.h>
-#include <io.h>
-#include <fcntl.h>
+#include <time.h>
+#include <math.h>
 
-#pragma comment(lib, "ws2_32.lib")
+#include "platform.h"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+typedef int HANDLE;
+#endif
+
+#include "metrics.h"
+#include "latency.h"
 
 #define INPUT_BUFFER_SIZE 480
 #define RECEIVE_BUFFER_SIZE 65536  // 2^16 as per requirements
+#define MAX_DATAGRAM_SIZE 65507 // Largest UDP payload over IPv4
+#define LINGER_MS 1000 // After stdin ends, how long to wait for the echo of the empty packet
+#define PROBE_HEADER_SIZE 20 // Magic, run ID, sequence number, send time
+#define PROBE_MAGIC "RTTP"
+#define DEFAULT_PROBE_SIZE 64
+#define DEFAULT_PROBE_INTERVAL_MS 100
+#define MAX_PROBES 100000000
+#define PROBE_VERBOSE_MS 100 // At this interval or longer, every echo gets its own line, ping-style
+#define HISTOGRAM_WIDTH 50 // Characters in the longest histogram bar
+#define LOAD_HEADER_SIZE 32 // Magic, run ID, client, sequence number, due time, send time
+#define LOAD_MAGIC "LOAD"
+#define MAX_LOAD_THREADS 64
+#define MAX_CLIENTS 1000000
+#define MAX_SIZES 64
+#define LOAD_BATCH 64 // Arrivals sent at most before the sockets are checked again
+#define LOAD_EVENTS 256
+#define LOAD_SOCKET_BUFFER_BYTES (4 << 20) // For the one socket of a thread in flow ID mode
 
+static const char *stats_socket = NULL;
+static long probe_count = 0; // 0: interactive; otherwise send this many probes and report
+static double probe_interval_ms = DEFAULT_PROBE_INTERVAL_MS;
+static int probe_size = DEFAULT_PROBE_SIZE;
+static long probe_wait_ms = LINGER_MS; // After the last probe, how long to wait for its echo
+static long load_clients = 0; // 0: no load; otherwise virtual clients of the load generator
+static int load_threads = 1;
+static double load_rate = 0; // Datagrams per second from all clients together
+static int load_poisson = 1; // 0: constant-rate arrivals
+static double load_seconds = 10;
+static int load_flow_ids = 0; // 1: a thread's clients share its socket, told apart by their ID
+static struct { int size; double cumulative; } load_sizes[MAX_SIZES] = { { DEFAULT_PROBE_SIZE, 1.0 } };
+static int load_size_count = 1;
+
+#ifdef _WIN32
 int better_read(HANDLE fd, char *buf, size_t count) {// Better read implementation for handling partial reads
     DWORD bytes_read;
     if (ReadFile(fd, buf, (DWORD)count, &bytes_read, NULL) == 0) { // Read data from file
-        return -1;
+        return GetLastError() == ERROR_BROKEN_PIPE ? 0 : -1; // A closed pipe is the end of input
     }
     return bytes_read;
 }
@@ -26,7 +64,880 @@ int better_write(HANDLE fd, const char *buf, size_t count) {// Better write impl
         return -1;
     }
     return bytes_written; // Return number of bytes written
-} 
+}
+#else
+int better_read(HANDLE fd, char *buf, size_t count) {// Better read implementation for handling partial reads
+    ssize_t bytes_read;
+    do {
+        bytes_read = read(fd, buf, count);
+    } while (bytes_read < 0 && errno == EINTR);
+    return (int)bytes_read;
+}
+
+int better_write(HANDLE fd, const char *buf, size_t count) {// Better write implementation for handling partial writes
+    size_t written = 0;
+    while (written < count) {
+        ssize_t n = write(fd, buf + written, count - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        written += (size_t)n;
+    }
+    return (int)written;
+}
+#endif
+
+// Sends one datagram on the nonblocking socket, waiting for room in the
+// send buffer if it is full. Returns 0, or -1 after printing the error.
+static int send_datagram(SOCKET sfd, const char *data, int length) {
+    while (send(sfd, data, length, 0) == SOCKET_ERROR) {
+        int error = WSAGetLastError();
+        if (error != SOCKET_WOULD_BLOCK) {
+            fprintf(stderr, "Error sending data: %d\n", error);
+            metrics_add(METRIC_SEND_ERRORS, 1);
+            return -1;
+        }
+        platform_wait(sfd, PLATFORM_WRITABLE, -1);
+        metrics_add(METRIC_WAKEUPS, 1);
+    }
+    metrics_add(METRIC_UDP_TX_PACKETS, 1);
+    metrics_add(METRIC_UDP_TX_BYTES, (uint64_t)length);
+    return 0;
+}
+
+// Reads one chunk of stdin and sends it, or the empty packet at the end of
+// the input. Returns 1 at the end, 0 to go on, -1 on an error.
+static int forward_input(SOCKET sfd, HANDLE input, char *buffer) {
+    int bytes_read = better_read(input, buffer, INPUT_BUFFER_SIZE);
+    if (bytes_read < 0) { // Error reading from stdin
+        fprintf(stderr, "Error reading from stdin\n");
+        return -1;
+    }
+    if (bytes_read == 0) { // Check if EOF is detected
+        printf("EOF detected, sending empty packet...\n");
+        fflush(stdout);
+        return send_datagram(sfd, "", 0) == 0 ? 1 : -1; // Send the EOF packet
+    }
+    if (send_datagram(sfd, buffer, bytes_read) != 0) // Send the message
+        return -1;
+    printf("Sent %d bytes\n", bytes_read);
+    fflush(stdout);
+    return 0;
+}
+
+// Prints every datagram waiting on the nonblocking socket. Returns 1 once the
+// empty packet comes back, 0 when the socket is drained, -1 on an error.
+static int print_received(SOCKET sfd, char *buffer) {
+    while (1) {
+        int bytes_read = recv(sfd, buffer, RECEIVE_BUFFER_SIZE, 0);
+        if (bytes_read == SOCKET_ERROR) { // Error receiving data
+            if (WSAGetLastError() == SOCKET_WOULD_BLOCK)
+                return 0;
+            fprintf(stderr, "Error receiving data: %d\n", WSAGetLastError());
+            return -1;
+        }
+
+        metrics_add(METRIC_UDP_RX_PACKETS, 1);
+        metrics_add(METRIC_UDP_RX_BYTES, (uint64_t)bytes_read);
+        if (bytes_read == 0) { // Check if EOF is detected
+            printf("Received empty packet, exiting...\n");
+            return 1;
+        }
+
+        printf("Received %d bytes: ", bytes_read); // Print received data
+        fflush(stdout); // Ahead of the raw write
+#ifdef _WIN32
+        HANDLE output = GetStdHandle(STD_OUTPUT_HANDLE);
+#else
+        HANDLE output = STDOUT_FILENO;
+#endif
+        if (better_write(output, buffer, (size_t)bytes_read) != bytes_read) { // Write received data to stdout
+            fprintf(stderr, "Error writing to stdout\n");
+            return -1;
+        }
+        printf("\n");  // Add newline after each received message
+        fflush(stdout);
+    }
+}
+
+#ifdef _WIN32
+struct input_thread_args {
+    SOCKET sfd;
+    HANDLE input;
+    int status; // What forward_input returned last
+};
+
+static DWORD WINAPI input_thread(LPVOID arg) { // Stdin is not waitable when it is a pipe: block on it here
+    struct input_thread_args *a = arg;
+    static char buffer[INPUT_BUFFER_SIZE];
+    while ((a->status = forward_input(a->sfd, a->input, buffer)) == 0)
+        ;
+    return 0;
+}
+#endif
+
+// Sends stdin and prints what comes back, waking only when either has
+// something: poll on both descriptors, or on Windows, where stdin cannot be
+// polled, a thread blocked on stdin and a wait on it and the socket's event.
+// Once stdin ends, waits up to LINGER_MS for the echo of the empty packet.
+static int run_interactive(SOCKET sfd, HANDLE input) {
+    static char receive_buffer[RECEIVE_BUFFER_SIZE];
+    uint64_t linger_until = 0; // Set once stdin has ended
+    int status = 0;
+
+#ifdef _WIN32
+    WSAEVENT readable = WSACreateEvent();
+    struct input_thread_args args = { sfd, input, 0 };
+    HANDLE reader = NULL;
+    if (readable == WSA_INVALID_EVENT || WSAEventSelect(sfd, readable, FD_READ) == SOCKET_ERROR ||
+        (reader = CreateThread(NULL, 0, input_thread, &args, 0, NULL)) == NULL) {
+        fprintf(stderr, "Could not wait for the socket and stdin: %d\n", WSAGetLastError());
+        if (readable != WSA_INVALID_EVENT)
+            WSACloseEvent(readable);
+        return 1;
+    }
+    HANDLE handles[2] = { readable, reader };
+    while (status == 0) {
+        DWORD timeout = INFINITE;
+        if (linger_until > 0) {
+            uint64_t now = platform_now_ns();
+            if (now >= linger_until)
+                break;
+            timeout = (DWORD)((linger_until - now + 999999) / 1000000);
+        }
+        DWORD woken = WaitForMultipleObjects(linger_until > 0 ? 1 : 2, handles, FALSE, timeout);
+        metrics_add(METRIC_WAKEUPS, 1);
+        if (woken == WAIT_OBJECT_0) {
+            WSAResetEvent(readable); // Before draining: anything later sets it again
+            int received = print_received(sfd, receive_buffer);
+            if (received != 0)
+                status = received < 0 ? 1 : 2;
+        } else if (woken == WAIT_OBJECT_0 + 1) { // The input thread is done
+            if (args.status < 0)
+                status = 1;
+            linger_until = platform_now_ns() + (uint64_t)LINGER_MS * 1000000;
+        } else if (woken == WAIT_FAILED) {
+            fprintf(stderr, "Wait failed: %lu\n", GetLastError());
+            status = 1;
+        }
+    }
+    CloseHandle(reader); // If it is still blocked on stdin, exiting ends it
+    WSACloseEvent(readable);
+#else
+    static char input_buffer[INPUT_BUFFER_SIZE];
+    struct pollfd fds[2] = { { sfd, POLLIN, 0 }, { input, POLLIN, 0 } };
+    while (status == 0) {
+        int timeout = -1;
+        if (linger_until > 0) {
+            uint64_t now = platform_now_ns();
+            if (now >= linger_until)
+                break;
+            timeout = (int)((linger_until - now + 999999) / 1000000);
+        }
+        int ready = poll(fds, linger_until > 0 ? 1 : 2, timeout);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "poll error: %d\n", errno);
+            status = 1;
+            break;
+        }
+        metrics_add(METRIC_WAKEUPS, 1);
+        if (fds[0].revents != 0) {
+            int received = print_received(sfd, receive_buffer);
+            if (received != 0)
+                status = received < 0 ? 1 : 2;
+        }
+        if (status == 0 && linger_until == 0 && fds[1].revents != 0) {
+            int forwarded = forward_input(sfd, input, input_buffer);
+            if (forwarded < 0)
+                status = 1;
+            else if (forwarded > 0)
+                linger_until = platform_now_ns() + (uint64_t)LINGER_MS * 1000000;
+        }
+    }
+#endif
+    return status == 1 ? 1 : 0;
+}
+
+// Probe mode (-p): every interval a datagram goes out with a sequence number
+// and its send time; the echo server sends it back unchanged, and the time
+// it took comes from one clock. The header, big-endian, is the magic "RTTP",
+// a random run ID so echoes of an earlier run are ignored, the sequence
+// number and the send time in ns. The rest of the datagram is zeros.
+//
+// RTTs go into a latency.h histogram, the one the tunnels use for their latency
+// instrumentation.
+struct probe_stats {
+    uint64_t sent, received, duplicates, reordered, foreign;
+    uint64_t rtt_min_ns, rtt_max_ns;
+    double rtt_sum_ns, rtt_square_sum; // In ns and ns^2, for the mean and standard deviation
+    double jitter_ns; // RFC 3550 interarrival jitter: |RTT change| between consecutive echoes, smoothed by 1/16
+    uint64_t last_rtt_ns;
+    uint32_t highest_seq;
+    uint8_t *seen; // One byte per probe: echoed yet
+    uint64_t counts[LATENCY_BUCKETS];
+};
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    for (int i = 3; i >= 0; i--, v >>= 8)
+        p[i] = (uint8_t)v;
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Records every echo waiting on the nonblocking socket. Returns 0 when the
+// socket is drained, -1 on an error.
+static int probe_receive(SOCKET sfd, struct probe_stats *st, uint32_t run_id, uint8_t *buffer) {
+    while (1) {
+        int length = recv(sfd, (char *)buffer, RECEIVE_BUFFER_SIZE, 0);
+        uint64_t now = platform_now_ns();
+        if (length == SOCKET_ERROR) {
+            int error = WSAGetLastError();
+            if (error == SOCKET_WOULD_BLOCK)
+                return 0;
+            if (error == SOCKET_REFUSED) // Nobody listening yet; the probe counts as lost
+                continue;
+            fprintf(stderr, "Error receiving data: %d\n", error);
+            return -1;
+        }
+        metrics_add(METRIC_UDP_RX_PACKETS, 1);
+        metrics_add(METRIC_UDP_RX_BYTES, (uint64_t)length);
+
+        uint32_t seq = length >= PROBE_HEADER_SIZE ? get_be32(buffer + 8) : 0;
+        if (length < PROBE_HEADER_SIZE || memcmp(buffer, PROBE_MAGIC, 4) != 0 || get_be32(buffer + 4) != run_id ||
+            seq >= st->sent) {
+            st->foreign++;
+            continue;
+        }
+        if (st->seen[seq]) {
+            st->duplicates++;
+            continue;
+        }
+        st->seen[seq] = 1;
+        uint64_t sent_ns = ((uint64_t)get_be32(buffer + 12) << 32) | get_be32(buffer + 16);
+        uint64_t rtt = now > sent_ns ? now - sent_ns : 0;
+        if (st->received > 0) {
+            double change = rtt > st->last_rtt_ns ? (double)(rtt - st->last_rtt_ns) : (double)(st->last_rtt_ns - rtt);
+            st->jitter_ns += (change - st->jitter_ns) / 16;
+            if (seq < st->highest_seq)
+                st->reordered++;
+        }
+        if (st->received == 0 || seq > st->highest_seq)
+            st->highest_seq = seq;
+        if (st->received == 0 || rtt < st->rtt_min_ns)
+            st->rtt_min_ns = rtt;
+        if (rtt > st->rtt_max_ns)
+            st->rtt_max_ns = rtt;
+        st->rtt_sum_ns += (double)rtt;
+        st->rtt_square_sum += (double)rtt * (double)rtt;
+        st->last_rtt_ns = rtt;
+        st->received++;
+        st->counts[latency_bucket(rtt)]++;
+        if (probe_interval_ms >= PROBE_VERBOSE_MS)
+            printf("%d bytes: seq=%u rtt=%.1f us\n", length, seq, (double)rtt / 1000);
+    }
+}
+
+// One row per power of two of microseconds, from the first to the last one used
+static void histogram_print(const char *name, const uint64_t *counts, uint64_t total) {
+    uint64_t rows[LATENCY_MAX_BITS] = { 0 };
+    int first = -1, last = -1;
+    uint64_t widest = 0;
+    for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+        if (counts[i] == 0)
+            continue;
+        uint64_t us = (i == 0 ? 0 : latency_bucket_top(i - 1) + 1) / 1000; // By the bucket's lowest value
+        int row = 0;
+        while (row < LATENCY_MAX_BITS - 1 && (us >> row) > 1)
+            row++;
+        rows[row] += counts[i];
+        if (first < 0 || row < first)
+            first = row;
+        if (row > last)
+            last = row;
+    }
+    if (first < 0)
+        return;
+    for (int r = first; r <= last; r++)
+        if (rows[r] > widest)
+            widest = rows[r];
+    printf("%s histogram:\n", name);
+    for (int r = first; r <= last; r++) {
+        char bar[HISTOGRAM_WIDTH + 1];
+        int width = (int)((rows[r] * HISTOGRAM_WIDTH + widest - 1) / widest);
+        memset(bar, '#', (size_t)width);
+        bar[width] = '\0';
+        if (r == 0)
+            printf("  %8s < %-8u us %9llu %5.1f%% %s\n", "", 2u, (unsigned long long)rows[r],
+                   100.0 * (double)rows[r] / (double)total, bar);
+        else
+            printf("  %8llu - %-8llu us %9llu %5.1f%% %s\n", 1ULL << r, 1ULL << (r + 1), (unsigned long long)rows[r],
+                   100.0 * (double)rows[r] / (double)total, bar);
+    }
+}
+
+static void probe_report(const struct probe_stats *st, double seconds) {
+    uint64_t lost = st->sent - st->received;
+    printf("--- %ld probes of %d bytes every %.3f ms ---\n", probe_count, probe_size, probe_interval_ms);
+    printf("%llu sent, %llu received, %.2f%% loss, %llu duplicates, %llu reordered, %llu foreign in %.1f s\n",
+           (unsigned long long)st->sent, (unsigned long long)st->received,
+           st->sent > 0 ? 100.0 * (double)lost / (double)st->sent : 0.0, (unsigned long long)st->duplicates,
+           (unsigned long long)st->reordered, (unsigned long long)st->foreign, seconds);
+    if (st->received == 0)
+        return;
+
+    double mean = st->rtt_sum_ns / (double)st->received;
+    double variance = st->rtt_square_sum / (double)st->received - mean * mean;
+    static const unsigned permille[] = { 500, 900, 990, 999 };
+    double value_us[4];
+    latency_quantiles(st->counts, st->received, permille, 4, value_us);
+    printf("RTT min %.1f us, mean %.1f us, max %.1f us, stddev %.1f us, jitter %.1f us\n",
+           (double)st->rtt_min_ns / 1000, mean / 1000, (double)st->rtt_max_ns / 1000,
+           variance > 0 ? sqrt(variance) / 1000 : 0.0, st->jitter_ns / 1000);
+    printf("RTT p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us\n", value_us[0], value_us[1], value_us[2],
+           value_us[3]);
+    histogram_print("RTT", st->counts, st->received);
+}
+
+// Sends probe_count probes every probe_interval_ms on a fixed schedule and
+// records their echoes, then waits up to probe_wait_ms for stragglers. The
+// only wait is on the socket, with the time until the next probe is
+// due as its timeout, so echoes are timed as they arrive.
+static int run_probes(SOCKET sfd) {
+    static uint8_t buffer[RECEIVE_BUFFER_SIZE];
+    static struct probe_stats st;
+    uint8_t *probe = calloc(1, (size_t)probe_size);
+    st.seen = calloc(1, (size_t)probe_count);
+    if (probe == NULL || st.seen == NULL) {
+        fprintf(stderr, "Out of memory for %ld probes\n", probe_count);
+        free(probe);
+        free(st.seen);
+        return 1;
+    }
+    uint64_t start = platform_now_ns();
+    uint32_t run_id = (uint32_t)(start ^ (start >> 32) ^ (uint64_t)time(NULL) * 2654435761u);
+    memcpy(probe, PROBE_MAGIC, 4);
+    put_be32(probe + 4, run_id);
+    double interval_ns = probe_interval_ms * 1e6;
+    uint64_t end = 0; // Set once the last probe is out
+    int status = 0;
+
+    printf("Probing with %d-byte datagrams every %.3f ms\n", probe_size, probe_interval_ms);
+    fflush(stdout);
+    while (status == 0) {
+        uint64_t now = platform_now_ns();
+        while (st.sent < (uint64_t)probe_count && now >= start + (uint64_t)((double)st.sent * interval_ns)) {
+            put_be32(probe + 8, (uint32_t)st.sent);
+            put_be32(probe + 12, (uint32_t)(now >> 32));
+            put_be32(probe + 16, (uint32_t)now);
+            if (send_datagram(sfd, (const char *)probe, probe_size) != 0) {
+                status = 1;
+                break;
+            }
+            st.sent++;
+            now = platform_now_ns();
+        }
+        if (status != 0)
+            break;
+        if (end == 0 && st.sent == (uint64_t)probe_count)
+            end = now + (uint64_t)probe_wait_ms * 1000000;
+        if (end > 0 && (now >= end || st.received == st.sent))
+            break;
+
+        uint64_t due = end > 0 ? end : start + (uint64_t)((double)st.sent * interval_ns);
+        int ready = platform_wait(sfd, PLATFORM_READABLE, (int64_t)(due > now ? due - now : 0));
+        if (ready < 0) {
+#ifndef _WIN32
+            if (errno == EINTR)
+                continue;
+#endif
+            fprintf(stderr, "Error waiting for echoes: %d\n", WSAGetLastError());
+            status = 1;
+            break;
+        }
+        metrics_add(METRIC_WAKEUPS, 1);
+        if (ready > 0 && probe_receive(sfd, &st, run_id, buffer) != 0)
+            status = 1;
+    }
+    probe_report(&st, (double)(platform_now_ns() - start) / 1e9);
+    free(probe);
+    free(st.seen);
+    return status;
+}
+
+// Load generator (-L): load_clients virtual clients spread over load_threads
+// threads offer load_rate datagrams per second in total for load_seconds.
+// Arrivals are open-loop: they follow a schedule fixed in advance, Poisson
+// or evenly spaced, and never wait for echoes. Each client has its own
+// socket and so its own source port, or with -k flow they share their
+// thread's socket and carry their ID. Each datagram carries its due time on
+// the schedule and the time it actually went out. An echo is timed from the
+// due time, so a generator or server that falls behind shows up as latency
+// instead of silently sending less (no coordinated omission). It is also
+// timed from the send, which is what a closed-loop client would report.
+struct load_thread {
+    int index;
+    long first_client, clients;
+    SOCKET *sockets; // One per client, or with flow IDs one for all
+    int socket_count;
+    uint64_t rng;
+    uint8_t *seen; // One bit per sequence number: echoed yet
+    uint64_t seen_bits;
+    uint64_t sent, unsent, received, duplicates, foreign, bytes;
+    uint64_t finished_ns; // When the last echo came or the wait ran out
+    uint64_t latency[LATENCY_BUCKETS]; // Echo arrival since the due time
+    uint64_t service[LATENCY_BUCKETS]; // Echo arrival since the send
+    uint64_t lag[LATENCY_BUCKETS]; // Send since the due time
+    int failed;
+    platform_thread thread;
+};
+
+static struct sockaddr_storage load_address;
+static socklen_t load_address_length;
+static uint64_t load_start_ns;
+static uint32_t load_run_id;
+static volatile long load_threads_running;
+
+static uint64_t load_random(struct load_thread *t) { // xorshift64*
+    t->rng ^= t->rng >> 12;
+    t->rng ^= t->rng << 25;
+    t->rng ^= t->rng >> 27;
+    return t->rng * 0x2545f4914f6cdd1dULL;
+}
+
+static double load_uniform(struct load_thread *t) { // In (0, 1]
+    return ((double)(load_random(t) >> 11) + 1) / 9007199254740992.0;
+}
+
+static int load_size(struct load_thread *t) {
+    double u = load_uniform(t);
+    for (int i = 0; i < load_size_count - 1; i++)
+        if (u <= load_sizes[i].cumulative)
+            return load_sizes[i].size;
+    return load_sizes[load_size_count - 1].size;
+}
+
+static SOCKET load_socket(void) { // Connected to the server, nonblocking
+    SOCKET sfd = socket(load_address.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (sfd == INVALID_SOCKET)
+        return INVALID_SOCKET;
+    if (connect(sfd, (struct sockaddr *)&load_address, load_address_length) == SOCKET_ERROR ||
+        platform_set_nonblocking(sfd, 1) != 0) {
+        closesocket(sfd);
+        return INVALID_SOCKET;
+    }
+    return sfd;
+}
+
+static void load_put_be64(uint8_t *p, uint64_t v) {
+    put_be32(p, (uint32_t)(v >> 32));
+    put_be32(p + 4, (uint32_t)v);
+}
+
+static uint64_t load_get_be64(const uint8_t *p) {
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+// Sends the next arrival, due at due_ns, from a client picked at random
+// (Poisson: the sum of the clients' Poisson streams) or in turn (constant).
+static void load_send(struct load_thread *t, uint8_t *datagram, uint64_t due_ns) {
+    long client = load_poisson ? (long)(load_random(t) % (uint64_t)t->clients) : (long)(t->sent % (uint64_t)t->clients);
+    SOCKET sfd = t->sockets[load_flow_ids ? 0 : client];
+    int size = load_size(t);
+    uint64_t seq = t->sent + t->unsent;
+    put_be32(datagram + 8, (uint32_t)(t->first_client + client));
+    put_be32(datagram + 12, (uint32_t)seq);
+    load_put_be64(datagram + 16, due_ns);
+    uint64_t now = platform_now_ns();
+    load_put_be64(datagram + 24, now);
+    if (send(sfd, (const char *)datagram, size, 0) == SOCKET_ERROR) { // A full send buffer or a bounce: not sent
+        t->unsent++;
+        metrics_add(WSAGetLastError() == SOCKET_WOULD_BLOCK ? METRIC_DROPS : METRIC_SEND_ERRORS, 1);
+        return;
+    }
+    t->sent++;
+    t->bytes += (uint64_t)size;
+    t->lag[latency_bucket(now > due_ns ? now - due_ns : 0)]++;
+    metrics_add(METRIC_UDP_TX_PACKETS, 1);
+    metrics_add(METRIC_UDP_TX_BYTES, (uint64_t)size);
+}
+
+static void load_receive(struct load_thread *t, SOCKET sfd, uint8_t *buffer) {
+    while (1) {
+        int length = recv(sfd, (char *)buffer, RECEIVE_BUFFER_SIZE, 0);
+        if (length == SOCKET_ERROR) { // Drained, or a bounce from a closed port: the datagram counts as lost
+            if (WSAGetLastError() == SOCKET_REFUSED)
+                continue;
+            return;
+        }
+        uint64_t now = platform_now_ns();
+        metrics_add(METRIC_UDP_RX_PACKETS, 1);
+        metrics_add(METRIC_UDP_RX_BYTES, (uint64_t)length);
+        uint32_t client = length >= LOAD_HEADER_SIZE ? get_be32(buffer + 8) : 0;
+        uint64_t seq = length >= LOAD_HEADER_SIZE ? get_be32(buffer + 12) : 0;
+        if (length < LOAD_HEADER_SIZE || memcmp(buffer, LOAD_MAGIC, 4) != 0 || get_be32(buffer + 4) != load_run_id ||
+            client < (uint32_t)t->first_client || client >= (uint32_t)(t->first_client + t->clients) ||
+            seq >= t->seen_bits) {
+            t->foreign++;
+            continue;
+        }
+        if (t->seen[seq / 8] & (1u << (seq % 8))) {
+            t->duplicates++;
+            continue;
+        }
+        t->seen[seq / 8] |= (uint8_t)(1u << (seq % 8));
+        uint64_t due = load_get_be64(buffer + 16), sent = load_get_be64(buffer + 24);
+        t->latency[latency_bucket(now > due ? now - due : 0)]++;
+        t->service[latency_bucket(now > sent ? now - sent : 0)]++;
+        t->received++;
+    }
+}
+
+// Runs one thread's schedule, then waits up to probe_wait_ms for the last
+// echoes. Sleeps in the poller whenever nothing is due, until a socket is
+// readable or the next arrival falls due.
+static void load_run(struct load_thread *t) {
+    uint8_t *datagram = calloc(2, RECEIVE_BUFFER_SIZE); // The datagram to send, then the receive buffer
+    uint8_t *buffer = datagram + RECEIVE_BUFFER_SIZE;
+    double rate = load_rate / load_threads;
+    double gap_ns = 1e9 / rate;
+    uint64_t end = load_start_ns + (uint64_t)(load_seconds * 1e9);
+    uint64_t linger_until = 0;
+    double due = (double)load_start_ns + (load_poisson ? -log(load_uniform(t)) * gap_ns : gap_ns * t->index / load_threads);
+    if (datagram == NULL) {
+        t->failed = 1;
+        return;
+    }
+    memcpy(datagram, LOAD_MAGIC, 4);
+    put_be32(datagram + 4, load_run_id);
+
+    struct platform_poller poller;
+    struct platform_event events[LOAD_EVENTS];
+    if (platform_poller_init(&poller) != 0) {
+        t->failed = 1;
+        free(datagram);
+        return;
+    }
+    for (int i = 0; i < t->socket_count; i++) {
+        if (platform_poller_add(&poller, t->sockets[i], PLATFORM_READABLE, (uint64_t)i) != 0) {
+            t->failed = 1;
+            break;
+        }
+    }
+
+    while (!t->failed) {
+        uint64_t now = platform_now_ns();
+        int sent = 0;
+        while (due <= (double)now && due < (double)end && sent < LOAD_BATCH) {
+            load_send(t, datagram, (uint64_t)due);
+            due += load_poisson ? -log(load_uniform(t)) * gap_ns : gap_ns;
+            sent++;
+        }
+        if (t->sent + t->unsent >= t->seen_bits) { // Poisson ran long: make room for more sequence numbers
+            uint8_t *grown = realloc(t->seen, (size_t)(t->seen_bits / 4));
+            if (grown == NULL) {
+                t->failed = 1;
+                break;
+            }
+            memset(grown + t->seen_bits / 8, 0, (size_t)(t->seen_bits / 8));
+            t->seen = grown;
+            t->seen_bits *= 2;
+        }
+        if (linger_until == 0 && due >= (double)end)
+            linger_until = (now > end ? now : end) + (uint64_t)probe_wait_ms * 1000000;
+        if (linger_until > 0 && (now >= linger_until || t->received == t->sent))
+            break;
+
+        uint64_t wake = linger_until > 0 ? linger_until : (uint64_t)due;
+        if (sent == LOAD_BATCH || wake <= now)
+            wake = now; // Behind schedule: only look at the sockets
+        int n = platform_poller_wait(&poller, events, LOAD_EVENTS, (int64_t)(wake - now));
+        metrics_add(METRIC_WAKEUPS, 1);
+        for (int i = 0; i < n; i++)
+            load_receive(t, t->sockets[events[i].token], buffer);
+    }
+    t->finished_ns = platform_now_ns();
+    platform_poller_destroy(&poller);
+    free(datagram);
+}
+
+static void load_thread_main(void *arg) {
+    metrics_thread_init();
+    load_run(arg);
+#ifdef _WIN32
+    InterlockedDecrement(&load_threads_running);
+#else
+    __atomic_fetch_sub(&load_threads_running, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+// Reads -z: one size, size:weight pairs separated by commas, or @file with a
+// "size weight" pair per line (# starts a comment). Sizes below the header
+// are raised to it.
+static int parse_sizes(const char *spec) {
+    char text[4096];
+    if (spec[0] == '@') {
+        FILE *f = fopen(spec + 1, "r");
+        if (f == NULL) {
+            fprintf(stderr, "Could not open size distribution %s\n", spec + 1);
+            return -1;
+        }
+        size_t used = 0;
+        char line[256];
+        while (fgets(line, sizeof(line), f) != NULL) {
+            char *comment = strchr(line, '#');
+            if (comment != NULL)
+                *comment = '\0';
+            int size;
+            double weight;
+            int fields = sscanf(line, "%d %lf", &size, &weight);
+            if (fields <= 0)
+                continue;
+            used += (size_t)snprintf(text + used, sizeof(text) - used, "%s%d:%g", used > 0 ? "," : "", size,
+                                     fields == 2 ? weight : 1.0);
+            if (used >= sizeof(text)) {
+                fclose(f);
+                fprintf(stderr, "Too many sizes in %s\n", spec + 1);
+                return -1;
+            }
+        }
+        fclose(f);
+        spec = text;
+    }
+    double total = 0;
+    int count = 0;
+    for (const char *p = spec; *p != '\0' && count < MAX_SIZES;) {
+        char *end;
+        double size = strtod(p, &end), weight = 1;
+        if (end == p || size < 0 || size > MAX_DATAGRAM_SIZE)
+            return -1;
+        p = end;
+        if (*p == ':') {
+            weight = strtod(p + 1, &end);
+            if (end == p + 1 || weight <= 0)
+                return -1;
+            p = end;
+        }
+        if (*p == ',')
+            p++;
+        else if (*p != '\0')
+            return -1;
+        load_sizes[count].size = size < LOAD_HEADER_SIZE ? LOAD_HEADER_SIZE : (int)size;
+        total += weight;
+        load_sizes[count++].cumulative = total;
+    }
+    if (count == 0)
+        return -1;
+    for (int i = 0; i < count; i++)
+        load_sizes[i].cumulative /= total;
+    load_size_count = count;
+    return 0;
+}
+
+static void load_report(struct load_thread *threads) {
+    static uint64_t latency[LATENCY_BUCKETS], service[LATENCY_BUCKETS], lag[LATENCY_BUCKETS];
+    uint64_t sent = 0, unsent = 0, received = 0, duplicates = 0, foreign = 0, bytes = 0, finished = load_start_ns;
+    for (int i = 0; i < load_threads; i++) {
+        struct load_thread *t = &threads[i];
+        sent += t->sent;
+        unsent += t->unsent;
+        received += t->received;
+        duplicates += t->duplicates;
+        foreign += t->foreign;
+        bytes += t->bytes;
+        if (t->finished_ns > finished)
+            finished = t->finished_ns;
+        for (unsigned b = 0; b < LATENCY_BUCKETS; b++) {
+            latency[b] += t->latency[b];
+            service[b] += t->service[b];
+            lag[b] += t->lag[b];
+        }
+    }
+    printf("--- %ld %s on %d thread%s, %s arrivals at %.0f/s for %.1f s ---\n", load_clients,
+           load_flow_ids ? "flow IDs" : "source ports", load_threads, load_threads > 1 ? "s" : "",
+           load_poisson ? "Poisson" : "constant", load_rate, load_seconds);
+    printf("%llu sent (%.0f/s, %.1f Mbit/s), %llu not sent, %llu echoed, %.3f%% loss, %llu duplicates, %llu foreign"
+           " in %.1f s\n", (unsigned long long)sent, (double)sent / load_seconds, (double)bytes * 8 / load_seconds / 1e6,
+           (unsigned long long)unsent, (unsigned long long)received,
+           sent > 0 ? 100.0 * (double)(sent - received) / (double)sent : 0.0, (unsigned long long)duplicates,
+           (unsigned long long)foreign, (double)(finished - load_start_ns) / 1e9);
+    static const unsigned permille[] = { 500, 900, 990, 999, 1000 };
+    double value_us[5];
+    if (sent > 0) {
+        latency_quantiles(lag, sent, permille, 5, value_us);
+        printf("Send lag behind schedule: p50 %.1f us, p99 %.1f us, max %.1f us\n", value_us[0], value_us[2],
+               value_us[4]);
+    }
+    if (received == 0)
+        return;
+    latency_quantiles(latency, received, permille, 5, value_us);
+    printf("Latency from schedule: p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+           value_us[0], value_us[1], value_us[2], value_us[3], value_us[4]);
+    latency_quantiles(service, received, permille, 5, value_us);
+    printf("Latency from send:     p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+           value_us[0], value_us[1], value_us[2], value_us[3], value_us[4]);
+    histogram_print("Latency from schedule", latency, received);
+}
+
+// Opens every client's socket, starts the threads, prints the send and echo
+// rates once a second while they run, and reports.
+static int run_load(void) {
+#ifndef _WIN32
+    struct rlimit files; // A socket per client: raise the open file limit as far as allowed
+    if (!load_flow_ids && getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+#endif
+    struct load_thread *threads = calloc((size_t)load_threads, sizeof(*threads));
+    if (threads == NULL) {
+        fprintf(stderr, "Out of memory for %d load threads\n", load_threads);
+        return 1;
+    }
+    uint64_t seed = platform_now_ns() ^ (uint64_t)time(NULL) * 0x9e3779b97f4a7c15ULL;
+    load_run_id = (uint32_t)(seed ^ (seed >> 32));
+    int status = 0;
+    for (int i = 0; i < load_threads && status == 0; i++) {
+        struct load_thread *t = &threads[i];
+        t->index = i;
+        t->first_client = load_clients * i / load_threads;
+        t->clients = load_clients * (i + 1) / load_threads - t->first_client;
+        t->socket_count = load_flow_ids ? 1 : (int)t->clients;
+        t->rng = seed + 0x9e3779b97f4a7c15ULL * (uint64_t)(i + 1);
+        t->seen_bits = ((uint64_t)(load_rate / load_threads * load_seconds * 1.25) + 1024 + 7) / 8 * 8;
+        t->sockets = calloc((size_t)t->socket_count, sizeof(*t->sockets));
+        t->seen = calloc(1, (size_t)(t->seen_bits / 8));
+        if (t->sockets == NULL || t->seen == NULL) {
+            fprintf(stderr, "Out of memory for %ld clients\n", load_clients);
+            status = 1;
+            break;
+        }
+        for (int c = 0; c < t->socket_count; c++) {
+            t->sockets[c] = load_socket();
+            if (t->sockets[c] == INVALID_SOCKET) {
+                fprintf(stderr, "Could not open the socket of client %ld: %d\n", t->first_client + c, WSAGetLastError());
+                t->socket_count = c;
+                status = 1;
+                break;
+            }
+        }
+        if (status == 0 && load_flow_ids) {
+            int bytes = LOAD_SOCKET_BUFFER_BYTES; // Best effort: the kernel caps it
+            setsockopt(t->sockets[0], SOL_SOCKET, SO_RCVBUF, (const char *)&bytes, sizeof(bytes));
+            setsockopt(t->sockets[0], SOL_SOCKET, SO_SNDBUF, (const char *)&bytes, sizeof(bytes));
+        }
+    }
+
+    int started = 0;
+    if (status == 0) {
+        printf("Offering %.0f datagrams/s from %ld clients on %d thread%s for %.1f s\n", load_rate, load_clients,
+               load_threads, load_threads > 1 ? "s" : "", load_seconds);
+        fflush(stdout);
+        load_start_ns = platform_now_ns() + 10000000; // Every thread starts on the same schedule
+        load_threads_running = load_threads;
+        for (; started < load_threads; started++) {
+            if (platform_thread_start(&threads[started].thread, load_thread_main, &threads[started]) != 0) {
+                fprintf(stderr, "Could not start load thread %d\n", started);
+                status = 1;
+#ifdef _WIN32
+                InterlockedAdd(&load_threads_running, started - load_threads);
+#else
+                __atomic_fetch_sub(&load_threads_running, load_threads - started, __ATOMIC_RELAXED);
+#endif
+                break;
+            }
+        }
+    }
+
+    if (started > 0) {
+        uint64_t last_sent = 0, last_received = 0;
+        for (int second = 1;; second++) {
+#ifdef _WIN32
+            Sleep(1000);
+            long running = InterlockedCompareExchange(&load_threads_running, 0, 0);
+#else
+            sleep(1);
+            long running = __atomic_load_n(&load_threads_running, __ATOMIC_RELAXED);
+#endif
+            if (running == 0)
+                break;
+            uint64_t sent = metrics_sum(METRIC_UDP_TX_PACKETS), received = metrics_sum(METRIC_UDP_RX_PACKETS);
+            printf("%3d s: %llu sent/s, %llu echoed/s\n", second, (unsigned long long)(sent - last_sent),
+                   (unsigned long long)(received - last_received));
+            fflush(stdout);
+            last_sent = sent;
+            last_received = received;
+        }
+        for (int i = 0; i < started; i++) {
+            platform_thread_join(threads[i].thread);
+            if (threads[i].failed) {
+                fprintf(stderr, "Load thread %d failed\n", i);
+                status = 1;
+            }
+        }
+        load_report(threads);
+    }
+
+    for (int i = 0; i < load_threads; i++) {
+        for (int c = 0; c < threads[i].socket_count; c++)
+            closesocket(threads[i].sockets[c]);
+        free(threads[i].sockets);
+        free(threads[i].seen);
+    }
+    free(threads);
+    return status;
+}
+
+static int parse_options(int argc, char *argv[]) {
+    for (int i = 3; i < argc; i++) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[i]);
+            return -1;
+        }
+        double value = strtod(argv[i + 1], NULL);
+        if (strcmp(argv[i], "-m") == 0) {
+            stats_socket = argv[i + 1];
+        } else if (strcmp(argv[i], "-p") == 0 && value >= 1 && value <= MAX_PROBES) {
+            probe_count = (long)value;
+        } else if (strcmp(argv[i], "-i") == 0 && value >= 0.001 && value <= 3600000) {
+            probe_interval_ms = value;
+        } else if (strcmp(argv[i], "-s") == 0 && value >= PROBE_HEADER_SIZE && value <= MAX_DATAGRAM_SIZE) {
+            probe_size = (int)value;
+        } else if (strcmp(argv[i], "-w") == 0 && value >= 0 && value <= 3600000) {
+            probe_wait_ms = (long)value;
+        } else if (strcmp(argv[i], "-L") == 0 && value >= 1 && value <= MAX_CLIENTS) {
+            load_clients = (long)value;
+        } else if (strcmp(argv[i], "-T") == 0 && value >= 1 && value <= MAX_LOAD_THREADS) {
+            load_threads = (int)value;
+        } else if (strcmp(argv[i], "-R") == 0 && value > 0 && value <= 1e8) {
+            load_rate = value;
+        } else if (strcmp(argv[i], "-a") == 0 &&
+                   (strcmp(argv[i + 1], "poisson") == 0 || strcmp(argv[i + 1], "constant") == 0)) {
+            load_poisson = argv[i + 1][0] == 'p';
+        } else if (strcmp(argv[i], "-d") == 0 && value > 0 && value <= 86400) {
+            load_seconds = value;
+        } else if (strcmp(argv[i], "-z") == 0 && parse_sizes(argv[i + 1]) == 0) {
+        } else if (strcmp(argv[i], "-k") == 0 &&
+                   (strcmp(argv[i + 1], "port") == 0 || strcmp(argv[i + 1], "flow") == 0)) {
+            load_flow_ids = argv[i + 1][0] == 'f';
+        } else {
+            fprintf(stderr, "Invalid option: %s %s\n", argv[i], argv[i + 1]);
+            return -1;
+        }
+        i++;
+    }
+    if (load_clients > 0 && load_rate <= 0) {
+        fprintf(stderr, "The load generator needs a rate (-R)\n");
+        return -1;
+    }
+    if (load_clients > 0 && load_clients < load_threads)
+        load_threads = (int)load_clients; // A thread without clients would have nothing to send
+    return 0;
+}
 
 int main(int argc, char *argv[]) { 
     WSADATA wsaData;// Initialize Winsock
@@ -36,13 +947,23 @@ int main(int argc, char *argv[]) {
     }
 
     if (argc < 3) { // Check if port name is provided
-        fprintf(stderr, "Usage: %s <server_name> <port_name>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <server_name> <port_name> [-p probes] [-i interval_ms] [-s probe_size]"
+                        " [-w wait_ms] [-m unix:path|udp:port]\n"
+                        "       %s <server_name> <port_name> -L clients -R rate [-T threads] [-a poisson|constant]"
+                        " [-d seconds] [-z sizes] [-k port|flow] [-w wait_ms] [-m unix:path|udp:port]\n",
+                argv[0], argv[0]);
         WSACleanup();
         return 1;
     }
 
     char *server_name = argv[1];
     char *port_name = argv[2];
+
+    if (parse_options(argc, argv) != 0 ||
+        (stats_socket != NULL && metrics_serve(stats_socket, "send_receive_udp") != 0)) { // Serve live metrics
+        WSACleanup();
+        return 1;
+    }
     
     struct addrinfo hints;// Set up UDP socket
     struct addrinfo *result, *rp;
@@ -66,8 +987,11 @@ int main(int argc, char *argv[]) {
         if (sfd == INVALID_SOCKET) // Create socket
             continue;
 
-        if (connect(sfd, rp->ai_addr, (int)rp->ai_addrlen) != SOCKET_ERROR) 
+        if (connect(sfd, rp->ai_addr, (int)rp->ai_addrlen) != SOCKET_ERROR) {
+            memcpy(&load_address, rp->ai_addr, rp->ai_addrlen); // Each load client connects its own socket here
+            load_address_length = (socklen_t)rp->ai_addrlen;
             break;
+        }
 
         closesocket(sfd); // Close socket
     }
@@ -81,6 +1005,28 @@ int main(int argc, char *argv[]) {
 
     freeaddrinfo(result); // Free address information
 
+    if (platform_set_nonblocking(sfd, 1) != 0) { // Every wait is for readiness; reads never block
+        fprintf(stderr, "Could not make the socket nonblocking\n");
+        closesocket(sfd);
+        WSACleanup();
+        return 1;
+    }
+
+    if (load_clients > 0) { // Load mode: the clients open their own sockets
+        closesocket(sfd);
+        int status = run_load();
+        WSACleanup();
+        return status;
+    }
+
+    if (probe_count > 0) { // Probe mode: no stdin
+        int status = run_probes(sfd);
+        closesocket(sfd);
+        WSACleanup();
+        return status;
+    }
+
+#ifdef _WIN32
     HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);// Get standard input handle
     if (hStdin == INVALID_HANDLE_VALUE) { // Check if handle is valid
         fprintf(stderr, "Could not get stdin handle\n");
@@ -90,7 +1036,7 @@ int main(int argc, char *argv[]) {
     }
 
     // Set stdin to binary mode
-    if (_setmode(_fileno(stdin), _O_BINARY) == -1) {
+    if (platform_binary_stdio(stdin) != 0) {
         fprintf(stderr, "Could not set binary mode for stdin\n");
         closesocket(sfd);
         WSACleanup();
@@ -98,87 +1044,23 @@ int main(int argc, char *argv[]) {
     }
 
     // Set stdout to binary mode
-    if (_setmode(_fileno(stdout), _O_BINARY) == -1) {
+    if (platform_binary_stdio(stdout) != 0) {
         fprintf(stderr, "Could not set binary mode for stdout\n");
         closesocket(sfd);
         WSACleanup();
         return 1;
     }
+#else
+    HANDLE hStdin = STDIN_FILENO;
+#endif
 
-    char input_buffer[INPUT_BUFFER_SIZE];
-    char receive_buffer[RECEIVE_BUFFER_SIZE];
-    fd_set readfds;
-    HANDLE handles[1] = { hStdin };
-    int stdin_eof = 0;
-    
     printf("Connected to UDP server. Ready to send/receive messages.\n");
     printf("Type your messages and press Enter to send.\n");
+    fflush(stdout);
 
-    while (!stdin_eof) { // Loop until EOF is detected
-        FD_ZERO(&readfds);
-        FD_SET(sfd, &readfds);
-
-        DWORD console_result = WaitForMultipleObjects(1, handles, FALSE, 0);// Check for console input
-        if (console_result == WAIT_OBJECT_0) {
-            int bytes_read = better_read(hStdin, input_buffer, INPUT_BUFFER_SIZE);
-            if (bytes_read > 0) {// Null terminate the input buffer for proper string handling
-                input_buffer[bytes_read] = '\0';
-                
-                if (send(sfd, input_buffer, bytes_read, 0) == SOCKET_ERROR) {// Send the message
-                    fprintf(stderr, "Error sending data: %d\n", WSAGetLastError());
-                    break;
-                }
-                
-                printf("Sent %d bytes\n", bytes_read);
-            } else if (bytes_read == 0) { // Check if EOF is detected
-                stdin_eof = 1;
-                printf("EOF detected, sending empty packet...\n");
-                if (send(sfd, "", 0, 0) == SOCKET_ERROR) { // Send the EOF packet
-                    fprintf(stderr, "Error sending EOF packet: %d\n", WSAGetLastError());
-                    break;
-                }
-            } else { // Error reading from stdin
-                fprintf(stderr, "Error reading from stdin\n");
-                break;
-            }
-        }
-
-        struct timeval tv;// Check for socket data
-        tv.tv_sec = 0;
-        tv.tv_usec = 100000;  // 100ms timeout
-
-        if (select(0, &readfds, NULL, NULL, &tv) == SOCKET_ERROR) { // Check for socket data
-            fprintf(stderr, "select error: %d\n", WSAGetLastError());
-            break;
-        }
-
-        if (FD_ISSET(sfd, &readfds)) { // Check if data is available
-            int bytes_read = recv(sfd, receive_buffer, RECEIVE_BUFFER_SIZE, 0);
-            if (bytes_read == SOCKET_ERROR) { // Error receiving data
-                fprintf(stderr, "Error receiving data: %d\n", WSAGetLastError());
-                break;
-            }
-
-            if (bytes_read == 0) { // Check if EOF is detected
-                printf("Received empty packet, exiting...\n");
-                break;
-            }
-
-            receive_buffer[bytes_read] = '\0';// Null terminate the receive buffer
-            
-            printf("Received %d bytes: ", bytes_read); // Print received data
-            HANDLE hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
-            if (better_write(hStdout, receive_buffer, bytes_read) != bytes_read) { // Write received data to stdout
-                fprintf(stderr, "Error writing to stdout\n");
-                break;
-            }
-            printf("\n");  // Add newline after each received message
-        }
-
-        Sleep(10);  // Small delay to prevent tight loop
-    }
+    int status = run_interactive(sfd, hStdin);
 
     closesocket(sfd); // Close socket
     WSACleanup(); // Free Winsock resources
-    return 0; // Return success
-}
\ No newline at end of file
+    return status; // Return success
+}
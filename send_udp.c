@@ -1,15 +1,45 @@
+#ifdef __linux__
+#define _GNU_SOURCE // sendmmsg
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
 #include <stdint.h>
-#include <io.h>
-#include <fcntl.h>
 
-#pragma comment(lib, "ws2_32.lib")
+#include "platform.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "metrics.h"
+#include "transfer.h"
+#include "fec.h"
 
 #define BUFFER_SIZE 480 // As per requirements
+#define MAX_DATAGRAM_SIZE 65507 // Largest UDP payload over IPv4
+#define DEFAULT_BATCH_SIZE 32
+#define MAX_BATCH_SIZE 1024
+#define SEND_BUFFER_BYTES (4 << 20)
+#define TRANSFER_DATAGRAM_SIZE 1400 // Default payload in transfer mode: with the header, fits a 1500-byte MTU
+#define DEFAULT_TRANSFER_WINDOW 1024
+#ifdef _WIN32
+#define PACING_SPIN_NS 16000000 // Sleep(1) may take a whole 15.6 ms timer tick
+#else
+#define PACING_SPIN_NS 50000 // Sleep until this close to a send time, then spin
+#endif
+
+static int datagram_size = 0; // 0: the 480-byte loop; otherwise the bulk sender
+static int batch_size = DEFAULT_BATCH_SIZE;
+static double bit_rate = 0; // Bits per second, payload only; 0: unpaced
+static double packet_rate = 0; // Datagrams per second; 0: unpaced
+static int transfer_mode = 0; // 1: reliable transfer to receive_udp -o
+static int transfer_window = DEFAULT_TRANSFER_WINDOW;
+static const struct congestion_ops *congestion_algorithm;
+static const char *stats_socket = NULL;
+static int fec_k = 0, fec_m = 0; // FEC block: K data and M repair datagrams; 0: no FEC
 
 // Better read implementation for handling partial reads
 int better_read(FILE* fd, char *buf, size_t count) {
@@ -20,6 +50,745 @@ int better_read(FILE* fd, char *buf, size_t count) {
     return bytes_read;
 }
 
+// Returns at due_ns: sleeps through most of the wait, spins through the rest
+static void wait_until(uint64_t due_ns) {
+    uint64_t now = platform_now_ns();
+    if (due_ns > now + PACING_SPIN_NS) {
+        uint64_t sleep_ns = due_ns - now - PACING_SPIN_NS;
+#ifdef _WIN32
+        Sleep((DWORD)(sleep_ns / 1000000));
+#else
+        struct timespec ts = { (time_t)(sleep_ns / 1000000000), (long)(sleep_ns % 1000000000) };
+        nanosleep(&ts, NULL);
+#endif
+    }
+    while (platform_now_ns() < due_ns)
+        ;
+}
+
+static double pacing_gap(double ns_per_packet, double ns_per_byte, size_t length) { // The stricter rate wins
+    double gap = ns_per_byte * (double)length;
+    return gap > ns_per_packet ? gap : ns_per_packet;
+}
+
+// Bulk input: the whole of stdin mapped when it is a regular file, otherwise
+// read into a buffer of buffer_bytes, one batch of datagrams at a time
+struct input {
+    const char *map;
+    uint64_t map_length;
+    uint64_t map_offset;
+    char *buffer;
+    int eof;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+};
+
+static int input_open(struct input *in, size_t buffer_bytes) {
+    memset(in, 0, sizeof(*in));
+#ifdef _WIN32
+    HANDLE file = (HANDLE)_get_osfhandle(_fileno(stdin));
+    LARGE_INTEGER size;
+    if (GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+        in->mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (in->mapping != NULL) {
+            in->map = MapViewOfFile(in->mapping, FILE_MAP_READ, 0, 0, 0);
+            if (in->map != NULL) {
+                in->map_length = (uint64_t)size.QuadPart;
+                return 0;
+            }
+            CloseHandle(in->mapping);
+        }
+    }
+#else
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            in->map = map;
+            in->map_length = (uint64_t)st.st_size;
+            return 0;
+        }
+    }
+#endif
+    in->buffer = malloc(buffer_bytes); // Not mappable: a pipe, a terminal
+    if (in->buffer == NULL) {
+        fprintf(stderr, "Out of memory for %zu bytes of input buffer\n", buffer_bytes);
+        return -1;
+    }
+    return 0;
+}
+
+static void input_close(struct input *in) {
+    if (in->map != NULL) {
+#ifdef _WIN32
+        UnmapViewOfFile(in->map);
+        CloseHandle(in->mapping);
+#else
+        munmap((void *)in->map, (size_t)in->map_length);
+#endif
+    }
+    free(in->buffer);
+}
+
+// Points data[] and lengths[] at the next batch of datagrams, every one
+// datagram_size bytes but the last of the input. Returns how many, 0 at the
+// end of the input, or -1 when reading fails.
+static int input_next(struct input *in, const char **data, size_t *lengths) {
+    int n = 0;
+    if (in->map != NULL) {
+        while (n < batch_size && in->map_offset < in->map_length) {
+            uint64_t left = in->map_length - in->map_offset;
+            lengths[n] = left < (uint64_t)datagram_size ? (size_t)left : (size_t)datagram_size;
+            data[n++] = in->map + in->map_offset;
+            in->map_offset += lengths[n - 1];
+        }
+        return n;
+    }
+    if (in->eof)
+        return 0;
+    size_t want = (size_t)batch_size * (size_t)datagram_size;
+    size_t got = fread(in->buffer, 1, want, stdin); // Fills the whole batch unless the input ends
+    if (got < want) {
+        if (ferror(stdin))
+            return -1;
+        in->eof = 1;
+    }
+    for (size_t offset = 0; offset < got; offset += lengths[n++]) {
+        lengths[n] = got - offset < (size_t)datagram_size ? got - offset : (size_t)datagram_size;
+        data[n] = in->buffer + offset;
+    }
+    return n;
+}
+
+// Takes the next datagram of the input, reading it into storage unless the
+// input is mapped. Returns 1, 0 at the end of the input, or -1 when reading fails.
+static int input_take(struct input *in, char *storage, const char **data, size_t *length) {
+    if (in->map != NULL) {
+        if (in->map_offset >= in->map_length)
+            return 0;
+        uint64_t left = in->map_length - in->map_offset;
+        *length = left < (uint64_t)datagram_size ? (size_t)left : (size_t)datagram_size;
+        *data = in->map + in->map_offset;
+        in->map_offset += *length;
+        return 1;
+    }
+    *length = fread(storage, 1, (size_t)datagram_size, stdin);
+    *data = storage;
+    if (*length == 0)
+        return ferror(stdin) ? -1 : 0;
+    return 1;
+}
+
+// Sends count datagrams, batched into one sendmmsg where there is one.
+// Returns the number of send calls made, or -1 after printing the error.
+static long send_datagrams(SOCKET sfd, const char **data, const size_t *lengths, int count) {
+    long calls = 0;
+    int sent = 0;
+#ifdef __linux__
+    static struct mmsghdr msgs[MAX_BATCH_SIZE];
+    static struct iovec iov[MAX_BATCH_SIZE];
+    for (int i = 0; i < count; i++) { // Connected socket: no addresses, the iovecs point straight at the input
+        iov[i].iov_base = (void *)data[i];
+        iov[i].iov_len = lengths[i];
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (sent < count) {
+        int m = sendmmsg(sfd, msgs + sent, (unsigned)(count - sent), 0);
+        calls++;
+        if (m < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error sending data: %d\n", errno);
+            metrics_add(METRIC_SEND_ERRORS, 1);
+            return -1;
+        }
+        sent += m;
+    }
+#else
+    for (; sent < count; sent++) {
+        calls++;
+        if (send(sfd, data[sent], (int)lengths[sent], 0) == SOCKET_ERROR) {
+            fprintf(stderr, "Error sending data: %d\n", WSAGetLastError());
+            metrics_add(METRIC_SEND_ERRORS, 1);
+            return -1;
+        }
+    }
+#endif
+    uint64_t bytes = 0;
+    for (int i = 0; i < count; i++)
+        bytes += lengths[i];
+    metrics_add(METRIC_UDP_TX_PACKETS, (uint64_t)count);
+    metrics_add(METRIC_UDP_TX_BYTES, bytes);
+    return calls;
+}
+
+struct fec_stage { // Between the input and the socket: wraps data in FEC headers and adds repairs
+    struct fec_encoder encoder;
+    uint8_t *buffer; // slot_bytes for every datagram of a batch and the repairs it completes
+    size_t slot_bytes;
+    const char **data;
+    size_t *lengths;
+    uint64_t repairs;
+};
+
+static int fec_stage_open(struct fec_stage *f) {
+    int capacity = batch_size + (batch_size / fec_k + 1) * fec_m;
+    memset(f, 0, sizeof(*f));
+    f->slot_bytes = (size_t)datagram_size + FEC_OVERHEAD;
+    f->buffer = malloc((size_t)capacity * f->slot_bytes);
+    f->data = malloc((size_t)capacity * sizeof(*f->data));
+    f->lengths = malloc((size_t)capacity * sizeof(*f->lengths));
+    if (fec_encoder_init(&f->encoder, fec_k, fec_m) != 0 || f->buffer == NULL || f->data == NULL ||
+        f->lengths == NULL) {
+        fprintf(stderr, "Out of memory for FEC blocks of %d:%d\n", fec_k, fec_m);
+        fec_encoder_destroy(&f->encoder);
+        free(f->buffer);
+        free(f->data);
+        free(f->lengths);
+        return -1;
+    }
+    return 0;
+}
+
+static void fec_stage_close(struct fec_stage *f) {
+    fec_encoder_destroy(&f->encoder);
+    free(f->buffer);
+    free(f->data);
+    free(f->lengths);
+}
+
+// Encodes a batch of n datagrams, each block's repairs right after its last
+// data datagram, into f->data and f->lengths. n = 0, at the end of the input,
+// closes a short final block. Returns how many datagrams to send.
+static int fec_stage_run(struct fec_stage *f, const char **data, const size_t *lengths, int n) {
+    int out = 0;
+    struct fec_encoder *e = &f->encoder;
+    for (int i = 0; i <= n; i++) {
+        if (e->count == e->k || (n == 0 && e->count > 0)) { // A full block, or the short last one
+            for (int r = 0; r < e->m; r++, out++) {
+                uint8_t *slot = f->buffer + (size_t)out * f->slot_bytes;
+                f->data[out] = (const char *)slot;
+                f->lengths[out] = (size_t)fec_encode_repair(e, r, slot);
+            }
+            f->repairs += (uint64_t)e->m;
+            metrics_add(METRIC_FEC_REPAIRS, (uint64_t)e->m);
+            fec_encoder_next_block(e);
+        }
+        if (i == n)
+            break;
+        uint8_t *slot = f->buffer + (size_t)out * f->slot_bytes;
+        f->data[out] = (const char *)slot;
+        f->lengths[out++] = (size_t)fec_encode(e, data[i], (uint32_t)lengths[i], slot);
+    }
+    return out;
+}
+
+// Sends stdin in datagram_size datagrams, batch_size at a time, held to
+// bit_rate and packet_rate. Every datagram has a due time, the previous one's
+// plus its gap under whichever rate is stricter for it. Whatever is due goes out in one batch;
+// nothing waits for a batch to fill. With -f the FEC stage sits between the
+// input and the socket, and pacing covers its repairs too. Prints what it
+// achieved when done.
+static int send_bulk(SOCKET sfd) {
+    struct input in;
+    if (input_open(&in, (size_t)batch_size * (size_t)datagram_size) != 0)
+        return 1;
+    const char **data = malloc((size_t)batch_size * sizeof(*data));
+    size_t *lengths = malloc((size_t)batch_size * sizeof(*lengths));
+    if (data == NULL || lengths == NULL) {
+        fprintf(stderr, "Out of memory for a batch of %d datagrams\n", batch_size);
+        free(data);
+        free(lengths);
+        input_close(&in);
+        return 1;
+    }
+    struct fec_stage fec;
+    if (fec_k > 0 && fec_stage_open(&fec) != 0) {
+        free(data);
+        free(lengths);
+        input_close(&in);
+        return 1;
+    }
+
+    int size = SEND_BUFFER_BYTES; // Best effort: the kernel caps it at net.core.wmem_max
+    setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (const char *)&size, sizeof(size));
+
+    double ns_per_packet = packet_rate > 0 ? 1e9 / packet_rate : 0;
+    double ns_per_byte = bit_rate > 0 ? 8e9 / bit_rate : 0;
+    int paced = ns_per_packet > 0 || ns_per_byte > 0;
+    uint64_t start = platform_now_ns();
+    double due = 0; // Of the next datagram, in ns after start
+    uint64_t datagrams = 0, bytes = 0, late_total_ns = 0, late_max_ns = 0;
+    long calls = 0;
+    int status = 0;
+
+    int n;
+    while ((n = input_next(&in, data, lengths)) >= 0) {
+        const char **batch = data;
+        const size_t *batch_lengths = lengths;
+        if (fec_k > 0) {
+            n = fec_stage_run(&fec, data, lengths, n);
+            batch = fec.data;
+            batch_lengths = fec.lengths;
+        }
+        if (n == 0)
+            break;
+        for (int first = 0; first < n;) {
+            int count = 1;
+            if (paced) {
+                uint64_t due_ns = start + (uint64_t)due;
+                wait_until(due_ns);
+                uint64_t now = platform_now_ns();
+                uint64_t late = now - due_ns;
+                double next = due + pacing_gap(ns_per_packet, ns_per_byte, batch_lengths[first]);
+                while (first + count < n && start + (uint64_t)next <= now) { // Also due already
+                    next += pacing_gap(ns_per_packet, ns_per_byte, batch_lengths[first + count]);
+                    count++;
+                }
+                due = next;
+                late_total_ns += late * (uint64_t)count;
+                if (late > late_max_ns)
+                    late_max_ns = late;
+            } else {
+                count = n - first;
+            }
+
+            long c = send_datagrams(sfd, batch + first, batch_lengths + first, count);
+            if (c < 0) {
+                status = 1;
+                break;
+            }
+            calls += c;
+            for (int i = first; i < first + count; i++)
+                bytes += batch_lengths[i];
+            datagrams += (uint64_t)count;
+            first += count;
+        }
+        if (status != 0)
+            break;
+    }
+    if (n < 0) {
+        fprintf(stderr, "Error reading from stdin\n");
+        status = 1;
+    }
+
+    double seconds = (double)(platform_now_ns() - start) / 1e9;
+    if (seconds <= 0)
+        seconds = 1e-9;
+    fprintf(stderr, "Sent %llu datagrams, %llu bytes in %.3f s: %.1f Mbit/s, %.0f datagrams/s\n",
+            (unsigned long long)datagrams, (unsigned long long)bytes, seconds, (double)bytes * 8 / seconds / 1e6,
+            (double)datagrams / seconds);
+    fprintf(stderr, "%ld send calls (%.3f per datagram), input %s\n", calls,
+            datagrams > 0 ? (double)calls / (double)datagrams : 0.0,
+            in.map != NULL ? "mapped" : "read");
+    if (paced && datagrams > 0) {
+        char target[64];
+        if (bit_rate > 0 && packet_rate > 0)
+            snprintf(target, sizeof(target), "%.1f Mbit/s and %.0f datagrams/s", bit_rate / 1e6, packet_rate);
+        else if (bit_rate > 0)
+            snprintf(target, sizeof(target), "%.1f Mbit/s", bit_rate / 1e6);
+        else
+            snprintf(target, sizeof(target), "%.0f datagrams/s", packet_rate);
+        fprintf(stderr, "Pacing to %s: datagrams left %.1f us after their due time on average, %.1f us at most\n",
+                target, (double)late_total_ns / (double)datagrams / 1000, (double)late_max_ns / 1000);
+    }
+    if (fec_k > 0) {
+        fprintf(stderr, "FEC %d:%d (%s): %llu of the datagrams were repairs\n", fec_k, fec_m,
+                fec_kernel_names[fec_kernel], (unsigned long long)fec.repairs);
+        fec_stage_close(&fec);
+    }
+
+    free(data);
+    free(lengths);
+    input_close(&in);
+    return status;
+}
+
+enum slot_state { SLOT_IN_FLIGHT = 1, SLOT_LOST, SLOT_SACKED };
+
+struct tx_slot { // A datagram between the cumulative ACK and the last one loaded from the input
+    const char *data;
+    uint32_t length;
+    uint8_t state; // Once sent
+    uint8_t retransmitted;
+    uint64_t sent_ns; // Latest transmission
+};
+
+struct transfer_sender {
+    SOCKET s;
+    uint32_t id;
+    struct tx_slot *slots; // Ring indexed by sequence & mask
+    uint32_t mask;
+    uint32_t una; // Lowest sequence not acknowledged cumulatively
+    uint32_t nxt; // Next sequence to send for the first time
+    uint32_t loaded; // Next sequence to take from the input
+    uint32_t fin_seq; // UINT32_MAX until the input ends
+    uint32_t peer_window;
+    uint32_t in_flight; // Sent, and neither acknowledged nor given up as lost
+    uint32_t lost; // Waiting to be sent again
+    uint32_t recovery_end; // Losses below this belong to the episode already reported
+    uint64_t newest_delivered_ns; // Latest send time of anything acknowledged
+    uint64_t rto_deadline_ns; // 0 while nothing is in flight
+    int timeouts_in_row;
+    struct transfer_rtt rtt;
+    struct congestion cc;
+    const struct congestion_ops *ops;
+    uint64_t datagrams, bytes, retransmits, timeouts, acks;
+};
+
+#define TRANSFER_TIMEOUT_LIMIT 10 // Timeouts in a row before the receiver is given up on
+
+static void transfer_mark_lost(struct transfer_sender *t, struct tx_slot *slot, uint32_t seq) {
+    slot->state = SLOT_LOST;
+    t->in_flight--;
+    t->lost++;
+    if (seq >= t->recovery_end) { // First loss of a new episode: the window reacts once per round trip of data
+        t->ops->on_loss(&t->cc);
+        t->recovery_end = t->nxt;
+    }
+}
+
+static void transfer_deliver(struct transfer_sender *t, struct tx_slot *slot, uint32_t *delivered) {
+    if (slot->state == SLOT_IN_FLIGHT)
+        t->in_flight--;
+    else if (slot->state == SLOT_LOST)
+        t->lost--;
+    else
+        return; // Selectively acknowledged already
+    (*delivered)++;
+    if (slot->sent_ns > t->newest_delivered_ns)
+        t->newest_delivered_ns = slot->sent_ns;
+}
+
+// Applies one ACK: advances the cumulative point, marks SACKed datagrams, and
+// declares lost whatever was sent more than a quarter RTT before something
+// that has since arrived. That is fast retransmit by send time rather than
+// by counting duplicate ACKs, so retransmissions that are lost again are
+// caught the same way.
+static void transfer_on_ack(struct transfer_sender *t, const uint8_t *ack, int length, uint64_t now) {
+    struct transfer_header h;
+    if (transfer_header_unpack(&h, ack, length) != 0 || h.type != TRANSFER_ACK || h.id != t->id)
+        return;
+    t->acks++;
+    t->peer_window = h.window < t->mask + 1 ? h.window : t->mask + 1;
+    uint64_t sample = h.stamp_ns != 0 && now > h.stamp_ns ? now - h.stamp_ns : 0;
+    if (sample > 0)
+        transfer_rtt_sample(&t->rtt, sample);
+
+    uint32_t delivered = 0;
+    uint32_t cum = h.seq < t->nxt ? h.seq : t->nxt;
+    for (; t->una < cum; t->una++)
+        transfer_deliver(t, &t->slots[t->una & t->mask], &delivered);
+    for (int i = 0; i < h.blocks; i++) {
+        struct transfer_sack block;
+        transfer_sack_unpack(&block, ack, i);
+        for (uint32_t seq = block.start > t->una ? block.start : t->una; seq < block.end && seq < t->nxt; seq++) {
+            struct tx_slot *slot = &t->slots[seq & t->mask];
+            transfer_deliver(t, slot, &delivered);
+            slot->state = SLOT_SACKED;
+        }
+    }
+    if (delivered == 0)
+        return;
+    t->timeouts_in_row = 0;
+    t->ops->on_ack(&t->cc, delivered, &t->rtt, sample, now);
+    if (t->cc.cwnd > t->mask + 1)
+        t->cc.cwnd = t->mask + 1;
+    t->rto_deadline_ns = t->in_flight > 0 ? now + t->rtt.rto_ns : 0;
+
+    uint64_t reorder_ns = t->rtt.srtt_ns / 4;
+    for (uint32_t seq = t->una; seq < t->nxt; seq++) {
+        struct tx_slot *slot = &t->slots[seq & t->mask];
+        if (slot->state != SLOT_IN_FLIGHT)
+            continue;
+        if (slot->sent_ns + reorder_ns < t->newest_delivered_ns)
+            transfer_mark_lost(t, slot, seq);
+        else if (!slot->retransmitted)
+            break; // First transmissions go out in order: everything after was sent later still
+    }
+}
+
+static void transfer_on_timeout(struct transfer_sender *t) {
+    t->timeouts++;
+    t->timeouts_in_row++;
+    for (uint32_t seq = t->una; seq < t->nxt; seq++) {
+        struct tx_slot *slot = &t->slots[seq & t->mask];
+        if (slot->state == SLOT_IN_FLIGHT) {
+            slot->state = SLOT_LOST;
+            t->in_flight--;
+            t->lost++;
+        }
+    }
+    t->ops->on_timeout(&t->cc);
+    t->recovery_end = t->nxt;
+    t->rtt.rto_ns = t->rtt.rto_ns * 2 < TRANSFER_MAX_RTO_NS ? t->rtt.rto_ns * 2 : TRANSFER_MAX_RTO_NS; // Back off
+    t->rto_deadline_ns = 0;
+}
+
+// Sends count datagrams from seqs, lost ones again and new ones for the first
+// time, and commits as many as the socket took. Returns that many, or -1
+// after printing the error.
+static int transfer_send(struct transfer_sender *t, const uint32_t *seqs, int count, uint64_t now) {
+    static uint8_t headers[MAX_BATCH_SIZE][TRANSFER_HEADER_SIZE];
+    for (int i = 0; i < count; i++) {
+        struct transfer_header h = { TRANSFER_DATA, 0, t->id, seqs[i], (uint32_t)datagram_size, now };
+        if (seqs[i] == t->fin_seq)
+            h.type = TRANSFER_FIN;
+        transfer_header_pack(headers[i], &h);
+    }
+    int sent = 0;
+#ifdef __linux__
+    static struct mmsghdr msgs[MAX_BATCH_SIZE];
+    static struct iovec iov[MAX_BATCH_SIZE][2];
+    for (int i = 0; i < count; i++) { // Header and payload gathered straight from where they are
+        const struct tx_slot *slot = &t->slots[seqs[i] & t->mask];
+        iov[i][0].iov_base = headers[i];
+        iov[i][0].iov_len = TRANSFER_HEADER_SIZE;
+        iov[i][1].iov_base = (void *)slot->data;
+        iov[i][1].iov_len = slot->length;
+        memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+        msgs[i].msg_hdr.msg_iov = iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+    sent = sendmmsg(t->s, msgs, (unsigned)count, 0);
+    if (sent < 0) {
+        if (!platform_would_block()) {
+            fprintf(stderr, "Error sending data: %d\n", errno);
+            metrics_add(METRIC_SEND_ERRORS, 1);
+            return -1;
+        }
+        sent = 0;
+    }
+#else
+    static char packet[TRANSFER_HEADER_SIZE + TRANSFER_MAX_PAYLOAD];
+    for (; sent < count; sent++) {
+        const struct tx_slot *slot = &t->slots[seqs[sent] & t->mask];
+        memcpy(packet, headers[sent], TRANSFER_HEADER_SIZE);
+        memcpy(packet + TRANSFER_HEADER_SIZE, slot->data, slot->length);
+        if (send(t->s, packet, (int)(TRANSFER_HEADER_SIZE + slot->length), 0) == SOCKET_ERROR) {
+            if (platform_would_block())
+                break;
+            fprintf(stderr, "Error sending data: %d\n", WSAGetLastError());
+            metrics_add(METRIC_SEND_ERRORS, 1);
+            return -1;
+        }
+    }
+#endif
+    for (int i = 0; i < sent; i++) {
+        struct tx_slot *slot = &t->slots[seqs[i] & t->mask];
+        if (seqs[i] == t->nxt) {
+            t->nxt++;
+            t->datagrams += seqs[i] != t->fin_seq;
+            t->bytes += slot->length;
+        } else { // Retransmission
+            t->lost--;
+            t->retransmits++;
+            slot->retransmitted = 1;
+            metrics_add(METRIC_RETRANSMITS, 1);
+        }
+        slot->state = SLOT_IN_FLIGHT;
+        slot->sent_ns = now;
+        t->in_flight++;
+        metrics_add(METRIC_UDP_TX_PACKETS, 1);
+        metrics_add(METRIC_UDP_TX_BYTES, TRANSFER_HEADER_SIZE + slot->length);
+    }
+    if (sent > 0 && t->rto_deadline_ns == 0)
+        t->rto_deadline_ns = now + t->rtt.rto_ns;
+    return sent;
+}
+
+// Sends stdin reliably: every datagram numbered, kept until acknowledged, and
+// sent again when ACKs show it lost or the retransmission timer fires. Up to
+// transfer_window datagrams are outstanding, fewer while congestion control
+// or the receiver's window says so. Sends go out in batches of up to
+// batch_size; one thread drains ACKs without blocking and waits in select
+// for the next ACK or timeout. Ends once the FIN is acknowledged.
+static int send_transfer(SOCKET sfd) {
+    struct transfer_sender t;
+    memset(&t, 0, sizeof(t));
+    uint32_t window = 16;
+    while (window < (uint32_t)transfer_window)
+        window <<= 1;
+    struct input in;
+    if (input_open(&in, (size_t)window * (size_t)datagram_size) != 0)
+        return 1;
+    t.slots = calloc(window, sizeof(*t.slots));
+    if (t.slots == NULL) {
+        fprintf(stderr, "Out of memory for a window of %u datagrams\n", window);
+        input_close(&in);
+        return 1;
+    }
+    int size = SEND_BUFFER_BYTES; // Best effort: room for a window in flight
+    setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (const char *)&size, sizeof(size));
+    if (platform_set_nonblocking(sfd, 1) != 0) {
+        fprintf(stderr, "Could not make the socket nonblocking\n");
+        free(t.slots);
+        input_close(&in);
+        return 1;
+    }
+
+    t.s = sfd;
+    t.mask = window - 1;
+    t.fin_seq = UINT32_MAX;
+    t.peer_window = window;
+    t.ops = congestion_algorithm;
+    transfer_rtt_init(&t.rtt);
+    congestion_init(&t.cc);
+    uint64_t start = platform_now_ns();
+    t.id = (uint32_t)((start * 0x9e3779b97f4a7c15ull) >> 32) | 1; // Tells this transfer from stale ones
+    int status = 0;
+
+    while (1) {
+        uint8_t ack[TRANSFER_MAX_ACK];
+        int length;
+        while ((length = recv(sfd, (char *)ack, sizeof(ack), 0)) >= 0) {
+            metrics_add(METRIC_UDP_RX_PACKETS, 1);
+            metrics_add(METRIC_UDP_RX_BYTES, (uint64_t)length);
+            transfer_on_ack(&t, ack, length, platform_now_ns());
+        }
+        if (!platform_would_block()) {
+            fprintf(stderr, "Error receiving ACKs: %d\n", WSAGetLastError());
+            status = 1;
+            break;
+        }
+        if (t.fin_seq != UINT32_MAX && t.una > t.fin_seq)
+            break; // FIN acknowledged: the receiver has everything
+
+        uint64_t now = platform_now_ns();
+        if (t.rto_deadline_ns != 0 && now >= t.rto_deadline_ns) {
+            transfer_on_timeout(&t);
+            if (t.timeouts_in_row > TRANSFER_TIMEOUT_LIMIT) {
+                fprintf(stderr, "Receiver not responding\n");
+                status = 1;
+                break;
+            }
+        }
+
+        while (t.fin_seq == UINT32_MAX && t.loaded - t.una <= t.mask) { // Fill free slots from the input
+            struct tx_slot *slot = &t.slots[t.loaded & t.mask];
+            size_t taken = 0;
+            char *storage = in.buffer != NULL ? in.buffer + (size_t)(t.loaded & t.mask) * (size_t)datagram_size : NULL;
+            int r = input_take(&in, storage, &slot->data, &taken);
+            if (r < 0) {
+                fprintf(stderr, "Error reading from stdin\n");
+                status = 1;
+                break;
+            }
+            slot->length = (uint32_t)taken;
+            slot->state = 0;
+            slot->retransmitted = 0;
+            if (r == 0)
+                t.fin_seq = t.loaded;
+            t.loaded++;
+        }
+        if (status != 0)
+            break;
+
+        uint32_t seqs[MAX_BATCH_SIZE];
+        int count = 0;
+        uint32_t cwnd = (uint32_t)t.cc.cwnd;
+        for (uint32_t seq = t.una; t.lost > 0 && seq < t.nxt && count < batch_size &&
+             t.in_flight + (uint32_t)count < cwnd; seq++) { // Lost datagrams first, oldest first
+            if (t.slots[seq & t.mask].state == SLOT_LOST)
+                seqs[count++] = seq;
+        }
+        for (uint32_t seq = t.nxt; seq < t.loaded && seq - t.una < t.peer_window && count < batch_size &&
+             t.in_flight + (uint32_t)count < cwnd; seq++)
+            seqs[count++] = seq;
+
+        int sent = count > 0 ? transfer_send(&t, seqs, count, now) : 0;
+        if (sent < 0) {
+            status = 1;
+            break;
+        }
+        if (sent == 0) { // Window full or socket full: sleep until an ACK or the timer
+            uint64_t wait_ns = t.rto_deadline_ns > now ? t.rto_deadline_ns - now : TRANSFER_MAX_RTO_NS;
+            if (platform_wait(sfd, PLATFORM_READABLE | (count > 0 ? PLATFORM_WRITABLE : 0), (int64_t)wait_ns) < 0) {
+                fprintf(stderr, "Error waiting for ACKs: %d\n", WSAGetLastError());
+                status = 1;
+                break;
+            }
+            metrics_add(METRIC_WAKEUPS, 1);
+        }
+    }
+
+    double seconds = (double)(platform_now_ns() - start) / 1e9;
+    if (seconds <= 0)
+        seconds = 1e-9;
+    fprintf(stderr, "Transferred %llu bytes in %llu datagrams in %.3f s: %.1f Mbit/s goodput\n",
+            (unsigned long long)t.bytes, (unsigned long long)t.datagrams, seconds, (double)t.bytes * 8 / seconds / 1e6);
+    fprintf(stderr, "%llu retransmissions (%.2f%%), %llu timeouts, %llu ACKs; srtt %.1f us, window %.0f datagrams (%s)\n",
+            (unsigned long long)t.retransmits, t.datagrams > 0 ? 100.0 * (double)t.retransmits / (double)t.datagrams : 0.0,
+            (unsigned long long)t.timeouts, (unsigned long long)t.acks, (double)t.rtt.srtt_ns / 1000, t.cc.cwnd,
+            t.ops->name);
+    free(t.slots);
+    input_close(&in);
+    return status;
+}
+
+static int parse_options(int argc, char *argv[]) {
+    for (int i = 3; i < argc; i++) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[i]);
+            return -1;
+        }
+        double value = strtod(argv[i + 1], NULL);
+        if (strcmp(argv[i], "-s") == 0 && value >= 1 && value <= MAX_DATAGRAM_SIZE) {
+            datagram_size = (int)value;
+        } else if (strcmp(argv[i], "-b") == 0 && value >= 1 && value <= MAX_BATCH_SIZE) {
+            batch_size = (int)value;
+        } else if (strcmp(argv[i], "-r") == 0 && value >= 0) {
+            bit_rate = value;
+        } else if (strcmp(argv[i], "-p") == 0 && value >= 0) {
+            packet_rate = value;
+        } else if (strcmp(argv[i], "-t") == 0 && (value == 0 || value == 1)) {
+            transfer_mode = (int)value;
+        } else if (strcmp(argv[i], "-w") == 0 && value >= 1 && value <= TRANSFER_MAX_WINDOW) {
+            transfer_window = (int)value;
+        } else if (strcmp(argv[i], "-c") == 0 && transfer_congestion(argv[i + 1]) != NULL) {
+            congestion_algorithm = transfer_congestion(argv[i + 1]);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            stats_socket = argv[i + 1];
+        } else if (strcmp(argv[i], "-f") == 0 && sscanf(argv[i + 1], "%d:%d", &fec_k, &fec_m) == 2 &&
+                   fec_k >= 1 && fec_k <= FEC_MAX_K && fec_m >= 1 && fec_m <= FEC_MAX_M) {
+            // K data and M repair datagrams per block
+        } else {
+            fprintf(stderr, "Invalid option: %s %s\n", argv[i], argv[i + 1]);
+            return -1;
+        }
+        i++;
+    }
+    if (congestion_algorithm == NULL)
+        congestion_algorithm = transfer_congestion("aimd");
+    if (transfer_mode) {
+        if (datagram_size == 0)
+            datagram_size = TRANSFER_DATAGRAM_SIZE;
+        if (datagram_size > TRANSFER_MAX_PAYLOAD) {
+            fprintf(stderr, "Datagrams in transfer mode carry at most %d bytes\n", TRANSFER_MAX_PAYLOAD);
+            return -1;
+        }
+        if (bit_rate > 0 || packet_rate > 0) {
+            fprintf(stderr, "Transfer mode is paced by its window; -r and -p do not apply\n");
+            return -1;
+        }
+        if (fec_k > 0) {
+            fprintf(stderr, "Transfer mode repairs loss by retransmission; -f does not apply\n");
+            return -1;
+        }
+    } else if (datagram_size == 0 &&
+               (bit_rate > 0 || packet_rate > 0 || batch_size != DEFAULT_BATCH_SIZE || fec_k > 0)) {
+        datagram_size = BUFFER_SIZE; // Any bulk option selects the bulk sender
+    }
+    if (fec_k > 0 && datagram_size > FEC_MAX_PAYLOAD) {
+        fprintf(stderr, "Datagrams with FEC carry at most %d bytes\n", FEC_MAX_PAYLOAD);
+        return -1;
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     // Initialize Winsock
     WSADATA wsaData;
@@ -29,7 +798,9 @@ int main(int argc, char *argv[]) {
     }
 
     if (argc < 3) { // Check if port name is provided
-        fprintf(stderr, "Usage: %s <server_name> <port_name>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <server_name> <port_name> [-s datagram_size] [-b batch_size]"
+                        " [-r bits_per_sec] [-p datagrams_per_sec] [-t 0|1] [-w window] [-c aimd|delay]"
+                        " [-f K:M] [-m unix:path|udp:port]\n", argv[0]);
         WSACleanup();
         return 1;
     }
@@ -37,6 +808,12 @@ int main(int argc, char *argv[]) {
     char *server_name = argv[1];
     char *port_name = argv[2];
 
+    if (parse_options(argc, argv) != 0 ||
+        (stats_socket != NULL && metrics_serve(stats_socket, "send_udp") != 0)) { // Serve live metrics
+        WSACleanup();
+        return 1;
+    }
+
     struct addrinfo hints;
     struct addrinfo *result, *rp;
     SOCKET sfd = INVALID_SOCKET;
@@ -77,20 +854,39 @@ int main(int argc, char *argv[]) {
     char buffer[BUFFER_SIZE];
     int bytes_read;
 
-    if (_setmode(_fileno(stdin), _O_BINARY) == -1) {// Set stdin to binary mode
+    if (platform_binary_stdio(stdin) != 0) {// Set stdin to binary mode
         fprintf(stderr, "Could not set binary mode\n");
         closesocket(sfd);
         WSACleanup();
         return 1;
     }
 
-    while ((bytes_read = better_read(stdin, buffer, BUFFER_SIZE)) > 0) { // Read from stdin
-        if (send(sfd, buffer, bytes_read, 0) == SOCKET_ERROR) { // Send data
-            fprintf(stderr, "Error sending data: %d\n", WSAGetLastError());
+    if (transfer_mode) { // Reliable transfer: ends with its own acknowledged FIN
+        int status = send_transfer(sfd);
+        closesocket(sfd);
+        WSACleanup();
+        return status;
+    }
+
+    if (datagram_size > 0) { // Bulk sender
+        if (send_bulk(sfd) != 0) {
             closesocket(sfd);
             WSACleanup();
             return 1;
         }
+        bytes_read = 0;
+    } else {
+        while ((bytes_read = better_read(stdin, buffer, BUFFER_SIZE)) > 0) { // Read from stdin
+            if (send(sfd, buffer, bytes_read, 0) == SOCKET_ERROR) { // Send data
+                fprintf(stderr, "Error sending data: %d\n", WSAGetLastError());
+                metrics_add(METRIC_SEND_ERRORS, 1);
+                closesocket(sfd);
+                WSACleanup();
+                return 1;
+            }
+            metrics_add(METRIC_UDP_TX_PACKETS, 1);
+            metrics_add(METRIC_UDP_TX_BYTES, (uint64_t)bytes_read);
+        }
     }
 
     if (bytes_read == -1) { // Check if read was successful
@@ -110,4 +906,4 @@ int main(int argc, char *argv[]) {
     closesocket(sfd);// Close socket
     WSACleanup();// Cleanup Winsock
     return 0;// Return success
-}
\ No newline at end of file
+}
@@ -0,0 +1,253 @@
+// Per-source session table shared by the echo servers: packets, bytes, first
+// and last seen, and an inter-arrival rate estimate for every source address.
+//
+// A fixed-capacity hash_slots.h index over a dense session array, with at
+// least twice as many slots as sessions. Everything is allocated up front, so the packet
+// path never allocates. When the table is full, a clock hand evicts the next
+// session not touched since the hand last passed it, so steady traffic keeps
+// its sessions and one-off senders are recycled first.
+//
+// Sessions can also rate-limit their source with a token bucket of a given
+// rate and burst, kept as a single deadline per session (see session_admit).
+//
+// A table belongs to one thread; workers keep one each. Include after
+// platform.h and hash_slots.h.
+
+#ifndef SESSION_TABLE_H
+#define SESSION_TABLE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+#define SESSION_MAX_CAPACITY (1u << 22)
+#define SESSION_GAP_SHIFT 6 // Inter-arrival average weighs each new gap 1/64, smoothing over bursts
+
+struct session_key { // Compact copy of the source address, compared bytewise
+    uint8_t addr[16];
+    uint16_t port;   // Network byte order
+    uint16_t family;
+};
+
+struct session {
+    struct session_key key;
+    uint32_t hash;
+    uint32_t referenced; // 2 when touched since the clock hand last passed it, else 1
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t first_seen_ns;
+    uint64_t last_seen_ns;
+    uint64_t gap_ns; // Moving average of the time between packets, 0 until the second one
+    uint64_t bucket_ns; // When the token bucket would be full again if nothing more were admitted
+    uint64_t limited; // Packets refused by the token bucket
+};
+
+struct session_limit { // Token bucket shape shared by every session; 0 interval_ns: no limit
+    uint64_t interval_ns; // Time to earn one token
+    uint64_t depth_ns; // Time to fill the bucket: burst tokens
+};
+
+struct session_table {
+    struct hash_slot *slots;
+    uint32_t slot_mask;
+    struct session *sessions;
+    uint32_t capacity;
+    uint32_t count; // Sessions in use, always the first count entries of the array
+    uint32_t hand; // Clock hand over the session array
+    uint64_t evictions;
+};
+
+static inline int session_key_from_addr(struct session_key *key, const struct sockaddr_storage *addr) {
+    memset(key, 0, sizeof(*key));
+    key->family = addr->ss_family;
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        memcpy(key->addr, &in->sin_addr, 4);
+        key->port = in->sin_port;
+        return 0;
+    }
+    if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        memcpy(key->addr, &in6->sin6_addr, 16);
+        key->port = in6->sin6_port;
+        return 0;
+    }
+    return -1;
+}
+
+static inline uint32_t session_hash(const struct session_key *key) { // Word-wise mix with a murmur3 finalizer
+    uint32_t words[5];
+    memcpy(words, key, sizeof(words));
+    uint32_t h = 0x9e3779b9u;
+    for (int i = 0; i < 5; i++) {
+        h ^= words[i];
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+    }
+    h ^= h >> 16;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline int session_table_init(struct session_table *t, uint32_t capacity) {
+    uint32_t slots = 16;
+    if (capacity == 0 || capacity > SESSION_MAX_CAPACITY)
+        return -1;
+    while (slots < capacity * 2)
+        slots <<= 1;
+
+    t->slots = malloc(slots * sizeof(*t->slots));
+    t->sessions = malloc(capacity * sizeof(*t->sessions));
+    if (t->slots == NULL || t->sessions == NULL) {
+        free(t->slots);
+        free(t->sessions);
+        return -1;
+    }
+    memset(t->slots, 0, slots * sizeof(*t->slots)); // Fault every page in now rather than on the packet path
+    memset(t->sessions, 0, capacity * sizeof(*t->sessions));
+    t->slot_mask = slots - 1;
+    t->capacity = capacity;
+    t->count = 0;
+    t->hand = 0;
+    t->evictions = 0;
+    return 0;
+}
+
+static inline void session_table_destroy(struct session_table *t) {
+    free(t->slots);
+    free(t->sessions);
+}
+
+// Picks the session to reuse for a new source once the table is full: the
+// first one the clock hand finds unreferenced, clearing marks as it passes.
+// At most two turns, and a turn clears every mark, so this always finishes.
+static inline uint32_t session_evict(struct session_table *t) {
+    while (1) {
+        uint32_t index = t->hand;
+        struct session *s = &t->sessions[index];
+        if (++t->hand == t->capacity)
+            t->hand = 0;
+        if (s->referenced > 1) {
+            s->referenced = 1; // Second chance
+            continue;
+        }
+        hash_slots_remove(t->slots, t->slot_mask, s->hash, index);
+        t->evictions++;
+        return index;
+    }
+}
+
+// Finds the session for key, creating it (evicting one if full) when unseen,
+// and accounts a packet of length bytes to it. Never fails.
+static inline struct session *session_touch(struct session_table *t, const struct session_key *key, uint32_t length,
+                                            uint64_t now_ns) {
+    uint32_t hash = session_hash(key);
+    uint32_t i = hash & t->slot_mask;
+    struct session *s;
+
+    while (t->slots[i].index != 0) { // Probe until the key or an empty slot turns up
+        if (t->slots[i].hash == hash) {
+            s = &t->sessions[t->slots[i].index - 1];
+            if (memcmp(&s->key, key, sizeof(*key)) == 0) {
+                uint64_t gap = now_ns - s->last_seen_ns;
+                if (s->packets == 1)
+                    s->gap_ns = gap;
+                else // Exponential moving average in integer arithmetic
+                    s->gap_ns = s->gap_ns + (gap >> SESSION_GAP_SHIFT) - (s->gap_ns >> SESSION_GAP_SHIFT);
+                s->referenced = 2;
+                s->packets++;
+                s->bytes += length;
+                s->last_seen_ns = now_ns;
+                return s;
+            }
+        }
+        i = (i + 1) & t->slot_mask;
+    }
+
+    uint32_t index;
+    if (t->count < t->capacity) {
+        index = t->count++;
+    } else {
+        index = session_evict(t);
+        i = hash_slots_free(t->slots, t->slot_mask, hash); // Eviction may have shifted slots: probe again
+    }
+    s = &t->sessions[index];
+    s->key = *key;
+    s->hash = hash;
+    s->referenced = 2;
+    s->packets = 1;
+    s->bytes = length;
+    s->first_seen_ns = now_ns;
+    s->last_seen_ns = now_ns;
+    s->gap_ns = 0;
+    s->bucket_ns = 0;
+    s->limited = 0;
+    t->slots[i].hash = hash;
+    t->slots[i].index = index + 1;
+    return s;
+}
+
+// Shapes a token bucket earning rate tokens a second and holding at most
+// burst. Returns -1 when the rate is too low or too high to express.
+static inline int session_limit_init(struct session_limit *l, double rate, uint32_t burst) {
+    if (rate <= 0 || rate > 1e9 || burst == 0)
+        return -1;
+    l->interval_ns = (uint64_t)(1e9 / rate);
+    if (l->interval_ns == 0 || l->interval_ns > UINT64_MAX / burst)
+        return -1;
+    l->depth_ns = l->interval_ns * burst;
+    return 0;
+}
+
+// Takes a token from the session's bucket, returning 1, or returns 0 and
+// counts the packet as limited when the bucket is empty. The bucket is kept
+// as the time it will be full again: every admitted packet pushes that time
+// one interval later, and a packet finding it more than the bucket depth
+// ahead of now would overdraw the bucket. One compare and one add, no
+// per-tick refill.
+static inline int session_admit(struct session *s, const struct session_limit *l, uint64_t now_ns) {
+    if (l->interval_ns == 0)
+        return 1;
+    uint64_t full = s->bucket_ns > now_ns ? s->bucket_ns : now_ns;
+    if (full + l->interval_ns - now_ns > l->depth_ns) {
+        s->limited++;
+        return 0;
+    }
+    s->bucket_ns = full + l->interval_ns;
+    return 1;
+}
+
+static inline double session_rate(const struct session *s) { // Packets per second from the inter-arrival average
+    return s->gap_ns > 0 ? 1e9 / (double)s->gap_ns : 0.0;
+}
+
+// Copies the n sessions with the most bytes into top, largest first, with one
+// pass over the session array. Returns how many were copied.
+static inline int session_top(const struct session_table *t, struct session *top, int n) {
+    int found = 0;
+    if (n <= 0)
+        return 0;
+    for (uint32_t index = 0; index < t->count; index++) {
+        const struct session *s = &t->sessions[index];
+        if (found == n && s->bytes <= top[n - 1].bytes)
+            continue;
+        int j = found < n ? found++ : n - 1;
+        while (j > 0 && top[j - 1].bytes < s->bytes) { // Insertion into the short sorted list
+            top[j] = top[j - 1];
+            j--;
+        }
+        top[j] = *s;
+    }
+    return found;
+}
+
+#endif
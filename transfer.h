@@ -0,0 +1,242 @@
+// Reliable transfer protocol spoken by send_udp -t 1 and receive_udp -o: the
+// wire format, the sender's RTT estimator and its pluggable congestion control.
+//
+// Every datagram starts with a 24-byte header, big-endian:
+//   0  magic "RT"        2  type       3  SACK blocks (ACK only)
+//   4  transfer ID       8  sequence or cumulative ACK
+//   12 datagram size or receive window
+//   16 sender timestamp in ns, echoed back by ACKs
+// DATA datagrams carry one chunk of the input each, numbered from 0. FIN has
+// no payload and takes the sequence number after the last chunk, so it is
+// retransmitted and acknowledged like data. An ACK carries the next sequence
+// the receiver expects, the reorder slots it has (the sender keeps everything
+// it sends within that many of the cumulative ACK), and up to
+// TRANSFER_MAX_SACK [start, end) blocks of what it holds beyond.
+//
+// Sequence numbers are 32 bits and never wrap: a transfer is at most 2^32 - 1
+// datagrams. Include after platform.h. Both ends drain their socket without
+// blocking and wait with platform_wait(), so one thread handles data, ACKs
+// and timers.
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define TRANSFER_MAGIC 0x5254
+#define TRANSFER_HEADER_SIZE 24
+#define TRANSFER_MAX_PAYLOAD (65507 - TRANSFER_HEADER_SIZE)
+#define TRANSFER_MAX_SACK 16
+#define TRANSFER_SACK_SIZE 8
+#define TRANSFER_MAX_ACK (TRANSFER_HEADER_SIZE + TRANSFER_MAX_SACK * TRANSFER_SACK_SIZE)
+#define TRANSFER_MAX_WINDOW 65536 // Datagrams in flight, and reorder slots
+#define TRANSFER_MIN_RTO_NS 10000000ull // Above scheduler hiccups, so timeouts mean loss
+#define TRANSFER_MAX_RTO_NS 2000000000ull
+#define TRANSFER_INITIAL_RTO_NS 200000000ull
+
+enum transfer_type { TRANSFER_DATA = 1, TRANSFER_FIN, TRANSFER_ACK };
+
+struct transfer_header {
+    uint8_t type;
+    uint8_t blocks; // ACK: SACK blocks after the header
+    uint32_t id; // Picked by the sender; the receiver ignores other transfers
+    uint32_t seq; // DATA, FIN: sequence number; ACK: next sequence expected
+    uint32_t window; // DATA, FIN: the sender's datagram size; ACK: reorder slots
+    uint64_t stamp_ns; // DATA, FIN: sender's clock at sending; ACK: stamp of the datagram that prompted it
+};
+
+struct transfer_sack {
+    uint32_t start;
+    uint32_t end; // One past the last sequence held
+};
+
+static inline void transfer_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline uint32_t transfer_get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void transfer_header_pack(uint8_t *p, const struct transfer_header *h) {
+    p[0] = (uint8_t)(TRANSFER_MAGIC >> 8);
+    p[1] = (uint8_t)(TRANSFER_MAGIC & 0xFF);
+    p[2] = h->type;
+    p[3] = h->blocks;
+    transfer_put32(p + 4, h->id);
+    transfer_put32(p + 8, h->seq);
+    transfer_put32(p + 12, h->window);
+    transfer_put32(p + 16, (uint32_t)(h->stamp_ns >> 32));
+    transfer_put32(p + 20, (uint32_t)h->stamp_ns);
+}
+
+// Returns 0 and fills h when the length bytes at p start with a well-formed
+// header, its SACK blocks included; -1 otherwise
+static inline int transfer_header_unpack(struct transfer_header *h, const uint8_t *p, int length) {
+    if (length < TRANSFER_HEADER_SIZE || transfer_get32(p) >> 16 != TRANSFER_MAGIC)
+        return -1;
+    h->type = p[2];
+    h->blocks = p[3];
+    h->id = transfer_get32(p + 4);
+    h->seq = transfer_get32(p + 8);
+    h->window = transfer_get32(p + 12);
+    h->stamp_ns = ((uint64_t)transfer_get32(p + 16) << 32) | transfer_get32(p + 20);
+    if (h->type < TRANSFER_DATA || h->type > TRANSFER_ACK)
+        return -1;
+    if (h->type == TRANSFER_ACK &&
+        (h->blocks > TRANSFER_MAX_SACK || length != TRANSFER_HEADER_SIZE + h->blocks * TRANSFER_SACK_SIZE))
+        return -1;
+    return 0;
+}
+
+static inline void transfer_sack_unpack(struct transfer_sack *s, const uint8_t *p, int index) {
+    s->start = transfer_get32(p + TRANSFER_HEADER_SIZE + index * TRANSFER_SACK_SIZE);
+    s->end = transfer_get32(p + TRANSFER_HEADER_SIZE + index * TRANSFER_SACK_SIZE + 4);
+}
+
+static inline void transfer_sack_pack(uint8_t *p, int index, uint32_t start, uint32_t end) {
+    transfer_put32(p + TRANSFER_HEADER_SIZE + index * TRANSFER_SACK_SIZE, start);
+    transfer_put32(p + TRANSFER_HEADER_SIZE + index * TRANSFER_SACK_SIZE + 4, end);
+}
+
+// Smoothed RTT and retransmission timeout as in RFC 6298, in nanoseconds
+struct transfer_rtt {
+    uint64_t srtt_ns; // 0 until the first sample
+    uint64_t rttvar_ns;
+    uint64_t min_ns;
+    uint64_t rto_ns;
+};
+
+static inline void transfer_rtt_init(struct transfer_rtt *r) {
+    memset(r, 0, sizeof(*r));
+    r->rto_ns = TRANSFER_INITIAL_RTO_NS;
+}
+
+static inline void transfer_rtt_sample(struct transfer_rtt *r, uint64_t sample_ns) {
+    if (r->srtt_ns == 0) {
+        r->srtt_ns = sample_ns;
+        r->rttvar_ns = sample_ns / 2;
+        r->min_ns = sample_ns;
+    } else {
+        uint64_t error = sample_ns > r->srtt_ns ? sample_ns - r->srtt_ns : r->srtt_ns - sample_ns;
+        r->rttvar_ns = r->rttvar_ns - r->rttvar_ns / 4 + error / 4;
+        r->srtt_ns = r->srtt_ns - r->srtt_ns / 8 + sample_ns / 8;
+        if (sample_ns < r->min_ns)
+            r->min_ns = sample_ns;
+    }
+    r->rto_ns = r->srtt_ns + 4 * r->rttvar_ns;
+    if (r->rto_ns < TRANSFER_MIN_RTO_NS)
+        r->rto_ns = TRANSFER_MIN_RTO_NS;
+    if (r->rto_ns > TRANSFER_MAX_RTO_NS)
+        r->rto_ns = TRANSFER_MAX_RTO_NS;
+}
+
+// Congestion control. The sender keeps at most cwnd datagrams in flight and
+// tells the algorithm about every ACK that delivered something, the first
+// loss of each recovery episode (one per window of data), and timeouts.
+// Algorithms are a table of hooks over shared state; transfer_congestion
+// finds one by name.
+struct congestion {
+    double cwnd; // Datagrams
+    double ssthresh;
+    uint64_t round_end_ns; // delay: end of the current measurement round
+    uint64_t round_min_ns; // delay: lowest RTT seen in the round
+};
+
+struct congestion_ops {
+    const char *name;
+    void (*on_ack)(struct congestion *c, uint32_t delivered, const struct transfer_rtt *rtt, uint64_t rtt_ns,
+                   uint64_t now_ns);
+    void (*on_loss)(struct congestion *c);
+    void (*on_timeout)(struct congestion *c);
+};
+
+#define CONGESTION_MIN_CWND 2.0
+#define CONGESTION_INITIAL_CWND 10.0
+
+static inline void congestion_init(struct congestion *c) {
+    c->cwnd = CONGESTION_INITIAL_CWND;
+    c->ssthresh = 1e9;
+    c->round_end_ns = 0;
+    c->round_min_ns = UINT64_MAX;
+}
+
+static inline void congestion_timeout(struct congestion *c) { // Shared by both: back to slow start from one datagram
+    c->ssthresh = c->cwnd / 2 > CONGESTION_MIN_CWND ? c->cwnd / 2 : CONGESTION_MIN_CWND;
+    c->cwnd = 1;
+}
+
+// aimd: Reno. Slow start doubles the window every round trip up to ssthresh,
+// then it grows by one datagram per round trip; a loss halves it.
+static inline void aimd_on_ack(struct congestion *c, uint32_t delivered, const struct transfer_rtt *rtt,
+                               uint64_t rtt_ns, uint64_t now_ns) {
+    (void)rtt;
+    (void)rtt_ns;
+    (void)now_ns;
+    if (c->cwnd < c->ssthresh)
+        c->cwnd += delivered;
+    else
+        c->cwnd += delivered / c->cwnd;
+}
+
+static inline void aimd_on_loss(struct congestion *c) {
+    c->ssthresh = c->cwnd / 2 > CONGESTION_MIN_CWND ? c->cwnd / 2 : CONGESTION_MIN_CWND;
+    c->cwnd = c->ssthresh;
+}
+
+// delay: Vegas. Once a round trip it compares the round's lowest RTT with the
+// lowest ever seen, and estimates the datagrams queued in the network as
+// cwnd * (rtt - min) / rtt. Slow start ends once one is queued; after that the
+// window grows by one while fewer than two are queued and shrinks by one
+// while more than four are. Queueing delay is the congestion signal, so a
+// loss only takes an eighth off the window.
+#define DELAY_ALPHA 2.0
+#define DELAY_BETA 4.0
+#define DELAY_GAMMA 1.0
+
+static inline void delay_on_ack(struct congestion *c, uint32_t delivered, const struct transfer_rtt *rtt,
+                                uint64_t rtt_ns, uint64_t now_ns) {
+    if (rtt_ns > 0 && rtt_ns < c->round_min_ns)
+        c->round_min_ns = rtt_ns;
+    if (c->cwnd < c->ssthresh)
+        c->cwnd += delivered;
+    if (now_ns < c->round_end_ns || c->round_min_ns == UINT64_MAX || rtt->min_ns == 0)
+        return;
+    double queued = c->cwnd * (double)(c->round_min_ns - rtt->min_ns) / (double)c->round_min_ns;
+    if (c->cwnd < c->ssthresh) {
+        if (queued > DELAY_GAMMA)
+            c->ssthresh = c->cwnd;
+    } else if (queued < DELAY_ALPHA) {
+        c->cwnd += 1;
+    } else if (queued > DELAY_BETA && c->cwnd > CONGESTION_MIN_CWND) {
+        c->cwnd -= 1;
+    }
+    c->round_end_ns = now_ns + rtt->srtt_ns;
+    c->round_min_ns = UINT64_MAX;
+}
+
+static inline void delay_on_loss(struct congestion *c) {
+    c->cwnd -= c->cwnd / 8;
+    if (c->cwnd < CONGESTION_MIN_CWND)
+        c->cwnd = CONGESTION_MIN_CWND;
+    c->ssthresh = c->cwnd;
+}
+
+static const struct congestion_ops congestion_algorithms[] = {
+    { "aimd", aimd_on_ack, aimd_on_loss, congestion_timeout },
+    { "delay", delay_on_ack, delay_on_loss, congestion_timeout },
+};
+
+static inline const struct congestion_ops *transfer_congestion(const char *name) { // NULL when unknown
+    for (size_t i = 0; i < sizeof(congestion_algorithms) / sizeof(congestion_algorithms[0]); i++) {
+        if (strcmp(congestion_algorithms[i].name, name) == 0)
+            return &congestion_algorithms[i];
+    }
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,920 @@
+// Tunnel I/O shared by tunnel_udp_over_tcp_client and
+// tunnel_udp_over_tcp_server: the latency statistics of an event loop and the
+// signals that print them, the receive ring for the TCP stream, batched UDP
+// receive and send, and the outbound TCP queue with its drop policies.
+//
+// Include after platform.h, metrics.h, frame.h, pool.h, compress.h and
+// latency.h. On Linux, define _GNU_SOURCE before the first include, for
+// recvmmsg and sendmmsg.
+
+#ifndef TUNNEL_IO_H
+#define TUNNEL_IO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+
+#ifdef __linux__
+#include <netinet/udp.h>
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103 // Older headers lack the GSO option
+#endif
+#endif
+
+#define UDP_BUFFER_SIZE 65536  // 2^16
+
+// Batched UDP ingress: up to batch_size datagrams are drained per wakeup and
+// their frames coalesced into runs of flush_bytes, sent with one TCP send.
+#define DEFAULT_BATCH_SIZE 32
+#define MAX_BATCH_SIZE 256
+#define DEFAULT_FLUSH_BYTES 32768
+#define DEFAULT_FLUSH_DEADLINE_US 0  // 0 flushes at the end of every wakeup
+#define COALESCE_COPY_LIMIT 2048  // Larger frames are gathered, not copied
+#define DEFAULT_QUEUE_BYTES 1048576  // Outbound TCP queue cap per connection
+#define TX_RING_MIN 16384  // Smallest queue ring borrowed from the pool
+#define MIN_QUEUE_BYTES (FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD)  // Room for the largest frame
+#define DEFAULT_DROP_SIZE 1500  // Frames above this go first under the size policy
+#define RX_SLOT_SIZE (FRAME_MAX_HEADER_SIZE + UDP_BUFFER_SIZE)
+
+// Batched UDP egress: frames parsed from one TCP read leave in one sendmmsg call,
+// and runs of equal-size payloads to one peer as a single GSO send
+#define EGRESS_MAX_VECTORS 1024  // UIO_MAXIOV
+#define GSO_MAX_SEGMENTS 64  // UDP_MAX_SEGMENTS on older kernels
+#define GSO_MAX_SEGMENT_SIZE 1472  // Ethernet MTU less IPv4 and UDP headers
+#define GSO_MAX_BYTES 64000  // Below the 64 KiB limit of one IP datagram
+
+struct latency_stats { // One set per event loop
+    struct latency_histogram transit; // Stamped at the peer's UDP receive, read at this end's UDP send
+    struct latency_histogram udp_to_tcp; // UDP receive until the frame's first byte goes to TCP
+    struct latency_histogram tcp_to_udp; // Arrival of the frame's first byte from TCP until its UDP send
+};
+
+// Prints the histograms of every event loop, merged. One report at a time.
+static inline void latency_report(const struct latency_stats *stats, int loops) {
+    static struct latency_stats sum;
+    memset(&sum, 0, sizeof(sum));
+    for (int l = 0; l < loops; l++) {
+        for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+            sum.transit.counts[i] += latency_count(&stats[l].transit.counts[i]);
+            sum.udp_to_tcp.counts[i] += latency_count(&stats[l].udp_to_tcp.counts[i]);
+            sum.tcp_to_udp.counts[i] += latency_count(&stats[l].tcp_to_udp.counts[i]);
+        }
+    }
+    latency_print("transit", &sum.transit);
+    latency_print("udp->tcp", &sum.udp_to_tcp);
+    latency_print("tcp->udp", &sum.tcp_to_udp);
+    fflush(stdout);
+}
+
+// LATENCY_DUMP_SIGNAL prints the histograms. With -l 1, SIGINT and SIGTERM end
+// the event loop instead of the process, so they are printed on the way out.
+#ifdef SIGUSR1
+#define LATENCY_DUMP_SIGNAL SIGUSR1
+#else
+#define LATENCY_DUMP_SIGNAL SIGBREAK  // Ctrl+Break on Windows
+#endif
+
+static volatile sig_atomic_t latency_dump_requested = 0;
+static volatile sig_atomic_t stop_requested = 0;
+
+static inline void on_latency_signal(int sig) {
+    signal(sig, on_latency_signal); // Windows resets the handler on every delivery
+    if (sig == LATENCY_DUMP_SIGNAL)
+        latency_dump_requested = 1;
+    else
+        stop_requested = 1;
+}
+
+// Prints the histograms when LATENCY_DUMP_SIGNAL has arrived, unless stats is
+// NULL, and returns nonzero once the event loop should end
+static inline int latency_checkpoint(const struct latency_stats *stats, int loops) {
+    if (latency_dump_requested && stats != NULL) {
+        latency_dump_requested = 0;
+        latency_report(stats, loops);
+    }
+    return stop_requested;
+}
+
+static inline void latency_catch_signals(void) {
+    signal(LATENCY_DUMP_SIGNAL, on_latency_signal);
+    signal(SIGINT, on_latency_signal);
+    signal(SIGTERM, on_latency_signal);
+}
+
+// Receive ring for the TCP stream: the frame decoder, plus arrival times for
+// the tcp->udp latency histogram. Bytes from recv land in the decoder once and
+// frames are parsed and forwarded in place; a frame that wraps the end of the
+// ring is handed to the UDP send as two vectors.
+struct frame_ring {
+    uint32_t read_start; // Where the latest read began (-l 1)
+    uint64_t read_ns; // When the latest read arrived (-l 1)
+    uint64_t head_ns; // When the byte at head arrived (-l 1)
+    struct frame_decoder decoder;
+};
+
+// Borrows the ring's memory from the pool for as long as it holds bytes, or
+// while a receive into it is outstanding. Returns -1 when the pool has none.
+static inline int ring_attach(struct frame_ring *r) {
+    if (r->decoder.data == NULL && (r->decoder.data = pool_alloc(FRAME_RING_SIZE)) == NULL) {
+        fprintf(stderr, "Out of memory for a frame ring\n");
+        return -1;
+    }
+    return 0;
+}
+
+static inline void ring_detach(struct frame_ring *r) { // Once every frame in it is consumed and sent
+    if (r->decoder.data != NULL && frame_decoder_buffered(&r->decoder) == 0) {
+        pool_release(r->decoder.data);
+        r->decoder.data = NULL;
+    }
+}
+
+static inline void ring_destroy(struct frame_ring *r) {
+    metrics_sub(METRIC_RING_BYTES, frame_decoder_buffered(&r->decoder)); // Frames that never completed
+    if (r->decoder.data != NULL)
+        pool_release(r->decoder.data);
+}
+
+static inline void ring_received(struct frame_ring *r, int bytes_read) {
+    frame_decoder_commit(&r->decoder, (uint32_t)bytes_read);
+    metrics_add(METRIC_TCP_RX_BYTES, (uint64_t)bytes_read);
+    metrics_add(METRIC_RING_BYTES, (uint64_t)bytes_read);
+}
+
+// Reads from the socket straight into the ring's free space
+static inline int ring_recv(SOCKET s, struct frame_ring *r) {
+    io_vec v[2];
+    if (ring_attach(r) != 0)
+        return SOCKET_ERROR;
+    int bytes_read = recv_vec(s, v, frame_decoder_space(&r->decoder, v));
+    if (bytes_read > 0)
+        ring_received(r, bytes_read);
+    return bytes_read;
+}
+
+static inline void ring_consume(struct frame_ring *r, int length) {
+    frame_decoder_consume(&r->decoder, length);
+    metrics_add(METRIC_TCP_RX_FRAMES, 1);
+    metrics_sub(METRIC_RING_BYTES, (uint64_t)length);
+    if ((int32_t)(r->decoder.head - r->read_start) >= 0) // Now within the latest read
+        r->head_ns = r->read_ns;
+}
+
+// Dates the bytes a read just added at the tail, for the tcp->udp histogram.
+// Bytes at head that arrived before the latest read take the time of the read
+// that was latest when head last moved, which overstates their wait at worst.
+static inline void ring_arrived(struct frame_ring *r, int bytes_read, uint64_t now_ns) {
+    r->read_start = r->decoder.tail - (uint32_t)bytes_read;
+    r->read_ns = now_ns;
+    if (r->decoder.head == r->read_start) // The ring was empty
+        r->head_ns = now_ns;
+}
+
+// Records the latency of a frame at the ring's head that is being handed to UDP
+static inline void latency_record_egress(struct latency_stats *l, const struct frame_ring *r, const struct frame_view *frame,
+                                         uint64_t *now_ns) {
+    if (*now_ns == 0) // One clock read per batch of frames
+        *now_ns = platform_realtime_ns();
+    latency_record(&l->tcp_to_udp, r->head_ns, *now_ns);
+    if (frame->flags & FRAME_FLAG_TIMESTAMP)
+        latency_record(&l->transit, frame->timestamp_ns, *now_ns);
+}
+
+// Batched UDP ingress. Every datagram of a batch lands in its own slot behind
+// FRAME_MAX_HEADER_SIZE bytes of headroom, so writing the header in front of it
+// turns the slot into a complete frame without moving the payload.
+struct rx_batch {
+    int capacity;
+    int count;
+    char *slots;
+    int length[MAX_BATCH_SIZE];
+    struct sockaddr_storage addr[MAX_BATCH_SIZE];
+#ifdef __linux__
+    struct mmsghdr msgs[MAX_BATCH_SIZE];
+    struct iovec iov[MAX_BATCH_SIZE];
+#else
+    socklen_t addr_len[MAX_BATCH_SIZE];
+#endif
+};
+
+static inline char *rx_batch_payload(struct rx_batch *b, int i) { // Datagram i, behind its headroom
+    return b->slots + (size_t)i * RX_SLOT_SIZE + FRAME_MAX_HEADER_SIZE;
+}
+
+static inline int rx_batch_init(struct rx_batch *b, int capacity) {
+    b->slots = malloc((size_t)capacity * RX_SLOT_SIZE);
+    if (b->slots == NULL)
+        return -1;
+    b->capacity = capacity;
+    b->count = 0;
+#ifdef __linux__
+    memset(b->msgs, 0, sizeof(b->msgs));
+    for (int i = 0; i < capacity; i++) {
+        b->iov[i].iov_base = rx_batch_payload(b, i);
+        b->iov[i].iov_len = UDP_BUFFER_SIZE;
+        b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+        b->msgs[i].msg_hdr.msg_name = &b->addr[i];
+    }
+#endif
+    return 0;
+}
+
+static inline void rx_batch_destroy(struct rx_batch *b) {
+    free(b->slots);
+}
+
+// Drains up to capacity datagrams that are already queued on the socket: one
+// recvmmsg call on Linux, a non-blocking recvfrom loop elsewhere. Returns the
+// number received, 0 when nothing was queued, or SOCKET_ERROR.
+static inline int rx_batch_recv(SOCKET s, struct rx_batch *b) {
+#ifdef __linux__
+    for (int i = 0; i < b->capacity; i++)
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addr[i]);
+    int n = recvmmsg(s, b->msgs, (unsigned int)b->capacity, MSG_DONTWAIT, NULL);
+    if (n == -1)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : SOCKET_ERROR;
+    uint64_t bytes = 0;
+    for (int i = 0; i < n; i++) {
+        b->length[i] = (int)b->msgs[i].msg_len;
+        bytes += b->msgs[i].msg_len;
+    }
+    metrics_add(METRIC_UDP_RX_PACKETS, (uint64_t)n);
+    metrics_add(METRIC_UDP_RX_BYTES, bytes);
+#else
+#ifdef _WIN32
+    const int flags = 0; // Windows sockets used here are switched to non-blocking mode instead
+#else
+    const int flags = MSG_DONTWAIT;
+#endif
+    int n = 0;
+    while (n < b->capacity) { // Stops once the socket is drained
+        b->addr_len[n] = sizeof(b->addr[n]);
+        int bytes_read = recvfrom(s, rx_batch_payload(b, n), UDP_BUFFER_SIZE, flags,
+                                  (struct sockaddr *)&b->addr[n], &b->addr_len[n]);
+        if (bytes_read == SOCKET_ERROR) {
+            if (WSAGetLastError() == WSAEWOULDBLOCK)
+                break;
+            if (n == 0)
+                return SOCKET_ERROR;
+            break; // Report the datagrams already received; the error resurfaces next time
+        }
+        b->length[n++] = bytes_read;
+        metrics_add(METRIC_UDP_RX_PACKETS, 1);
+        metrics_add(METRIC_UDP_RX_BYTES, (uint64_t)bytes_read);
+    }
+#endif
+    b->count = n;
+    return n;
+}
+
+// Batched UDP egress for the frames parsed out of one TCP read. Payloads are
+// queued as vectors pointing into the receive ring, so the batch must be
+// flushed before the ring is read into again. On Linux the queue goes out with
+// one sendmmsg call, and consecutive payloads of equal size for the same
+// destination share one message that the kernel splits with UDP_SEGMENT (GSO).
+// Elsewhere every payload is sent as it is queued. With latency set, the
+// histograms are fed once a payload has left, from a clock read after its send.
+struct tx_batch {
+    SOCKET socket; // Every queued message leaves through this socket
+    int capacity; // Messages per flush
+    int gso; // Cleared for good the first time the kernel refuses a segmented send
+    struct latency_stats *latency; // NULL unless -l 1
+#ifdef __linux__
+    int count;
+    int iov_count;
+    struct mmsghdr msgs[MAX_BATCH_SIZE];
+    struct sockaddr_storage addr[MAX_BATCH_SIZE];
+    int segment_size[MAX_BATCH_SIZE];
+    int segments[MAX_BATCH_SIZE];
+    int iov_start[MAX_BATCH_SIZE];
+    char control[MAX_BATCH_SIZE][CMSG_SPACE(sizeof(uint16_t))];
+    struct iovec iov[EGRESS_MAX_VECTORS];
+    uint8_t frame_start[EGRESS_MAX_VECTORS]; // Marks the first vector of every payload
+    uint64_t arrival_ns[EGRESS_MAX_VECTORS]; // By a payload's first vector: its frame's arrival from TCP (-l 1)
+    uint64_t timestamp_ns[EGRESS_MAX_VECTORS]; // And its frame's timestamp, or 0 (-l 1)
+    char *held[MAX_BATCH_SIZE]; // Pool buffers that queued payloads sit in, released by the flush
+    int held_count;
+#endif
+};
+
+static inline void tx_batch_init(struct tx_batch *b, int capacity, int use_gso) {
+    b->socket = INVALID_SOCKET;
+    b->capacity = capacity;
+    b->gso = 0;
+    b->latency = NULL;
+#ifdef __linux__
+    b->count = 0;
+    b->iov_count = 0;
+    b->held_count = 0;
+    if (use_gso) { // Kernels before 4.18 do not know the option at all
+        SOCKET probe = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        int size = 0;
+        if (probe != INVALID_SOCKET) {
+            b->gso = setsockopt(probe, SOL_UDP, UDP_SEGMENT, &size, sizeof(size)) == 0;
+            closesocket(probe);
+        }
+    }
+#else
+    (void)use_gso;
+#endif
+}
+
+static inline void tx_batch_record(struct tx_batch *b, uint64_t arrival_ns, uint64_t timestamp_ns, uint64_t now_ns) {
+    latency_record(&b->latency->tcp_to_udp, arrival_ns, now_ns);
+    if (timestamp_ns != 0)
+        latency_record(&b->latency->transit, timestamp_ns, now_ns);
+}
+
+#ifdef __linux__
+// Records the latency of the payloads that start in iov[first..end), which
+// have just been sent
+static inline void tx_batch_record_sent(struct tx_batch *b, int first, int end) {
+    uint64_t now_ns = platform_realtime_ns();
+    for (int i = first; i < end; i++)
+        if (b->frame_start[i])
+            tx_batch_record(b, b->arrival_ns[i], b->timestamp_ns[i], now_ns);
+}
+
+// Sends the payloads of a segmented message one datagram at a time
+static inline int tx_batch_send_split(struct tx_batch *b, int m) {
+    struct msghdr *hdr = &b->msgs[m].msg_hdr;
+    int first = b->iov_start[m];
+    int end = first + (int)hdr->msg_iovlen;
+    int result = 0;
+    for (int i = first; i < end;) {
+        int j = i + 1;
+        while (j < end && !b->frame_start[j])
+            j++;
+        int sent = send_vec(b->socket, &b->iov[i], j - i, (const struct sockaddr *)hdr->msg_name, hdr->msg_namelen);
+        if (sent == SOCKET_ERROR) {
+            metrics_add(METRIC_SEND_ERRORS, 1);
+            result = SOCKET_ERROR;
+        } else {
+            metrics_add(METRIC_UDP_TX_PACKETS, 1);
+            metrics_add(METRIC_UDP_TX_BYTES, (uint64_t)sent);
+            if (b->latency != NULL)
+                tx_batch_record_sent(b, i, j);
+        }
+        i = j;
+    }
+    return result;
+}
+#endif
+
+// Sends everything queued. A datagram the kernel refuses is dropped and the rest
+// still go out; SOCKET_ERROR reports the last such failure.
+static inline int tx_batch_flush(struct tx_batch *b) {
+#ifdef __linux__
+    int result = 0;
+    for (int m = 0; m < b->count; m++) { // Attach the segment size to messages that carry several payloads
+        struct msghdr *hdr = &b->msgs[m].msg_hdr;
+        hdr->msg_iov = &b->iov[b->iov_start[m]];
+        if (b->segments[m] > 1) {
+            hdr->msg_control = b->control[m];
+            hdr->msg_controllen = sizeof(b->control[m]);
+            struct cmsghdr *cm = CMSG_FIRSTHDR(hdr);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t size = (uint16_t)b->segment_size[m];
+            memcpy(CMSG_DATA(cm), &size, sizeof(size));
+        } else {
+            hdr->msg_control = NULL;
+            hdr->msg_controllen = 0;
+        }
+    }
+
+    int m = 0;
+    while (m < b->count) {
+        int sent = sendmmsg(b->socket, &b->msgs[m], (unsigned int)(b->count - m), 0);
+        if (sent > 0) {
+            for (int k = m; k < m + sent; k++) {
+                metrics_add(METRIC_UDP_TX_PACKETS, (uint64_t)b->segments[k]);
+                metrics_add(METRIC_UDP_TX_BYTES, b->msgs[k].msg_len);
+            }
+            if (b->latency != NULL) {
+                int last = m + sent - 1;
+                tx_batch_record_sent(b, b->iov_start[m], b->iov_start[last] + (int)b->msgs[last].msg_hdr.msg_iovlen);
+            }
+            m += sent;
+            continue;
+        }
+        // The message at m failed. A segmented send the kernel or device cannot
+        // offload turns GSO off and goes out as plain datagrams instead.
+        // A segment larger than the path MTU only splits this message (EINVAL).
+        if (b->segments[m] > 1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+            if (errno != EINVAL)
+                b->gso = 0;
+            if (tx_batch_send_split(b, m) == SOCKET_ERROR)
+                result = SOCKET_ERROR;
+        } else {
+            metrics_add(METRIC_SEND_ERRORS, (uint64_t)b->segments[m]);
+            if (errno != EAGAIN && errno != EWOULDBLOCK) // A lost datagram, not a lost tunnel
+                result = SOCKET_ERROR;
+        }
+        m++;
+    }
+    b->count = 0;
+    b->iov_count = 0;
+    for (int i = 0; i < b->held_count; i++)
+        pool_release(b->held[i]);
+    b->held_count = 0;
+    return result;
+#else
+    (void)b;
+    return 0;
+#endif
+}
+
+#ifdef __linux__
+// References held, the pool buffer a payload about to be queued sits in,
+// unless the batch already does. Flushes first when it holds too many.
+static inline int tx_batch_hold(struct tx_batch *b, char *held) {
+    if (held == NULL || (b->held_count > 0 && b->held[b->held_count - 1] == held))
+        return 0;
+    int result = b->held_count == MAX_BATCH_SIZE ? tx_batch_flush(b) : 0;
+    pool_ref(held);
+    b->held[b->held_count++] = held;
+    return result;
+}
+#endif
+
+// Queues the payload of a frame for to (NULL for a connected socket). Flushes
+// first when the payload goes out through a different socket or the batch is
+// full. A payload outside the ring sits in held, a pool buffer the batch
+// references until the flush. arrival_ns is when the frame's first byte came
+// in from TCP, for the latency histograms.
+static inline int tx_batch_add(struct tx_batch *b, SOCKET s, const struct frame_view *frame, uint64_t arrival_ns,
+                               const struct sockaddr *to, socklen_t to_len, char *held) {
+    const io_vec *payload = frame->payload;
+    int payload_count = frame->payload_count;
+    int payload_length = frame->payload_length;
+    uint64_t timestamp_ns = frame->flags & FRAME_FLAG_TIMESTAMP ? frame->timestamp_ns : 0;
+#ifdef __linux__
+    int result = 0;
+    if (b->count > 0 && (s != b->socket || b->iov_count + payload_count > EGRESS_MAX_VECTORS))
+        result = tx_batch_flush(b);
+    b->socket = s;
+    if (tx_batch_hold(b, held) == SOCKET_ERROR)
+        result = SOCKET_ERROR;
+
+    if (b->gso && b->count > 0 && payload_length > 0 && payload_length <= GSO_MAX_SEGMENT_SIZE) { // Try to extend the last message
+        int m = b->count - 1;
+        struct msghdr *hdr = &b->msgs[m].msg_hdr;
+        int same_peer = hdr->msg_namelen == to_len &&
+                        (to == NULL || memcmp(&b->addr[m], to, to_len) == 0);
+        int total = b->segment_size[m] * b->segments[m];
+        if (same_peer && payload_length == b->segment_size[m] && b->segments[m] < GSO_MAX_SEGMENTS &&
+            total + payload_length <= GSO_MAX_BYTES) {
+            b->arrival_ns[b->iov_count] = arrival_ns;
+            b->timestamp_ns[b->iov_count] = timestamp_ns;
+            for (int i = 0; i < payload_count; i++) {
+                b->frame_start[b->iov_count] = i == 0;
+                b->iov[b->iov_count++] = payload[i];
+            }
+            hdr->msg_iovlen += (size_t)payload_count;
+            b->segments[m]++;
+            return result;
+        }
+    }
+
+    if (b->count == b->capacity) {
+        if (tx_batch_flush(b) == SOCKET_ERROR)
+            result = SOCKET_ERROR;
+        tx_batch_hold(b, held); // The flush let go of it; nothing is queued to flush again
+    }
+
+    int m = b->count++;
+    struct msghdr *hdr = &b->msgs[m].msg_hdr;
+    memset(hdr, 0, sizeof(*hdr));
+    if (to != NULL) {
+        memcpy(&b->addr[m], to, to_len);
+        hdr->msg_name = &b->addr[m];
+    }
+    hdr->msg_namelen = to_len;
+    hdr->msg_iovlen = (size_t)payload_count;
+    b->iov_start[m] = b->iov_count;
+    b->segment_size[m] = payload_length;
+    b->segments[m] = 1;
+    b->arrival_ns[b->iov_count] = arrival_ns;
+    b->timestamp_ns[b->iov_count] = timestamp_ns;
+    for (int i = 0; i < payload_count; i++) {
+        b->frame_start[b->iov_count] = i == 0;
+        b->iov[b->iov_count++] = payload[i];
+    }
+    return result;
+#else
+    (void)b;
+    (void)held; // Sent before this returns
+    if (send_vec(s, (io_vec *)payload, payload_count, to, to_len) == SOCKET_ERROR) {
+        metrics_add(METRIC_SEND_ERRORS, 1);
+        return SOCKET_ERROR;
+    }
+    metrics_add(METRIC_UDP_TX_PACKETS, 1);
+    metrics_add(METRIC_UDP_TX_BYTES, (uint64_t)payload_length);
+    if (b->latency != NULL)
+        tx_batch_record(b, arrival_ns, timestamp_ns, platform_realtime_ns());
+    return 0;
+#endif
+}
+
+// Outbound queue of one non-blocking TCP connection. Frames are appended to a
+// byte ring capped at limit bytes, which doubles as the coalescing buffer: a
+// run goes to the socket once it reaches flush_bytes or its oldest frame has
+// waited flush_deadline_us. When the socket refuses more bytes the queue is
+// blocked until the connection is writable again, and frames that do not fit
+// are dropped by policy instead of stalling the loop. A frame whose first byte
+// has been sent always goes out whole, so the stream stays parseable. With -z,
+// frames are compressed on their way in, or whole runs of them just before
+// they go to the socket.
+enum drop_policy {
+    DROP_TAIL, // Refuse the new frame
+    DROP_OLDEST, // Make room by dropping the oldest frames not yet started
+    DROP_LARGE // Also refuse frames above drop_size while the connection is blocked
+};
+
+struct tx_queue {
+    char *data; // Borrowed from the pool while bytes are queued, else NULL
+    char *sending; // Buffer an asynchronous send (io_uring) reads from, referenced until it completes
+    uint32_t mask; // Ring size - 1; the ring grows by size class while frames arrive, up to limit bytes
+    uint32_t busy_depth; // Deepest since the ring was borrowed; sizes the next one
+    uint32_t limit;
+    uint32_t head; // Next byte to send
+    uint32_t tail; // Where the next frame is appended
+    uint32_t frame_end; // End of the frame head points into; whole frames follow it
+    int blocked; // The socket is full; wait until it becomes writable
+    uint32_t in_flight; // Bytes at the head that an asynchronous send (io_uring) still reads
+    struct latency_histogram *residency; // Where stamped frames record their wait (-l 1), or NULL
+    uint32_t timed; // Start of the first frame whose wait is not recorded yet
+    enum drop_policy policy;
+    int drop_size;
+    uint64_t first_us; // Arrival of the oldest queued frame
+    uint32_t peak; // Deepest the queue has been, in bytes
+    unsigned long long dropped_frames;
+    unsigned long long dropped_bytes;
+    enum compress_mode compression;
+    struct compress_gate frame_gate; // Frames compressed on their own
+    struct compress_gate run_gate; // Runs compressed together
+    uint32_t packed; // Frames before this were already offered to the run compressor
+};
+
+static inline void tx_queue_set_compression(struct tx_queue *q, enum compress_mode mode, int link_mbit) {
+    q->compression = mode;
+    compress_gate_init(&q->frame_gate, link_mbit);
+    compress_gate_init(&q->run_gate, link_mbit);
+}
+
+static inline void tx_queue_init(struct tx_queue *q, uint32_t limit, enum drop_policy policy, int drop_size) {
+    q->data = q->sending = NULL;
+    q->mask = TX_RING_MIN - 1;
+    q->busy_depth = 0;
+    q->limit = limit;
+    q->head = q->tail = q->frame_end = 0;
+    q->blocked = 0;
+    q->in_flight = 0;
+    q->residency = NULL;
+    q->timed = 0;
+    q->policy = policy;
+    q->drop_size = drop_size;
+    q->first_us = 0;
+    q->peak = 0;
+    q->dropped_frames = 0;
+    q->dropped_bytes = 0;
+    q->packed = 0;
+    tx_queue_set_compression(q, COMPRESS_OFF, COMPRESS_DEFAULT_LINK_MBIT);
+}
+
+static inline void tx_queue_destroy(struct tx_queue *q) {
+    metrics_sub(METRIC_QUEUE_BYTES, q->tail - q->head);
+    if (q->data != NULL)
+        pool_release(q->data);
+    if (q->sending != NULL)
+        pool_release(q->sending);
+}
+
+static inline uint32_t tx_queue_depth(const struct tx_queue *q) {
+    return q->tail - q->head;
+}
+
+static inline uint32_t tx_queue_frame_length(const struct tx_queue *q, uint32_t pos) { // Whole frame starting at pos
+    return FRAME_PREFIX_SIZE + (((uint32_t)(uint8_t)q->data[pos & q->mask] << 8) |
+                                (uint8_t)q->data[(pos + 1) & q->mask]);
+}
+
+static inline int tx_queue_vectors(const struct tx_queue *q, io_vec *v) { // Queued bytes as 0-2 vectors
+    uint32_t depth = tx_queue_depth(q);
+    uint32_t start = q->head & q->mask;
+    uint32_t first = q->mask + 1 - start;
+    if (depth == 0)
+        return 0;
+    if (depth <= first) {
+        io_vec_set(&v[0], q->data + start, depth);
+        return 1;
+    }
+    io_vec_set(&v[0], q->data + start, first);
+    io_vec_set(&v[1], q->data, depth - first);
+    return 2;
+}
+
+static inline void ring_copy_in(char *data, uint32_t mask, uint32_t pos, const char *bytes, uint32_t length) {
+    uint32_t start = pos & mask;
+    uint32_t first = mask + 1 - start;
+    if (length <= first) {
+        memcpy(data + start, bytes, length);
+    } else {
+        memcpy(data + start, bytes, first);
+        memcpy(data, bytes + first, length - first);
+    }
+}
+
+// Makes room for length more bytes: borrows a ring from the pool when the
+// queue is empty, sized for what the last busy spell needed, and moves to a
+// larger class when the ring is full. Returns -1 when the pool has no buffer.
+static inline int tx_queue_reserve(struct tx_queue *q, uint32_t length) {
+    uint32_t needed = tx_queue_depth(q) + length;
+    if (q->data != NULL && needed <= q->mask + 1)
+        return 0;
+    uint32_t size = q->data != NULL ? q->mask + 1 : TX_RING_MIN;
+    while (size < needed || (q->data == NULL && size < q->busy_depth))
+        size <<= 1;
+    char *data = pool_alloc(size);
+    if (data == NULL)
+        return -1;
+    if (q->data != NULL) { // Same positions in the larger ring; an in-flight send keeps reading the old one
+        io_vec v[2];
+        uint32_t pos = q->head;
+        for (int i = 0, count = tx_queue_vectors(q, v); i < count; i++) {
+            ring_copy_in(data, size - 1, pos, IO_VEC_BASE(v[i]), (uint32_t)IO_VEC_LEN(v[i]));
+            pos += (uint32_t)IO_VEC_LEN(v[i]);
+        }
+        pool_release(q->data);
+    }
+    q->data = data;
+    q->mask = size - 1;
+    return 0;
+}
+
+// Returns the ring to the pool once nothing is queued or being sent from it
+static inline void tx_queue_release(struct tx_queue *q) {
+    if (q->data == NULL || tx_queue_depth(q) > 0 || q->in_flight > 0)
+        return;
+    pool_release(q->data);
+    q->data = NULL;
+    q->busy_depth = q->busy_depth / 2 > TX_RING_MIN ? q->busy_depth / 2 : 0; // Forget past bursts by halves
+}
+
+// Copies bytes in at the tail. Returns -1 when the ring cannot grow to fit them.
+static inline int tx_queue_append(struct tx_queue *q, const char *bytes, uint32_t length) {
+    if (tx_queue_reserve(q, length) != 0)
+        return -1;
+    ring_copy_in(q->data, q->mask, q->tail, bytes, length);
+    q->tail += length;
+    metrics_add(METRIC_QUEUE_BYTES, length);
+    if (tx_queue_depth(q) > q->peak)
+        q->peak = tx_queue_depth(q);
+    if (tx_queue_depth(q) > q->busy_depth)
+        q->busy_depth = tx_queue_depth(q);
+    return 0;
+}
+
+// Records how long each stamped frame starting before end waited to be handed
+// to the socket, once per frame
+static inline void tx_queue_record_starts(struct tx_queue *q, uint32_t end) {
+    uint64_t now_ns = 0;
+    while ((int32_t)(end - q->timed) > 0) {
+        uint32_t pos = q->timed;
+        if (q->data[(pos + 3) & q->mask] & FRAME_FLAG_TIMESTAMP) {
+            char header[FRAME_MAX_HEADER_SIZE];
+            for (uint32_t i = 0; i < FRAME_MAX_HEADER_SIZE; i++)
+                header[i] = q->data[(pos + i) & q->mask];
+            if (now_ns == 0)
+                now_ns = platform_realtime_ns();
+            latency_record(q->residency, frame_timestamp(header), now_ns);
+        }
+        q->timed += tx_queue_frame_length(q, pos);
+    }
+}
+
+static inline void tx_queue_advance(struct tx_queue *q, uint32_t sent) { // Releases bytes the socket took
+    q->head += sent;
+    metrics_add(METRIC_TCP_TX_BYTES, sent);
+    metrics_sub(METRIC_QUEUE_BYTES, sent);
+    while ((int32_t)(q->frame_end - q->head) < 0)
+        q->frame_end += tx_queue_frame_length(q, q->frame_end);
+    if (q->residency != NULL)
+        tx_queue_record_starts(q, q->head);
+    tx_queue_release(q);
+}
+
+// Drops whole frames after the one in progress until length more bytes fit.
+// The unsent rest of the frame in progress is slid forward so it sits right
+// in front of the first frame kept.
+static inline void tx_queue_drop_oldest(struct tx_queue *q, uint32_t length) {
+    if (q->in_flight > 0) // The bytes an asynchronous send reads from must stay put
+        return;
+    uint32_t keep = q->frame_end - q->head;
+    uint32_t drop_to = q->frame_end;
+    while (q->tail - drop_to + keep + length > q->limit && drop_to != q->tail) {
+        uint32_t frame_length = tx_queue_frame_length(q, drop_to);
+        drop_to += frame_length;
+        q->dropped_frames++;
+        q->dropped_bytes += frame_length;
+        metrics_add(METRIC_DROPS, 1);
+    }
+    if (drop_to == q->frame_end)
+        return;
+    for (uint32_t i = keep; i > 0; i--)
+        q->data[(drop_to - keep + i - 1) & q->mask] = q->data[(q->head + i - 1) & q->mask];
+    metrics_sub(METRIC_QUEUE_BYTES, drop_to - q->frame_end);
+    q->head = drop_to - keep;
+    q->frame_end = drop_to;
+    if ((int32_t)(q->timed - drop_to) < 0) // Dropped frames are never handed to the socket
+        q->timed = drop_to;
+}
+
+// Compresses a frame on its own when the queue compresses frames: every frame
+// with -z frame, and with -z batch those too large to join a run. Returns a
+// pool buffer holding the compressed frame, with *length updated, or NULL to
+// queue the frame as it is.
+static inline char *tx_queue_pack_frame(struct tx_queue *q, const char *frame, int *length) {
+    if (q->compression == COMPRESS_OFF || *length < COMPRESS_MIN_FRAME ||
+        (q->compression == COMPRESS_RUNS && *length <= COALESCE_COPY_LIMIT) || !compress_gate_open(&q->frame_gate))
+        return NULL;
+    return compress_frame(&q->frame_gate, frame, length);
+}
+
+// With -z batch, compresses the whole frames queued behind the one in progress
+// into batch frames, a run at a time. A run ends at COMPRESS_RUN_BYTES,
+// COMPRESS_RUN_FRAMES or a frame that is compressed already. Runs that do not
+// shrink, or that the gate skips, stay as they are, and everything moves down
+// to close the gaps, so the tail drops by the bytes saved. A batch frame's
+// wait is recorded once, from the stamp of its first frame.
+static inline void tx_queue_pack_runs(struct tx_queue *q) {
+    if (q->compression != COMPRESS_RUNS || q->in_flight > 0) // The bytes an asynchronous send reads must stay put
+        return;
+    uint32_t from = q->frame_end;
+    if ((int32_t)(q->packed - from) > 0)
+        from = q->packed;
+    if (q->residency != NULL && (int32_t)(q->timed - from) > 0) // Already handed to the socket once
+        from = q->timed;
+    uint32_t to = from;
+    char *scratch = NULL; // The compressed run, then room to join a run that wraps
+    while (from != q->tail) {
+        uint32_t end = from;
+        int frames = 0;
+        while (end != q->tail && frames < COMPRESS_RUN_FRAMES &&
+               !(q->data[(end + 3) & q->mask] & FRAME_FLAG_COMPRESSED) &&
+               end - from + tx_queue_frame_length(q, end) <= COMPRESS_RUN_BYTES) {
+            end += tx_queue_frame_length(q, end);
+            frames++;
+        }
+        if (frames == 0) // Compressed already, or too large for a run
+            end = from + tx_queue_frame_length(q, from);
+        uint32_t length = end - from;
+        int packed = 0;
+        if (frames > 0 && compress_gate_open(&q->run_gate) &&
+            (scratch != NULL || (scratch = pool_alloc(2 * COMPRESS_RUN_BYTES)) != NULL)) {
+            uint32_t start = from & q->mask;
+            uint32_t first = q->mask + 1 - start;
+            const char *run = q->data + start;
+            if (length > first) {
+                memcpy(scratch + COMPRESS_RUN_BYTES, run, first);
+                memcpy(scratch + COMPRESS_RUN_BYTES + first, q->data, length - first);
+                run = scratch + COMPRESS_RUN_BYTES;
+            }
+            packed = compress_run(&q->run_gate, run, (int)length, scratch);
+        }
+        if (packed > 0) {
+            ring_copy_in(q->data, q->mask, to, scratch, (uint32_t)packed);
+            to += (uint32_t)packed;
+        } else {
+            for (uint32_t i = 0; to != from && i < length; i++) // Into the room earlier runs gave up
+                q->data[(to + i) & q->mask] = q->data[(from + i) & q->mask];
+            to += length;
+        }
+        from = end;
+    }
+    if (scratch != NULL)
+        pool_release(scratch);
+    metrics_sub(METRIC_QUEUE_BYTES, q->tail - to);
+    q->tail = q->packed = to;
+}
+
+// Queues a complete frame unless the drop policy refuses it
+static inline void tx_queue_admit(struct tx_queue *q, const char *frame, int length, uint64_t now_us) {
+    if (q->policy == DROP_LARGE && q->blocked && length > q->drop_size) {
+        q->dropped_frames++;
+        q->dropped_bytes += (unsigned long long)length;
+        metrics_add(METRIC_DROPS, 1);
+        return;
+    }
+    if (tx_queue_depth(q) + (uint32_t)length > q->limit) {
+        tx_queue_pack_runs(q); // Compressing what waits may make room
+        if (q->policy == DROP_OLDEST)
+            tx_queue_drop_oldest(q, (uint32_t)length);
+        if (tx_queue_depth(q) + (uint32_t)length > q->limit) {
+            q->dropped_frames++;
+            q->dropped_bytes += (unsigned long long)length;
+            metrics_add(METRIC_DROPS, 1);
+            return;
+        }
+    }
+    if (tx_queue_append(q, frame, (uint32_t)length) != 0) { // The pool is out of memory
+        q->dropped_frames++;
+        q->dropped_bytes += (unsigned long long)length;
+        metrics_add(METRIC_DROPS, 1);
+        return;
+    }
+    if (tx_queue_depth(q) == (uint32_t)length)
+        q->first_us = now_us;
+    metrics_add(METRIC_TCP_TX_FRAMES, 1);
+}
+
+// Writes queued bytes until the queue is empty or the socket is full
+static inline int tx_queue_send(SOCKET s, struct tx_queue *q) {
+    tx_queue_pack_runs(q);
+    while (tx_queue_depth(q) > 0) {
+        io_vec v[2];
+        int count = tx_queue_vectors(q, v);
+        int sent = send_vec(s, v, count, NULL, 0);
+        if (sent == SOCKET_ERROR) {
+            if (!platform_would_block()) {
+                metrics_add(METRIC_SEND_ERRORS, 1);
+                return SOCKET_ERROR;
+            }
+            q->blocked = 1;
+            return 0;
+        }
+        tx_queue_advance(q, (uint32_t)sent);
+    }
+    q->blocked = 0;
+    return 0;
+}
+
+// Queues one frame bound for the TCP connection and sends once flush_bytes are
+// waiting. While the socket keeps up, a frame larger than COALESCE_COPY_LIMIT is
+// sent straight from the caller's buffer behind whatever is queued, and only
+// a part the socket did not take is copied.
+static inline int tx_queue_push(SOCKET s, struct tx_queue *q, const char *frame, int length,
+                                int flush_bytes, uint64_t now_us) {
+    if (length > COALESCE_COPY_LIMIT && !q->blocked) {
+        io_vec v[3];
+        tx_queue_pack_runs(q);
+        int count = tx_queue_vectors(q, v);
+        uint32_t queued = tx_queue_depth(q);
+        io_vec_set(&v[count++], frame, (size_t)length);
+
+        int sent = send_vec(s, v, count, NULL, 0);
+        if (sent == SOCKET_ERROR) {
+            if (!platform_would_block()) {
+                metrics_add(METRIC_SEND_ERRORS, 1);
+                return SOCKET_ERROR;
+            }
+            sent = 0;
+        }
+        if ((uint32_t)sent <= queued) { // The frame itself was not started
+            tx_queue_advance(q, (uint32_t)sent);
+            q->blocked = 1;
+            tx_queue_admit(q, frame, length, now_us);
+            return 0;
+        }
+        tx_queue_advance(q, queued);
+        metrics_add(METRIC_TCP_TX_BYTES, (uint64_t)(sent - (int)queued));
+        metrics_add(METRIC_TCP_TX_FRAMES, 1);
+        uint64_t timestamp_ns = q->residency != NULL ? frame_timestamp(frame) : 0;
+        if (timestamp_ns != 0)
+            latency_record(q->residency, timestamp_ns, platform_realtime_ns());
+        int rest = sent - (int)queued;
+        if (rest < length) { // Started: the remainder must follow, whatever the policy
+            q->first_us = now_us;
+            if (tx_queue_append(q, frame + rest, (uint32_t)(length - rest)) != 0) {
+                fprintf(stderr, "Out of memory for the rest of a frame\n");
+                return SOCKET_ERROR; // The stream cannot continue without it
+            }
+            q->frame_end = q->timed = q->tail;
+            q->blocked = 1;
+        }
+        return 0;
+    }
+
+    tx_queue_admit(q, frame, length, now_us);
+    if (!q->blocked && tx_queue_depth(q) >= (uint32_t)flush_bytes)
+        return tx_queue_send(s, q);
+    return 0;
+}
+
+static inline int parse_drop_policy(const char *name, enum drop_policy *policy) {
+    if (strcmp(name, "tail") == 0)
+        *policy = DROP_TAIL;
+    else if (strcmp(name, "oldest") == 0)
+        *policy = DROP_OLDEST;
+    else if (strcmp(name, "size") == 0)
+        *policy = DROP_LARGE;
+    else
+        return -1;
+    return 0;
+}
+
+#endif
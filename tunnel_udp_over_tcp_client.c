@@ -1,39 +1,603 @@
+#ifdef __linux__
+#define _GNU_SOURCE // recvmmsg
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
 #include <stdint.h>
+#include <signal.h>
+
+#include "platform.h"
+
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#endif
+
+#include "metrics.h"
+#include "frame.h"
+#include "pool.h"
+#include "compress.h"
+#include "hash_slots.h"
+#include "latency.h"
+#include "tunnel_io.h"
+#include "uring.h"
+
+#define DEFAULT_MAX_FLOWS 4096
+#define DEFAULT_IDLE_TIMEOUT_SECONDS 60
+#define SWEEP_INTERVAL_MS 1000
+
+// Flow IDs carry the flow's slot in the dense flow array in their low bits and
+// a generation counter above it, so the TCP->UDP direction resolves an ID with
+// one array access and a stale ID from an evicted flow never matches.
+#define FLOW_INDEX_BITS 20
+#define FLOW_INDEX_MASK ((1u << FLOW_INDEX_BITS) - 1)
+#define FLOW_MAX_CAPACITY (1u << FLOW_INDEX_BITS)
+
+// Striping: flows are spread over up to MAX_STRIPES parallel TCP connections by
+// a hash of their peer address, so a loss on one connection only stalls the
+// flows behind it. Each connection opens with a HELLO control frame on flow 0
+// naming the session, which lets the server join the stripes into one session.
+#define MAX_STRIPES 16
+#define CONTROL_FLOW_ID 0
+#define CONTROL_HELLO 1
+#define HELLO_PAYLOAD_SIZE 11  // Type, 64-bit session ID, stripe index, stripe count
+
+struct flow_key { // Compact copy of the peer's address, compared bytewise
+    uint8_t addr[16];
+    uint16_t port;   // Network byte order
+    uint16_t family;
+};
+
+struct flow {
+    struct flow_key key;
+    uint32_t hash; // Of the key; also picks the flow's TCP stripe
+    uint32_t id;
+    uint32_t in_use;
+    uint64_t last_seen_ms;
+};
+
+// hash_slots.h index over a dense flow array. Slots are sized to at least
+// twice the flow capacity, so probe sequences stay short.
+struct flow_table {
+    struct hash_slot *slots;
+    uint32_t slot_mask;
+    struct flow *flows;
+    uint32_t *free_list;
+    uint32_t free_count;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t sweep_cursor;
+    uint64_t idle_timeout_ms;
+    unsigned long dropped; // Datagrams refused because the table was full
+};
+
+static int flow_key_from_addr(struct flow_key *key, const struct sockaddr_storage *addr) {
+    memset(key, 0, sizeof(*key));
+    key->family = addr->ss_family;
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        memcpy(key->addr, &in->sin_addr, 4);
+        key->port = in->sin_port;
+        return 0;
+    }
+    if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        memcpy(key->addr, &in6->sin6_addr, 16);
+        key->port = in6->sin6_port;
+        return 0;
+    }
+    return -1;
+}
+
+static socklen_t flow_key_to_addr(const struct flow_key *key, struct sockaddr_storage *addr) {
+    memset(addr, 0, sizeof(*addr));
+    if (key->family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *)addr;
+        in->sin_family = AF_INET;
+        memcpy(&in->sin_addr, key->addr, 4);
+        in->sin_port = key->port;
+        return sizeof(*in);
+    }
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+    in6->sin6_family = AF_INET6;
+    memcpy(&in6->sin6_addr, key->addr, 16);
+    in6->sin6_port = key->port;
+    return sizeof(*in6);
+}
+
+static uint32_t flow_hash(const struct flow_key *key) { // Word-wise mix with a murmur3 finalizer
+    uint32_t words[5];
+    memcpy(words, key, sizeof(words));
+    uint32_t h = 0x9e3779b9u;
+    for (int i = 0; i < 5; i++) {
+        h ^= words[i];
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+    }
+    h ^= h >> 16;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int flow_table_init(struct flow_table *t, uint32_t capacity, uint64_t idle_timeout_ms) {
+    uint32_t slots = 16;
+    while (slots < capacity * 2)
+        slots <<= 1;
+
+    t->slots = calloc(slots, sizeof(*t->slots));
+    t->flows = calloc(capacity, sizeof(*t->flows));
+    t->free_list = malloc(capacity * sizeof(*t->free_list));
+    if (t->slots == NULL || t->flows == NULL || t->free_list == NULL) {
+        free(t->slots);
+        free(t->flows);
+        free(t->free_list);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < capacity; i++) { // Hand out low indexes first
+        t->free_list[i] = capacity - 1 - i;
+        t->flows[i].id = i; // Generation 0, bumped to 1 on first use
+    }
+    t->slot_mask = slots - 1;
+    t->free_count = capacity;
+    t->capacity = capacity;
+    t->count = 0;
+    t->sweep_cursor = 0;
+    t->idle_timeout_ms = idle_timeout_ms;
+    t->dropped = 0;
+    return 0;
+}
+
+static void flow_table_destroy(struct flow_table *t) {
+    metrics_sub(METRIC_FLOWS, t->count);
+    free(t->slots);
+    free(t->flows);
+    free(t->free_list);
+}
 
-#pragma comment(lib, "ws2_32.lib")
+// Finds the flow for a peer, creating it when unseen. Returns NULL when full.
+static struct flow *flow_lookup(struct flow_table *t, const struct flow_key *key, uint64_t now) {
+    uint32_t hash = flow_hash(key);
+    uint32_t i = hash & t->slot_mask;
+
+    while (t->slots[i].index != 0) { // Probe until the key or an empty slot turns up
+        if (t->slots[i].hash == hash) {
+            struct flow *f = &t->flows[t->slots[i].index - 1];
+            if (memcmp(&f->key, key, sizeof(*key)) == 0) {
+                f->last_seen_ms = now;
+                return f;
+            }
+        }
+        i = (i + 1) & t->slot_mask;
+    }
 
-#define UDP_BUFFER_SIZE 65536  // 2^16
-#define TCP_BUFFER_SIZE 65538  // UDP_BUFFER_SIZE + 2 bytes for length
-#define RECONSTRUCTION_BUFFER_SIZE 131076  // 2^17 + 4
+    if (t->free_count == 0)
+        return NULL;
+
+    uint32_t index = t->free_list[--t->free_count];
+    struct flow *f = &t->flows[index];
+    uint32_t generation = (f->id >> FLOW_INDEX_BITS) + 1;
+    if ((generation & (0xFFFFFFFFu >> FLOW_INDEX_BITS)) == 0) // Skip generation 0 so no ID is ever 0
+        generation = 1;
+    f->id = (generation << FLOW_INDEX_BITS) | index;
+    f->key = *key;
+    f->hash = hash;
+    f->in_use = 1;
+    f->last_seen_ms = now;
+
+    t->slots[i].hash = hash;
+    t->slots[i].index = index + 1;
+    t->count++;
+    metrics_add(METRIC_FLOWS, 1);
+    return f;
+}
+
+static struct flow *flow_by_id(struct flow_table *t, uint32_t id) {
+    uint32_t index = id & FLOW_INDEX_MASK;
+    if (index >= t->capacity)
+        return NULL;
+    struct flow *f = &t->flows[index];
+    if (!f->in_use || f->id != id) // Evicted, or an older generation of this slot
+        return NULL;
+    return f;
+}
+
+static void flow_remove(struct flow_table *t, struct flow *f) {
+    uint32_t index = (uint32_t)(f - t->flows);
+    hash_slots_remove(t->slots, t->slot_mask, f->hash, index);
+    f->in_use = 0;
+    t->free_list[t->free_count++] = index;
+    t->count--;
+    metrics_sub(METRIC_FLOWS, 1);
+}
 
-static int convert_port_name(uint16_t *port, const char *port_name) {
-    char *end;
-    long long int nn;
-    uint16_t t;
-    long long int tt;
+// Evicts flows idle for longer than the timeout, scanning a bounded slice per call
+static void flow_sweep(struct flow_table *t, uint64_t now, uint32_t budget) {
+    if (budget > t->capacity)
+        budget = t->capacity;
+    while (budget-- > 0) {
+        struct flow *f = &t->flows[t->sweep_cursor];
+        if (f->in_use && now - f->last_seen_ms > t->idle_timeout_ms)
+            flow_remove(t, f);
+        if (++t->sweep_cursor == t->capacity)
+            t->sweep_cursor = 0;
+    }
+}
 
-    if (port_name == NULL || *port_name == '\0')
+struct client_options {
+    uint32_t max_flows;
+    uint64_t idle_timeout_ms;
+    int batch_size;
+    int flush_bytes;
+    uint64_t flush_deadline_us;
+    int use_gso;
+    uint32_t queue_bytes;
+    enum drop_policy drop_policy;
+    int drop_size;
+    int stripes;
+    int use_uring; // -e uring, when the kernel supports it
+    int latency; // -l 1: stamp frames and keep latency histograms
+    enum compress_mode compression; // -z off|frame|batch
+    int link_mbit; // -r: link rate that compression's CPU time is weighed against, 0 to ignore it
+    const char *stats; // -m unix:<path> or udp:<port>, or NULL
+};
+
+static int parse_options(int argc, char *argv[], struct client_options *options) {
+    for (int i = 4; i < argc; i++) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[i]);
+            return -1;
+        }
+        long value = strtol(argv[i + 1], NULL, 10);
+        if (strcmp(argv[i], "-f") == 0 && value > 0 && value <= (long)FLOW_MAX_CAPACITY) {
+            options->max_flows = (uint32_t)value;
+        } else if (strcmp(argv[i], "-i") == 0 && value > 0) {
+            options->idle_timeout_ms = (uint64_t)value * 1000;
+        } else if (strcmp(argv[i], "-b") == 0 && value > 0 && value <= MAX_BATCH_SIZE) {
+            options->batch_size = (int)value;
+        } else if (strcmp(argv[i], "-t") == 0 && value >= 0 && value <= FRAME_MAX_PAYLOAD * 4) {
+            options->flush_bytes = (int)value;
+        } else if (strcmp(argv[i], "-d") == 0 && value >= 0) {
+            options->flush_deadline_us = (uint64_t)value;
+        } else if (strcmp(argv[i], "-g") == 0 && (value == 0 || value == 1)) {
+            options->use_gso = (int)value;
+        } else if (strcmp(argv[i], "-q") == 0 && value >= MIN_QUEUE_BYTES && value <= (1L << 30)) {
+            options->queue_bytes = (uint32_t)value;
+        } else if (strcmp(argv[i], "-p") == 0 && parse_drop_policy(argv[i + 1], &options->drop_policy) == 0) {
+            // Named policy, already stored
+        } else if (strcmp(argv[i], "-s") == 0 && value > 0) {
+            options->drop_size = (int)value;
+        } else if (strcmp(argv[i], "-k") == 0 && value > 0 && value <= MAX_STRIPES) {
+            options->stripes = (int)value;
+        } else if (strcmp(argv[i], "-e") == 0 && (strcmp(argv[i + 1], "poll") == 0 || strcmp(argv[i + 1], "uring") == 0)) {
+            options->use_uring = strcmp(argv[i + 1], "uring") == 0;
+        } else if (strcmp(argv[i], "-l") == 0 && (value == 0 || value == 1)) {
+            options->latency = (int)value;
+        } else if (strcmp(argv[i], "-z") == 0 && parse_compress_mode(argv[i + 1], &options->compression) == 0) {
+            // Named mode, already stored
+        } else if (strcmp(argv[i], "-r") == 0 && value >= 0 && value <= 1000000) {
+            options->link_mbit = (int)value;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            options->stats = argv[i + 1];
+        } else {
+            fprintf(stderr, "Invalid option: %s %s\n", argv[i], argv[i + 1]);
+            return -1;
+        }
+        i++;
+    }
+    if ((uint32_t)options->flush_bytes > options->queue_bytes) {
+        fprintf(stderr, "Flush threshold %d exceeds the queue cap of %u bytes\n",
+                options->flush_bytes, options->queue_bytes);
         return -1;
+    }
+    return 0;
+}
 
-    nn = strtoll(port_name, &end, 0);
-    if (*end != '\0')
+struct stripe { // One of the parallel TCP connections to the server
+    SOCKET socket;
+    struct frame_ring ring; // Bytes received from the TCP server
+    struct tx_queue tx; // Frames not yet sent to the TCP server
+    unsigned long long reported_drops; // tx.dropped_frames at the last report
+    unsigned watched; // Readiness events registered with the poller
+    unsigned ready; // Readiness events the last wait reported
+#ifdef HAVE_IO_URING
+    struct msghdr recv_msg; // io_uring backend: the ring recv and queue send in flight
+    struct iovec recv_iov[2];
+    struct msghdr send_msg;
+    struct iovec send_iov[2];
+    int recv_armed; // A recv, or a resume once send slots are back, ends the stripe's link chain
+#endif
+};
+
+static struct stripe *stripe_of(struct stripe *stripes, int stripe_count, const struct flow *flow) {
+    return &stripes[((uint64_t)flow->hash * (uint32_t)stripe_count) >> 32]; // A flow always uses the same stripe
+}
+
+// Evicts idle flows and reports datagrams dropped since the last sweep
+static void sweep_flows(struct flow_table *flows, struct stripe *stripes, int stripe_count, uint32_t queue_bytes,
+                        uint64_t now, unsigned long *reported_drops) {
+    flow_sweep(flows, now, flows->capacity / 4 + 1); // A full pass over the table every few seconds
+    if (flows->dropped != *reported_drops) {
+        fprintf(stderr, "Flow table full (%u flows): %lu datagrams dropped\n",
+                flows->capacity, flows->dropped - *reported_drops);
+        *reported_drops = flows->dropped;
+    }
+    for (int k = 0; k < stripe_count; k++) {
+        struct stripe *st = &stripes[k];
+        if (st->tx.dropped_frames != st->reported_drops) {
+            fprintf(stderr, "TCP queue full on stripe %d: %llu frames dropped, depth %u of %u bytes\n",
+                    k, st->tx.dropped_frames - st->reported_drops, tx_queue_depth(&st->tx), queue_bytes);
+            st->reported_drops = st->tx.dropped_frames;
+        }
+    }
+}
+
+static uint64_t new_session_id(void) { // Distinct per client run; mixed with splitmix64
+    uint64_t x = platform_monotonic_us() ^ (uint64_t)(uintptr_t)&x;
+#ifdef _WIN32
+    x ^= (uint64_t)GetCurrentProcessId() << 32;
+#else
+    x ^= (uint64_t)getpid() << 32;
+#endif
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// Announces a stripe of a session; sent before anything else on the connection
+static int send_hello(SOCKET s, uint64_t session_id, int index, int count) {
+    char frame[FRAME_HEADER_SIZE + HELLO_PAYLOAD_SIZE];
+    char *p = frame + FRAME_HEADER_SIZE;
+    frame_prepend_header(p, HELLO_PAYLOAD_SIZE, CONTROL_FLOW_ID, 0);
+    p[0] = CONTROL_HELLO;
+    for (int i = 0; i < 8; i++)
+        p[1 + i] = (char)(session_id >> (56 - 8 * i));
+    p[9] = (char)index;
+    p[10] = (char)count;
+
+    int sent = 0;
+    while (sent < (int)sizeof(frame)) { // The socket is still blocking here
+        int n = send(s, frame + sent, (int)sizeof(frame) - sent, 0);
+        if (n == SOCKET_ERROR)
+            return SOCKET_ERROR;
+        sent += n;
+    }
+    return 0;
+}
+
+static SOCKET connect_stripe(struct addrinfo *result) { // First address that accepts a connection
+    for (struct addrinfo *rp = result; rp != NULL; rp = rp->ai_next) {
+        SOCKET s = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (s == INVALID_SOCKET) // Check if socket creation was successful
+            continue;
+        if (connect(s, rp->ai_addr, (int)rp->ai_addrlen) != SOCKET_ERROR) // Check if connection was successful
+            return s;
+        closesocket(s);
+    }
+    return INVALID_SOCKET;
+}
+
+#ifdef HAVE_IO_URING
+// Operations in flight carry their kind in the top byte of user_data and a
+// stripe or send slot index below it
+enum uring_op { URING_UDP_RECV = 1, URING_UDP_SEND, URING_TCP_RECV, URING_TCP_RESUME, URING_TCP_SEND, URING_TCP_POLL };
+#define URING_TAG(op, index) (((uint64_t)(op) << 56) | (uint64_t)(index))
+#define URING_OP(data) ((int)((data) >> 56))
+#define URING_INDEX(data) ((int)((data) & 0xFFFFFFFFu))
+#define URING_CLIENT_BUFFERS 64  // Provided UDP receive buffers
+
+// Sends the complete frames waiting in a stripe's ring to their UDP peers,
+// then arms the ring's recv behind those sends. When every send slot is busy
+// a NOP takes its place, and the rest of the ring is forwarded once the NOP
+// completes: a new chain started earlier could overtake the sends still
+// queued in this one, since the links after a chain's head run later.
+static int uring_forward(struct uring *u, struct uring_send_pool *pool, SOCKET udp_socket, struct flow_table *flows,
+                         struct stripe *st, int k, uint64_t now, unsigned long *unknown_flow_frames,
+                         struct latency_stats *latency) {
+    if (ring_attach(&st->ring) != 0) // The receive always has a ring to land in
         return -1;
-    if (nn < 0)
+    if (uring_sq_space(u) < (unsigned)pool->free_count + 1) // A link chain must not span two submissions
+        uring_submit(u, 0, 0);
+
+    struct sockaddr_storage peer_addr;
+    struct frame_view frame, view;
+    struct frame_unpack unpack;
+    uint64_t now_ns = 0;
+    int status;
+    while ((status = frame_decoder_next(&st->ring.decoder, &frame)) == 1) {
+        if (frame_unpack_open(&unpack, &frame) != 0) {
+            status = -1;
+            break;
+        }
+        if (unpack.count > pool->free_count) { // A batch goes out whole; the frame stays in the ring
+            frame_unpack_close(&unpack);
+            break;
+        }
+        while (frame_unpack_next(&unpack, &view)) {
+            struct flow *flow = flow_by_id(flows, view.flow_id);
+            if (flow != NULL) { // Queue for the UDP peer that owns this flow
+                flow->last_seen_ms = now;
+                socklen_t addr_len = flow_key_to_addr(&flow->key, &peer_addr);
+                uring_send_datagram(u, pool, udp_socket, &view, &peer_addr, addr_len, NULL, unpack.buffer,
+                                    URING_TAG(URING_UDP_SEND, 0)); // Cannot run out of slots: counted above
+                if (latency != NULL)
+                    latency_record_egress(latency, &st->ring, &view, &now_ns);
+            } else {
+                (*unknown_flow_frames)++; // Reply for a flow that was already evicted
+                metrics_add(METRIC_DROPS, 1);
+            }
+        }
+        frame_unpack_close(&unpack); // Each send holds its own reference
+        ring_consume(&st->ring, frame.length);
+    }
+    if (status < 0) { // Not a v2 frame
+        fprintf(stderr, "Malformed frame from TCP server\n");
         return -1;
+    }
 
-    t = (uint16_t) nn;
-    tt = (long long int) t;
-    if (tt != nn)
-        return -1;
+    if (status == 1)
+        uring_prep_nop(u, URING_TAG(URING_TCP_RESUME, k));
+    else
+        uring_prep_ring_recv(u, st->socket, &st->ring, &st->recv_msg, st->recv_iov, URING_TAG(URING_TCP_RECV, k));
+    st->recv_armed = 1;
+    return 0;
+}
+
+// The io_uring event loop. Returns 1 when io_uring cannot be used, before
+// anything was touched, and 0 once the tunnel ends.
+static int run_uring(SOCKET udp_socket, struct flow_table *flows, struct stripe *stripes, int stripe_count,
+                     const struct client_options *options, int gso, unsigned long *unknown_flow_frames,
+                     struct latency_stats *latency) {
+    struct uring u;
+    struct uring_buffers buffers;
+    struct uring_send_pool pool;
+    if (uring_init(&u, URING_ENTRIES) != 0)
+        return 1;
+    if (uring_buffers_init(&u, &buffers, 0, URING_CLIENT_BUFFERS, URING_BUFFER_SIZE) != 0) {
+        uring_destroy(&u);
+        return 1;
+    }
+    if (uring_send_pool_init(&pool, gso) != 0) {
+        uring_destroy(&u);
+        uring_buffers_destroy(&buffers);
+        return 1;
+    }
+    printf("Using the io_uring backend\n");
+
+    struct msghdr udp_msg;
+    memset(&udp_msg, 0, sizeof(udp_msg));
+    udp_msg.msg_namelen = sizeof(struct sockaddr_storage); // Room for the sender address in every buffer
+    int udp_armed = 0;
+    for (int k = 0; k < stripe_count; k++)
+        stripes[k].recv_armed = 0;
+
+    unsigned long reported_drops = 0;
+    uint64_t next_sweep_ms = platform_monotonic_ms() + SWEEP_INTERVAL_MS;
+
+    while (!latency_checkpoint(latency, 1)) { // Loop until client disconnects
+        uint64_t now = platform_monotonic_ms();
+        if (!udp_armed) { // Multishot receives end when the buffers run out
+            uring_prep_recv_multishot(&u, &buffers, udp_socket, &udp_msg, URING_TAG(URING_UDP_RECV, 0));
+            udp_armed = 1;
+        }
+        for (int k = 0; k < stripe_count; k++) {
+            if (!stripes[k].recv_armed &&
+                uring_forward(&u, &pool, udp_socket, flows, &stripes[k], k, now, unknown_flow_frames, latency) != 0)
+                goto done;
+        }
 
-    *port = t;
+        uint64_t now_us = platform_monotonic_us(); // Send the queues whose frames are due
+        int64_t wait_us = SWEEP_INTERVAL_MS * 1000;
+        for (int k = 0; k < stripe_count; k++) {
+            struct stripe *st = &stripes[k];
+            if (st->tx.blocked || st->tx.in_flight > 0 || tx_queue_depth(&st->tx) == 0)
+                continue;
+            uint64_t due_us = st->tx.first_us + options->flush_deadline_us;
+            if (tx_queue_depth(&st->tx) >= (uint32_t)options->flush_bytes || due_us <= now_us)
+                uring_prep_queue_send(&u, st->socket, &st->tx, &st->send_msg, st->send_iov, URING_TAG(URING_TCP_SEND, k));
+            else if ((int64_t)(due_us - now_us) < wait_us)
+                wait_us = (int64_t)(due_us - now_us);
+        }
+
+        if (uring_submit(&u, 1, wait_us) != 0) {
+            fprintf(stderr, "io_uring_enter failed: %d\n", errno);
+            break;
+        }
+        metrics_add(METRIC_WAKEUPS, 1);
+
+        unsigned head, count = uring_cq_ready(&u, &head);
+        now = platform_monotonic_ms();
+        now_us = platform_monotonic_us();
+        for (int pass = 0; pass < 2; pass++) { // Send completions first: they free queue bytes and send slots
+            for (unsigned i = 0; i < count; i++) {
+                struct io_uring_cqe *cqe = uring_cqe_at(&u, head + i);
+                int op = URING_OP(cqe->user_data), index = URING_INDEX(cqe->user_data);
+                if ((pass == 0) != (op == URING_TCP_SEND || op == URING_UDP_SEND))
+                    continue;
+
+                if (op == URING_TCP_SEND) {
+                    struct stripe *st = &stripes[index];
+                    if (uring_queue_sent(&st->tx, cqe->res) == SOCKET_ERROR) {
+                        fprintf(stderr, "TCP send failed: %d\n", errno);
+                        goto done;
+                    }
+                    if (st->tx.blocked) // Resume the queue once the TCP socket drains
+                        uring_prep_poll_out(&u, st->socket, URING_TAG(URING_TCP_POLL, index));
+                } else if (op == URING_UDP_SEND) {
+                    int res = uring_send_slot_release(&pool, index, cqe->res);
+                    if (res < 0 && res != -EAGAIN && res != -ENOBUFS) { // A full send buffer only drops the datagram
+                        fprintf(stderr, "UDP send failed: %d\n", -res);
+                        goto done;
+                    }
+                } else if (op == URING_UDP_RECV) {
+                    if (!(cqe->flags & IORING_CQE_F_MORE))
+                        udp_armed = 0;
+                    if (cqe->res == -ENOBUFS) // Re-armed once buffers are back
+                        continue;
+                    if (cqe->res < 0) {
+                        fprintf(stderr, "UDP receive failed: %d\n", -cqe->res);
+                        goto done;
+                    }
+
+                    struct uring_datagram d;
+                    uring_datagram_parse(&buffers, cqe, &d);
+                    metrics_add(METRIC_UDP_RX_PACKETS, 1);
+                    metrics_add(METRIC_UDP_RX_BYTES, (uint64_t)d.length);
+                    struct flow_key key;
+                    struct flow *flow = NULL;
+                    if (d.length >= 0 && d.length <= FRAME_MAX_PAYLOAD && flow_key_from_addr(&key, d.addr) == 0)
+                        flow = flow_lookup(flows, &key, now);
+                    if (flow == NULL) { // No room for another flow, or an oversized datagram
+                        flows->dropped++;
+                        metrics_add(METRIC_DROPS, 1);
+                    } else { // The header goes into the address area, in front of the data
+                        struct stripe *st = stripe_of(stripes, stripe_count, flow);
+                        char *frame = frame_prepend_header(d.payload, d.length, flow->id,
+                                                           latency != NULL ? platform_realtime_ns() : 0);
+                        int length = (int)(d.payload - frame) + d.length;
+                        char *packed = tx_queue_pack_frame(&st->tx, frame, &length);
+                        tx_queue_admit(&st->tx, packed != NULL ? packed : frame, length, now_us);
+                        if (packed != NULL)
+                            pool_release(packed);
+                    }
+                    uring_buffer_recycle(&buffers, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                } else if (op == URING_TCP_RECV) {
+                    struct stripe *st = &stripes[index];
+                    st->recv_armed = 0;
+                    if (cqe->res < 0) {
+                        fprintf(stderr, "TCP receive failed: %d\n", -cqe->res);
+                        goto done;
+                    }
+                    if (cqe->res == 0) // TCP connection closed
+                        goto done;
+                    ring_received(&st->ring, cqe->res); // Frames are forwarded at the top of the loop
+                    if (latency != NULL)
+                        ring_arrived(&st->ring, cqe->res, platform_realtime_ns());
+                } else if (op == URING_TCP_RESUME) {
+                    stripes[index].recv_armed = 0;
+                } else if (op == URING_TCP_POLL) {
+                    stripes[index].tx.blocked = 0;
+                }
+            }
+        }
+        uring_cq_advance(&u, count);
+
+        if (now >= next_sweep_ms) {
+            sweep_flows(flows, stripes, stripe_count, options->queue_bytes, now, &reported_drops);
+            next_sweep_ms = now + SWEEP_INTERVAL_MS;
+        }
+    }
+
+done:
+    uring_destroy(&u); // Cancels every pending operation
+    uring_buffers_destroy(&buffers);
+    uring_send_pool_destroy(&pool);
     return 0;
 }
+#endif
 
 int main(int argc, char *argv[]) {
     WSADATA wsaData;
@@ -42,8 +606,15 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN); // Report a dropped TCP connection as a send error
+#endif
+
     if (argc < 4) { // Check if port name is provided
-        fprintf(stderr, "Usage: %s <udp_port> <tcp_server> <tcp_port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <udp_port> <tcp_server> <tcp_port> [-f max_flows] [-i idle_seconds]"
+                        " [-b batch_size] [-t flush_bytes] [-d flush_deadline_us] [-g 0|1]"
+                        " [-q queue_bytes] [-p tail|oldest|size] [-s drop_size] [-k stripes] [-e poll|uring] [-l 0|1]"
+                        " [-z off|frame|batch] [-r link_mbit] [-m unix:path|udp:port]\n", argv[0]);
         WSACleanup();
         return 1;
     }
@@ -57,30 +628,62 @@ int main(int argc, char *argv[]) {
 
     char *tcp_server = argv[2];
     char *tcp_port = argv[3];
-    
+
+    struct client_options options;
+    options.max_flows = DEFAULT_MAX_FLOWS;
+    options.idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_SECONDS * 1000;
+    options.batch_size = DEFAULT_BATCH_SIZE;
+    options.flush_bytes = DEFAULT_FLUSH_BYTES;
+    options.flush_deadline_us = DEFAULT_FLUSH_DEADLINE_US;
+    options.use_gso = 1;
+    options.queue_bytes = DEFAULT_QUEUE_BYTES;
+    options.drop_policy = DROP_TAIL;
+    options.drop_size = DEFAULT_DROP_SIZE;
+    options.stripes = 1;
+    options.use_uring = 0;
+    options.latency = 0;
+    options.compression = COMPRESS_OFF;
+    options.link_mbit = COMPRESS_DEFAULT_LINK_MBIT;
+    options.stats = NULL;
+    metrics_extra = pool_format;
+    if (parse_options(argc, argv, &options) != 0 ||
+        (options.stats != NULL && metrics_serve(options.stats, "tunnel_udp_over_tcp_client") != 0)) {
+        WSACleanup();
+        return 1;
+    }
+
+    struct flow_table flows;
+    if (flow_table_init(&flows, options.max_flows, options.idle_timeout_ms) != 0) {
+        fprintf(stderr, "Could not allocate flow table for %u flows\n", options.max_flows);
+        WSACleanup();
+        return 1;
+    }
+
     SOCKET udp_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);// Create UDP socket
     if (udp_socket == INVALID_SOCKET) { // Check if socket creation was successful
         fprintf(stderr, "UDP socket creation failed: %d\n", WSAGetLastError());
+        flow_table_destroy(&flows);
         WSACleanup();
         return 1;
     }
-    
+
     struct sockaddr_in udp_addr;// Bind UDP socket
+    memset(&udp_addr, 0, sizeof(udp_addr));
     udp_addr.sin_family = AF_INET;
     udp_addr.sin_addr.s_addr = htonl(INADDR_ANY);
     udp_addr.sin_port = htons(udp_port);
 
-    if (bind(udp_socket, (struct sockaddr*)&udp_addr, sizeof(udp_addr)) == SOCKET_ERROR) { 
+    if (bind(udp_socket, (struct sockaddr*)&udp_addr, sizeof(udp_addr)) == SOCKET_ERROR) {
         fprintf(stderr, "UDP bind failed: %d\n", WSAGetLastError()); // Check if binding was successful
         closesocket(udp_socket); // Close socket
+        flow_table_destroy(&flows);
         WSACleanup();
         return 1;
     }
 
-    struct addrinfo hints, *result, *rp;// Create TCP socket and connect to server
-    SOCKET tcp_socket = INVALID_SOCKET; // Initialize socket variable
+    struct addrinfo hints, *result;// Create the TCP sockets and connect to server
 
-    memset(&hints, 0, sizeof(hints)); 
+    memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_protocol = IPPROTO_TCP;
@@ -88,124 +691,298 @@ int main(int argc, char *argv[]) {
     if (getaddrinfo(tcp_server, tcp_port, &hints, &result) != 0) { // Convert port name to port number
         fprintf(stderr, "getaddrinfo failed: %d\n", WSAGetLastError()); // Check if getaddrinfo was successful
         closesocket(udp_socket); // Close socket
+        flow_table_destroy(&flows);
         WSACleanup();
         return 1;
     }
 
-    for (rp = result; rp != NULL; rp = rp->ai_next) { // Connect to server
-        tcp_socket = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (tcp_socket == INVALID_SOCKET) // Check if socket creation was successful
-            continue;
-
-        if (connect(tcp_socket, rp->ai_addr, (int)rp->ai_addrlen) != SOCKET_ERROR) // Check if connection was successful
+    static struct rx_batch rx; // Datagrams drained from the UDP socket per wakeup
+    struct stripe *stripes = calloc((size_t)options.stripes, sizeof(*stripes));
+    int stripe_count = 0;
+    struct latency_stats *latency = options.latency ? calloc(1, sizeof(*latency)) : NULL;
+    int ok = stripes != NULL && rx_batch_init(&rx, options.batch_size) == 0 && (latency != NULL || !options.latency);
+    uint64_t session_id = new_session_id();
+
+    while (ok && stripe_count < options.stripes) { // Connect every stripe
+        struct stripe *st = &stripes[stripe_count];
+        tx_queue_init(&st->tx, options.queue_bytes, options.drop_policy, options.drop_size);
+        tx_queue_set_compression(&st->tx, options.compression, options.link_mbit);
+        if (latency != NULL)
+            st->tx.residency = &latency->udp_to_tcp;
+        st->socket = connect_stripe(result);
+        if (st->socket == INVALID_SOCKET) {
+            fprintf(stderr, "Could not connect to TCP server\n");
+            tx_queue_destroy(&st->tx);
+            ok = 0;
             break;
-
-        closesocket(tcp_socket); // Close socket
+        }
+        stripe_count++;
+        // A single connection stays a plain v2 stream that any server accepts
+        if (options.stripes > 1 && send_hello(st->socket, session_id, stripe_count - 1, options.stripes) != 0) {
+            fprintf(stderr, "TCP send failed: %d\n", WSAGetLastError());
+            ok = 0;
+            break;
+        }
+        platform_set_nonblocking(st->socket, 1); // A congested TCP path drops frames instead of stalling both directions
+        int one = 1; // Frames are already coalesced; Nagle would only hold them for delayed ACKs
+        setsockopt(st->socket, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one));
     }
 
     freeaddrinfo(result); // Free address information
 
-    if (rp == NULL) { // Check if connection was successful
-        fprintf(stderr, "Could not connect to TCP server\n");
+    if (!ok) {
+        for (int k = 0; k < stripe_count; k++) {
+            closesocket(stripes[k].socket);
+            tx_queue_destroy(&stripes[k].tx);
+        }
+        free(stripes);
+        free(latency);
+        rx_batch_destroy(&rx);
         closesocket(udp_socket); // Close socket
+        flow_table_destroy(&flows);
         WSACleanup(); // Cleanup Winsock
         return 1;
     }
 
-    char udp_buffer[UDP_BUFFER_SIZE];// Buffers for data handling
-    char tcp_buffer[TCP_BUFFER_SIZE];
-    char reconstruction_buffer[RECONSTRUCTION_BUFFER_SIZE];
-    int reconstruction_index = 0;
-
-    struct sockaddr_in peer_addr;
-    int peer_addr_len = sizeof(peer_addr);
-    int have_peer_addr = 0;
+    static struct tx_batch egress; // Payloads parsed from one TCP read
+    tx_batch_init(&egress, options.batch_size, options.use_gso);
+    egress.latency = latency;
+    if (latency != NULL || options.compression != COMPRESS_OFF) // Ctrl+C ends the loop, so the reports are printed
+        latency_catch_signals();
+
+#ifdef _WIN32
+    platform_set_nonblocking(udp_socket, 1); // Batches are drained with recvfrom until it would block
+#endif
+
+    struct sockaddr_storage peer_addr;
+    unsigned long unknown_flow_frames = 0;
+    unsigned long reported_drops = 0;
+    uint64_t next_sweep_ms = platform_monotonic_ms() + SWEEP_INTERVAL_MS;
+
+    struct platform_poller poller; // Token k is stripe k; the UDP socket comes after the stripes
+    struct platform_event events[MAX_STRIPES + 1];
+    int poller_ready = 0;
+
+    printf("Tunnel client ready. Listening on UDP port %d and connected to TCP server %s:%s (%d stripes)\n",
+           udp_port, tcp_server, tcp_port, stripe_count); // Print ready message
+
+    if (options.use_uring) {
+#ifdef HAVE_IO_URING
+        if (run_uring(udp_socket, &flows, stripes, stripe_count, &options, egress.gso, &unknown_flow_frames,
+                      latency) == 0)
+            goto cleanup;
+#endif
+        fprintf(stderr, "io_uring is not available, using the readiness loop\n");
+    }
 
-    fd_set readfds;
-    
-    printf("Tunnel client ready. Listening on UDP port %d and connected to TCP server %s:%s\n", 
-           udp_port, tcp_server, tcp_port); // Print ready message
+    if (platform_poller_init(&poller) != 0 ||
+        platform_poller_add(&poller, udp_socket, PLATFORM_READABLE, (uint64_t)stripe_count) != 0) {
+        fprintf(stderr, "Could not create the poller: %d\n", WSAGetLastError());
+        goto cleanup;
+    }
+    poller_ready = 1;
+    for (int k = 0; k < stripe_count; k++) {
+        stripes[k].watched = PLATFORM_READABLE;
+        if (platform_poller_add(&poller, stripes[k].socket, PLATFORM_READABLE, (uint64_t)k) != 0) {
+            fprintf(stderr, "Could not watch TCP stripe %d: %d\n", k, WSAGetLastError());
+            goto cleanup;
+        }
+    }
 
-    while (1) { // Loop until client disconnects
-        FD_ZERO(&readfds);
-        FD_SET(udp_socket, &readfds);
-        FD_SET(tcp_socket, &readfds);
+    while (!latency_checkpoint(latency, 1)) { // Loop until client disconnects
+        // Wake up periodically to evict idle flows, or when coalesced frames fall due
+        uint64_t wait_us = SWEEP_INTERVAL_MS * 1000;
+        uint64_t now_us = platform_monotonic_us();
+        for (int k = 0; k < stripe_count; k++) {
+            struct stripe *st = &stripes[k];
+            unsigned wanted = PLATFORM_READABLE | (st->tx.blocked ? PLATFORM_WRITABLE : 0); // Resume the queue once the TCP socket drains
+            if (wanted != st->watched) {
+                if (platform_poller_modify(&poller, st->socket, wanted, (uint64_t)k) != 0) {
+                    fprintf(stderr, "Could not watch TCP stripe %d: %d\n", k, WSAGetLastError());
+                    goto cleanup;
+                }
+                st->watched = wanted;
+            }
+            st->ready = 0;
+            if (!st->tx.blocked && tx_queue_depth(&st->tx) > 0) {
+                uint64_t due_us = st->tx.first_us + options.flush_deadline_us;
+                if (due_us <= now_us)
+                    wait_us = 0;
+                else if (due_us - now_us < wait_us)
+                    wait_us = due_us - now_us;
+            }
+        }
 
-        if (select(0, &readfds, NULL, NULL, NULL) == SOCKET_ERROR) { // Check if select was successful
-            fprintf(stderr, "select failed: %d\n", WSAGetLastError());
+        int n = platform_poller_wait(&poller, events, stripe_count + 1, (int64_t)wait_us * 1000);
+        if (n < 0) {
+#ifndef _WIN32
+            if (errno == EINTR) // A latency signal, handled at the top of the loop
+                continue;
+#endif
+            fprintf(stderr, "Waiting for sockets failed: %d\n", WSAGetLastError());
             break;
         }
+        metrics_add(METRIC_WAKEUPS, 1);
+        int udp_ready = 0;
+        for (int i = 0; i < n; i++) {
+            if (events[i].token == (uint64_t)stripe_count)
+                udp_ready = 1;
+            else
+                stripes[events[i].token].ready = events[i].events;
+        }
+
+        uint64_t now = platform_monotonic_ms();
+        if (now >= next_sweep_ms) {
+            sweep_flows(&flows, stripes, stripe_count, options.queue_bytes, now, &reported_drops);
+            next_sweep_ms = now + SWEEP_INTERVAL_MS;
+        }
 
-        if (FD_ISSET(udp_socket, &readfds)) {// Handle UDP data
-            int bytes_read = recvfrom(udp_socket, udp_buffer, UDP_BUFFER_SIZE, 0,
-                                    (struct sockaddr*)&peer_addr, &peer_addr_len);
-            if (bytes_read == SOCKET_ERROR) { // Check if receive was successful
+        for (int k = 0; k < stripe_count; k++) {
+            if ((stripes[k].ready & PLATFORM_WRITABLE) && stripes[k].tx.blocked && tx_queue_send(stripes[k].socket, &stripes[k].tx) == SOCKET_ERROR) {
+                fprintf(stderr, "TCP send failed: %d\n", WSAGetLastError());
+                goto cleanup;
+            }
+        }
+
+        if (udp_ready) {// Handle UDP data
+            int count = rx_batch_recv(udp_socket, &rx); // Up to batch_size datagrams at once
+            if (count == SOCKET_ERROR) { // Check if receive was successful
                 fprintf(stderr, "UDP receive failed: %d\n", WSAGetLastError());
                 break;
             }
 
-            have_peer_addr = 1;
+            now_us = platform_monotonic_us();
+            uint64_t stamp_ns = latency != NULL ? platform_realtime_ns() : 0; // One clock read for the whole batch
+            for (int i = 0; i < count; i++) {
+                struct flow_key key;
+                struct flow *flow = NULL;
+                if (rx.length[i] <= FRAME_MAX_PAYLOAD && flow_key_from_addr(&key, &rx.addr[i]) == 0)
+                    flow = flow_lookup(&flows, &key, now);
+
+                if (flow == NULL) { // No room for another flow, or an oversized datagram
+                    flows.dropped++;
+                    metrics_add(METRIC_DROPS, 1);
+                    continue;
+                }
 
-            // Prepare TCP message: length + data
-            uint16_t length = (uint16_t)bytes_read;
-            tcp_buffer[0] = (length >> 8) & 0xFF;
-            tcp_buffer[1] = length & 0xFF;
-            memcpy(tcp_buffer + 2, udp_buffer, bytes_read);
+                // A flow always uses the same stripe, which keeps its datagrams in order
+                struct stripe *st = stripe_of(stripes, stripe_count, flow);
+
+                // The header goes into the slot's headroom, in front of the data
+                char *payload = rx_batch_payload(&rx, i);
+                char *frame = frame_prepend_header(payload, rx.length[i], flow->id, stamp_ns);
+                int length = (int)(payload - frame) + rx.length[i];
+                char *packed = tx_queue_pack_frame(&st->tx, frame, &length);
+                int result = tx_queue_push(st->socket, &st->tx, packed != NULL ? packed : frame, length,
+                                           options.flush_bytes, now_us); // Send to TCP server
+                if (packed != NULL)
+                    pool_release(packed);
+                if (result == SOCKET_ERROR) {
+                    fprintf(stderr, "TCP send failed: %d\n", WSAGetLastError());
+                    goto cleanup;
+                }
+            }
+        }
 
-            // Send to TCP server
-            if (send(tcp_socket, tcp_buffer, bytes_read + 2, 0) == SOCKET_ERROR) {
-                fprintf(stderr, "TCP send failed: %d\n", WSAGetLastError());
-                break;
+        for (int k = 0; k < stripe_count; k++) {
+            struct stripe *st = &stripes[k];
+            if (!st->tx.blocked && tx_queue_depth(&st->tx) > 0 &&
+                (options.flush_deadline_us == 0 || platform_monotonic_us() - st->tx.first_us >= options.flush_deadline_us)) {
+                if (tx_queue_send(st->socket, &st->tx) == SOCKET_ERROR) {
+                    fprintf(stderr, "TCP send failed: %d\n", WSAGetLastError());
+                    goto cleanup;
+                }
             }
         }
 
         // Handle TCP data
-        if (FD_ISSET(tcp_socket, &readfds)) {
-            int bytes_read = recv(tcp_socket, tcp_buffer, TCP_BUFFER_SIZE, 0);
+        for (int k = 0; k < stripe_count; k++) {
+            struct stripe *st = &stripes[k];
+            if (!(st->ready & PLATFORM_READABLE))
+                continue;
+
+            int bytes_read = ring_recv(st->socket, &st->ring); // Lands directly in the ring
+            if (bytes_read == SOCKET_ERROR && platform_would_block())
+                continue;
             if (bytes_read == SOCKET_ERROR) {
                 fprintf(stderr, "TCP receive failed: %d\n", WSAGetLastError());
-                break;
+                goto cleanup;
             }
             if (bytes_read == 0) {  // TCP connection closed
-                break;
+                goto cleanup;
             }
-
-            // Copy new data to reconstruction buffer
-            memcpy(reconstruction_buffer + reconstruction_index, tcp_buffer, bytes_read);
-            reconstruction_index += bytes_read;
-
-            // Process complete messages
-            int processed = 0;
-            while (reconstruction_index - processed >= 2) { // Check if message is complete
-                uint16_t msg_length = ((uint16_t)(reconstruction_buffer[processed]) << 8) |
-                                    (uint8_t)(reconstruction_buffer[processed + 1]);
-
-                if (reconstruction_index - processed < msg_length + 2)
+            if (latency != NULL)
+                ring_arrived(&st->ring, bytes_read, platform_realtime_ns());
+
+            // Process complete messages in place; compressed ones are opened into a pool buffer
+            struct frame_view frame, view;
+            struct frame_unpack unpack;
+            int status;
+            while ((status = frame_decoder_next(&st->ring.decoder, &frame)) == 1) {
+                if (frame_unpack_open(&unpack, &frame) != 0) {
+                    status = -1;
                     break;
-
-                if (have_peer_addr) { // Send to UDP server
-                    if (sendto(udp_socket, reconstruction_buffer + processed + 2, msg_length, 0,
-                             (struct sockaddr*)&peer_addr, peer_addr_len) == SOCKET_ERROR) {
-                        fprintf(stderr, "UDP send failed: %d\n", WSAGetLastError());
-                        goto cleanup;
+                }
+                while (frame_unpack_next(&unpack, &view)) {
+                    struct flow *flow = flow_by_id(&flows, view.flow_id);
+
+                    if (flow != NULL) { // Queue for the UDP peer that owns this flow
+                        flow->last_seen_ms = now;
+                        socklen_t addr_len = flow_key_to_addr(&flow->key, &peer_addr);
+                        if (tx_batch_add(&egress, udp_socket, &view, st->ring.head_ns,
+                                         (struct sockaddr*)&peer_addr, addr_len, unpack.buffer) == SOCKET_ERROR &&
+                            WSAGetLastError() != WSAEWOULDBLOCK) { // A full send buffer only drops the datagram
+                            fprintf(stderr, "UDP send failed: %d\n", WSAGetLastError());
+                            frame_unpack_close(&unpack);
+                            goto cleanup;
+                        }
+                    } else {
+                        unknown_flow_frames++; // Reply for a flow that was already evicted
+                        metrics_add(METRIC_DROPS, 1);
                     }
                 }
+                frame_unpack_close(&unpack); // The batch keeps its own reference until the flush
+
+                ring_consume(&st->ring, frame.length);
+            }
 
-                processed += msg_length + 2;
+            // The queued payloads still point into the ring, which the next read reuses
+            if (tx_batch_flush(&egress) == SOCKET_ERROR) {
+                fprintf(stderr, "UDP send failed: %d\n", WSAGetLastError());
+                goto cleanup;
             }
+            ring_detach(&st->ring); // An idle stripe holds no ring
 
-            // Move any remaining data to the start of the buffer
-            if (processed > 0) {
-                memmove(reconstruction_buffer, reconstruction_buffer + processed,
-                       reconstruction_index - processed);
-                reconstruction_index -= processed;
+            if (status < 0) { // Not a v2 frame
+                fprintf(stderr, "Malformed frame from TCP server\n");
+                goto cleanup;
             }
         }
     }
 
-cleanup: 
+cleanup:
+    if (poller_ready)
+        platform_poller_destroy(&poller);
+    if (unknown_flow_frames > 0)
+        fprintf(stderr, "Dropped %lu frames for unknown flows\n", unknown_flow_frames);
+    for (int k = 0; k < stripe_count; k++) {
+        struct stripe *st = &stripes[k];
+        if (st->tx.dropped_frames > 0)
+            fprintf(stderr, "TCP queue full on stripe %d: %llu frames (%llu bytes) dropped, peak depth %u bytes\n",
+                    k, st->tx.dropped_frames, st->tx.dropped_bytes, st->tx.peak);
+        closesocket(st->socket);
+        tx_queue_destroy(&st->tx);
+        ring_destroy(&st->ring);
+    }
+    free(stripes);
     closesocket(udp_socket);// Close socket
-    closesocket(tcp_socket);
+    rx_batch_destroy(&rx);
+    flow_table_destroy(&flows);
+    if (latency != NULL) {
+        latency_report(latency, 1);
+        free(latency);
+    }
+    compress_report();
     WSACleanup();// Cleanup Winsock
     return 0;
-}
\ No newline at end of file
+}
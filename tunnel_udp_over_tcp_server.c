@@ -1,40 +1,1394 @@
+#ifdef __linux__
+#define _GNU_SOURCE // recvmmsg, pthread_setaffinity_np
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
 #include <stdint.h>
+#include <signal.h>
+
+#include "platform.h"
+
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#endif
+
+#include "metrics.h"
+#include "frame.h"
+#include "pool.h"
+#include "compress.h"
+#include "hash_slots.h"
+#include "latency.h"
+#include "tunnel_io.h"
+#include "uring.h"
+
+#define MAX_EVENTS 256  // Ready sockets handled per wakeup
+#define MAX_WORKERS 256
+
+// Worker threads share nothing on the packet path: each owns its event loop,
+// its clients and their UDP sockets. Everything a loop mutates is thread-local.
+#ifdef _MSC_VER
+#define WORKER_LOCAL __declspec(thread)
+#else
+#define WORKER_LOCAL _Thread_local
+#endif
+
+#define DEFAULT_MAX_FLOWS 4096  // Per tunnel client
+#define DEFAULT_IDLE_TIMEOUT_SECONDS 60
+#define SWEEP_INTERVAL_MS 1000
+
+// A striped tunnel client spreads its flows over several TCP connections and
+// opens each with a HELLO control frame (flow 0) naming its session, so the
+// stripes share one flow map. Connections without HELLO are sessions of one.
+#define MAX_STRIPES 16
+#define CONTROL_HELLO 1
+#define HELLO_PAYLOAD_SIZE 11  // Type, 64-bit session ID, stripe index, stripe count
+
+// Every socket the loop waits on is registered with a pointer to its endpoint,
+// so a readiness event leads straight to the owning client without a search.
+enum endpoint_kind { ENDPOINT_LISTEN, ENDPOINT_TCP, ENDPOINT_UDP };
+
+struct tunnel_client;
+struct tunnel_flow;
+struct tunnel_session;
+
+struct endpoint {
+    enum endpoint_kind kind;
+    SOCKET socket;
+    struct tunnel_client *client;
+    struct tunnel_flow *flow; // UDP endpoints only
+    int readable; // Readiness from the last poller_wait
+    int writable;
+#ifdef HAVE_IO_URING
+    int uring_ops; // io_uring operations not yet completed, plus a place on the deferred list
+    struct endpoint *deferred_next;
+    struct msghdr recv_msg; // Header of the receive in flight
+    struct iovec recv_iov[2];
+#endif
+};
+
+struct tunnel_flow { // One UDP peer multiplexed over a client's TCP connection
+    struct endpoint udp; // Connected UDP socket towards the UDP server; its client
+                         // is the stripe the flow's frames arrive on, which carries the replies
+    uint32_t id;
+    uint32_t index; // In the session's flow array
+    uint64_t last_seen_ms;
+    struct tunnel_flow *prev;
+    struct tunnel_flow *next;
+};
 
-#pragma comment(lib, "ws2_32.lib")
+struct tunnel_session { // The TCP connections of one tunnel client and the flows they carry
+    uint64_t id; // From HELLO; 0 until the first connection announces one
+    struct tunnel_client *stripes; // Linked through stripe_next
+    int stripe_count;
+    int closed;
+    struct tunnel_session *prev;
+    struct tunnel_session *next;
+    struct tunnel_session *next_closed;
+    struct hash_slot *flow_slots; // hash_slots.h index from flow ID to flow_array
+    uint32_t flow_slot_mask;
+    struct tunnel_flow **flow_array; // The first flow_count entries are the open flows
+    uint32_t flow_count;
+    struct tunnel_flow *flows; // Every open flow, for sweeps and teardown
+    unsigned long dropped_frames; // Frames refused because the flow limit was reached
+};
 
-#define UDP_BUFFER_SIZE 65536  // 2^16
-#define TCP_BUFFER_SIZE 65538  // UDP_BUFFER_SIZE + 2 bytes for length
-#define RECONSTRUCTION_BUFFER_SIZE 131076  // 2^17 + 4
+struct tunnel_client { // One TCP connection, a stripe of its session
+    struct endpoint tcp; // TCP connection from the tunnel client
+    int closed;
+    struct tunnel_client *prev;
+    struct tunnel_client *next;
+    struct tunnel_session *session;
+    struct tunnel_client *stripe_next;
+    struct tx_queue tx; // Frames from the UDP side not yet sent to TCP
+    int watching_output; // Waiting for the TCP socket to become writable
+    unsigned long long reported_drops; // tx.dropped_frames at the last report
+    int pending; // Linked into the pending list while tx holds data and is not blocked
+    struct tunnel_client *pending_prev;
+    struct tunnel_client *pending_next;
+    struct frame_ring ring; // Bytes received from the TCP connection
+#ifdef HAVE_IO_URING
+    struct msghdr send_msg; // Header of the queue send in flight
+    struct iovec send_iov[2];
+#endif
+};
 
-static int convert_port_name(uint16_t *port, const char *port_name) {
-    char *end;
-    long long int nn;
-    uint16_t t;
-    long long int tt;
+#ifdef HAVE_IO_URING
+// With -e uring, user_data of an operation on an endpoint is the endpoint's
+// address with the operation in its low bits. Datagrams towards UDP carry the
+// index of their send slot instead.
+enum uring_op { URING_OP_ACCEPT = 1, URING_OP_RECV, URING_OP_RESUME, URING_OP_SEND, URING_OP_POLL, URING_OP_CANCEL };
+#define URING_OP_MASK 7u
+#define URING_TAG(ep, op) ((uint64_t)(uintptr_t)(ep) | (uint64_t)(op))
+#define URING_SEND_SLOT_TAG (1ull << 63)  // Above every user space address
+#define URING_SERVER_BUFFERS 128  // Provided UDP receive buffers, shared by a worker's flows
+
+struct uring_backend { // Everything a worker running on io_uring owns
+    struct uring ring;
+    struct uring_buffers buffers;
+    struct uring_send_pool sends;
+    struct endpoint *deferred; // Receives to arm, and clients waiting for send slots
+};
+
+// Queues an endpoint for the end of the iteration, outside of any link chain
+static void uring_defer(struct uring_backend *b, struct endpoint *ep) {
+    ep->uring_ops++;
+    ep->deferred_next = b->deferred;
+    b->deferred = ep;
+}
+#endif
+
+// A worker waits on the shared platform_poller, with each socket registered
+// under a pointer to its endpoint, or on io_uring when it runs there instead
+struct poller {
+    struct platform_poller readiness;
+#ifdef HAVE_IO_URING
+    struct uring_backend *uring; // Set when the worker runs on io_uring
+#endif
+};
+
+static int poller_init(struct poller *p) {
+#ifdef HAVE_IO_URING
+    p->uring = NULL;
+#endif
+    return platform_poller_init(&p->readiness);
+}
+
+static void poller_destroy(struct poller *p) {
+    platform_poller_destroy(&p->readiness);
+}
+
+static int poller_add(struct poller *p, struct endpoint *ep) { // Start watching an endpoint for input
+#ifdef HAVE_IO_URING
+    ep->uring_ops = 0;
+    if (p->uring != NULL) { // Its first receive or accept is armed at the end of the iteration
+        uring_defer(p->uring, ep);
+        return 0;
+    }
+#endif
+    return platform_poller_add(&p->readiness, ep->socket, PLATFORM_READABLE, (uint64_t)(uintptr_t)ep);
+}
 
-    if (port_name == NULL || *port_name == '\0') // Check if port_name is NULL
+// Adds or removes interest in writability, for a TCP socket with a blocked queue
+static int poller_watch_output(struct poller *p, struct endpoint *ep, int enable) {
+#ifdef HAVE_IO_URING
+    if (p->uring != NULL) { // A one-shot poll, armed again whenever the queue blocks
+        if (enable) {
+            uring_prep_poll_out(&p->uring->ring, ep->socket, URING_TAG(ep, URING_OP_POLL));
+            ep->uring_ops++;
+        }
+        return 0;
+    }
+#endif
+    unsigned events = enable ? (PLATFORM_READABLE | PLATFORM_WRITABLE) : PLATFORM_READABLE;
+    return platform_poller_modify(&p->readiness, ep->socket, events, (uint64_t)(uintptr_t)ep);
+}
+
+static void poller_remove(struct poller *p, struct endpoint *ep) { // Stop watching an endpoint
+#ifdef HAVE_IO_URING
+    if (p->uring != NULL) { // Cancel whatever is in flight on the socket
+        struct io_uring_sqe *sqe = uring_sqe(&p->uring->ring);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = ep->socket;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = URING_OP_CANCEL;
+        p->uring->ring.prompt++;
+        uring_submit(&p->uring->ring, 0, 0); // The descriptor is looked up now, before the caller closes it
+        return;
+    }
+#endif
+    platform_poller_remove(&p->readiness, ep->socket);
+}
+
+// Waits for readiness and fills ready[] with at most max endpoints; a signal
+// ends the wait early with none
+static int poller_wait(struct poller *p, struct endpoint **ready, int max, int64_t timeout_ns) {
+    struct platform_event events[MAX_EVENTS];
+    if (max > MAX_EVENTS)
+        max = MAX_EVENTS;
+    int n = platform_poller_wait(&p->readiness, events, max, timeout_ns);
+    if (n < 0) {
+#ifndef _WIN32
+        if (errno == EINTR)
+            return 0;
+#endif
         return -1;
+    }
+    for (int i = 0; i < n; i++) { // Errors and hangups are reported through recv() or send()
+        ready[i] = (struct endpoint *)(uintptr_t)events[i].token;
+        ready[i]->readable = (events[i].events & PLATFORM_READABLE) != 0;
+        ready[i]->writable = (events[i].events & PLATFORM_WRITABLE) != 0;
+    }
+    return n;
+}
+
+static WORKER_LOCAL struct tunnel_client *client_list = NULL;
+static WORKER_LOCAL struct tunnel_session *session_list = NULL;
+static WORKER_LOCAL struct tunnel_session *closed_sessions = NULL;
+static WORKER_LOCAL struct tunnel_flow *retired_flows = NULL; // Closed, freed once io_uring is done with them
+static WORKER_LOCAL int client_count = 0;
+
+static struct sockaddr_storage udp_addr; // Where every flow's UDP socket is connected
+static socklen_t udp_addr_len = 0;
+static uint32_t max_flows = DEFAULT_MAX_FLOWS;
+static uint64_t idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_SECONDS * 1000;
+static int batch_size = DEFAULT_BATCH_SIZE;
+static int flush_bytes = DEFAULT_FLUSH_BYTES;
+static uint64_t flush_deadline_us = DEFAULT_FLUSH_DEADLINE_US;
+static uint32_t queue_bytes = DEFAULT_QUEUE_BYTES;
+static enum drop_policy drop_policy = DROP_TAIL;
+static int drop_size = DEFAULT_DROP_SIZE;
+static WORKER_LOCAL struct tunnel_client *pending_clients = NULL; // Clients with coalesced frames waiting
+static WORKER_LOCAL struct rx_batch rx; // Datagrams of the flow being drained
+static int use_gso = 1;
+static WORKER_LOCAL struct tx_batch egress; // Payloads parsed from the TCP read being handled
+static int worker_count = 1;
+static int use_uring = 0;
+static int measure_latency = 0;
+static enum compress_mode compression = COMPRESS_OFF; // -z
+static int link_mbit = COMPRESS_DEFAULT_LINK_MBIT; // -r
+static const char *stats_socket = NULL; // -m unix:<path> or udp:<port>
+static struct latency_stats *latency_workers = NULL; // One set per worker with -l 1
+static WORKER_LOCAL struct latency_stats *latency = NULL; // This worker's set
+
+static uint32_t flow_id_hash(uint32_t id) { // murmur3 finalizer
+    id ^= id >> 16;
+    id *= 0x85ebca6bu;
+    id ^= id >> 13;
+    id *= 0xc2b2ae35u;
+    id ^= id >> 16;
+    return id;
+}
+
+// flow_id_hash is a bijection, so a slot with the ID's hash holds the ID
+static struct tunnel_flow *flow_find(struct tunnel_session *session, uint32_t id) {
+    uint32_t hash = flow_id_hash(id);
+    uint32_t mask = session->flow_slot_mask;
+    for (uint32_t i = hash & mask; session->flow_slots[i].index != 0; i = (i + 1) & mask) {
+        if (session->flow_slots[i].hash == hash)
+            return session->flow_array[session->flow_slots[i].index - 1];
+    }
+    return NULL;
+}
+
+static int flow_map_insert(struct tunnel_session *session, struct tunnel_flow *flow) {
+    if ((session->flow_count + 1) * 2 > session->flow_slot_mask + 1) { // Keep the load factor under 1/2
+        uint32_t slot_count = (session->flow_slot_mask + 1) * 2;
+        struct tunnel_flow **array = realloc(session->flow_array, slot_count / 2 * sizeof(*array));
+        if (array == NULL)
+            return -1;
+        session->flow_array = array;
+        struct hash_slot *slots = calloc(slot_count, sizeof(*slots));
+        if (slots == NULL)
+            return -1;
+        for (uint32_t k = 0; k < session->flow_count; k++)
+            hash_slots_insert(slots, slot_count - 1, flow_id_hash(array[k]->id), k);
+        free(session->flow_slots);
+        session->flow_slots = slots;
+        session->flow_slot_mask = slot_count - 1;
+    }
+    flow->index = session->flow_count++;
+    session->flow_array[flow->index] = flow;
+    hash_slots_insert(session->flow_slots, session->flow_slot_mask, flow_id_hash(flow->id), flow->index);
+    metrics_add(METRIC_FLOWS, 1);
+    return 0;
+}
+
+// Removes a flow from the map. The last flow in the array moves into its place.
+static void flow_map_remove(struct tunnel_session *session, struct tunnel_flow *flow) {
+    uint32_t mask = session->flow_slot_mask;
+    hash_slots_remove(session->flow_slots, mask, flow_id_hash(flow->id), flow->index);
+    uint32_t last = --session->flow_count;
+    if (flow->index != last) {
+        struct tunnel_flow *moved = session->flow_array[last];
+        uint32_t i = hash_slots_find(session->flow_slots, mask, flow_id_hash(moved->id), last);
+        session->flow_slots[i].index = flow->index + 1;
+        session->flow_array[flow->index] = moved;
+        moved->index = flow->index;
+    }
+    metrics_sub(METRIC_FLOWS, 1);
+}
+
+// Opens a UDP socket for a new flow, connected to the UDP server
+static struct tunnel_flow *flow_open(struct poller *p, struct tunnel_client *client, uint32_t id) {
+    struct tunnel_session *session = client->session;
+    struct tunnel_flow *flow = malloc(sizeof(*flow));
+    if (flow == NULL) {
+        fprintf(stderr, "Out of memory for new flow\n");
+        return NULL;
+    }
+
+    flow->udp.socket = socket(udp_addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (flow->udp.socket == INVALID_SOCKET) {
+        fprintf(stderr, "UDP socket creation failed: %d\n", WSAGetLastError());
+        free(flow);
+        return NULL;
+    }
+
+    if (connect(flow->udp.socket, (struct sockaddr *)&udp_addr, udp_addr_len) == SOCKET_ERROR) { // Connect to UDP server
+        fprintf(stderr, "UDP connect failed: %d\n", WSAGetLastError());
+        closesocket(flow->udp.socket);
+        free(flow);
+        return NULL;
+    }
+
+#ifdef _WIN32
+    platform_set_nonblocking(flow->udp.socket, 1); // Batches are drained with recvfrom until it would block
+#endif
+
+    flow->udp.kind = ENDPOINT_UDP;
+    flow->udp.client = client;
+    flow->udp.flow = flow;
+    flow->id = id;
+    flow->last_seen_ms = platform_monotonic_ms();
+
+    if (flow_map_insert(session, flow) != 0) {
+        fprintf(stderr, "Out of memory for flow map\n");
+        closesocket(flow->udp.socket);
+        free(flow);
+        return NULL;
+    }
+    if (poller_add(p, &flow->udp) != 0) {
+        fprintf(stderr, "Could not watch UDP socket: %d\n", WSAGetLastError());
+        flow_map_remove(session, flow);
+        closesocket(flow->udp.socket);
+        free(flow);
+        return NULL;
+    }
+
+    flow->prev = NULL; // Link into the session's flow list
+    flow->next = session->flows;
+    if (session->flows != NULL)
+        session->flows->prev = flow;
+    session->flows = flow;
+    return flow;
+}
+
+// Closes a flow's socket and unlinks it. Only called outside event batches,
+// or while tearing down a session whose memory outlives the batch.
+static void flow_close(struct poller *p, struct tunnel_session *session, struct tunnel_flow *flow) {
+    poller_remove(p, &flow->udp);
+    closesocket(flow->udp.socket);
+    flow->udp.socket = INVALID_SOCKET; // Marks completions still on their way as stale
+    flow_map_remove(session, flow);
+
+    if (flow->prev != NULL)
+        flow->prev->next = flow->next;
+    else
+        session->flows = flow->next;
+    if (flow->next != NULL)
+        flow->next->prev = flow->prev;
+}
+
+static void flow_free(struct tunnel_flow *flow) {
+#ifdef HAVE_IO_URING
+    if (flow->udp.uring_ops > 0) { // Its receive buffer header is still in use
+        flow->next = retired_flows;
+        retired_flows = flow;
+        return;
+    }
+#endif
+    free(flow);
+}
+
+static void pending_link(struct tunnel_client *client) {
+    if (client->pending)
+        return;
+    client->pending = 1;
+    client->pending_prev = NULL;
+    client->pending_next = pending_clients;
+    if (pending_clients != NULL)
+        pending_clients->pending_prev = client;
+    pending_clients = client;
+}
+
+static void pending_unlink(struct tunnel_client *client) {
+    if (!client->pending)
+        return;
+    client->pending = 0;
+    if (client->pending_prev != NULL)
+        client->pending_prev->pending_next = client->pending_next;
+    else
+        pending_clients = client->pending_next;
+    if (client->pending_next != NULL)
+        client->pending_next->pending_prev = client->pending_prev;
+}
+
+// Tracks what the client's queue waits for: writability while blocked, or
+// otherwise a place on the pending list while it holds coalesced frames and
+// no send is in flight
+static void client_update_output(struct poller *p, struct tunnel_client *client) {
+    if (client->tx.blocked != client->watching_output) {
+        poller_watch_output(p, &client->tcp, client->tx.blocked);
+        client->watching_output = client->tx.blocked;
+    }
+    if (!client->tx.blocked && client->tx.in_flight == 0 && tx_queue_depth(&client->tx) > 0)
+        pending_link(client);
+    else
+        pending_unlink(client);
+}
+
+static struct tunnel_session *session_open(void) {
+    struct tunnel_session *session = malloc(sizeof(*session));
+    if (session == NULL)
+        return NULL;
+    session->flow_slots = calloc(16, sizeof(*session->flow_slots));
+    session->flow_array = malloc(8 * sizeof(*session->flow_array));
+    if (session->flow_slots == NULL || session->flow_array == NULL) {
+        free(session->flow_slots);
+        free(session->flow_array);
+        free(session);
+        return NULL;
+    }
+    session->id = 0;
+    session->stripes = NULL;
+    session->stripe_count = 0;
+    session->closed = 0;
+    session->next_closed = NULL;
+    session->flow_slot_mask = 15;
+    session->flow_count = 0;
+    session->flows = NULL;
+    session->dropped_frames = 0;
+
+    session->prev = NULL; // Link into the list of live sessions
+    session->next = session_list;
+    if (session_list != NULL)
+        session_list->prev = session;
+    session_list = session;
+    return session;
+}
+
+static void session_unlink(struct tunnel_session *session) {
+    if (session->prev != NULL)
+        session->prev->next = session->next;
+    else
+        session_list = session->next;
+    if (session->next != NULL)
+        session->next->prev = session->prev;
+}
+
+static void session_free(struct tunnel_session *session) {
+    free(session->flow_slots);
+    free(session->flow_array);
+    free(session);
+}
+
+static void session_add_stripe(struct tunnel_session *session, struct tunnel_client *client) {
+    client->session = session;
+    client->stripe_next = session->stripes;
+    session->stripes = client;
+    session->stripe_count++;
+}
+
+// Registers the TCP socket of a new client in a session of its own; its UDP
+// sockets open per flow
+static struct tunnel_client *client_open(struct poller *p, SOCKET tcp_socket) {
+    struct tunnel_client *client = malloc(sizeof(*client));
+    if (client == NULL) {
+        fprintf(stderr, "Out of memory for new client\n");
+        return NULL;
+    }
+
+    tx_queue_init(&client->tx, queue_bytes, drop_policy, drop_size);
+    tx_queue_set_compression(&client->tx, compression, link_mbit);
+    if (latency != NULL)
+        client->tx.residency = &latency->udp_to_tcp;
+    client->pending = 0;
+    client->watching_output = 0;
+    client->reported_drops = 0;
+
+    client->tcp.kind = ENDPOINT_TCP;
+    client->tcp.socket = tcp_socket;
+    client->tcp.client = client;
+    client->tcp.flow = NULL;
+    client->closed = 0;
+    frame_decoder_init(&client->ring.decoder, NULL); // Borrowed from the pool once bytes arrive
+    client->ring.read_start = 0;
+    client->ring.read_ns = client->ring.head_ns = 0;
+
+    struct tunnel_session *session = session_open();
+    if (session == NULL) {
+        fprintf(stderr, "Out of memory for new client\n");
+        tx_queue_destroy(&client->tx);
+        free(client);
+        return NULL;
+    }
+    session_add_stripe(session, client);
+
+    if (poller_add(p, &client->tcp) != 0) {
+        fprintf(stderr, "Could not watch TCP socket: %d\n", WSAGetLastError());
+        session_unlink(session);
+        session_free(session);
+        tx_queue_destroy(&client->tx);
+        free(client);
+        return NULL;
+    }
+
+    client->prev = NULL; // Link into the list of live clients
+    client->next = client_list;
+    if (client_list != NULL)
+        client_list->prev = client;
+    client_list = client;
+    client_count++;
+    return client;
+}
+
+// Moves a connection that announced a striped session into the session its
+// sibling stripes already opened, or names its own session after the HELLO.
+// Only a fresh connection may join: one that has carried no flows yet.
+static void client_hello(struct tunnel_client *client, const struct frame_view *frame) {
+    uint8_t hello[HELLO_PAYLOAD_SIZE];
+    if (frame->payload_length < HELLO_PAYLOAD_SIZE)
+        return;
+    for (uint32_t i = 0, v = 0, off = 0; i < HELLO_PAYLOAD_SIZE; i++, off++) { // The payload may wrap the ring
+        while (off >= IO_VEC_LEN(frame->payload[v])) {
+            off = 0;
+            v++;
+        }
+        hello[i] = ((const uint8_t *)IO_VEC_BASE(frame->payload[v]))[off];
+    }
+    if (hello[0] != CONTROL_HELLO)
+        return; // Unknown control frames are ignored
+
+    uint64_t id = 0;
+    for (int i = 1; i <= 8; i++)
+        id = (id << 8) | hello[i];
+    int stripe_count = hello[10];
+    struct tunnel_session *own = client->session;
+    if (id == 0 || stripe_count < 1 || stripe_count > MAX_STRIPES ||
+        own->id != 0 || own->stripe_count != 1 || own->flow_count != 0)
+        return;
+
+    for (struct tunnel_session *s = session_list; s != NULL; s = s->next) {
+        if (s != own && s->id == id && s->stripe_count < stripe_count) {
+            session_unlink(own); // The private session was never used
+            session_free(own);
+            session_add_stripe(s, client);
+            printf("Stripe %d joined tunnel session (%d of %d connected)\n",
+                   hello[9], s->stripe_count, stripe_count);
+            return;
+        }
+    }
+    own->id = id;
+}
+
+// Unregisters and closes the sockets of a client's whole session: losing one
+// stripe loses the frames in flight on it, so the tunnel client starts over.
+// The memory is released only after the current batch of events, which may
+// still hold pointers to its endpoints.
+static void client_close(struct poller *p, struct tunnel_client *client) {
+    struct tunnel_session *session = client->session;
+    if (session->closed)
+        return;
+    session->closed = 1;
+
+    for (struct tunnel_client *c = session->stripes; c != NULL; c = c->stripe_next) {
+        c->closed = 1;
+        pending_unlink(c); // Frames still coalesced have nowhere to go
+        poller_remove(p, &c->tcp);
+        closesocket(c->tcp.socket);
+        c->tcp.socket = INVALID_SOCKET;
+
+        if (c->prev != NULL)
+            c->prev->next = c->next;
+        else
+            client_list = c->next;
+        if (c->next != NULL)
+            c->next->prev = c->prev;
+        client_count--;
+
+        if (c->tx.dropped_frames > 0)
+            fprintf(stderr, "TCP queue full: %llu frames (%llu bytes) dropped, peak depth %u bytes\n",
+                    c->tx.dropped_frames, c->tx.dropped_bytes, c->tx.peak);
+    }
+    for (struct tunnel_flow *flow = session->flows; flow != NULL; flow = flow->next) {
+        poller_remove(p, &flow->udp);
+        closesocket(flow->udp.socket);
+        flow->udp.socket = INVALID_SOCKET;
+    }
+    metrics_sub(METRIC_FLOWS, session->flow_count); // The map goes with the session
+
+    session_unlink(session);
+    session->next_closed = closed_sessions;
+    closed_sessions = session;
+    if (session->dropped_frames > 0)
+        fprintf(stderr, "Flow limit reached: %lu frames dropped\n", session->dropped_frames);
+    printf("Tunnel client disconnected (%d active)\n", client_count);
+}
+
+static int session_busy(const struct tunnel_session *session) { // io_uring still reads or writes its buffers
+#ifdef HAVE_IO_URING
+    for (const struct tunnel_client *c = session->stripes; c != NULL; c = c->stripe_next) {
+        if (c->tcp.uring_ops > 0)
+            return 1;
+    }
+#else
+    (void)session;
+#endif
+    return 0;
+}
+
+static void free_closed_clients(void) {
+    struct tunnel_session **link = &closed_sessions;
+    while (*link != NULL) {
+        struct tunnel_session *session = *link;
+        if (session_busy(session)) { // Kept until its last completion arrives
+            link = &session->next_closed;
+            continue;
+        }
+        *link = session->next_closed;
+        while (session->flows != NULL) {
+            struct tunnel_flow *flow = session->flows;
+            session->flows = flow->next;
+            flow_free(flow);
+        }
+        while (session->stripes != NULL) {
+            struct tunnel_client *client = session->stripes;
+            session->stripes = client->stripe_next;
+            ring_destroy(&client->ring);
+            tx_queue_destroy(&client->tx);
+            free(client);
+        }
+        session_free(session);
+    }
+
+    struct tunnel_flow *flow = retired_flows;
+    retired_flows = NULL;
+    while (flow != NULL) {
+        struct tunnel_flow *next = flow->next;
+        flow_free(flow); // Retired again while still in use
+        flow = next;
+    }
+}
+
+// Evicts every flow that has been idle longer than the timeout, and reports
+// frames a congested TCP connection dropped since the last sweep
+static void sweep_idle_flows(struct poller *p, uint64_t now) {
+    for (struct tunnel_client *client = client_list; client != NULL; client = client->next) {
+        if (client->tx.dropped_frames != client->reported_drops) {
+            fprintf(stderr, "TCP queue full: %llu frames dropped, depth %u of %u bytes\n",
+                    client->tx.dropped_frames - client->reported_drops, tx_queue_depth(&client->tx), queue_bytes);
+            client->reported_drops = client->tx.dropped_frames;
+        }
+    }
+    for (struct tunnel_session *session = session_list; session != NULL; session = session->next) {
+        struct tunnel_flow *flow = session->flows;
+        while (flow != NULL) {
+            struct tunnel_flow *next = flow->next;
+            if (now - flow->last_seen_ms > idle_timeout_ms) {
+                flow_close(p, session, flow);
+                flow_free(flow);
+            }
+            flow = next;
+        }
+    }
+}
+
+// Datagrams egress_add can take before it has to wait: the free io_uring send
+// slots. The worker's send batch flushes when full, so it takes any frame.
+static int egress_room(const struct poller *p) {
+#ifdef HAVE_IO_URING
+    if (p->uring != NULL)
+        return p->uring->sends.free_count;
+#else
+    (void)p;
+#endif
+    return COMPRESS_RUN_FRAMES; // The most a batch frame holds
+}
+
+// Queues a frame's payload for the UDP socket of its flow: on the worker's
+// send batch, or as a linked io_uring send. held is the pool buffer of an
+// opened compressed frame, or NULL when the payload is in the client's ring.
+// now_ns is the wall-clock time for the latency of io_uring sends, or 0 to read
+// it when needed; the batch records its own once the datagrams have left.
+// The caller checks egress_room first.
+static void egress_add(struct poller *p, struct tunnel_client *client, struct tunnel_flow *flow,
+                       const struct frame_view *frame, char *held, uint64_t *now_ns) {
+#ifdef HAVE_IO_URING
+    if (p->uring != NULL) {
+        struct uring_backend *b = p->uring;
+        int queued = uring_send_datagram(&b->ring, &b->sends, flow->udp.socket, frame, NULL, 0,
+                                         &client->tcp, held, URING_SEND_SLOT_TAG); // The ring or held has the payload
+        if (queued > 0)
+            client->tcp.uring_ops += queued;
+        if (queued >= 0 && latency != NULL)
+            latency_record_egress(latency, &client->ring, frame, now_ns);
+        return;
+    }
+#else
+    (void)p;
+    (void)now_ns;
+#endif
+    if (tx_batch_add(&egress, flow->udp.socket, frame, client->ring.head_ns,
+                     NULL, 0, held) == SOCKET_ERROR) // A lost datagram, not a lost tunnel
+        fprintf(stderr, "UDP send failed: %d\n", WSAGetLastError());
+}
+
+// Forwards every complete frame in the client's ring, straight from the ring,
+// to the UDP socket of its flow. Returns 0 once no complete frame is left, 1
+// when the rest waits for io_uring send slots, or -1 on a malformed frame.
+static int forward_frames(struct poller *p, struct tunnel_client *client) {
+    uint64_t now = platform_monotonic_ms();
+    uint64_t now_ns = 0;
+    struct frame_view frame, view;
+    struct frame_unpack unpack;
+    int status;
+
+    while ((status = frame_decoder_next(&client->ring.decoder, &frame)) == 1) { // Process complete messages
+        if (frame_unpack_open(&unpack, &frame) != 0) // Compressed ones are opened into a pool buffer
+            return -1;
+        if (unpack.count > egress_room(p)) { // A batch goes out whole
+            frame_unpack_close(&unpack);
+            return 1; // The frame stays in the ring
+        }
+
+        while (frame_unpack_next(&unpack, &view)) {
+            struct tunnel_session *session = client->session;
+            if (view.flow_id == 0) { // Control frame
+                client_hello(client, &view);
+                continue;
+            }
+
+            struct tunnel_flow *flow = flow_find(session, view.flow_id);
+            if (flow == NULL) { // First datagram of a new flow
+                if (session->flow_count < max_flows)
+                    flow = flow_open(p, client, view.flow_id);
+                if (flow == NULL) {
+                    session->dropped_frames++;
+                    metrics_add(METRIC_DROPS, 1);
+                }
+            }
+
+            if (flow != NULL) {
+                flow->last_seen_ms = now;
+                flow->udp.client = client; // Replies follow the stripe the flow arrives on
+                egress_add(p, client, flow, &view, unpack.buffer, &now_ns);
+            }
+        }
+        frame_unpack_close(&unpack); // Every send holds its own reference
+
+        ring_consume(&client->ring, frame.length); // Move to next message
+    }
+    return status < 0 ? -1 : 0;
+}
+
+// Reads from the client's TCP connection into its ring and forwards every
+// complete frame. The datagrams of one read are queued and leave together.
+static void handle_tcp(struct poller *p, struct tunnel_client *client) {
+    int bytes_read = ring_recv(client->tcp.socket, &client->ring);
+    if (bytes_read == SOCKET_ERROR && platform_would_block()) // Nothing to read after all
+        return;
+    if (bytes_read == SOCKET_ERROR) { // Check if TCP data was received
+        fprintf(stderr, "TCP receive failed: %d\n", WSAGetLastError());
+        client_close(p, client);
+        return;
+    }
+    if (bytes_read == 0) {  // TCP connection closed
+        client_close(p, client);
+        return;
+    }
+    if (latency != NULL)
+        ring_arrived(&client->ring, bytes_read, platform_realtime_ns());
+
+    int status = forward_frames(p, client);
+
+    // The queued payloads still point into the ring, which the next read reuses
+    if (tx_batch_flush(&egress) == SOCKET_ERROR)
+        fprintf(stderr, "UDP send failed: %d\n", WSAGetLastError());
+    ring_detach(&client->ring); // An idle connection holds no ring
+
+    if (status < 0) { // Not a v2 frame
+        fprintf(stderr, "Malformed frame from tunnel client\n");
+        client_close(p, client);
+    }
+}
+
+// Drains a batch of datagrams from a flow's UDP socket. Each one gets its frame
+// header written into the headroom of its slot and is queued on the client's
+// coalescer, which sends whole runs of frames to TCP at a time.
+static void handle_udp(struct poller *p, struct tunnel_flow *flow) {
+    struct tunnel_client *client = flow->udp.client;
+    int count = rx_batch_recv(flow->udp.socket, &rx);
+    if (count == SOCKET_ERROR) { // Errors such as ICMP port unreachable only affect this flow
+        fprintf(stderr, "UDP receive failed: %d\n", WSAGetLastError());
+        return;
+    }
+    if (count == 0)
+        return;
+
+    uint64_t now_us = platform_monotonic_us();
+    uint64_t stamp_ns = latency != NULL ? platform_realtime_ns() : 0; // One clock read for the whole batch
+    flow->last_seen_ms = now_us / 1000;
+
+    for (int i = 0; i < count; i++) {
+        if (rx.length[i] > FRAME_MAX_PAYLOAD) { // Cannot be described by a 16-bit length
+            metrics_add(METRIC_DROPS, 1);
+            continue;
+        }
+        char *payload = rx_batch_payload(&rx, i);
+        char *frame = frame_prepend_header(payload, rx.length[i], flow->id, stamp_ns);
+        int length = (int)(payload - frame) + rx.length[i];
+        char *packed = tx_queue_pack_frame(&client->tx, frame, &length);
+        int result = tx_queue_push(client->tcp.socket, &client->tx, packed != NULL ? packed : frame, length,
+                                   flush_bytes, now_us); // Send TCP message
+        if (packed != NULL)
+            pool_release(packed);
+        if (result == SOCKET_ERROR) {
+            fprintf(stderr, "TCP send failed: %d\n", WSAGetLastError());
+            client_close(p, client);
+            return;
+        }
+    }
+
+    client_update_output(p, client);
+}
+
+// The client's TCP socket can take more data: resume its queue
+static void handle_tcp_writable(struct poller *p, struct tunnel_client *client) {
+    if (tx_queue_send(client->tcp.socket, &client->tx) == SOCKET_ERROR) {
+        fprintf(stderr, "TCP send failed: %d\n", WSAGetLastError());
+        client_close(p, client);
+        return;
+    }
+    client_update_output(p, client);
+}
+
+// Sends the client's queued frames: right away on the readiness backend, or
+// as a submission on io_uring, which keeps one send in flight per connection
+static int client_flush(struct poller *p, struct tunnel_client *client) {
+#ifdef HAVE_IO_URING
+    if (p->uring != NULL) {
+        if (client->tx.in_flight == 0 && !client->tx.blocked && tx_queue_depth(&client->tx) > 0) {
+            uring_prep_queue_send(&p->uring->ring, client->tcp.socket, &client->tx, &client->send_msg,
+                                  client->send_iov, URING_TAG(&client->tcp, URING_OP_SEND));
+            client->tcp.uring_ops++;
+        }
+        return 0;
+    }
+#else
+    (void)p;
+#endif
+    return tx_queue_send(client->tcp.socket, &client->tx);
+}
+
+// Sends the queued frames of every pending client whose deadline has passed or
+// whose queue reached the flush threshold, or of all of them when force is
+// set. Returns the microseconds until the next deadline, or -1 when nothing is
+// left waiting.
+static int64_t flush_pending(struct poller *p, int force) {
+    uint64_t now_us = platform_monotonic_us();
+    int64_t next = -1;
+    struct tunnel_client *client = pending_clients;
+    while (client != NULL) {
+        struct tunnel_client *next_client = client->pending_next;
+        uint64_t due_us = client->tx.first_us + flush_deadline_us;
+        if (force || due_us <= now_us || tx_queue_depth(&client->tx) >= (uint32_t)flush_bytes) {
+            if (client_flush(p, client) == SOCKET_ERROR) {
+                fprintf(stderr, "TCP send failed: %d\n", WSAGetLastError());
+                client_close(p, client);
+            } else {
+                client_update_output(p, client);
+            }
+        } else if (next < 0 || (int64_t)(due_us - now_us) < next) {
+            next = (int64_t)(due_us - now_us);
+        }
+        client = next_client;
+    }
+    return next;
+}
+
+// Registers an accepted connection as a new client
+static void accept_client(struct poller *p, SOCKET client_socket) {
+    if (platform_set_nonblocking(client_socket, 1) != 0) { // A congested client must never stall the loop
+        fprintf(stderr, "Could not make TCP socket non-blocking: %d\n", WSAGetLastError());
+        closesocket(client_socket);
+        return;
+    }
+
+    int one = 1; // Frames are already coalesced; Nagle would only hold them for delayed ACKs
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one));
+
+    if (client_open(p, client_socket) == NULL) {
+        closesocket(client_socket);
+        return;
+    }
+
+    printf("Accepted TCP connection (%d active)\n", client_count);
+}
+
+// Accepts every pending connection on the non-blocking listener
+static void handle_accept(struct poller *p, SOCKET listen_socket) {
+    while (1) {
+        SOCKET client_socket = accept(listen_socket, NULL, NULL);// Accept TCP connection
+        if (client_socket == INVALID_SOCKET) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK) // Check if connection was successful
+                fprintf(stderr, "Accept failed: %d\n", WSAGetLastError());
+            return;
+        }
+        accept_client(p, client_socket);
+    }
+}
 
-    nn = strtoll(port_name, &end, 0);
-    if (*end != '\0')// Check if port_name contains invalid characters
+// Between event batches: worker 0 prints the histograms of every worker when
+// asked to. Returns nonzero once the server should shut down.
+static int worker_checkpoint(void) {
+    return latency_checkpoint(latency != NULL && latency == &latency_workers[0] ? latency_workers : NULL, worker_count);
+}
+
+#ifdef HAVE_IO_URING
+static int uring_backend_init(struct uring_backend *b) {
+    if (uring_init(&b->ring, URING_ENTRIES) != 0)
         return -1;
-    if (nn < 0) // Check if port_name is negative
+    if (uring_buffers_init(&b->ring, &b->buffers, 0, URING_SERVER_BUFFERS, URING_BUFFER_SIZE) != 0) {
+        uring_destroy(&b->ring);
         return -1;
-
-    t = (uint16_t) nn;
-    tt = (long long int) t;
-    if (tt != nn) // Check if port number is not an integer
+    }
+    if (uring_send_pool_init(&b->sends, egress.gso) != 0) {
+        uring_destroy(&b->ring);
+        uring_buffers_destroy(&b->buffers);
         return -1;
+    }
+    b->deferred = NULL;
+    return 0;
+}
+
+static void uring_backend_destroy(struct uring_backend *b) {
+    uring_destroy(&b->ring);
+    uring_buffers_destroy(&b->buffers);
+    uring_send_pool_destroy(&b->sends);
+}
+
+// Sends the frames waiting in a client's ring as a chain of linked datagram
+// sends with the ring's next receive at its tail, so the receive cannot
+// overwrite payloads still being sent. When the send slots run out a NOP ends
+// the chain instead, and forwarding resumes once it completes: the links
+// after a chain's head run later, so a new chain could overtake them.
+static void uring_forward(struct poller *p, struct tunnel_client *client) {
+    struct uring_backend *b = p->uring;
+    if (ring_attach(&client->ring) != 0) { // The receive always has a ring to land in
+        client_close(p, client);
+        return;
+    }
+    if (uring_sq_space(&b->ring) < (unsigned)b->sends.free_count + 1) // A link chain must not span two submissions
+        uring_submit(&b->ring, 0, 0);
+
+    int free_slots = b->sends.free_count;
+    int status = forward_frames(p, client);
+    if (status < 0) { // Not a v2 frame
+        if (b->sends.free_count < free_slots) // Nothing follows the last send after all
+            uring_unlink_last(&b->ring);
+        fprintf(stderr, "Malformed frame from tunnel client\n");
+        client_close(p, client);
+        return;
+    }
+    if (status == 1)
+        uring_prep_nop(&b->ring, URING_TAG(&client->tcp, URING_OP_RESUME));
+    else
+        uring_prep_ring_recv(&b->ring, client->tcp.socket, &client->ring, &client->tcp.recv_msg,
+                             client->tcp.recv_iov, URING_TAG(&client->tcp, URING_OP_RECV));
+    client->tcp.uring_ops++;
+}
+
+// Arms the receives and accepts queued during the iteration
+static void uring_arm_deferred(struct poller *p) {
+    struct uring_backend *b = p->uring;
+    struct endpoint *ep = b->deferred;
+    b->deferred = NULL;
+    while (ep != NULL) {
+        struct endpoint *next = ep->deferred_next;
+        ep->uring_ops--;
+        if (ep->socket == INVALID_SOCKET) { // Closed in the meantime
+        } else if (ep->kind == ENDPOINT_TCP) {
+            uring_forward(p, ep->client);
+        } else if (ep->kind == ENDPOINT_UDP) {
+            memset(&ep->recv_msg, 0, sizeof(ep->recv_msg));
+            ep->recv_msg.msg_namelen = sizeof(struct sockaddr_storage); // Layout expected by uring_datagram_parse
+            uring_prep_recv_multishot(&b->ring, &b->buffers, ep->socket, &ep->recv_msg, URING_TAG(ep, URING_OP_RECV));
+            ep->uring_ops++;
+        } else {
+            struct io_uring_sqe *sqe = uring_sqe(&b->ring);
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = ep->socket;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->user_data = URING_TAG(ep, URING_OP_ACCEPT);
+            ep->uring_ops++;
+        }
+        ep = next;
+    }
+}
+
+// A datagram from a flow's UDP socket, in a provided buffer. Its frame header
+// is written over the end of the address area, in front of the payload, and
+// the frame is queued on the client's coalescer.
+static void uring_udp_received(struct poller *p, struct tunnel_flow *flow, const struct io_uring_cqe *cqe) {
+    struct uring_backend *b = p->uring;
+    if (!(cqe->flags & IORING_CQE_F_MORE)) // Out of buffers, or an error: armed again at the end of the iteration
+        uring_defer(b, &flow->udp);
+    if (cqe->res < 0) {
+        if (cqe->res != -ENOBUFS) // Errors such as ICMP port unreachable only affect this flow
+            fprintf(stderr, "UDP receive failed: %d\n", -cqe->res);
+        return;
+    }
+
+    struct uring_datagram d;
+    uring_datagram_parse(&b->buffers, cqe, &d);
+    metrics_add(METRIC_UDP_RX_PACKETS, 1);
+    metrics_add(METRIC_UDP_RX_BYTES, (uint64_t)d.length);
+    uint64_t now_us = platform_monotonic_us();
+    flow->last_seen_ms = now_us / 1000;
+    if (d.length >= 0 && d.length <= FRAME_MAX_PAYLOAD) { // Cannot be described by a 16-bit length
+        struct tunnel_client *client = flow->udp.client;
+        char *frame = frame_prepend_header(d.payload, d.length, flow->id, latency != NULL ? platform_realtime_ns() : 0);
+        int length = (int)(d.payload - frame) + d.length;
+        char *packed = tx_queue_pack_frame(&client->tx, frame, &length);
+        tx_queue_admit(&client->tx, packed != NULL ? packed : frame, length, now_us);
+        if (packed != NULL)
+            pool_release(packed);
+        client_update_output(p, client);
+    } else {
+        metrics_add(METRIC_DROPS, 1);
+    }
+    uring_buffer_recycle(&b->buffers, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+}
+
+static void uring_tcp_received(struct poller *p, struct tunnel_client *client, int res) {
+    if (res < 0) {
+        fprintf(stderr, "TCP receive failed: %d\n", -res);
+        client_close(p, client);
+        return;
+    }
+    if (res == 0) { // TCP connection closed
+        client_close(p, client);
+        return;
+    }
+    ring_received(&client->ring, res);
+    if (latency != NULL)
+        ring_arrived(&client->ring, res, platform_realtime_ns());
+    uring_forward(p, client);
+}
+
+static int uring_is_send(uint64_t user_data) {
+    return (user_data & URING_SEND_SLOT_TAG) || (user_data & URING_OP_MASK) == URING_OP_SEND;
+}
+
+static void uring_complete(struct poller *p, const struct io_uring_cqe *cqe) {
+    struct uring_backend *b = p->uring;
+    if (cqe->user_data & URING_SEND_SLOT_TAG) { // A datagram towards UDP
+        int index = (int)(cqe->user_data & 0xFFFFFFFFu);
+        struct endpoint *owner = b->sends.slots[index].owner;
+        owner->uring_ops--;
+        int res = uring_send_slot_release(&b->sends, index, cqe->res);
+        if (res < 0 && res != -EAGAIN && res != -ENOBUFS) // A full send buffer only drops the datagram
+            fprintf(stderr, "UDP send failed: %d\n", -res);
+        return;
+    }
+
+    int op = (int)(cqe->user_data & URING_OP_MASK);
+    if (op == URING_OP_CANCEL)
+        return;
+    struct endpoint *ep = (struct endpoint *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+    if (!(cqe->flags & IORING_CQE_F_MORE)) // The operation is over
+        ep->uring_ops--;
+    if (ep->socket == INVALID_SOCKET) { // Closed since the operation was submitted
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+            uring_buffer_recycle(&b->buffers, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        return;
+    }
 
-    *port = t;
+    if (op == URING_OP_ACCEPT) {
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            uring_defer(b, ep);
+        if (cqe->res >= 0)
+            accept_client(p, cqe->res);
+        else
+            fprintf(stderr, "Accept failed: %d\n", -cqe->res);
+    } else if (op == URING_OP_RECV && ep->kind == ENDPOINT_TCP) {
+        uring_tcp_received(p, ep->client, cqe->res);
+    } else if (op == URING_OP_RECV) {
+        uring_udp_received(p, ep->flow, cqe);
+    } else if (op == URING_OP_RESUME) { // The chain that ran out of send slots is done
+        uring_forward(p, ep->client);
+    } else if (op == URING_OP_SEND) {
+        if (uring_queue_sent(&ep->client->tx, cqe->res) == SOCKET_ERROR) {
+            fprintf(stderr, "TCP send failed: %d\n", errno);
+            client_close(p, ep->client);
+            return;
+        }
+        client_update_output(p, ep->client);
+    } else if (op == URING_OP_POLL) { // The TCP socket can take more data: resume its queue
+        ep->client->tx.blocked = 0;
+        client_update_output(p, ep->client);
+    }
+}
+
+// The io_uring event loop: one io_uring_enter per iteration submits whatever
+// the last one queued and waits for completions
+static void run_uring(struct poller *p) {
+    struct uring_backend *b = p->uring;
+    uint64_t next_sweep_ms = platform_monotonic_ms() + SWEEP_INTERVAL_MS;
+    int64_t next_flush_us = -1;
+
+    while (!worker_checkpoint()) { // Serve clients until the loop itself fails
+        uring_arm_deferred(p);
+        int64_t timeout_us = SWEEP_INTERVAL_MS * 1000;
+        if (next_flush_us >= 0 && next_flush_us < timeout_us)
+            timeout_us = next_flush_us;
+        if (uring_submit(&b->ring, 1, timeout_us) != 0) {
+            fprintf(stderr, "io_uring_enter failed: %d\n", errno);
+            break;
+        }
+        metrics_add(METRIC_WAKEUPS, 1);
+
+        unsigned head, count = uring_cq_ready(&b->ring, &head);
+        for (int pass = 0; pass < 2; pass++) { // Sends first: they free queue bytes and send slots
+            for (unsigned i = 0; i < count; i++) {
+                struct io_uring_cqe *cqe = uring_cqe_at(&b->ring, head + i);
+                if ((pass == 0) == uring_is_send(cqe->user_data))
+                    uring_complete(p, cqe);
+            }
+        }
+        uring_cq_advance(&b->ring, count);
+
+        next_flush_us = flush_pending(p, flush_deadline_us == 0);
+        free_closed_clients();
+
+        uint64_t now = platform_monotonic_ms();
+        if (now >= next_sweep_ms) {
+            sweep_idle_flows(p, now);
+            next_sweep_ms = now + SWEEP_INTERVAL_MS;
+        }
+    }
+}
+#endif
+
+static int parse_options(int argc, char *argv[]) {
+    for (int i = 4; i < argc; i++) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[i]);
+            return -1;
+        }
+        long value = strtol(argv[i + 1], NULL, 10);
+        if (strcmp(argv[i], "-f") == 0 && value > 0) {
+            max_flows = (uint32_t)value;
+        } else if (strcmp(argv[i], "-i") == 0 && value > 0) {
+            idle_timeout_ms = (uint64_t)value * 1000;
+        } else if (strcmp(argv[i], "-b") == 0 && value > 0 && value <= MAX_BATCH_SIZE) {
+            batch_size = (int)value;
+        } else if (strcmp(argv[i], "-t") == 0 && value >= 0 && value <= FRAME_MAX_PAYLOAD * 4) {
+            flush_bytes = (int)value;
+        } else if (strcmp(argv[i], "-d") == 0 && value >= 0) {
+            flush_deadline_us = (uint64_t)value;
+        } else if (strcmp(argv[i], "-g") == 0 && (value == 0 || value == 1)) {
+            use_gso = (int)value;
+        } else if (strcmp(argv[i], "-q") == 0 && value >= MIN_QUEUE_BYTES && value <= (1L << 30)) {
+            queue_bytes = (uint32_t)value;
+        } else if (strcmp(argv[i], "-p") == 0 && parse_drop_policy(argv[i + 1], &drop_policy) == 0) {
+            // Named policy, already stored
+        } else if (strcmp(argv[i], "-s") == 0 && value > 0) {
+            drop_size = (int)value;
+        } else if (strcmp(argv[i], "-w") == 0 && value > 0 && value <= MAX_WORKERS) {
+            worker_count = (int)value;
+        } else if (strcmp(argv[i], "-e") == 0 && (strcmp(argv[i + 1], "poll") == 0 || strcmp(argv[i + 1], "uring") == 0)) {
+            use_uring = strcmp(argv[i + 1], "uring") == 0;
+        } else if (strcmp(argv[i], "-l") == 0 && (value == 0 || value == 1)) {
+            measure_latency = (int)value;
+        } else if (strcmp(argv[i], "-z") == 0 && parse_compress_mode(argv[i + 1], &compression) == 0) {
+            // Named mode, already stored
+        } else if (strcmp(argv[i], "-r") == 0 && value >= 0 && value <= 1000000) {
+            link_mbit = (int)value;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            stats_socket = argv[i + 1];
+        } else {
+            fprintf(stderr, "Invalid option: %s %s\n", argv[i], argv[i + 1]);
+            return -1;
+        }
+        i++;
+    }
+    if ((uint32_t)flush_bytes > queue_bytes) {
+        fprintf(stderr, "Flush threshold %d exceeds the queue cap of %u bytes\n", flush_bytes, queue_bytes);
+        return -1;
+    }
     return 0;
 }
 
+// Opens the non-blocking TCP listener. Each worker of a multi-worker server on
+// Linux binds its own with SO_REUSEPORT, so the kernel spreads connections
+// over the workers without a shared accept queue.
+static SOCKET open_listener(uint16_t tcp_port, int reuse_port) {
+    SOCKET listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP); // Create TCP socket
+    if (listen_socket == INVALID_SOCKET) { // Check if socket creation was successful
+        fprintf(stderr, "TCP socket creation failed: %d\n", WSAGetLastError());
+        return INVALID_SOCKET;
+    }
+
+#ifndef _WIN32
+    int reuse = 1; // Allow quick restarts while old connections sit in TIME_WAIT
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#endif
+#ifdef __linux__
+    if (reuse_port && setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0) {
+        fprintf(stderr, "SO_REUSEPORT failed: %d\n", WSAGetLastError());
+        closesocket(listen_socket);
+        return INVALID_SOCKET;
+    }
+#else
+    (void)reuse_port;
+#endif
+
+    // Bind TCP socket
+    struct sockaddr_in tcp_addr;
+    memset(&tcp_addr, 0, sizeof(tcp_addr));
+    tcp_addr.sin_family = AF_INET;
+    tcp_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    tcp_addr.sin_port = htons(tcp_port);
+
+    if (bind(listen_socket, (struct sockaddr*)&tcp_addr, sizeof(tcp_addr)) == SOCKET_ERROR) {
+        fprintf(stderr, "TCP bind failed: %d\n", WSAGetLastError()); // Check if binding was successful
+        closesocket(listen_socket);
+        return INVALID_SOCKET;
+    }
+
+    // Listen for connections
+    if (listen(listen_socket, SOMAXCONN) == SOCKET_ERROR) {
+        fprintf(stderr, "Listen failed: %d\n", WSAGetLastError());
+        closesocket(listen_socket);
+        return INVALID_SOCKET;
+    }
+
+    if (platform_set_nonblocking(listen_socket, 1) != 0) { // Accept is drained until it would block
+        fprintf(stderr, "Could not make listening socket non-blocking: %d\n", WSAGetLastError());
+        closesocket(listen_socket);
+        return INVALID_SOCKET;
+    }
+    return listen_socket;
+}
+
+struct worker {
+    int index;
+    SOCKET listen_socket; // Shared by all workers where SO_REUSEPORT cannot balance
+    platform_thread thread;
+};
+
+// The readiness event loop, on the shared poller
+static void run_readiness(struct poller *p, SOCKET listen_socket) {
+    struct endpoint *ready[MAX_EVENTS];
+    uint64_t next_sweep_ms = platform_monotonic_ms() + SWEEP_INTERVAL_MS;
+    int64_t next_flush_us = -1;
+
+    while (!worker_checkpoint()) { // Serve clients until the loop itself fails
+        int64_t timeout_us = SWEEP_INTERVAL_MS * 1000;
+        if (next_flush_us >= 0 && next_flush_us < timeout_us)
+            timeout_us = next_flush_us;
+
+        int n = poller_wait(p, ready, MAX_EVENTS, timeout_us * 1000);
+        if (n < 0) { // Check if waiting was successful
+            fprintf(stderr, "poll failed: %d\n", WSAGetLastError());
+            break;
+        }
+        metrics_add(METRIC_WAKEUPS, 1);
+
+        for (int i = 0; i < n; i++) {
+            struct endpoint *ep = ready[i];
+            if (ep->kind == ENDPOINT_LISTEN) {
+                handle_accept(p, listen_socket);
+                continue;
+            }
+            if (ep->client->closed) // Closed earlier in this batch
+                continue;
+            if (ep->kind == ENDPOINT_TCP) {
+                if (ep->writable)
+                    handle_tcp_writable(p, ep->client);
+                if (ep->readable && !ep->client->closed)
+                    handle_tcp(p, ep->client);
+            } else
+                handle_udp(p, ep->flow);
+        }
+
+        next_flush_us = flush_pending(p, flush_deadline_us == 0);
+        free_closed_clients();
+
+        uint64_t now = platform_monotonic_ms();
+        if (now >= next_sweep_ms) { // Flows are only evicted between event batches
+            sweep_idle_flows(p, now);
+            next_sweep_ms = now + SWEEP_INTERVAL_MS;
+        }
+    }
+}
+
+// One event loop: accepts clients from its listener and serves them until the
+// loop itself fails
+static int run_worker(struct worker *w) {
+    metrics_thread_init();
+    if (worker_count > 1)
+        platform_pin_thread(w->index);
+    if (latency_workers != NULL)
+        latency = &latency_workers[w->index];
+
+    if (rx_batch_init(&rx, batch_size) != 0) {
+        fprintf(stderr, "Out of memory for a batch of %d datagrams\n", batch_size);
+        return 1;
+    }
+    tx_batch_init(&egress, batch_size, use_gso);
+    egress.latency = latency;
+
+    struct poller poller;
+    if (poller_init(&poller) != 0) {
+        fprintf(stderr, "Could not create poller: %d\n", WSAGetLastError());
+        rx_batch_destroy(&rx);
+        return 1;
+    }
+#ifdef HAVE_IO_URING
+    struct uring_backend backend;
+    if (use_uring && uring_backend_init(&backend) == 0)
+        poller.uring = &backend;
+    int uring_missing = use_uring && poller.uring == NULL;
+#else
+    int uring_missing = use_uring;
+#endif
+    if (uring_missing && w->index == 0)
+        fprintf(stderr, "io_uring is not available, using the readiness loop\n");
+    else if (use_uring && w->index == 0)
+        printf("Using the io_uring backend\n");
+
+    struct endpoint listen_endpoint;
+    listen_endpoint.kind = ENDPOINT_LISTEN;
+    listen_endpoint.socket = w->listen_socket;
+    listen_endpoint.client = NULL;
+    listen_endpoint.flow = NULL;
+    if (poller_add(&poller, &listen_endpoint) != 0) {
+        fprintf(stderr, "Could not watch listening socket: %d\n", WSAGetLastError());
+        poller_destroy(&poller);
+        rx_batch_destroy(&rx);
+        return 1;
+    }
+
+#ifdef HAVE_IO_URING
+    if (poller.uring != NULL)
+        run_uring(&poller);
+    else
+        run_readiness(&poller, w->listen_socket);
+#else
+    run_readiness(&poller, w->listen_socket);
+#endif
+
+    while (client_list != NULL) // Close every remaining client
+        client_close(&poller, client_list);
+    free_closed_clients();
+#ifdef HAVE_IO_URING
+    if (poller.uring != NULL)
+        uring_backend_destroy(&backend);
+#endif
+    rx_batch_destroy(&rx);
+    poller_destroy(&poller);
+    pool_thread_flush();
+    return stop_requested ? 0 : 1;
+}
+
+static void worker_thread(void *arg) {
+    run_worker(arg);
+}
+
 int main(int argc, char *argv[]) {
     WSADATA wsaData;
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) { // Initialize Winsock
@@ -42,8 +1396,15 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN); // A client vanishing mid-send must not kill the server
+#endif
+
     if (argc < 4) { // Check if port name is provided
-        fprintf(stderr, "Usage: %s <tcp_port> <udp_server> <udp_port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <tcp_port> <udp_server> <udp_port> [-f max_flows] [-i idle_seconds]"
+                        " [-b batch_size] [-t flush_bytes] [-d flush_deadline_us] [-g 0|1]"
+                        " [-q queue_bytes] [-p tail|oldest|size] [-s drop_size] [-w workers] [-e poll|uring] [-l 0|1]"
+                        " [-z off|frame|batch] [-r link_mbit] [-m unix:path|udp:port]\n", argv[0]);
         WSACleanup();
         return 1;
     }
@@ -59,40 +1420,44 @@ int main(int argc, char *argv[]) {
     char *udp_server = argv[2];
     char *udp_port = argv[3];
 
-    // Create TCP listening socket
-    SOCKET listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP); // Create TCP socket
-    if (listen_socket == INVALID_SOCKET) { // Check if socket creation was successful
-        fprintf(stderr, "TCP socket creation failed: %d\n", WSAGetLastError());
+    metrics_extra = pool_format;
+    if (parse_options(argc, argv) != 0 ||
+        (stats_socket != NULL && metrics_serve(stats_socket, "tunnel_udp_over_tcp_server") != 0)) {
         WSACleanup();
         return 1;
     }
 
-    // Bind TCP socket
-    struct sockaddr_in tcp_addr;
-    tcp_addr.sin_family = AF_INET;
-    tcp_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    tcp_addr.sin_port = htons(tcp_port);
-
-    if (bind(listen_socket, (struct sockaddr*)&tcp_addr, sizeof(tcp_addr)) == SOCKET_ERROR) {
-        fprintf(stderr, "TCP bind failed: %d\n", WSAGetLastError()); // Check if binding was successful
-        closesocket(listen_socket);
+#ifdef __linux__
+    int listener_count = worker_count; // One SO_REUSEPORT listener per worker
+#else
+    int listener_count = 1; // Workers take turns accepting from one listener
+#endif
+    struct worker *workers = calloc((size_t)worker_count, sizeof(*workers));
+    if (workers == NULL) {
+        fprintf(stderr, "Out of memory for %d workers\n", worker_count);
         WSACleanup();
         return 1;
     }
-
-    // Listen for connections
-    if (listen(listen_socket, 1) == SOCKET_ERROR) {
-        fprintf(stderr, "Listen failed: %d\n", WSAGetLastError());
-        closesocket(listen_socket);
-        WSACleanup();
-        return 1;
+    for (int i = 0; i < listener_count; i++) {
+        workers[i].listen_socket = open_listener(tcp_port, worker_count > 1);
+        if (workers[i].listen_socket == INVALID_SOCKET) {
+            while (i-- > 0)
+                closesocket(workers[i].listen_socket);
+            free(workers);
+            WSACleanup();
+            return 1;
+        }
+    }
+    for (int i = 0; i < worker_count; i++) {
+        workers[i].index = i;
+        workers[i].listen_socket = workers[i % listener_count].listen_socket;
     }
 
     printf("Tunnel server listening on TCP port %d...\n", tcp_port);
 
-    // Create UDP socket and resolve UDP server address
+    // Resolve the UDP server address. Each tunneled flow later gets its own
+    // UDP socket connected to it, so replies are never mixed between flows.
     struct addrinfo hints, *result, *rp;
-    SOCKET udp_socket = INVALID_SOCKET;
 
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_INET;
@@ -101,125 +1466,78 @@ int main(int argc, char *argv[]) {
 
     if (getaddrinfo(udp_server, udp_port, &hints, &result) != 0) { // Resolve UDP server address
         fprintf(stderr, "getaddrinfo failed for UDP server: %d\n", WSAGetLastError()); // Check if resolution was successful
-        closesocket(listen_socket); // Close TCP socket
+        for (int i = 0; i < listener_count; i++)
+            closesocket(workers[i].listen_socket); // Close TCP sockets
+        free(workers);
         WSACleanup(); // Deinitialize Winsock
         return 1;
     }
 
-    for (rp = result; rp != NULL; rp = rp->ai_next) { // Connect to UDP server
-        udp_socket = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (udp_socket == INVALID_SOCKET) // Check if socket creation was successful
+    for (rp = result; rp != NULL; rp = rp->ai_next) { // Find an address we can connect a UDP socket to
+        SOCKET probe = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (probe == INVALID_SOCKET) // Check if socket creation was successful
             continue;
 
-        if (connect(udp_socket, rp->ai_addr, (int)rp->ai_addrlen) != SOCKET_ERROR) // Connect to UDP server
+        int connected = connect(probe, rp->ai_addr, (int)rp->ai_addrlen) != SOCKET_ERROR;
+        closesocket(probe);
+        if (connected) {
+            memcpy(&udp_addr, rp->ai_addr, rp->ai_addrlen);
+            udp_addr_len = (socklen_t)rp->ai_addrlen;
             break;
-
-        closesocket(udp_socket); // Close UDP socket
+        }
     }
 
     freeaddrinfo(result);// Free memory
 
     if (rp == NULL) { // Check if connection was successful
         fprintf(stderr, "Could not connect to UDP server\n");
-        closesocket(listen_socket);
+        for (int i = 0; i < listener_count; i++)
+            closesocket(workers[i].listen_socket);
+        free(workers);
         WSACleanup();
         return 1;
     }
 
-    printf("Connected to UDP server %s:%s\n", udp_server, udp_port);
-
-    SOCKET client_socket = accept(listen_socket, NULL, NULL);// Accept TCP connection
-    if (client_socket == INVALID_SOCKET) { // Check if connection was successful
-        fprintf(stderr, "Accept failed: %d\n", WSAGetLastError());
-        closesocket(udp_socket);
-        closesocket(listen_socket);
-        WSACleanup();
-        return 1;
-    }
-
-    printf("Accepted TCP connection. Starting tunnel...\n");
-
-    // Buffers for data handling
-    char udp_buffer[UDP_BUFFER_SIZE];
-    char tcp_buffer[TCP_BUFFER_SIZE];
-    char reconstruction_buffer[RECONSTRUCTION_BUFFER_SIZE];
-    int reconstruction_index = 0;
-
-    fd_set readfds;
-
-    while (1) { // Loop until client disconnects
-        FD_ZERO(&readfds);
-        FD_SET(client_socket, &readfds);
-        FD_SET(udp_socket, &readfds);
-
-        if (select(0, &readfds, NULL, NULL, NULL) == SOCKET_ERROR) { // Check if select was successful
-            fprintf(stderr, "select failed: %d\n", WSAGetLastError());
-            break;
-        }
-
-        // Handle TCP data
-        if (FD_ISSET(client_socket, &readfds)) { // Check if TCP data is available
-            int bytes_read = recv(client_socket, tcp_buffer, TCP_BUFFER_SIZE, 0);
-            if (bytes_read == SOCKET_ERROR) { // Check if TCP data was received
-                fprintf(stderr, "TCP receive failed: %d\n", WSAGetLastError());
-                break;
-            }
-            if (bytes_read == 0) {  // TCP connection closed
-                break;
-            }
-
-            // Copy new data to reconstruction buffer
-            memcpy(reconstruction_buffer + reconstruction_index, tcp_buffer, bytes_read);
-            reconstruction_index += bytes_read;
-
-            // Process complete messages
-            int processed = 0;
-            while (reconstruction_index - processed >= 2) {
-                uint16_t msg_length = ((uint16_t)(reconstruction_buffer[processed]) << 8) |
-                                    (uint8_t)(reconstruction_buffer[processed + 1]);
-
-                if (reconstruction_index - processed < msg_length + 2) // Check if message is complete
-                    break;
-
-                if (send(udp_socket, reconstruction_buffer + processed + 2, msg_length, 0) == SOCKET_ERROR) {
-                    fprintf(stderr, "UDP send failed: %d\n", WSAGetLastError());
-                    goto cleanup;
-                }
-
-                processed += msg_length + 2; // Move to next message
-            }
-
-            if (processed > 0) {//Move any remaining data to the start of the buffer
-                memmove(reconstruction_buffer, reconstruction_buffer + processed,
-                       reconstruction_index - processed); // Move data to the start of the buffer
-                reconstruction_index -= processed;
-            }
+    if (measure_latency) {
+        latency_workers = calloc((size_t)worker_count, sizeof(*latency_workers));
+        if (latency_workers == NULL) {
+            fprintf(stderr, "Out of memory for latency histograms\n");
+            for (int i = 0; i < listener_count; i++)
+                closesocket(workers[i].listen_socket);
+            free(workers);
+            WSACleanup();
+            return 1;
         }
+    }
+    if (measure_latency || compression != COMPRESS_OFF) // Ctrl+C ends the workers, so the reports are printed
+        latency_catch_signals();
 
-        // Handle UDP data
-        if (FD_ISSET(udp_socket, &readfds)) {
-            int bytes_read = recv(udp_socket, udp_buffer, UDP_BUFFER_SIZE, 0);
-            if (bytes_read == SOCKET_ERROR) { // Check if UDP data was received
-                fprintf(stderr, "UDP receive failed: %d\n", WSAGetLastError());
-                break;
-            }
-
-            // Prepare TCP message: length + data
-            tcp_buffer[0] = (bytes_read >> 8) & 0xFF;
-            tcp_buffer[1] = bytes_read & 0xFF;
-            memcpy(tcp_buffer + 2, udp_buffer, bytes_read);
+    printf("Forwarding to UDP server %s:%s\n", udp_server, udp_port);
+    printf("Waiting for tunnel clients on %d worker%s...\n", worker_count, worker_count > 1 ? "s" : "");
 
-            if (send(client_socket, tcp_buffer, bytes_read + 2, 0) == SOCKET_ERROR) { // Send TCP message
-                fprintf(stderr, "TCP send failed: %d\n", WSAGetLastError());
-                break;
+    int status = 0;
+    if (worker_count == 1) {
+        status = run_worker(&workers[0]);
+    } else {
+        for (int i = 0; i < worker_count; i++) { // Every worker runs on its own thread and CPU
+            if (platform_thread_start(&workers[i].thread, worker_thread, &workers[i]) != 0) {
+                fprintf(stderr, "Could not start worker %d\n", i);
+                return 1; // Returning from main also stops the workers already running
             }
         }
+        for (int i = 0; i < worker_count; i++)
+            platform_thread_join(workers[i].thread);
+        status = stop_requested ? 0 : 1;
     }
 
-cleanup:
-    closesocket(client_socket); // Close TCP socket
-    closesocket(udp_socket);// Close UDP socket
-    closesocket(listen_socket);// Close TCP socket
+    for (int i = 0; i < listener_count; i++)
+        closesocket(workers[i].listen_socket);// Close TCP sockets
+    free(workers);
+    if (latency_workers != NULL) {
+        latency_report(latency_workers, worker_count);
+        free(latency_workers);
+    }
+    compress_report();
     WSACleanup();// Cleanup Winsock
-    return 0;
-}
\ No newline at end of file
+    return status;
+}
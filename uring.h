@@ -0,0 +1,461 @@
+// io_uring backend (-e uring) shared by tunnel_udp_over_tcp_client and
+// tunnel_udp_over_tcp_server, driven through raw system calls so no liburing
+// is needed. Receives complete into memory the kernel already owns: multishot
+// recvmsg into a ring of provided buffers for UDP, and TCP straight into the
+// frame ring. Sends are queued as submissions that go out with the next wait,
+// so a busy loop costs one io_uring_enter per wakeup. Setup asks for flags
+// introduced in Linux 6.1, which doubles as the check for everything else used.
+//
+// HAVE_IO_URING is defined when the kernel headers are present; everything
+// else here exists only then. Each program tags its submissions its own way.
+//
+// Include after tunnel_io.h.
+
+#ifndef URING_H
+#define URING_H
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1 // Headers for the -e uring backend
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#define URING_ENTRIES 2048  // Submission queue; the completion queue is four times larger
+#define URING_SEND_SLOTS 1024  // Datagrams towards UDP in flight at once
+#define URING_BUFFER_SIZE (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) + UDP_BUFFER_SIZE)
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned sq_mask;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_local_tail; // Entries prepared so far; published by uring_submit
+    unsigned prompt; // Prepared since the last uring_cq_ready and sure to complete without waiting on a peer
+    struct io_uring_sqe *sqes;
+    unsigned cq_mask;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    struct io_uring_cqe *cqes;
+    void *ring_map;
+    size_t ring_map_size;
+    size_t sqes_size;
+};
+
+static inline int uring_init(struct uring *u, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                   IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = entries * 4;
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (u->fd < 0) // Older kernel, or io_uring disabled
+        return -1;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        close(u->fd);
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_map_size = sq_size > cq_size ? sq_size : cq_size;
+    u->ring_map = mmap(NULL, u->ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       u->fd, IORING_OFF_SQ_RING);
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->ring_map == MAP_FAILED || u->sqes == MAP_FAILED) {
+        if (u->ring_map != MAP_FAILED)
+            munmap(u->ring_map, u->ring_map_size);
+        close(u->fd);
+        return -1;
+    }
+
+    char *ring = u->ring_map;
+    u->sq_entries = params.sq_entries;
+    u->sq_mask = *(unsigned *)(ring + params.sq_off.ring_mask);
+    u->sq_head = (unsigned *)(ring + params.sq_off.head);
+    u->sq_tail = (unsigned *)(ring + params.sq_off.tail);
+    u->sq_local_tail = *u->sq_tail;
+    u->prompt = 0;
+    unsigned *sq_array = (unsigned *)(ring + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) // Slot i always holds entry i
+        sq_array[i] = i;
+    u->cq_mask = *(unsigned *)(ring + params.cq_off.ring_mask);
+    u->cq_head = (unsigned *)(ring + params.cq_off.head);
+    u->cq_tail = (unsigned *)(ring + params.cq_off.tail);
+    u->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+    return 0;
+}
+
+static inline void uring_destroy(struct uring *u) { // Closing the ring cancels whatever is still pending
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->ring_map, u->ring_map_size);
+    close(u->fd);
+}
+
+static inline unsigned uring_sq_space(const struct uring *u) {
+    return u->sq_entries - (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE));
+}
+
+// Hands every prepared entry to the kernel and, with wait_nr > 0, waits up to
+// timeout_us (negative: no limit) for that many completions beyond the prompt
+// ones: non-blocking sends complete during submission, and counting them would
+// end the wait at once. Returns 0, or -1 on failure.
+static inline int uring_submit(struct uring *u, unsigned wait_nr, int64_t timeout_us) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    void *argp = NULL;
+    size_t arg_size = 0;
+    unsigned flags = IORING_ENTER_GETEVENTS; // Also runs completion work deferred to this thread
+    if (wait_nr > 0 && timeout_us >= 0) {
+        ts.tv_sec = timeout_us / 1000000;
+        ts.tv_nsec = (timeout_us % 1000000) * 1000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        arg_size = sizeof(arg);
+    }
+
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (wait_nr > 0)
+        wait_nr += u->prompt;
+    if (syscall(__NR_io_uring_enter, u->fd, to_submit, wait_nr, flags, argp, arg_size) < 0 &&
+        errno != ETIME && errno != EINTR && errno != EBUSY) // EBUSY: reap completions first
+        return -1;
+    return 0;
+}
+
+static inline struct io_uring_sqe *uring_sqe(struct uring *u) { // Next submission entry, zeroed
+    if (uring_sq_space(u) == 0)
+        uring_submit(u, 0, 0);
+    struct io_uring_sqe *sqe = &u->sqes[u->sq_local_tail++ & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static inline struct io_uring_sqe *uring_prep_msg(struct uring *u, int opcode, int fd, struct msghdr *msg,
+                                                  unsigned msg_flags, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = msg_flags;
+    sqe->user_data = user_data;
+    return sqe;
+}
+
+static inline void uring_prep_poll_out(struct uring *u, int fd, uint64_t user_data) { // One-shot writability
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = user_data;
+}
+
+// Completions are consumed in place: peek at [head, head + count), then advance
+static inline unsigned uring_cq_ready(struct uring *u, unsigned *head) {
+    u->prompt = 0; // Their completions are among these
+    *head = *u->cq_head;
+    return __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) - *head;
+}
+
+static inline struct io_uring_cqe *uring_cqe_at(const struct uring *u, unsigned index) {
+    return &u->cqes[index & u->cq_mask];
+}
+
+static inline void uring_cq_advance(struct uring *u, unsigned count) {
+    __atomic_store_n(u->cq_head, *u->cq_head + count, __ATOMIC_RELEASE);
+}
+
+// Ring of provided buffers: multishot receives take a buffer per datagram and
+// report its ID in the completion; the buffer is handed back once consumed.
+struct uring_buffers {
+    struct io_uring_buf_ring *ring; // Shared with the kernel
+    size_t ring_size;
+    char *data;
+    unsigned count; // Power of two
+    unsigned size;
+    uint16_t group;
+};
+
+static inline char *uring_buffer(const struct uring_buffers *b, unsigned id) {
+    return b->data + (size_t)id * b->size;
+}
+
+static inline void uring_buffer_recycle(struct uring_buffers *b, unsigned id) {
+    uint16_t tail = b->ring->tail;
+    struct io_uring_buf *buf = &b->ring->bufs[tail & (b->count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(b, id);
+    buf->len = b->size;
+    buf->bid = (uint16_t)id;
+    __atomic_store_n(&b->ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+
+static inline int uring_buffers_init(struct uring *u, struct uring_buffers *b, uint16_t group, unsigned count, unsigned size) {
+    b->count = count;
+    b->size = size;
+    b->group = group;
+    b->ring_size = count * sizeof(struct io_uring_buf);
+    b->ring = mmap(NULL, b->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    b->data = malloc((size_t)count * size);
+    if (b->ring == MAP_FAILED || b->data == NULL) {
+        if (b->ring != MAP_FAILED)
+            munmap(b->ring, b->ring_size);
+        free(b->data);
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)b->ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        munmap(b->ring, b->ring_size);
+        free(b->data);
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++)
+        uring_buffer_recycle(b, i);
+    return 0;
+}
+
+static inline void uring_buffers_destroy(struct uring_buffers *b) { // After uring_destroy
+    munmap(b->ring, b->ring_size);
+    free(b->data);
+}
+
+// Arms a multishot recvmsg on a UDP socket. Each completion carries one
+// datagram laid out as io_uring_recvmsg_out, the sender address (msg_namelen
+// bytes) and the payload.
+static inline void uring_prep_recv_multishot(struct uring *u, const struct uring_buffers *b, int fd,
+                                             struct msghdr *msg, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_prep_msg(u, IORING_OP_RECVMSG, fd, msg, 0, user_data);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = b->group;
+}
+
+struct uring_datagram { // One received datagram inside a provided buffer
+    const struct sockaddr_storage *addr;
+    char *payload; // FRAME_MAX_HEADER_SIZE bytes of the address area precede it
+    int length; // -1 when truncated
+};
+
+static inline void uring_datagram_parse(const struct uring_buffers *b, const struct io_uring_cqe *cqe, struct uring_datagram *d) {
+    char *buffer = uring_buffer(b, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buffer;
+    d->addr = (const struct sockaddr_storage *)(out + 1);
+    d->payload = buffer + sizeof(*out) + sizeof(struct sockaddr_storage);
+    d->length = (out->flags & MSG_TRUNC) ? -1 : (int)out->payloadlen;
+}
+
+// Receives frame ring free space as a one-shot recvmsg: multishot would need
+// provided buffers and a copy into the ring
+static inline void uring_prep_ring_recv(struct uring *u, int fd, struct frame_ring *r, struct msghdr *msg,
+                                        struct iovec *iov, uint64_t user_data) {
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_iov = iov;
+    msg->msg_iovlen = (size_t)frame_decoder_space(&r->decoder, iov);
+    uring_prep_msg(u, IORING_OP_RECVMSG, fd, msg, 0, user_data);
+}
+
+// Sends the queued TCP bytes without waiting for room; a short or refused
+// send marks the queue blocked and the caller arms a writability poll
+static inline void uring_prep_queue_send(struct uring *u, int fd, struct tx_queue *q, struct msghdr *msg,
+                                         struct iovec *iov, uint64_t user_data) {
+    tx_queue_pack_runs(q);
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_iov = iov;
+    msg->msg_iovlen = (size_t)tx_queue_vectors(q, iov);
+    q->in_flight = tx_queue_depth(q);
+    q->sending = q->data; // Kept alive even if the queue moves to a larger ring meanwhile
+    pool_ref(q->sending);
+    if (q->residency != NULL) // Every queued frame is handed over with this submission
+        tx_queue_record_starts(q, q->tail);
+    u->prompt++;
+    uring_prep_msg(u, IORING_OP_SENDMSG, fd, msg, MSG_DONTWAIT | MSG_NOSIGNAL, user_data);
+}
+
+// Applies a TCP send completion. Returns 0, or SOCKET_ERROR with errno set.
+static inline int uring_queue_sent(struct tx_queue *q, int res) {
+    uint32_t submitted = q->in_flight;
+    q->in_flight = 0;
+    pool_release(q->sending);
+    q->sending = NULL;
+    if (res == -EAGAIN) {
+        q->blocked = 1;
+        return 0;
+    }
+    if (res < 0) {
+        metrics_add(METRIC_SEND_ERRORS, 1);
+        errno = -res;
+        return SOCKET_ERROR;
+    }
+    tx_queue_advance(q, (uint32_t)res);
+    if ((uint32_t)res < submitted) // The socket is full
+        q->blocked = 1;
+    return 0;
+}
+
+// A pool of sendmsg headers for datagrams towards UDP. The payloads stay in
+// the frame ring, so these sends are hard-linked ahead of the ring's next recv.
+// As in tx_batch, a run of equal-size datagrams for the same destination
+// shares one send that the kernel splits with UDP_SEGMENT.
+#define URING_SLOT_VECTORS (2 * GSO_MAX_SEGMENTS)  // A payload wrapping the ring takes two
+
+struct uring_send_slot {
+    struct msghdr msg;
+    struct iovec iov[URING_SLOT_VECTORS];
+    struct sockaddr_storage addr;
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    int fd;
+    int segment_size;
+    int segments;
+    void *owner; // Endpoint whose frame ring holds the payload (server only)
+    char *held; // Pool buffer holding the payload instead, referenced until the send completes
+};
+
+struct uring_send_pool {
+    struct uring_send_slot *slots;
+    int *free_list;
+    int free_count;
+    int gso; // From tx_batch's probe; cleared when the kernel refuses a segmented send
+    int last; // Slot of the newest send, which may still grow while it is the last entry prepared
+    unsigned last_tail;
+};
+
+static inline int uring_send_pool_init(struct uring_send_pool *pool, int gso) {
+    pool->slots = calloc(URING_SEND_SLOTS, sizeof(*pool->slots));
+    pool->free_list = malloc(URING_SEND_SLOTS * sizeof(int));
+    if (pool->slots == NULL || pool->free_list == NULL) {
+        free(pool->slots);
+        free(pool->free_list);
+        return -1;
+    }
+    for (int i = 0; i < URING_SEND_SLOTS; i++)
+        pool->free_list[i] = URING_SEND_SLOTS - 1 - i;
+    pool->free_count = URING_SEND_SLOTS;
+    pool->gso = gso;
+    pool->last = -1;
+    pool->last_tail = 0;
+    return 0;
+}
+
+static inline void uring_send_pool_destroy(struct uring_send_pool *pool) { // After uring_destroy
+    for (int i = 0; i < URING_SEND_SLOTS; i++) {
+        if (pool->slots[i].held != NULL)
+            pool_release(pool->slots[i].held);
+    }
+    free(pool->slots);
+    free(pool->free_list);
+}
+
+static inline int uring_send_extend(struct uring *u, struct uring_send_pool *pool, int fd, const struct frame_view *frame,
+                                    const struct sockaddr_storage *to, socklen_t to_len, const char *held) {
+    if (!pool->gso || pool->last < 0 || pool->last_tail != u->sq_local_tail || *u->sq_tail == u->sq_local_tail)
+        return 0; // Another entry follows it, or it was already submitted
+    struct uring_send_slot *slot = &pool->slots[pool->last];
+    int same_peer = slot->fd == fd && slot->msg.msg_namelen == (to != NULL ? to_len : 0) &&
+                    (to == NULL || memcmp(&slot->addr, to, to_len) == 0);
+    if (!same_peer || slot->held != held || frame->payload_length != slot->segment_size || frame->payload_length == 0 ||
+        frame->payload_length > GSO_MAX_SEGMENT_SIZE || slot->segments == GSO_MAX_SEGMENTS ||
+        (slot->segments + 1) * slot->segment_size > GSO_MAX_BYTES ||
+        slot->msg.msg_iovlen + (size_t)frame->payload_count > URING_SLOT_VECTORS)
+        return 0;
+
+    for (int i = 0; i < frame->payload_count; i++)
+        slot->iov[slot->msg.msg_iovlen++] = frame->payload[i];
+    if (slot->segments++ == 1) { // Now a segmented send
+        slot->msg.msg_control = slot->control;
+        slot->msg.msg_controllen = sizeof(slot->control);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&slot->msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t size = (uint16_t)slot->segment_size;
+        memcpy(CMSG_DATA(cm), &size, sizeof(size));
+    }
+    return 1;
+}
+
+// Queues one datagram from a parsed frame, on the owner's behalf; held is the
+// pool buffer the payload sits in, or NULL when it is in the ring. Returns 1
+// for a new send, 0 when it joined the previous one, or -1 when every slot is
+// in flight.
+static inline int uring_send_datagram(struct uring *u, struct uring_send_pool *pool, int fd, const struct frame_view *frame,
+                                      const struct sockaddr_storage *to, socklen_t to_len, void *owner, char *held,
+                                      uint64_t user_data) {
+    if (uring_send_extend(u, pool, fd, frame, to, to_len, held))
+        return 0;
+    if (pool->free_count == 0)
+        return -1;
+    int index = pool->free_list[--pool->free_count];
+    struct uring_send_slot *slot = &pool->slots[index];
+    memset(&slot->msg, 0, sizeof(slot->msg));
+    for (int i = 0; i < frame->payload_count; i++)
+        slot->iov[i] = frame->payload[i];
+    slot->msg.msg_iov = slot->iov;
+    slot->msg.msg_iovlen = (size_t)frame->payload_count;
+    slot->fd = fd;
+    slot->segment_size = frame->payload_length;
+    slot->segments = 1;
+    slot->owner = owner;
+    slot->held = held;
+    if (held != NULL)
+        pool_ref(held);
+    if (to != NULL) {
+        memcpy(&slot->addr, to, to_len);
+        slot->msg.msg_name = &slot->addr;
+        slot->msg.msg_namelen = to_len;
+    }
+    struct io_uring_sqe *sqe = uring_prep_msg(u, IORING_OP_SENDMSG, fd, &slot->msg, MSG_DONTWAIT,
+                                              user_data | (uint64_t)index);
+    sqe->flags = IOSQE_IO_HARDLINK; // Runs before whatever follows, even if it fails
+    u->prompt++;
+    pool->last = index;
+    pool->last_tail = u->sq_local_tail;
+    return 1;
+}
+
+static inline void uring_unlink_last(struct uring *u) { // Ends a chain when no entry follows its last send after all
+    u->sqes[(u->sq_local_tail - 1) & u->sq_mask].flags &= (uint8_t)~IOSQE_IO_HARDLINK;
+}
+
+static inline void uring_prep_nop(struct uring *u, uint64_t user_data) { // Completes once the chain before it has run
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = user_data;
+    u->prompt++;
+}
+
+// Frees the slot of a completed send. Returns the send's result, or 0 when
+// the kernel refused a segmented send: GSO stays off and those datagrams are lost.
+static inline int uring_send_slot_release(struct uring_send_pool *pool, int index, int res) {
+    pool->free_list[pool->free_count++] = index;
+    if (pool->slots[index].held != NULL) {
+        pool_release(pool->slots[index].held);
+        pool->slots[index].held = NULL;
+    }
+    if (res >= 0) {
+        metrics_add(METRIC_UDP_TX_PACKETS, (uint64_t)pool->slots[index].segments);
+        metrics_add(METRIC_UDP_TX_BYTES, (uint64_t)res);
+    } else {
+        metrics_add(METRIC_SEND_ERRORS, (uint64_t)pool->slots[index].segments);
+    }
+    if (pool->slots[index].segments > 1 && (res == -EIO || res == -ENOPROTOOPT || res == -EOPNOTSUPP)) {
+        pool->gso = 0;
+        return 0;
+    }
+    return res;
+}
+#endif
+
+#endif